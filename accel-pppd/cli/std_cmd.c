@@ -4,9 +4,12 @@
 #include <unistd.h>
 #include <signal.h>
 #include <malloc.h>
+#include <dirent.h>
+#include <sys/resource.h>
 #include <arpa/inet.h>
 
 #include "triton.h"
+#include "mempool.h"
 #include "events.h"
 #include "ppp.h"
 #include "ipdb.h"
@@ -15,6 +18,78 @@
 #include "log.h"
 #include "memdebug.h"
 
+static void show_fd_stat(void *client)
+{
+	struct ppp_t *ppp;
+	struct rlimit rlim;
+	struct dirent *ent;
+	DIR *dir;
+	const char *name[CTRL_TYPE_PPPOE + 1] = {};
+	unsigned int sessions[CTRL_TYPE_PPPOE + 1] = {};
+	unsigned int fds[CTRL_TYPE_PPPOE + 1] = {};
+	unsigned int open_fds = 0;
+	int i;
+
+	dir = opendir("/proc/self/fd");
+	if (dir) {
+		while ((ent = readdir(dir))) {
+			if (ent->d_name[0] != '.')
+				open_fds++;
+		}
+		closedir(dir);
+	}
+
+	getrlimit(RLIMIT_NOFILE, &rlim);
+
+	// only descriptors owned by ppp core and the pppox socket are counted
+	pthread_rwlock_rdlock(&ppp_lock);
+	list_for_each_entry(ppp, &ppp_list, entry) {
+		i = ppp->ctrl->type;
+		if (i < 0 || i > CTRL_TYPE_PPPOE)
+			continue;
+		name[i] = ppp->ctrl->name;
+		sessions[i]++;
+		fds[i] += (ppp->fd >= 0) + (ppp->chan_fd >= 0) + (ppp->unit_fd >= 0);
+	}
+	pthread_rwlock_unlock(&ppp_lock);
+
+	cli_send(client, "fd:\r\n");
+	cli_sendv(client, "  open: %u\r\n", open_fds);
+	cli_sendv(client, "  limit: %lu\r\n", (unsigned long)rlim.rlim_cur);
+	for (i = 0; i <= CTRL_TYPE_PPPOE; i++) {
+		if (!sessions[i])
+			continue;
+		cli_sendv(client, "  %s: %u (%.2f per session)\r\n", name[i], fds[i], (double)fds[i] / sessions[i]);
+	}
+}
+
+static void show_latency(void *client, const char *name, int id)
+{
+	long cnt[PPP_LAT_BUCKETS];
+	long total = 0;
+	int i;
+
+	for (i = 0; i < PPP_LAT_BUCKETS; i++) {
+		cnt[i] = triton_counter_read(id + i);
+		total += cnt[i];
+	}
+
+	if (!total)
+		return;
+
+	cli_sendv(client, "  %s:\r\n", name);
+	for (i = 0; i < PPP_LAT_BUCKETS; i++) {
+		if (!cnt[i])
+			continue;
+		if (i == PPP_LAT_BUCKETS - 1)
+			cli_sendv(client, "    >=%lums: %ld\r\n", (1ul << (i - 1)) / 1000, cnt[i]);
+		else if (i < 10)
+			cli_sendv(client, "    <%luus: %ld\r\n", 1ul << i, cnt[i]);
+		else
+			cli_sendv(client, "    <%lums: %ld\r\n", (1ul << i) / 1000, cnt[i]);
+	}
+}
+
 static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt, void *client)
 {
 	struct timespec ts;
@@ -24,6 +99,8 @@ static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt,
 	FILE *f;
 	unsigned long vmsize = 0, vmrss = 0;
 	unsigned long page_size_kb = sysconf(_SC_PAGE_SIZE) / 1024;
+	struct mempool_stat_t mempool_stat = mempool_get_stat();
+	long md_wakeups = triton_counter_read(TRITON_COUNTER_MD_WAKEUPS);
 #ifdef MEMDEBUG
 	struct mallinfo mi = mallinfo();
 #endif
@@ -55,8 +132,8 @@ static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt,
 	cli_sendv(client, "mem(rss/virt): %lu/%lu kB\r\n", vmrss * page_size_kb, vmsize * page_size_kb);
 #endif
 	cli_send(client, "core:\r\n");
-	cli_sendv(client, "  mempool_allocated: %u\r\n", triton_stat.mempool_allocated);
-	cli_sendv(client, "  mempool_available: %u\r\n", triton_stat.mempool_available);
+	cli_sendv(client, "  mempool_allocated: %u\r\n", mempool_stat.allocated);
+	cli_sendv(client, "  mempool_available: %u\r\n", mempool_stat.available);
 	cli_sendv(client, "  thread_count: %u\r\n", triton_stat.thread_count);
 	cli_sendv(client, "  thread_active: %u\r\n", triton_stat.thread_active);
 	cli_sendv(client, "  context_count: %u\r\n", triton_stat.context_count);
@@ -64,14 +141,24 @@ static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt,
 	cli_sendv(client, "  context_pending: %u\r\n", triton_stat.context_pending);
 	cli_sendv(client, "  md_handler_count: %u\r\n", triton_stat.md_handler_count);
 	cli_sendv(client, "  md_handler_pending: %u\r\n", triton_stat.md_handler_pending);
+	cli_sendv(client, "  md_events_per_wakeup: %.2f\r\n", md_wakeups ? (double)triton_counter_read(TRITON_COUNTER_MD_EVENTS) / md_wakeups : 0.0);
 	cli_sendv(client, "  timer_count: %u\r\n", triton_stat.timer_count);
 	cli_sendv(client, "  timer_pending: %u\r\n", triton_stat.timer_pending);
 
+	show_fd_stat(client);
+
 //===========
 	cli_send(client, "ppp:\r\n");
 	cli_sendv(client, "  starting: %u\r\n", ppp_stat.starting);
 	cli_sendv(client, "  active: %u\r\n", ppp_stat.active);
 	cli_sendv(client, "  finishing: %u\r\n", ppp_stat.finishing);
+	if (ppp_counters >= 0) {
+		cli_sendv(client, "  recv control: %ld\r\n", triton_counter_read(ppp_counters + PPP_COUNTER_RECV));
+		cli_sendv(client, "  protocol reject: %ld\r\n", triton_counter_read(ppp_counters + PPP_COUNTER_PROTO_REJ));
+		cli_sendv(client, "  unit cache hit/miss: %ld/%ld\r\n", triton_counter_read(ppp_counters + PPP_COUNTER_UNIT_HIT), triton_counter_read(ppp_counters + PPP_COUNTER_UNIT_MISS));
+		show_latency(client, "establish latency", ppp_counters + PPP_COUNTER_ESTABLISH);
+		show_latency(client, "connect latency", ppp_counters + PPP_COUNTER_CONNECT);
+	}
 
 	return CLI_CMD_OK;
 }
@@ -147,6 +234,7 @@ static int terminate_exec2(int key, char * const *f, int f_cnt, void *cli)
 	struct ppp_t *ppp;
 	int hard = 0;
 	in_addr_t ipaddr = 0;
+	const void *val = f[2];
 	
 	if (f_cnt == 4) {
 		if (!strcmp(f[3], "hard"))
@@ -156,33 +244,13 @@ static int terminate_exec2(int key, char * const *f, int f_cnt, void *cli)
 	} else if (f_cnt != 3)
 		return CLI_CMD_SYNTAX;
 	
-	if (key == 1)
+	if (key == PPP_IDX_IPV4) {
 		ipaddr = inet_addr(f[2]);
+		val = &ipaddr;
+	}
 			
 	pthread_rwlock_rdlock(&ppp_lock);
-	list_for_each_entry(ppp, &ppp_list, entry) {
-		switch (key) {
-			case 0:
-				if (!ppp->username || strcmp(ppp->username, f[2]))
-					continue;
-				break;
-			case 1:
-				if (ppp->ipv4 && ppp->ipv4->peer_addr != ipaddr)
-					continue;
-				break;
-			case 2:
-				if (strcmp(ppp->ctrl->calling_station_id, f[2]))
-					continue;
-				break;
-			case 3:
-				if (strcmp(ppp->sessionid, f[2]))
-					continue;
-				break;
-			case 4:
-				if (strcmp(ppp->ifname, f[2]))
-					continue;
-				break;
-		}
+	ppp_index_for_each(ppp, key, val) {
 		if (hard)
 			triton_context_call(ppp->ctrl->ctx, (triton_event_func)ppp_terminate_hard, ppp);
 		else
@@ -205,15 +273,15 @@ static int terminate_exec(const char *cmd, char * const *fields, int fields_cnt,
 	if (!strcmp(fields[1], "match") && fields_cnt > 3 && !strcmp(fields[2], "username"))
 		return terminate_exec1(fields, fields_cnt, client);
 	else if (!strcmp(fields[1], "username"))
-		return terminate_exec2(0, fields, fields_cnt, client);
+		return terminate_exec2(PPP_IDX_USERNAME, fields, fields_cnt, client);
 	else if (!strcmp(fields[1], "ip"))
-		return terminate_exec2(1, fields, fields_cnt, client);
+		return terminate_exec2(PPP_IDX_IPV4, fields, fields_cnt, client);
 	else if (!strcmp(fields[1], "csid"))
-		return terminate_exec2(2, fields, fields_cnt, client);
+		return terminate_exec2(PPP_IDX_CSID, fields, fields_cnt, client);
 	else if (!strcmp(fields[1], "sid"))
-		return terminate_exec2(3, fields, fields_cnt, client);
+		return terminate_exec2(PPP_IDX_SESSIONID, fields, fields_cnt, client);
 	else if (!strcmp(fields[1], "if"))
-		return terminate_exec2(4, fields, fields_cnt, client);
+		return terminate_exec2(PPP_IDX_IFNAME, fields, fields_cnt, client);
 	else if (strcmp(fields[1], "all"))
 		return CLI_CMD_SYNTAX;
 	
@@ -328,12 +396,30 @@ static void reload_help(char * const *fields, int fields_cnt, void *client)
 	cli_send(client, "reload - reload config file\r\n");
 }
 
+static int restart_exec(const char *cmd, char * const *f, int f_cnt, void *cli)
+{
+	if (f_cnt != 1)
+		return CLI_CMD_SYNTAX;
+
+	// returns only on failure
+	if (ppp_hot_restart())
+		cli_send(cli, "failed\r\n");
+
+	return CLI_CMD_OK;
+}
+
+static void restart_help(char * const *fields, int fields_cnt, void *client)
+{
+	cli_send(client, "restart - re-execute daemon keeping sessions (requires ppp.checkpoint-file)\r\n");
+}
+
 static void init(void)
 {
 	cli_register_simple_cmd2(show_stat_exec, show_stat_help, 2, "show", "stat");
 	cli_register_simple_cmd2(terminate_exec, terminate_help, 1, "terminate");
 	cli_register_simple_cmd2(reload_exec, reload_help, 1, "reload");
 	cli_register_simple_cmd2(shutdown_exec, shutdown_help, 1, "shutdown");
+	cli_register_simple_cmd2(restart_exec, restart_help, 1, "restart");
 	cli_register_simple_cmd2(exit_exec, exit_help, 1, "exit");
 }
 
@@ -60,6 +60,11 @@ static int conf_mppe = MPPE_UNSET;
 static unsigned int stat_active;
 static unsigned int stat_starting;
 
+#define STAT_RECV 0 // control packets
+#define STAT_DROP 1 // SCCRQ dropped by connlimit
+#define STAT_CNT  2
+static int stat_counters = -1;
+
 struct l2tp_serv_t
 {
 	struct triton_context_t ctx;
@@ -111,6 +116,17 @@ static void l2tp_send_SCCRP(struct l2tp_conn_t *conn);
 static int l2tp_send(struct l2tp_conn_t *conn, struct l2tp_packet_t *pack, int log_debug);
 static int l2tp_conn_read(struct triton_md_handler_t *);
 
+static void stat_inc(int stat)
+{
+	if (stat_counters >= 0)
+		triton_counter_inc(stat_counters + stat);
+}
+
+static long stat_read(int stat)
+{
+	return stat_counters >= 0 ? triton_counter_read(stat_counters + stat) : 0;
+}
+
 static void l2tp_disconnect(struct l2tp_conn_t *conn)
 {
 	struct l2tp_packet_t *pack;
@@ -657,8 +673,10 @@ static int l2tp_recv_SCCRQ(struct l2tp_serv_t *serv, struct l2tp_packet_t *pack,
 	if (ppp_shutdown)
 		return 0;
 	
-	if (triton_module_loaded("connlimit") && connlimit_check(cl_key_from_ipv4(pack->addr.sin_addr.s_addr)))
+	if (triton_module_loaded("connlimit") && connlimit_check(cl_key_from_ipv4(pack->addr.sin_addr.s_addr))) {
+		stat_inc(STAT_DROP);
 		return 0;
+	}
 
 	list_for_each_entry(attr, &pack->attrs, entry) {
 		switch (attr->attr->id) {
@@ -890,6 +908,8 @@ static int l2tp_conn_read(struct triton_md_handler_t *h)
 		if (!pack)
 			continue;
 
+		stat_inc(STAT_RECV);
+
 		if (ntohs(pack->hdr.tid) != conn->tid && (pack->hdr.tid || !conf_dir300_quirk)) {
 			if (conf_verbose)
 				log_warn("l2tp: incorrect tid %i in tunnel %i\n", ntohs(pack->hdr.tid), conn->tid);
@@ -1025,6 +1045,8 @@ static int l2tp_udp_read(struct triton_md_handler_t *h)
 		if (!pack)
 			continue;
 
+		stat_inc(STAT_RECV);
+
 		if (iprange_client_check(pack->addr.sin_addr.s_addr)) {
 			log_warn("l2tp: IP is out of client-ip-range, droping connection...\n");
 			goto skip;
@@ -1140,6 +1162,8 @@ static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt,
 	cli_send(client, "l2tp:\r\n");
 	cli_sendv(client, "  starting: %u\r\n", stat_starting);
 	cli_sendv(client, "  active: %u\r\n", stat_active);
+	cli_sendv(client, "  recv control: %ld\r\n", stat_read(STAT_RECV));
+	cli_sendv(client, "  drop SCCRQ: %ld\r\n", stat_read(STAT_DROP));
 
 	return CLI_CMD_OK;
 }
@@ -1215,6 +1239,7 @@ static void l2tp_init(void)
 	memset(l2tp_conn, 0, L2TP_MAX_TID * sizeof(void *));
 
 	l2tp_conn_pool = mempool_create(sizeof(struct l2tp_conn_t));
+	stat_counters = triton_counter_alloc(STAT_CNT);
 
 	load_config();
 
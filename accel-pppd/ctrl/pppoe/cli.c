@@ -107,16 +107,47 @@ help:
 
 //===================================
 
+static long stat_read(int base, int stat)
+{
+	return base >= 0 ? triton_counter_read(base + stat) : 0;
+}
+
 static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt, void *client)
 {
+	struct pppoe_serv_t *serv;
+
 	cli_send(client, "pppoe:\r\n");
 	cli_sendv(client, "  active: %u\r\n", stat_active);
 	cli_sendv(client, "  delayed PADO: %u\r\n", stat_delayed_pado);
-	cli_sendv(client, "  recv PADI: %lu\r\n", stat_PADI_recv);
-	cli_sendv(client, "  drop PADI: %lu\r\n", stat_PADI_drop);
-	cli_sendv(client, "  sent PADO: %lu\r\n", stat_PADO_sent);
-	cli_sendv(client, "  recv PADR(dup): %lu(%lu)\r\n", stat_PADR_recv, stat_PADR_dup_recv);
-	cli_sendv(client, "  sent PADS: %lu\r\n", stat_PADS_sent);
+	cli_sendv(client, "  recv PADI: %ld\r\n", stat_read(stat_counters, STAT_PADI_RECV));
+	cli_sendv(client, "  drop PADI: %ld\r\n", stat_read(stat_counters, STAT_PADI_DROP));
+	cli_sendv(client, "    interface limit: %ld\r\n", stat_read(stat_counters, STAT_PADI_DROP_IF));
+	cli_sendv(client, "    global limit: %ld\r\n", stat_read(stat_counters, STAT_PADI_DROP_GLOBAL));
+	cli_sendv(client, "    per-mac limit: %ld\r\n", stat_read(stat_counters, STAT_PADI_DROP_MAC));
+	cli_sendv(client, "    connlimit: %ld\r\n", stat_read(stat_counters, STAT_PADI_DROP_CONNLIMIT));
+	cli_sendv(client, "  sent PADO: %ld\r\n", stat_read(stat_counters, STAT_PADO_SENT));
+	cli_sendv(client, "  recv PADR(dup): %ld(%ld)\r\n", stat_read(stat_counters, STAT_PADR_RECV), stat_read(stat_counters, STAT_PADR_DUP_RECV));
+	cli_sendv(client, "  sent PADS: %ld\r\n", stat_read(stat_counters, STAT_PADS_SENT));
+
+	pthread_rwlock_rdlock(&serv_lock);
+	list_for_each_entry(serv, &serv_list, entry) {
+		// interfaces which haven't seen any PADI are skipped
+		if (stat_read(serv->stat_counters, STAT_PADI_RECV))
+			cli_sendv(client, "  %s: recv PADI %ld drop PADI %ld sent PADO %ld recv PADR(dup) %ld(%ld) sent PADS %ld\r\n", serv->ifname,
+			          stat_read(serv->stat_counters, STAT_PADI_RECV),
+			          stat_read(serv->stat_counters, STAT_PADI_DROP),
+			          stat_read(serv->stat_counters, STAT_PADO_SENT),
+			          stat_read(serv->stat_counters, STAT_PADR_RECV),
+			          stat_read(serv->stat_counters, STAT_PADR_DUP_RECV),
+			          stat_read(serv->stat_counters, STAT_PADS_SENT));
+		if (!serv->rx_ring)
+			continue;
+		cli_sendv(client, "  %s rx-ring: blocks %lu frames %lu (%lu per block) drops %lu\r\n", serv->ifname,
+		          serv->stat_ring_blocks, serv->stat_ring_frames,
+		          serv->stat_ring_blocks ? serv->stat_ring_frames / serv->stat_ring_blocks : 0,
+		          serv->stat_ring_drops);
+	}
+	pthread_rwlock_unlock(&serv_lock);
 
 	return CLI_CMD_OK;
 }
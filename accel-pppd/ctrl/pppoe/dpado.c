@@ -1,8 +1,10 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
 #include <errno.h>
 #include <limits.h>
+#include <time.h>
 #include <netinet/in.h>
 #include <net/ethernet.h>
 
@@ -14,50 +16,42 @@
 
 #include "pppoe.h"
 
+/*
+ * Ranges are kept in an immutable table, PADI handlers pick the delay for the
+ * current number of active sessions without locking. The table is replaced
+ * by publish_ptr() and the old one is freed after a grace period.
+ */
+
 struct dpado_range_t
 {
-	struct list_head entry;
 	unsigned int conn_cnt;
 	int pado_delay;
 };
 
-static pthread_mutex_t dpado_range_lock = PTHREAD_MUTEX_INITIALIZER;
-static LIST_HEAD(dpado_range_list);
-static struct dpado_range_t *dpado_range_next;
-static struct dpado_range_t *dpado_range_prev;
-int pado_delay;
-
-void dpado_check_next(int conn_cnt)
+struct dpado_table_t
 {
-	pthread_mutex_lock(&dpado_range_lock);
-	if (dpado_range_next && conn_cnt == dpado_range_next->conn_cnt) {
-		pado_delay = dpado_range_next->pado_delay;
-		dpado_range_prev = dpado_range_next;
-		if (dpado_range_next->entry.next != &dpado_range_list)
-			dpado_range_next = list_entry(dpado_range_next->entry.next, typeof(*dpado_range_next), entry);
-		else
-			dpado_range_next = NULL;
-	/*printf("active=%i, prev=%i:%i, next=%i:%i, pado_delay=%i\n", stat_active, 
-	dpado_range_prev?dpado_range_prev->pado_delay:0,dpado_range_prev?dpado_range_prev->conn_cnt:0,
-	dpado_range_next?dpado_range_next->pado_delay:0,dpado_range_next?dpado_range_next->conn_cnt:0,
-	pado_delay);*/
-	}
-	pthread_mutex_unlock(&dpado_range_lock);
-}
+	struct retire_t retire;
+	int cnt;
+	struct dpado_range_t range[0];
+};
 
-void dpado_check_prev(int conn_cnt)
+static pthread_mutex_t dpado_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct dpado_table_t *dpado_table;
+
+int dpado_get(void)
 {
-	pthread_mutex_lock(&dpado_range_lock);
-	if (dpado_range_prev && conn_cnt == dpado_range_prev->conn_cnt) {
-		dpado_range_next = dpado_range_prev;
-		dpado_range_prev = list_entry(dpado_range_prev->entry.prev, typeof(*dpado_range_prev), entry);
-		pado_delay = dpado_range_prev->pado_delay;
-	/*printf("active=%i, prev=%i:%i, next=%i:%i, pado_delay=%i\n", stat_active, 
-	dpado_range_prev?dpado_range_prev->pado_delay:0,dpado_range_prev?dpado_range_prev->conn_cnt:0,
-	dpado_range_next?dpado_range_next->pado_delay:0,dpado_range_next?dpado_range_next->conn_cnt:0,
-	pado_delay);*/
-	}
-	pthread_mutex_unlock(&dpado_range_lock);
+	struct dpado_table_t *t = __atomic_load_n(&dpado_table, __ATOMIC_ACQUIRE);
+	unsigned int active = __atomic_load_n(&stat_active, __ATOMIC_RELAXED);
+	int i, delay;
+
+	if (!t)
+		return 0;
+
+	delay = t->range[0].pado_delay;
+	for (i = 1; i < t->cnt && active >= t->range[i].conn_cnt; i++)
+		delay = t->range[i].pado_delay;
+
+	return delay;
 }
 
 static void strip(char *str)
@@ -77,11 +71,20 @@ int dpado_parse(const char *str)
 {
 	char *str1 = _strdup(str);
 	char *ptr1, *ptr2, *ptr3, *endptr;
-	LIST_HEAD(range_list);
+	struct dpado_table_t *t;
 	struct dpado_range_t *r;
+	int cnt = 1;
 
 	strip(str1);
 
+	for (ptr1 = str1; *ptr1; ptr1++) {
+		if (*ptr1 == ',')
+			cnt++;
+	}
+
+	t = _malloc(sizeof(*t) + cnt * sizeof(*r));
+	memset(t, 0, sizeof(*t) + cnt * sizeof(*r));
+
 	ptr1 = str1;
 
 	while (1) {
@@ -92,14 +95,13 @@ int dpado_parse(const char *str)
 		if (ptr3)
 			*ptr3 = 0;
 
-		r = _malloc(sizeof(*r));
-		memset(r, 0, sizeof(*r));
+		r = &t->range[t->cnt];
 
 		r->pado_delay = strtol(ptr1, &endptr, 10);
 		if (*endptr)
 			goto out_err;
 
-		if (list_empty(&range_list))
+		if (t->cnt == 0)
 			r->conn_cnt = INT_MAX;
 		else {
 			if (!ptr3)
@@ -109,8 +111,7 @@ int dpado_parse(const char *str)
 				goto out_err;
 		}
 
-		list_add_tail(&r->entry, &range_list);
-		//printf("parsed range: %i:%i\n", r->pado_delay, r->conn_cnt);
+		t->cnt++;
 
 		if (!ptr2)
 			break;
@@ -118,44 +119,20 @@ int dpado_parse(const char *str)
 		ptr1 = ptr2 + 1;
 	}
 
-	pthread_mutex_lock(&dpado_range_lock);
-	while (!list_empty(&dpado_range_list)) {
-		r = list_entry(dpado_range_list.next, typeof(*r), entry);
-		list_del(&r->entry);
-		_free(r);
-	}
-
-	dpado_range_next = NULL;
-	dpado_range_prev = NULL;
-
-	while (!list_empty(&range_list)) {
-		r = list_entry(range_list.next, typeof(*r), entry);
-		list_del(&r->entry);
-		list_add_tail(&r->entry, &dpado_range_list);
-
-		if (!dpado_range_prev || stat_active >= r->conn_cnt)
-			dpado_range_prev = r;
-		else if (!dpado_range_next)
-			dpado_range_next = r;
-	}
-
-	pado_delay = dpado_range_prev->pado_delay;
+	pthread_mutex_lock(&dpado_lock);
+	publish_ptr(&dpado_table, t, retire);
 
 	if (conf_pado_delay)
 		_free(conf_pado_delay);
 	conf_pado_delay = _strdup(str);
-	/*printf("active=%i, prev=%i:%i, next=%i:%i, pado_delay=%i\n", stat_active, 
-	dpado_range_prev?dpado_range_prev->pado_delay:0,dpado_range_prev?dpado_range_prev->conn_cnt:0,
-	dpado_range_next?dpado_range_next->pado_delay:0,dpado_range_next?dpado_range_next->conn_cnt:0,
-	pado_delay);*/
-
-	pthread_mutex_unlock(&dpado_range_lock);
+	pthread_mutex_unlock(&dpado_lock);
 
 	_free(str1);
 	return 0;
 
 out_err:
 	_free(str1);
+	_free(t);
 	log_emerg("pppoe: pado_delay: invalid format\n");
 	return -1;
 }
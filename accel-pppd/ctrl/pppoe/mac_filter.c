@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
+#include <time.h>
 #include <pthread.h>
 #include <errno.h>
 #include <netinet/in.h>
@@ -14,46 +16,203 @@
 
 #include "pppoe.h"
 
-struct mac_t
+/*
+ * The list is an open addressing hash set. Readers never lock: they load the
+ * table pointer and probe it. Single slots are added and deleted in place
+ * (a slot is one word, deleted slots become tombstones), whole tables are
+ * replaced on reload or growth by publish_ptr() and the old one is freed
+ * after a grace period.
+ */
+
+#define SLOT_EMPTY     0
+#define SLOT_DELETED   (1ull << 49)
+#define SLOT_USED      (1ull << 48)
+#define MIN_SIZE       64
+
+struct mac_table_t
 {
-	struct list_head entry;
-	uint8_t addr[ETH_ALEN];
+	struct retire_t retire;
+	int type; // 1 - allow, 0 - denied
+	unsigned int size;
+	unsigned int cnt;
+	unsigned int used; // cnt + tombstones
+	uint64_t slot[0];
 };
 
-static LIST_HEAD(mac_list);
-static int type; // -1 - disabled, 1 - allow, 0 - denied
-static pthread_rwlock_t lock = PTHREAD_RWLOCK_INITIALIZER;
+static struct mac_table_t *table; // NULL - disabled
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 static const char *conf_mac_filter;
 
+static inline uint64_t mac_key(const uint8_t *addr)
+{
+	return SLOT_USED | (uint64_t)addr[0] << 40 | (uint64_t)addr[1] << 32 | (uint64_t)addr[2] << 24 |
+	       (uint64_t)addr[3] << 16 | (uint64_t)addr[4] << 8 | addr[5];
+}
+
+static inline unsigned int mac_hash(uint64_t key, unsigned int size)
+{
+	return (key * 0x9e3779b97f4a7c15ull) >> 32 & (size - 1);
+}
+
+static inline void key_to_mac(uint64_t key, uint8_t *addr)
+{
+	int i;
+
+	for (i = ETH_ALEN - 1; i >= 0; i--, key >>= 8)
+		addr[i] = key;
+}
+
+static uint64_t *table_find(struct mac_table_t *t, uint64_t key)
+{
+	unsigned int i = mac_hash(key, t->size);
+	uint64_t v;
+
+	while (1) {
+		v = __atomic_load_n(&t->slot[i], __ATOMIC_RELAXED);
+		if (v == key)
+			return &t->slot[i];
+		if (v == SLOT_EMPTY)
+			return NULL;
+		i = (i + 1) & (t->size - 1);
+	}
+}
+
+static struct mac_table_t *table_alloc(int type, unsigned int cnt)
+{
+	struct mac_table_t *t;
+	unsigned int size = MIN_SIZE;
+
+	while (size < cnt * 2)
+		size <<= 1;
+
+	t = _malloc(sizeof(*t) + size * sizeof(uint64_t));
+	if (!t)
+		return NULL;
+
+	memset(t, 0, sizeof(*t) + size * sizeof(uint64_t));
+	t->type = type;
+	t->size = size;
+
+	return t;
+}
+
+/* Slot stores are single words, so a reader sees either old or new value */
+static int table_insert(struct mac_table_t *t, uint64_t key)
+{
+	unsigned int i = mac_hash(key, t->size);
+	uint64_t *tomb = NULL;
+	uint64_t v;
+
+	while (1) {
+		v = t->slot[i];
+		if (v == key)
+			return 0;
+		if (v == SLOT_EMPTY)
+			break;
+		if (v == SLOT_DELETED && !tomb)
+			tomb = &t->slot[i];
+		i = (i + 1) & (t->size - 1);
+	}
+
+	if (tomb)
+		__atomic_store_n(tomb, key, __ATOMIC_RELEASE);
+	else {
+		__atomic_store_n(&t->slot[i], key, __ATOMIC_RELEASE);
+		t->used++;
+	}
+
+	t->cnt++;
+
+	return 1;
+}
+
+static struct mac_table_t *table_rebuild(struct mac_table_t *old, unsigned int cnt)
+{
+	struct mac_table_t *t = table_alloc(old->type, cnt);
+	unsigned int i;
+
+	if (!t)
+		return NULL;
+
+	for (i = 0; i < old->size; i++) {
+		if (old->slot[i] & SLOT_USED)
+			table_insert(t, old->slot[i]);
+	}
+
+	return t;
+}
+
 int mac_filter_check(const uint8_t *addr)
 {
-	struct mac_t *mac;
-	int res = type;
+	struct mac_table_t *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
 
-	if (type == -1)
+	if (!t)
 		return 0;
 
-	pthread_rwlock_rdlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
-		if (memcmp(mac->addr, addr, ETH_ALEN))
+	return table_find(t, mac_key(addr)) ? !t->type : t->type;
+}
+
+/* Copies the list for socket filters, *cnt is -1 if it doesn't fit */
+int mac_filter_get(uint8_t (*addrs)[ETH_ALEN], int max, int *cnt)
+{
+	struct mac_table_t *t;
+	unsigned int i;
+	int n = 0, type;
+
+	pthread_mutex_lock(&lock);
+	t = table;
+	if (!t) {
+		pthread_mutex_unlock(&lock);
+		*cnt = 0;
+		return -1;
+	}
+
+	type = t->type;
+
+	for (i = 0; i < t->size; i++) {
+		if (!(t->slot[i] & SLOT_USED))
 			continue;
-		res = !type;
-		break;
+		if (n == max) {
+			n = -1;
+			break;
+		}
+		key_to_mac(t->slot[i], addrs[n++]);
 	}
-	pthread_rwlock_unlock(&lock);
+	pthread_mutex_unlock(&lock);
+
+	*cnt = n;
 
-	return res;
+	return type;
+}
+
+static int parse_mac(const char *str, uint8_t *addr)
+{
+	int n[ETH_ALEN];
+	int i;
+
+	if (sscanf(str, "%x:%x:%x:%x:%x:%x",
+		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6)
+		return -1;
+
+	for (i = 0; i < ETH_ALEN; i++) {
+		if (n[i] > 255)
+			return -1;
+		addr[i] = n[i];
+	}
+
+	return 0;
 }
 
 static int mac_filter_load(const char *opt)
 {
-	struct mac_t *mac;
+	struct mac_table_t *t, *t1;
 	FILE *f;
 	char *c;
 	char *name = _strdup(opt);
 	char *buf = _malloc(1024);
-	int n[ETH_ALEN];
-	int i, line = 0;
+	uint8_t addr[ETH_ALEN];
+	int type;
+	int line = 0;
 
 	c = strstr(name, ",");
 	if (!c)
@@ -76,40 +235,44 @@ static int mac_filter_load(const char *opt)
 	
 	conf_mac_filter = opt;
 
-	pthread_rwlock_wrlock(&lock);
-	while (!list_empty(&mac_list)) {
-		mac = list_entry(mac_list.next, typeof(*mac), entry);
-		list_del(&mac->entry);
-		_free(mac);
+	// the new table is built aside, readers keep using the old one meanwhile
+	t = table_alloc(type, 0);
+	if (!t) {
+		fclose(f);
+		goto err;
 	}
 
 	while (fgets(buf, 1024, f)) {
 		line++;
 		if (buf[0] == '#' || buf[0] == ';' || buf[0] == '\n')
 			continue;
-		if (sscanf(buf, "%x:%x:%x:%x:%x:%x",
-			n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+		if (parse_mac(buf, addr)) {
 			log_warn("pppoe: mac-filter:%s:%i: address is invalid\n", name, line);
 			continue;
 		}
-		mac = _malloc(sizeof(*mac));
-		for (i = 0; i < ETH_ALEN; i++) {
-			if (n[i] > 255) {
-				log_warn("pppoe: mac-filter:%s:%i: address is invalid\n", name, line);
-				_free(mac);
-				continue;
+		if ((t->used + 1) * 2 > t->size) {
+			t1 = table_rebuild(t, t->cnt + 1);
+			if (!t1) {
+				log_emerg("pppoe: mac-filter: out of memory\n");
+				break;
 			}
-			mac->addr[i] = n[i];
+			_free(t);
+			t = t1;
 		}
-		list_add_tail(&mac->entry, &mac_list);
+		table_insert(t, mac_key(addr));
 	}
-	pthread_rwlock_unlock(&lock);
 
 	fclose(f);
 
+	pthread_mutex_lock(&lock);
+	publish_ptr(&table, t, retire);
+	pthread_mutex_unlock(&lock);
+
 	_free(name);
 	_free(buf);
 
+	pppoe_update_filters();
+
 	return 0;
 
 err_inval:
@@ -120,91 +283,93 @@ err:
 	return -1;
 }
 
-static void mac_filter_add(const char *addr, void *client)
+static void mac_filter_add(const char *str, void *client)
 {
-	int n[ETH_ALEN];
-	struct mac_t *mac;
-	int i;
+	struct mac_table_t *t;
+	uint8_t addr[ETH_ALEN];
 
-	if (sscanf(addr, "%x:%x:%x:%x:%x:%x",
-		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+	if (parse_mac(str, addr)) {
 		cli_send(client, "invalid format\r\n");
 		return;
 	}
 
-	mac = _malloc(sizeof(*mac));
-	for (i = 0; i < ETH_ALEN; i++) {
-		if (n[i] > 255) {
-			_free(mac);
-			cli_send(client, "invalid format\r\n");
+	pthread_mutex_lock(&lock);
+	if (!table) {
+		pthread_mutex_unlock(&lock);
+		cli_send(client, "error: mac-filter is disabled\r\n");
+		return;
+	}
+
+	t = table;
+	if ((t->used + 1) * 2 > t->size) {
+		t = table_rebuild(t, t->cnt + 1);
+		if (!t) {
+			pthread_mutex_unlock(&lock);
+			cli_send(client, "error: out of memory\r\n");
 			return;
 		}
-		mac->addr[i] = n[i];
-	}
+		table_insert(t, mac_key(addr));
+		publish_ptr(&table, t, retire);
+	} else
+		table_insert(t, mac_key(addr));
+	pthread_mutex_unlock(&lock);
 
-	pthread_rwlock_wrlock(&lock);
-	list_add_tail(&mac->entry, &mac_list);
-	pthread_rwlock_unlock(&lock);
+	pppoe_update_filters();
 }
 
-static void mac_filter_del(const char *addr, void *client)
+static void mac_filter_del(const char *str, void *client)
 {
-	int n[ETH_ALEN];
-	uint8_t a[ETH_ALEN];
-	struct mac_t *mac;
-	int i;
-	int found = 0;
+	uint8_t addr[ETH_ALEN];
+	uint64_t *slot = NULL;
 
-	if (sscanf(addr, "%x:%x:%x:%x:%x:%x",
-		n + 0, n + 1, n + 2, n + 3, n + 4, n + 5) != 6) {
+	if (parse_mac(str, addr)) {
 		cli_send(client, "invalid format\r\n");
 		return;
 	}
 
-	for (i = 0; i < ETH_ALEN; i++) {
-		if (n[i] > 255) {
-			cli_send(client, "invalid format\r\n");
-			return;
-		}
-		a[i] = n[i];
-	}
-
-	pthread_rwlock_wrlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
-		if (memcmp(a, mac->addr, ETH_ALEN))
-			continue;
-		list_del(&mac->entry);
-		_free(mac);
-		found = 1;
-		break;
+	pthread_mutex_lock(&lock);
+	if (table)
+		slot = table_find(table, mac_key(addr));
+	if (slot) {
+		__atomic_store_n(slot, SLOT_DELETED, __ATOMIC_RELEASE);
+		table->cnt--;
 	}
-	pthread_rwlock_unlock(&lock);
+	pthread_mutex_unlock(&lock);
 
-	if (!found)
+	if (!slot)
 		cli_send(client, "not found\r\n");
+	else
+		pppoe_update_filters();
 }
 
 static void mac_filter_show(void *client)
 {
-	struct mac_t *mac;
+	struct mac_table_t *t;
 	const char *filter_type;
+	uint8_t addr[ETH_ALEN];
+	unsigned int i;
 
-	if (type == 0)
+	pthread_mutex_lock(&lock);
+	t = table;
+
+	if (!t)
+		filter_type = "disabled";
+	else if (t->type == 0)
 		filter_type = "deny";
-	else if (type == 1)
-		filter_type = "allow";
 	else
-		filter_type = "disabled";
+		filter_type = "allow";
 
 	cli_sendv(client, "filter type: %s\r\n", filter_type);
 
-	pthread_rwlock_rdlock(&lock);
-	list_for_each_entry(mac, &mac_list, entry) {
+	for (i = 0; t && i < t->size; i++) {
+		if (!(t->slot[i] & SLOT_USED))
+			continue;
+		key_to_mac(t->slot[i], addr);
 		cli_sendv(client, "%02x:%02x:%02x:%02x:%02x:%02x\r\n",
-			mac->addr[0], mac->addr[1], mac->addr[2],
-			mac->addr[3],	mac->addr[4], mac->addr[5]);
+			addr[0], addr[1], addr[2],
+			addr[3], addr[4], addr[5]);
 	}
-	pthread_rwlock_unlock(&lock);
+	pthread_mutex_unlock(&lock);
 }
 
 static void cmd_help(char * const *fields, int fields_cnt, void *client);
@@ -247,9 +412,9 @@ static void cmd_help(char * const *fields, int fields_cnt, void *client)
 static void init(void)
 {
 	const char *opt = conf_get_opt("pppoe", "mac-filter");
-	if (!opt || mac_filter_load(opt))
-		type = -1;
-	
+	if (opt)
+		mac_filter_load(opt);
+
 	cli_register_simple_cmd2(cmd_exec, cmd_help, 2, "pppoe", "mac-filter");
 }
 
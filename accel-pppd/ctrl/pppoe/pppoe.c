@@ -8,8 +8,12 @@
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <net/ethernet.h>
-#include <netpacket/packet.h>
+#include <linux/if_packet.h>
+#include <linux/filter.h>
+#include <linux/if_vlan.h>
+#include <linux/sockios.h>
 #include <arpa/inet.h>
 #include <printf.h>
 #include <ctype.h>
@@ -22,12 +26,14 @@
 #include "ppp.h"
 #include "mempool.h"
 #include "cli.h"
+#include "utils.h"
 
 #ifdef RADIUS
 #include "radius.h"
 #endif
 
 #include "connlimit.h"
+#include "libnetlink.h"
 
 #include "pppoe.h"
 
@@ -36,12 +42,14 @@
 struct pppoe_conn_t
 {
 	struct list_head entry;
+	struct list_head cookie_entry;
+	struct list_head uniq_entry;
 	struct triton_context_t ctx;
 	struct pppoe_serv_t *serv;
-	int disc_sock;
 	uint16_t sid;
 	uint8_t addr[ETH_ALEN];
 	int ppp_started:1;
+	int padt_sent:1;
 
 	struct pppoe_tag *relay_sid;
 	struct pppoe_tag *host_uniq;
@@ -56,22 +64,64 @@ struct pppoe_conn_t
 #endif
 };
 
+// PPPoE part of a session checkpoint, tags are stored whole
+struct pppoe_ckpt_t
+{
+	uint16_t sid;
+	uint8_t addr[ETH_ALEN];
+	uint8_t cookie[COOKIE_LENGTH];
+	char ifname[IFNAMSIZ];
+	uint16_t host_uniq_len;
+	uint16_t relay_sid_len;
+	uint16_t service_name_len;
+	uint16_t tr101_len;
+	uint8_t data[0];
+};
+
 struct delayed_pado_t
 {
 	struct list_head entry;
-	struct triton_timer_t timer;
-	struct pppoe_serv_t *serv;
+	struct list_head hash_entry;
+	uint64_t expire; // ms
 	uint8_t addr[ETH_ALEN];
-	struct pppoe_tag *host_uniq;
+	struct pppoe_tag *host_uniq; // these point to tags
 	struct pppoe_tag *relay_sid;
 	struct pppoe_tag *service_name;
+	uint8_t tags[MAX_PPPOE_PAYLOAD];
 };
 
-struct padi_t
+struct pado_bucket_t
 {
 	struct list_head entry;
-	struct timespec ts;
-	uint8_t addr[ETH_ALEN];
+	int delay;
+	struct list_head queue; // ordered by expire since delay is the same
+};
+
+struct vlan_frame_t
+{
+	struct list_head entry;
+	int len;
+	uint8_t pack[ETHER_MAX_LEN];
+};
+
+struct sid_quarantine_t
+{
+	struct list_head entry;
+	time_t ts;
+	uint16_t sid;
+};
+
+struct vlan_mon_t
+{
+	uint8_t vid[VLAN_CNT / 8];
+	uint8_t starting[VLAN_CNT / 8]; // queued to vlan_mon_ctx
+	time_t last_fail[VLAN_CNT];
+};
+
+struct vlan_mon_req_t
+{
+	struct pppoe_parent_t *parent;
+	int vid;
 };
 
 int conf_verbose;
@@ -80,55 +130,247 @@ int conf_ifname_in_sid;
 char *conf_pado_delay;
 int conf_tr101 = 1;
 int conf_padi_limit = 0;
+int conf_padi_burst = 0;
+int conf_sid_reuse_delay = 0;
+int conf_rx_ring = 0;
+int conf_vlan_shared_socket = 0;
+int conf_vlan_timeout = 60;
+int conf_vlan_create = 0;
+int conf_cookie_type = COOKIE_DES;
+int conf_cookie_timeout = 10;
 int conf_mppe = MPPE_UNSET;
 int conf_reply_exact_service = 0;
 char *conf_service_names[MAX_SERVICE_NAMES];
 
 static mempool_t conn_pool;
 static mempool_t pado_pool;
-static mempool_t padi_pool;
+static mempool_t frame_pool;
+static mempool_t sid_pool;
 
 unsigned int stat_starting;
 unsigned int stat_active;
 unsigned int stat_delayed_pado;
-unsigned long stat_PADI_recv;
-unsigned long stat_PADI_drop;
-unsigned long stat_PADO_sent;
-unsigned long stat_PADR_recv;
-unsigned long stat_PADR_dup_recv;
-unsigned long stat_PADS_sent;
-unsigned int total_padi_cnt;
+int stat_counters = -1;
+
+static struct token_bucket_t padi_bucket;
+static pthread_mutex_t padi_bucket_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t *padi_mac_hash;
+static uint8_t padi_mac_key[16];
 
 pthread_rwlock_t serv_lock = PTHREAD_RWLOCK_INITIALIZER;
 LIST_HEAD(serv_list);
 
+static LIST_HEAD(parent_list);
+static pthread_mutex_t parent_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static uint8_t bc_addr[ETH_ALEN] = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 
 static void pppoe_send_PADT(struct pppoe_conn_t *conn);
+static void pppoe_queue_PADT(struct pppoe_conn_t *conn);
 static void _server_stop(struct pppoe_serv_t *serv);
+static void vlan_parent_put(struct pppoe_parent_t *parent);
+static struct pppoe_serv_t *__pppoe_server_start(const char *opt, void *cli, int vlan_mon);
 void pppoe_server_free(struct pppoe_serv_t *serv);
 static int init_secret(struct pppoe_serv_t *serv);
 
+static void stat_inc(struct pppoe_serv_t *serv, int stat)
+{
+	if (stat_counters >= 0)
+		triton_counter_inc(stat_counters + stat);
+	if (serv->stat_counters >= 0)
+		triton_counter_inc(serv->stat_counters + stat);
+}
+
+static unsigned int cookie_hash(const uint8_t *cookie)
+{
+	uint32_t h;
+
+	// cookie starts with a cipher text or a MAC, evenly distributed anyway
+	memcpy(&h, cookie, sizeof(h));
+
+	return h & (CONN_HASH_SIZE - 1);
+}
+
+static uint32_t addr_uniq_hash(const uint8_t *addr, const struct pppoe_tag *host_uniq)
+{
+	uint32_t h = 2166136261u;
+	int i;
+
+	for (i = 0; i < ETH_ALEN; i++)
+		h = (h ^ addr[i]) * 16777619;
+
+	if (host_uniq) {
+		for (i = 0; i < ntohs(host_uniq->tag_len); i++)
+			h = (h ^ (uint8_t)host_uniq->tag_data[i]) * 16777619;
+	}
+
+	return h;
+}
+
+static unsigned int uniq_hash(const uint8_t *addr, const struct pppoe_tag *host_uniq)
+{
+	return addr_uniq_hash(addr, host_uniq) & (CONN_HASH_SIZE - 1);
+}
+
+static struct pppoe_conn_t *sid_lookup(struct pppoe_serv_t *serv, uint16_t sid)
+{
+	struct pppoe_conn_t **page = serv->conn[sid >> SID_PAGE_BITS];
+
+	return page ? page[sid & (SID_PAGE_SIZE - 1)] : NULL;
+}
+
+static int sid_set(struct pppoe_serv_t *serv, uint16_t sid, struct pppoe_conn_t *conn)
+{
+	struct pppoe_conn_t ***page = &serv->conn[sid >> SID_PAGE_BITS];
+
+	if (!*page) {
+		*page = _malloc(SID_PAGE_SIZE * sizeof(**page));
+		if (!*page)
+			return -1;
+		memset(*page, 0, SID_PAGE_SIZE * sizeof(**page));
+	}
+
+	(*page)[sid & (SID_PAGE_SIZE - 1)] = conn;
+
+	return 0;
+}
+
+static void sid_map_set(struct pppoe_serv_t *serv, uint16_t sid)
+{
+	int w = sid >> 6;
+
+	serv->sid_map[w] |= 1ull << (sid & 63);
+	if (serv->sid_map[w] == ~0ull)
+		serv->sid_map_full[w >> 6] |= 1ull << (w & 63);
+}
+
+static void sid_map_clear(struct pppoe_serv_t *serv, uint16_t sid)
+{
+	int w = sid >> 6;
+
+	serv->sid_map[w] &= ~(1ull << (sid & 63));
+	serv->sid_map_full[w >> 6] &= ~(1ull << (w & 63));
+}
+
+static int sid_map_init(struct pppoe_serv_t *serv)
+{
+	serv->sid_map = _malloc(SID_MAP_WORDS * sizeof(uint64_t));
+	if (!serv->sid_map)
+		return -1;
+
+	memset(serv->sid_map, 0, SID_MAP_WORDS * sizeof(uint64_t));
+
+	// never allocated
+	sid_map_set(serv, 0);
+	sid_map_set(serv, MAX_SID);
+	sid_map_set(serv, 0xffff);
+
+	return 0;
+}
+
+/* Returns the first free SID after the last allocated one, 0 if none */
+static uint16_t sid_alloc(struct pppoe_serv_t *serv)
+{
+	unsigned int sid = (serv->sid + 1) & 0xffff;
+	unsigned int w = sid >> 6;
+	uint64_t v = ~serv->sid_map[w] & (~0ull << (sid & 63));
+	unsigned int i, j;
+
+	if (v)
+		return (w << 6) + __builtin_ctzll(v);
+
+	w = (w + 1) & (SID_MAP_WORDS - 1);
+	j = w >> 6;
+	v = ~serv->sid_map_full[j] & (~0ull << (w & 63));
+
+	for (i = 0; i <= SID_MAP_WORDS / 64; i++) {
+		if (v) {
+			w = (j << 6) + __builtin_ctzll(v);
+			return (w << 6) + __builtin_ctzll(~serv->sid_map[w]);
+		}
+		j = (j + 1) & (SID_MAP_WORDS / 64 - 1);
+		v = ~serv->sid_map_full[j];
+	}
+
+	return 0;
+}
+
+static void sid_free(struct pppoe_serv_t *serv, uint16_t sid)
+{
+	struct sid_quarantine_t *q;
+	struct timespec ts;
+
+	if (serv->sid_reuse_delay && (q = mempool_alloc(sid_pool))) {
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		q->sid = sid;
+		q->ts = ts.tv_sec;
+		list_add_tail(&q->entry, &serv->sid_quarantine);
+	} else
+		sid_map_clear(serv, sid);
+}
+
+static void sid_release_quarantine(struct pppoe_serv_t *serv)
+{
+	struct sid_quarantine_t *q;
+	struct timespec ts;
+
+	if (list_empty(&serv->sid_quarantine))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	while (!list_empty(&serv->sid_quarantine)) {
+		q = list_entry(serv->sid_quarantine.next, typeof(*q), entry);
+		if (ts.tv_sec - q->ts < serv->sid_reuse_delay)
+			break;
+		sid_map_clear(serv, q->sid);
+		list_del(&q->entry);
+		mempool_free(q);
+	}
+}
+
+static int conn_hash_init(struct pppoe_serv_t *serv)
+{
+	int i;
+
+	serv->cookie_hash = _malloc(2 * CONN_HASH_SIZE * sizeof(struct list_head));
+	if (!serv->cookie_hash)
+		return -1;
+
+	serv->uniq_hash = serv->cookie_hash + CONN_HASH_SIZE;
+
+	for (i = 0; i < 2 * CONN_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&serv->cookie_hash[i]);
+
+	return 0;
+}
+
 static void disconnect(struct pppoe_conn_t *conn)
 {
 	if (conn->ppp_started) {
-		dpado_check_prev(__sync_fetch_and_sub(&stat_active, 1));
+		__sync_sub_and_fetch(&stat_active, 1);
 		conn->ppp_started = 0;
 		ppp_terminate(&conn->ppp, TERM_USER_REQUEST, 1);
 	}
 
-	pppoe_send_PADT(conn);
-
-	close(conn->disc_sock);
-
+	if (!conn->padt_sent) {
+		if (ppp_shutdown || conn->serv->stopping)
+			pppoe_queue_PADT(conn);
+		else
+			pppoe_send_PADT(conn);
+	}
 
 	triton_event_fire(EV_CTRL_FINISHED, &conn->ppp);
 
 	log_ppp_info1("disconnected\n");
 
 	pthread_mutex_lock(&conn->serv->lock);
-	conn->serv->conn[conn->sid] = NULL;
+	sid_set(conn->serv, conn->sid, NULL);
+	sid_free(conn->serv, conn->sid);
 	list_del(&conn->entry);
+	list_del(&conn->cookie_entry);
+	if (conn->host_uniq)
+		list_del(&conn->uniq_entry);
 	conn->serv->conn_cnt--;
 	if (conn->serv->stopping && conn->serv->conn_cnt == 0) {
 		pthread_mutex_unlock(&conn->serv->lock);
@@ -151,9 +393,89 @@ static void disconnect(struct pppoe_conn_t *conn)
 	mempool_free(conn);
 }
 
+#ifdef RADIUS
+static int pppoe_rad_send_access_request(struct rad_plugin_t *rad, struct rad_packet_t *pack)
+{
+	struct pppoe_conn_t *conn = container_of(rad, typeof(*conn), radius);
+
+	if (conn->tr101)
+		return tr101_send_access_request(conn->tr101, pack);
+	
+	return 0;
+}
+
+static int pppoe_rad_send_accounting_request(struct rad_plugin_t *rad, struct rad_packet_t *pack)
+{
+	struct pppoe_conn_t *conn = container_of(rad, typeof(*conn), radius);
+
+	if (conn->tr101)
+		return tr101_send_accounting_request(conn->tr101, pack);
+	
+	return 0;
+}
+#endif
+
+static void register_tr101(struct pppoe_conn_t *conn)
+{
+#ifdef RADIUS
+	if (conn->tr101 && triton_module_loaded("radius")) {
+		conn->radius.send_access_request = pppoe_rad_send_access_request;
+		conn->radius.send_accounting_request = pppoe_rad_send_accounting_request;
+		rad_register_plugin(&conn->ppp, &conn->radius);
+	}
+#endif
+}
+
+static int tag_size(const struct pppoe_tag *tag)
+{
+	return tag ? sizeof(*tag) + ntohs(tag->tag_len) : 0;
+}
+
+static uint8_t *put_tag(uint8_t *ptr, const struct pppoe_tag *tag)
+{
+	memcpy(ptr, tag, tag_size(tag));
+	return ptr + tag_size(tag);
+}
+
+static void ckpt_save(struct pppoe_conn_t *conn)
+{
+	uint8_t buf[sizeof(struct pppoe_ckpt_t) + 4 * (sizeof(struct pppoe_tag) + MAX_PPPOE_PAYLOAD)] __attribute__((aligned(8)));
+	struct pppoe_ckpt_t *c = (struct pppoe_ckpt_t *)buf;
+	uint8_t *ptr = c->data;
+
+	c->sid = conn->sid;
+	memcpy(c->addr, conn->addr, ETH_ALEN);
+	memcpy(c->cookie, conn->cookie, COOKIE_LENGTH);
+	strncpy(c->ifname, conn->serv->ifname, IFNAMSIZ);
+	c->host_uniq_len = tag_size(conn->host_uniq);
+	c->relay_sid_len = tag_size(conn->relay_sid);
+	c->service_name_len = tag_size(conn->service_name);
+	c->tr101_len = tag_size(conn->tr101);
+
+	ptr = put_tag(ptr, conn->host_uniq);
+	ptr = put_tag(ptr, conn->relay_sid);
+	ptr = put_tag(ptr, conn->service_name);
+	ptr = put_tag(ptr, conn->tr101);
+
+	if (ppp_ckpt_set(&conn->ppp, PPP_CKPT_PPPOE, buf, ptr - buf))
+		log_ppp_warn("pppoe: session doesn't fit checkpoint slot\n");
+}
+
 static void ppp_started(struct ppp_t *ppp)
 {
+	struct pppoe_conn_t *conn = container_of(ppp, typeof(*conn), ppp);
+
 	log_ppp_debug("pppoe: ppp started\n");
+
+	// resumed by hot restart, connect_channel() was not called
+	if (!conn->ppp_started) {
+		register_tr101(conn);
+		conn->ppp_started = 1;
+		__sync_add_and_fetch(&stat_active, 1);
+	}
+
+	if (ppp->ckpt)
+		ckpt_save(conn);
 }
 
 static void ppp_finished(struct ppp_t *ppp)
@@ -163,7 +485,7 @@ static void ppp_finished(struct ppp_t *ppp)
 	log_ppp_debug("pppoe: ppp finished\n");
 
 	if (conn->ppp_started) {
-		dpado_check_prev(__sync_fetch_and_sub(&stat_active, 1));
+		__sync_sub_and_fetch(&stat_active, 1);
 		conn->ppp_started = 0;
 		triton_context_call(&conn->ctx, (triton_event_func)disconnect, conn);
 	}
@@ -179,29 +501,7 @@ static void pppoe_conn_close(struct triton_context_t *ctx)
 		disconnect(conn);
 }
 
-#ifdef RADIUS
-static int pppoe_rad_send_access_request(struct rad_plugin_t *rad, struct rad_packet_t *pack)
-{
-	struct pppoe_conn_t *conn = container_of(rad, typeof(*conn), radius);
-
-	if (conn->tr101)
-		return tr101_send_access_request(conn->tr101, pack);
-	
-	return 0;
-}
-
-static int pppoe_rad_send_accounting_request(struct rad_plugin_t *rad, struct rad_packet_t *pack)
-{
-	struct pppoe_conn_t *conn = container_of(rad, typeof(*conn), radius);
-
-	if (conn->tr101)
-		return tr101_send_accounting_request(conn->tr101, pack);
-	
-	return 0;
-}
-#endif
-
-static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid, const struct pppoe_tag *service_name, const struct pppoe_tag *tr101, const uint8_t *cookie)
+static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid, const struct pppoe_tag *service_name, const struct pppoe_tag *tr101, const uint8_t *cookie, uint16_t req_sid)
 {
 	struct pppoe_conn_t *conn;
 	int sid;
@@ -214,33 +514,52 @@ static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const ui
 
 	memset(conn, 0, sizeof(*conn));
 
+	conn->serv = serv;
+	memcpy(conn->addr, addr, ETH_ALEN);
+	memcpy(conn->cookie, cookie, COOKIE_LENGTH);
+
+	if (host_uniq) {
+		conn->host_uniq = _malloc(sizeof(*host_uniq) + ntohs(host_uniq->tag_len));
+		memcpy(conn->host_uniq, host_uniq, sizeof(*host_uniq) + ntohs(host_uniq->tag_len));
+	}
+
 	pthread_mutex_lock(&serv->lock);
-	for (sid = serv->sid + 1; sid != serv->sid; sid++) {
-		if (sid == MAX_SID)
-			sid = 1;
-		if (!serv->conn[sid]) {
+	if (!serv->cookie_hash && conn_hash_init(serv)) {
+		pthread_mutex_unlock(&serv->lock);
+		log_emerg("pppoe: out of memory\n");
+		goto out_err;
+	}
+	if (!serv->sid_map && sid_map_init(serv)) {
+		pthread_mutex_unlock(&serv->lock);
+		log_emerg("pppoe: out of memory\n");
+		goto out_err;
+	}
+	sid_release_quarantine(serv);
+	if (!req_sid)
+		sid = sid_alloc(serv);
+	else if (sid_lookup(serv, req_sid) || (serv->sid_map[req_sid >> 6] & (1ull << (req_sid & 63))))
+		sid = 0;
+	else
+		sid = req_sid;
+	if (sid) {
+		if (sid_set(serv, sid, conn))
+			log_emerg("pppoe: out of memory\n");
+		else {
+			sid_map_set(serv, sid);
 			conn->sid = sid;
 			serv->sid = sid;
-			serv->conn[sid] = conn;
 			list_add_tail(&conn->entry, &serv->conn_list);
+			list_add_tail(&conn->cookie_entry, &serv->cookie_hash[cookie_hash(cookie)]);
+			if (host_uniq)
+				list_add_tail(&conn->uniq_entry, &serv->uniq_hash[uniq_hash(addr, host_uniq)]);
 			serv->conn_cnt++;
-			break;
 		}
 	}
 	pthread_mutex_unlock(&serv->lock);
 
 	if (!conn->sid) {
 		log_warn("pppoe: no free sid available\n");
-		mempool_free(conn);
-		return NULL;
-	}
-	
-	conn->serv = serv;
-	memcpy(conn->addr, addr, ETH_ALEN);
-
-	if (host_uniq) {
-		conn->host_uniq = _malloc(sizeof(*host_uniq) + ntohs(host_uniq->tag_len));
-		memcpy(conn->host_uniq, host_uniq, sizeof(*host_uniq) + ntohs(host_uniq->tag_len));
+		goto out_err;
 	}
 
 	if (relay_sid) {
@@ -256,8 +575,6 @@ static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const ui
 	conn->service_name = _malloc(sizeof(*service_name) + ntohs(service_name->tag_len));
 	memcpy(conn->service_name, service_name, sizeof(*service_name) + ntohs(service_name->tag_len));
 
-	memcpy(conn->cookie, cookie, COOKIE_LENGTH);
-
 	conn->ctx.before_switch = log_switch;
 	conn->ctx.close = pppoe_conn_close;
 	conn->ctrl.ctx = &conn->ctx;
@@ -296,9 +613,13 @@ static struct pppoe_conn_t *allocate_channel(struct pppoe_serv_t *serv, const ui
 	triton_event_fire(EV_CTRL_STARTING, &conn->ppp);
 	triton_event_fire(EV_CTRL_STARTED, &conn->ppp);
 
-	conn->disc_sock = dup(serv->hnd.fd);
-
 	return conn;
+
+out_err:
+	if (conn->host_uniq)
+		_free(conn->host_uniq);
+	mempool_free(conn);
+	return NULL;
 }
 
 static void connect_channel(struct pppoe_conn_t *conn)
@@ -332,17 +653,11 @@ static void connect_channel(struct pppoe_conn_t *conn)
 	if (establish_ppp(&conn->ppp))
 		goto out_err_close;
 	
-#ifdef RADIUS
-	if (conn->tr101 && triton_module_loaded("radius")) {
-		conn->radius.send_access_request = pppoe_rad_send_access_request;
-		conn->radius.send_accounting_request = pppoe_rad_send_accounting_request;
-		rad_register_plugin(&conn->ppp, &conn->radius);
-	}
-#endif
+	register_tr101(conn);
 
 	conn->ppp_started = 1;
 	
-	dpado_check_next(__sync_add_and_fetch(&stat_active, 1));
+	__sync_add_and_fetch(&stat_active, 1);
 	
 	return;
 
@@ -352,39 +667,120 @@ out_err:
 	disconnect(conn);
 }
 
-static struct pppoe_conn_t *find_channel(struct pppoe_serv_t *serv, const uint8_t *cookie)
+static void restore_channel(struct pppoe_conn_t *conn)
 {
-	struct pppoe_conn_t *conn;
-
-	list_for_each_entry(conn, &serv->conn_list, entry)
-		if (!memcmp(conn->cookie, cookie, COOKIE_LENGTH))
-			return conn;
-
-	return NULL;
+	if (ppp_restore(&conn->ppp)) {
+		close(conn->ppp.fd);
+		disconnect(conn);
+	}
 }
 
-static void print_tag_string(struct pppoe_tag *tag)
+static const struct pppoe_tag *get_tag(const uint8_t **ptr, int len)
 {
-	int i;
+	const struct pppoe_tag *tag = (const struct pppoe_tag *)*ptr;
 
-	for (i = 0; i < ntohs(tag->tag_len); i++)
-		log_info2("%c", tag->tag_data[i]);
+	*ptr += len;
+
+	return len ? tag : NULL;
 }
 
-static void print_tag_octets(struct pppoe_tag *tag)
+/* Hot restart hook, called from init for PPPoE records of the checkpoint */
+static int pppoe_restore(struct ppp_ckpt_rec_t *rec)
 {
-	int i;
+	const struct pppoe_ckpt_t *c;
+	const struct pppoe_tag *host_uniq, *relay_sid, *service_name, *tr101;
+	const uint8_t *ptr;
+	struct pppoe_serv_t *serv;
+	struct pppoe_conn_t *conn = NULL;
+	int len;
 
-	for (i = 0; i < ntohs(tag->tag_len); i++)
-		log_info2("%02x", (uint8_t)tag->tag_data[i]);
-}
+	c = ppp_ckpt_get(rec, PPP_CKPT_PPPOE, &len);
+	if (!c || len < sizeof(*c) || !c->service_name_len ||
+	    len != sizeof(*c) + c->host_uniq_len + c->relay_sid_len + c->service_name_len + c->tr101_len)
+		return -1;
 
-static void print_packet(uint8_t *pack)
-{
-	struct ethhdr *ethhdr = (struct ethhdr *)pack;
-	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
-	struct pppoe_tag *tag;
-	int n;
+	ptr = c->data;
+	host_uniq = get_tag(&ptr, c->host_uniq_len);
+	relay_sid = get_tag(&ptr, c->relay_sid_len);
+	service_name = get_tag(&ptr, c->service_name_len);
+	tr101 = get_tag(&ptr, c->tr101_len);
+
+	pthread_rwlock_rdlock(&serv_lock);
+	list_for_each_entry(serv, &serv_list, entry) {
+		if (serv->stopping || strncmp(serv->ifname, c->ifname, IFNAMSIZ))
+			continue;
+		conn = allocate_channel(serv, c->addr, host_uniq, relay_sid, service_name, tr101, c->cookie, c->sid);
+		break;
+	}
+	pthread_rwlock_unlock(&serv_lock);
+
+	if (!conn)
+		return -1;
+
+	conn->ppp.fd = rec->fd;
+	conn->ppp.ckpt = rec;
+
+	triton_context_call(&conn->ctx, (triton_event_func)restore_channel, conn);
+
+	return 0;
+}
+
+static struct pppoe_conn_t *find_channel(struct pppoe_serv_t *serv, const uint8_t *cookie)
+{
+	struct pppoe_conn_t *conn;
+
+	if (!serv->cookie_hash)
+		return NULL;
+
+	list_for_each_entry(conn, &serv->cookie_hash[cookie_hash(cookie)], cookie_entry)
+		if (!memcmp(conn->cookie, cookie, COOKIE_LENGTH))
+			return conn;
+
+	return NULL;
+}
+
+static struct pppoe_conn_t *find_channel_uniq(struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq)
+{
+	struct pppoe_conn_t *conn;
+
+	if (!serv->cookie_hash)
+		return NULL;
+
+	list_for_each_entry(conn, &serv->uniq_hash[uniq_hash(addr, host_uniq)], uniq_entry) {
+		if (memcmp(conn->addr, addr, ETH_ALEN))
+			continue;
+		if (conn->host_uniq->tag_len != host_uniq->tag_len)
+			continue;
+		if (memcmp(conn->host_uniq->tag_data, host_uniq->tag_data, ntohs(host_uniq->tag_len)))
+			continue;
+		return conn;
+	}
+
+	return NULL;
+}
+
+static void print_tag_string(struct pppoe_tag *tag)
+{
+	int i;
+
+	for (i = 0; i < ntohs(tag->tag_len); i++)
+		log_info2("%c", tag->tag_data[i]);
+}
+
+static void print_tag_octets(struct pppoe_tag *tag)
+{
+	int i;
+
+	for (i = 0; i < ntohs(tag->tag_len); i++)
+		log_info2("%02x", (uint8_t)tag->tag_data[i]);
+}
+
+static void print_packet(uint8_t *pack)
+{
+	struct ethhdr *ethhdr = (struct ethhdr *)pack;
+	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
+	struct pppoe_tag *tag;
+	int n;
 
 	log_info2("[PPPoE ");
 
@@ -467,7 +863,7 @@ static void print_packet(uint8_t *pack)
 	log_info2("]\n");
 }
 
-static void generate_cookie(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie)
+static void generate_cookie_des(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie)
 {
 	MD5_CTX ctx;
 	DES_cblock key;
@@ -498,7 +894,7 @@ static void generate_cookie(struct pppoe_serv_t *serv, const uint8_t *src, uint8
 	memcpy(cookie, u1.raw, 24);
 }
 
-static int check_cookie(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie)
+static int check_cookie_des(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie)
 {
 	MD5_CTX ctx;
 	DES_key_schedule ks;	
@@ -529,6 +925,87 @@ static int check_cookie(struct pppoe_serv_t *serv, const uint8_t *src, const uin
 	return memcmp(u1.raw, u2.raw, 16);
 }
 
+/*
+ * SipHash cookie:
+ *  0      8           12    16    17        24
+ *  | tag  | timestamp | seq | gen | 0 ...   |
+ * tag covers both addresses and the rest of the cookie, key is chosen
+ * by gen and is rotated every cookie-timeout seconds
+ */
+static uint64_t cookie_tag(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie)
+{
+	uint8_t buf[2 * ETH_ALEN + COOKIE_LENGTH - 8];
+
+	memcpy(buf, serv->hwaddr, ETH_ALEN);
+	memcpy(buf + ETH_ALEN, src, ETH_ALEN);
+	memcpy(buf + 2 * ETH_ALEN, cookie + 8, COOKIE_LENGTH - 8);
+
+	return u_siphash(serv->cookie_key[cookie[16] & 1], buf, sizeof(buf));
+}
+
+static void generate_cookie_siphash(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie)
+{
+	struct timespec ts;
+	uint32_t t, seq;
+	uint64_t tag;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	if (ts.tv_sec - serv->cookie_key_ts >= conf_cookie_timeout) {
+		if (read(urandom_fd, serv->cookie_key[(serv->cookie_gen + 1) & 1], COOKIE_KEY_LENGTH) == COOKIE_KEY_LENGTH) {
+			serv->cookie_gen++;
+			serv->cookie_key_ts = ts.tv_sec;
+		}
+	}
+
+	t = htonl(ts.tv_sec);
+	seq = htonl(++serv->cookie_seq);
+
+	memset(cookie + 8, 0, COOKIE_LENGTH - 8);
+	memcpy(cookie + 8, &t, 4);
+	memcpy(cookie + 12, &seq, 4);
+	cookie[16] = serv->cookie_gen;
+
+	tag = cookie_tag(serv, src, cookie);
+	memcpy(cookie, &tag, 8);
+}
+
+static int check_cookie_siphash(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie)
+{
+	struct timespec ts;
+	uint32_t t;
+	uint64_t tag;
+
+	if (cookie[16] != serv->cookie_gen && cookie[16] != (uint8_t)(serv->cookie_gen - 1))
+		return -1;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	memcpy(&t, cookie + 8, 4);
+	t = ntohl(t);
+	if (t > ts.tv_sec || ts.tv_sec - t > conf_cookie_timeout)
+		return -1;
+
+	tag = cookie_tag(serv, src, cookie);
+
+	return memcmp(&tag, cookie, 8);
+}
+
+static void generate_cookie(struct pppoe_serv_t *serv, const uint8_t *src, uint8_t *cookie)
+{
+	if (conf_cookie_type == COOKIE_SIPHASH)
+		generate_cookie_siphash(serv, src, cookie);
+	else
+		generate_cookie_des(serv, src, cookie);
+}
+
+static int check_cookie(struct pppoe_serv_t *serv, const uint8_t *src, const uint8_t *cookie)
+{
+	if (conf_cookie_type == COOKIE_SIPHASH)
+		return check_cookie_siphash(serv, src, cookie);
+	else
+		return check_cookie_des(serv, src, cookie);
+}
+
 static void setup_header(uint8_t *pack, const uint8_t *src, const uint8_t *dst, int code, uint16_t sid)
 {
 	struct ethhdr *ethhdr = (struct ethhdr *)pack;
@@ -567,13 +1044,27 @@ static void add_tag2(uint8_t *pack, const struct pppoe_tag *t)
 	hdr->length = htons(ntohs(hdr->length) + sizeof(*tag) + ntohs(t->tag_len));
 }
 
-static void pppoe_send(int fd, const uint8_t *pack)
+/* Connections send through the server socket too, it is closed only
+ * after the last connection is gone (see disconnect()) */
+static void pppoe_send(struct pppoe_serv_t *serv, const uint8_t *pack)
 {
 	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
+	struct sockaddr_ll sa;
 	int n, s;
 
 	s = ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length);
-	n = write(fd, pack, s);
+
+	if (serv->parent) {
+		// socket is bound to the parent, send through the VLAN device
+		memset(&sa, 0, sizeof(sa));
+		sa.sll_family = AF_PACKET;
+		sa.sll_protocol = htons(ETH_P_PPP_DISC);
+		sa.sll_ifindex = serv->ifindex;
+		sa.sll_halen = ETH_ALEN;
+		memcpy(sa.sll_addr, pack, ETH_ALEN);
+		n = sendto(serv->hnd.fd, pack, s, 0, (struct sockaddr *)&sa, sizeof(sa));
+	} else
+		n = write(serv->hnd.fd, pack, s);
 	if (n < 0 )
 		log_error("pppoe: write: %s\n", strerror(errno));
 	else if (n != s) {
@@ -581,6 +1072,73 @@ static void pppoe_send(int fd, const uint8_t *pack)
 	}
 }
 
+static void pppoe_send_batch(struct pppoe_serv_t *serv, uint8_t *buf, int *len, int cnt)
+{
+	struct mmsghdr msg[TX_BATCH];
+	struct iovec iov[TX_BATCH];
+	struct sockaddr_ll sa;
+	int i, n, r;
+
+	memset(msg, 0, cnt * sizeof(msg[0]));
+
+	if (serv->parent) {
+		memset(&sa, 0, sizeof(sa));
+		sa.sll_family = AF_PACKET;
+		sa.sll_protocol = htons(ETH_P_PPP_DISC);
+		sa.sll_ifindex = serv->ifindex;
+		sa.sll_halen = ETH_ALEN;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		iov[i].iov_base = buf + i * ETHER_MAX_LEN;
+		iov[i].iov_len = len[i];
+		msg[i].msg_hdr.msg_iov = &iov[i];
+		msg[i].msg_hdr.msg_iovlen = 1;
+		if (serv->parent) {
+			msg[i].msg_hdr.msg_name = &sa;
+			msg[i].msg_hdr.msg_namelen = sizeof(sa);
+		}
+	}
+
+	for (n = 0; n < cnt; n += r) {
+		r = sendmmsg(serv->hnd.fd, msg + n, cnt - n, 0);
+		if (r < 0) {
+			log_error("pppoe: sendmmsg: %s\n", strerror(errno));
+			break;
+		}
+	}
+}
+
+static void pppoe_serv_flush(struct pppoe_serv_t *serv)
+{
+	if (!serv->tx_cnt)
+		return;
+
+	pppoe_send_batch(serv, serv->tx_buf, serv->tx_len, serv->tx_cnt);
+
+	serv->tx_cnt = 0;
+}
+
+/* While a ring block is being processed replies on the server socket
+ * are collected and sent by one sendmmsg() once the block is done */
+static void pppoe_serv_send(struct pppoe_serv_t *serv, const uint8_t *pack)
+{
+	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
+	int s;
+
+	if (!serv->tx_buf) {
+		pppoe_send(serv, pack);
+		return;
+	}
+
+	s = ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length);
+	memcpy(serv->tx_buf + serv->tx_cnt * ETHER_MAX_LEN, pack, s);
+	serv->tx_len[serv->tx_cnt] = s;
+
+	if (++serv->tx_cnt == TX_BATCH)
+		pppoe_serv_flush(serv);
+}
+
 static void pppoe_send_PADO(struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid, const struct pppoe_tag *service_name)
 {
 	uint8_t pack[ETHER_MAX_LEN];
@@ -618,8 +1176,8 @@ static void pppoe_send_PADO(struct pppoe_serv_t *serv, const uint8_t *addr, cons
 		print_packet(pack);
 	}
 
-	__sync_add_and_fetch(&stat_PADO_sent, 1);
-	pppoe_send(serv->hnd.fd, pack);
+	stat_inc(serv, STAT_PADO_SENT);
+	pppoe_serv_send(serv, pack);
 }
 
 static void pppoe_send_err(struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq, const struct pppoe_tag *relay_sid, int code, int tag_type)
@@ -642,7 +1200,7 @@ static void pppoe_send_err(struct pppoe_serv_t *serv, const uint8_t *addr, const
 		print_packet(pack);
 	}
 
-	pppoe_send(serv->hnd.fd, pack);
+	pppoe_serv_send(serv, pack);
 }
 
 static void pppoe_send_PADS(struct pppoe_conn_t *conn)
@@ -666,13 +1224,13 @@ static void pppoe_send_PADS(struct pppoe_conn_t *conn)
 		print_packet(pack);
 	}
 
-	__sync_add_and_fetch(&stat_PADS_sent, 1);
-	pppoe_send(conn->disc_sock, pack);
+	stat_inc(conn->serv, STAT_PADS_SENT);
+	pppoe_send(conn->serv, pack);
 }
 
-static void pppoe_send_PADT(struct pppoe_conn_t *conn)
+static int setup_PADT(struct pppoe_conn_t *conn, uint8_t *pack)
 {
-	uint8_t pack[ETHER_MAX_LEN];
+	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
 
 	setup_header(pack, conn->serv->hwaddr, conn->addr, CODE_PADT, conn->sid);
 
@@ -691,143 +1249,358 @@ static void pppoe_send_PADT(struct pppoe_conn_t *conn)
 		print_packet(pack);
 	}
 
-	pppoe_send(conn->disc_sock, pack);
+	return ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length);
 }
 
-static void free_delayed_pado(struct delayed_pado_t *pado)
+static void pppoe_send_PADT(struct pppoe_conn_t *conn)
 {
-	triton_timer_del(&pado->timer);
-
-	__sync_sub_and_fetch(&stat_delayed_pado, 1);
-	list_del(&pado->entry);
+	uint8_t pack[ETHER_MAX_LEN];
 
-	if (pado->host_uniq)
-		_free(pado->host_uniq);
-	if (pado->relay_sid)
-		_free(pado->relay_sid);
-	if (pado->service_name)
-		_free(pado->service_name);
+	setup_PADT(conn, pack);
 
-	mempool_free(pado);
+	pppoe_send(conn->serv, pack);
 }
 
-static void pado_timer(struct triton_timer_t *t)
+/* Must be called with serv->lock held */
+static void padt_flush(struct pppoe_serv_t *serv)
 {
-	struct delayed_pado_t *pado = container_of(t, typeof(*pado), timer);
+	if (!serv->padt_cnt)
+		return;
 
-	if (!ppp_shutdown)
-		pppoe_send_PADO(pado->serv, pado->addr, pado->host_uniq, pado->relay_sid, pado->service_name);
+	pppoe_send_batch(serv, serv->padt_buf, serv->padt_len, serv->padt_cnt);
 
-	free_delayed_pado(pado);
+	serv->padt_cnt = 0;
 }
 
-static int check_padi_limit(struct pppoe_serv_t *serv, uint8_t *addr)
+static void padt_timer(struct triton_timer_t *t)
 {
-	struct padi_t *padi;
-	struct timespec ts;
+	struct pppoe_serv_t *serv = container_of(t, typeof(*serv), padt_timer);
 
-	if (serv->padi_limit == 0)
-		goto connlimit_check;
+	pthread_mutex_lock(&serv->lock);
+	padt_flush(serv);
+	triton_timer_del(t);
+	pthread_mutex_unlock(&serv->lock);
+}
 
-	clock_gettime(CLOCK_MONOTONIC, &ts);
+/* Must be called with serv->lock held */
+static int __pppoe_queue_PADT(struct pppoe_conn_t *conn)
+{
+	struct pppoe_serv_t *serv = conn->serv;
 
-	while (!list_empty(&serv->padi_list)) {
-		padi = list_entry(serv->padi_list.next, typeof(*padi), entry);
-		if ((ts.tv_sec - padi->ts.tv_sec) * 1000 + (ts.tv_nsec - padi->ts.tv_nsec) / 1000000 > 1000) {
-			list_del(&padi->entry);
-			mempool_free(padi);
-			serv->padi_cnt--;
-			__sync_sub_and_fetch(&total_padi_cnt, 1);
-		} else
-			break;
-	}
-	
-	if (serv->padi_cnt == serv->padi_limit)
-		return -1;
-	
-	if (conf_padi_limit && total_padi_cnt >= conf_padi_limit)
-		return -1;
-	
-	list_for_each_entry(padi, &serv->padi_list, entry) {
-		if (memcmp(padi->addr, addr, ETH_ALEN) == 0)
+	if (!serv->padt_buf) {
+		serv->padt_buf = _malloc(TX_BATCH * ETHER_MAX_LEN);
+		if (!serv->padt_buf)
 			return -1;
 	}
 
-	padi = mempool_alloc(padi_pool);
-	if (!padi)
-		return -1;
-	
-	padi->ts = ts;
-	memcpy(padi->addr, addr, ETH_ALEN);
-	list_add_tail(&padi->entry, &serv->padi_list);
-	serv->padi_cnt++;
-
-	__sync_add_and_fetch(&total_padi_cnt, 1);
+	serv->padt_len[serv->padt_cnt] = setup_PADT(conn, serv->padt_buf + serv->padt_cnt * ETHER_MAX_LEN);
+	conn->padt_sent = 1;
 
-connlimit_check:
-	if (triton_module_loaded("connlimit") && connlimit_check(cl_key_from_mac(addr)))
-		return -1;
+	if (++serv->padt_cnt == TX_BATCH)
+		padt_flush(serv);
 
 	return 0;
 }
 
-static void pppoe_recv_PADI(struct pppoe_serv_t *serv, uint8_t *pack, int size)
+/* PADTs of sessions terminated at once are collected per interface and
+ * sent by sendmmsg() when the batch is full or PADT_BATCH_TIMEOUT expires */
+static void pppoe_queue_PADT(struct pppoe_conn_t *conn)
+{
+	struct pppoe_serv_t *serv = conn->serv;
+	int r;
+
+	pthread_mutex_lock(&serv->lock);
+	r = __pppoe_queue_PADT(conn);
+	if (!r && serv->padt_cnt && !serv->padt_timer.tpd) {
+		serv->padt_timer.expire = padt_timer;
+		serv->padt_timer.expire_tv.tv_usec = PADT_BATCH_TIMEOUT * 1000;
+		triton_timer_add(&serv->ctx, &serv->padt_timer, 0);
+	}
+	pthread_mutex_unlock(&serv->lock);
+
+	if (r)
+		pppoe_send_PADT(conn);
+}
+
+static uint64_t get_ms(void)
 {
-	struct ethhdr *ethhdr = (struct ethhdr *)pack;
-	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
-	struct pppoe_tag *tag;
-	struct pppoe_tag *host_uniq_tag = NULL;
-	struct pppoe_tag *relay_sid_tag = NULL;
-	struct pppoe_tag *service_name_tag = NULL;
-	int n, i, service_match = 0;
-	struct delayed_pado_t *pado;
-	char **service_names = NULL;
 	struct timespec ts;
 
-	__sync_add_and_fetch(&stat_PADI_recv, 1);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
 
-	if (ppp_shutdown || pado_delay == -1)
-		return;
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-	if (check_padi_limit(serv, ethhdr->h_source)) {
-		__sync_add_and_fetch(&stat_PADI_drop, 1);
-		if (conf_verbose) {
-			clock_gettime(CLOCK_MONOTONIC, &ts);
-			if (ts.tv_sec - 60 >= serv->last_padi_limit_warn) {
-				log_warn("pppoe: discarding overlimit PADI packets on interface %s\n", serv->ifname);
-				serv->last_padi_limit_warn = ts.tv_sec;
-			}
+static void free_delayed_pado(struct pppoe_serv_t *serv, struct delayed_pado_t *pado)
+{
+	__sync_sub_and_fetch(&stat_delayed_pado, 1);
+	serv->pado_cnt--;
+	list_del(&pado->entry);
+	list_del(&pado->hash_entry);
+
+	mempool_free(pado);
+}
+
+static void pado_timer(struct triton_timer_t *t)
+{
+	struct pppoe_serv_t *serv = container_of(t, typeof(*serv), pado_timer);
+	struct pado_bucket_t *b;
+	struct delayed_pado_t *pado;
+	uint64_t now = get_ms();
+
+	list_for_each_entry(b, &serv->pado_buckets, entry) {
+		while (!list_empty(&b->queue)) {
+			pado = list_entry(b->queue.next, typeof(*pado), entry);
+			if (pado->expire > now)
+				break;
+			if (!ppp_shutdown)
+				pppoe_send_PADO(serv, pado->addr, pado->host_uniq, pado->relay_sid, pado->service_name);
+			free_delayed_pado(serv, pado);
 		}
-		return;
 	}
 
-	if (hdr->sid) {
-		log_warn("pppoe: discarding PADI packet (sid is not zero)\n");
+	pppoe_serv_flush(serv);
+
+	if (!serv->pado_cnt)
+		triton_timer_del(t);
+}
+
+static int pado_queued(struct pppoe_serv_t *serv, const uint8_t *addr, const struct pppoe_tag *host_uniq)
+{
+	struct delayed_pado_t *pado;
+
+	if (!serv->pado_hash)
+		return 0;
+
+	list_for_each_entry(pado, &serv->pado_hash[addr_uniq_hash(addr, host_uniq) & (PADO_HASH_SIZE - 1)], hash_entry) {
+		if (memcmp(pado->addr, addr, ETH_ALEN))
+			continue;
+		if (!host_uniq != !pado->host_uniq)
+			continue;
+		if (host_uniq && (pado->host_uniq->tag_len != host_uniq->tag_len ||
+		    memcmp(pado->host_uniq->tag_data, host_uniq->tag_data, ntohs(host_uniq->tag_len))))
+			continue;
+		return 1;
+	}
+
+	return 0;
+}
+
+static struct pppoe_tag *pado_copy_tag(uint8_t **ptr, const struct pppoe_tag *tag)
+{
+	struct pppoe_tag *r = (struct pppoe_tag *)*ptr;
+
+	if (!tag)
+		return NULL;
+
+	memcpy(r, tag, sizeof(*tag) + ntohs(tag->tag_len));
+	*ptr += sizeof(*tag) + ntohs(tag->tag_len);
+
+	return r;
+}
+
+static void pado_queue(struct pppoe_serv_t *serv, int delay, const uint8_t *addr, const struct pppoe_tag *host_uniq,
+                       const struct pppoe_tag *relay_sid, const struct pppoe_tag *service_name)
+{
+	struct pado_bucket_t *b;
+	struct delayed_pado_t *pado;
+	uint8_t *ptr;
+	int i;
+
+	if (tag_size(host_uniq) + tag_size(relay_sid) + tag_size(service_name) > sizeof(pado->tags))
 		return;
+
+	if (!serv->pado_hash) {
+		serv->pado_hash = _malloc(PADO_HASH_SIZE * sizeof(struct list_head));
+		if (!serv->pado_hash)
+			return;
+		for (i = 0; i < PADO_HASH_SIZE; i++)
+			INIT_LIST_HEAD(&serv->pado_hash[i]);
 	}
 
-	if (conf_verbose) {
-		log_info2("recv ");
-		print_packet(pack);
+	list_for_each_entry(b, &serv->pado_buckets, entry) {
+		if (b->delay == delay)
+			goto found;
 	}
-	
 
-	if (serv->service_names[0])
-		service_names = serv->service_names;
-	else if (conf_service_names[0])
-		service_names = conf_service_names;
+	b = _malloc(sizeof(*b));
+	if (!b)
+		return;
+	b->delay = delay;
+	INIT_LIST_HEAD(&b->queue);
+	list_add_tail(&b->entry, &serv->pado_buckets);
 
-	for (n = 0; n < ntohs(hdr->length); n += sizeof(*tag) + ntohs(tag->tag_len)) {
-		tag = (struct pppoe_tag *)(pack + ETH_HLEN + sizeof(*hdr) + n);
-		switch (ntohs(tag->tag_type)) {
-			case TAG_END_OF_LIST:
-				break;
-			case TAG_SERVICE_NAME:
-				if (service_names && tag->tag_len) {
-					for (i = 0; i < MAX_SERVICE_NAMES && service_names[i]; i++) {
-						if (ntohs(tag->tag_len) != strlen(service_names[i]))
-							continue;
-						if (memcmp(tag->tag_data, service_names[i], ntohs(tag->tag_len)))
+found:
+	pado = mempool_alloc(pado_pool);
+	if (!pado)
+		return;
+
+	pado->expire = get_ms() + delay;
+	memcpy(pado->addr, addr, ETH_ALEN);
+	ptr = pado->tags;
+	pado->host_uniq = pado_copy_tag(&ptr, host_uniq);
+	pado->relay_sid = pado_copy_tag(&ptr, relay_sid);
+	pado->service_name = pado_copy_tag(&ptr, service_name);
+
+	list_add_tail(&pado->entry, &b->queue);
+	list_add_tail(&pado->hash_entry, &serv->pado_hash[addr_uniq_hash(addr, host_uniq) & (PADO_HASH_SIZE - 1)]);
+	serv->pado_cnt++;
+	__sync_add_and_fetch(&stat_delayed_pado, 1);
+
+	if (!serv->pado_timer.tpd) {
+		serv->pado_timer.expire = pado_timer;
+		serv->pado_timer.period = PADO_TICK;
+		triton_timer_add(&serv->ctx, &serv->pado_timer, 0);
+	}
+}
+
+/* burst == 0 means burst of one second worth of tokens */
+static int token_bucket_take(struct token_bucket_t *b, int rate, int burst, uint64_t now)
+{
+	int64_t max = (int64_t)(burst ? burst : rate) * 1000;
+	uint64_t d = now - b->ts;
+
+	b->ts = now;
+
+	if (d > max / rate)
+		b->tokens = max;
+	else {
+		b->tokens += d * rate;
+		if (b->tokens > max)
+			b->tokens = max;
+	}
+
+	if (b->tokens < 1000)
+		return -1;
+
+	b->tokens -= 1000;
+
+	return 0;
+}
+
+/*
+ * Each mac hashes to a single slot, a colliding mac just takes the slot over,
+ * so at worst a PADI which should be dropped is passed.
+ */
+static int check_padi_mac(const uint8_t *addr, uint64_t now)
+{
+	uint64_t *slot = &padi_mac_hash[u_siphash(padi_mac_key, addr, ETH_ALEN) & (PADI_MAC_HASH_SIZE - 1)];
+	uint64_t mac = 0;
+	uint64_t old = *slot;
+	uint16_t ts = now >> PADI_MAC_TS_SHIFT;
+	int i;
+
+	for (i = 0; i < ETH_ALEN; i++)
+		mac = (mac << 8) | addr[i];
+
+	if (old >> 16 == mac && (uint16_t)(ts - (uint16_t)old) < (PADI_MAC_INTERVAL >> PADI_MAC_TS_SHIFT))
+		return -1;
+
+	__sync_bool_compare_and_swap(slot, old, (mac << 16) | ts);
+
+	return 0;
+}
+
+static int check_padi_limit(struct pppoe_serv_t *serv, uint8_t *addr)
+{
+	uint64_t now;
+	int r;
+
+	if (serv->padi_limit == 0)
+		goto connlimit_check;
+
+	now = get_ms();
+
+	if (check_padi_mac(addr, now)) {
+		stat_inc(serv, STAT_PADI_DROP_MAC);
+		return -1;
+	}
+
+	if (token_bucket_take(&serv->padi_bucket, serv->padi_limit, serv->padi_burst, now)) {
+		stat_inc(serv, STAT_PADI_DROP_IF);
+		return -1;
+	}
+
+	if (conf_padi_limit) {
+		pthread_mutex_lock(&padi_bucket_lock);
+		r = token_bucket_take(&padi_bucket, conf_padi_limit, conf_padi_burst, now);
+		pthread_mutex_unlock(&padi_bucket_lock);
+		if (r) {
+			stat_inc(serv, STAT_PADI_DROP_GLOBAL);
+			return -1;
+		}
+	}
+
+connlimit_check:
+	if (triton_module_loaded("connlimit") && connlimit_check(cl_key_from_mac(addr))) {
+		stat_inc(serv, STAT_PADI_DROP_CONNLIMIT);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void pppoe_recv_PADI(struct pppoe_serv_t *serv, uint8_t *pack, int size)
+{
+	struct ethhdr *ethhdr = (struct ethhdr *)pack;
+	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
+	struct pppoe_tag *tag;
+	struct pppoe_tag *host_uniq_tag = NULL;
+	struct pppoe_tag *relay_sid_tag = NULL;
+	struct pppoe_tag *service_name_tag = NULL;
+	int n, i, service_match = 0;
+	int pado_delay;
+	char **service_names = NULL;
+	struct timespec ts;
+
+	stat_inc(serv, STAT_PADI_RECV);
+
+	if (ppp_shutdown)
+		return;
+
+	pado_delay = dpado_get();
+	if (pado_delay == -1)
+		return;
+
+	if (check_padi_limit(serv, ethhdr->h_source)) {
+		stat_inc(serv, STAT_PADI_DROP);
+		if (conf_verbose) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			if (ts.tv_sec - 60 >= serv->last_padi_limit_warn) {
+				log_warn("pppoe: discarding overlimit PADI packets on interface %s\n", serv->ifname);
+				serv->last_padi_limit_warn = ts.tv_sec;
+			}
+		}
+		return;
+	}
+
+	if (hdr->sid) {
+		log_warn("pppoe: discarding PADI packet (sid is not zero)\n");
+		return;
+	}
+
+	if (conf_verbose) {
+		log_info2("recv ");
+		print_packet(pack);
+	}
+	
+
+	if (serv->service_names[0])
+		service_names = serv->service_names;
+	else if (conf_service_names[0])
+		service_names = conf_service_names;
+
+	for (n = 0; n < ntohs(hdr->length); n += sizeof(*tag) + ntohs(tag->tag_len)) {
+		tag = (struct pppoe_tag *)(pack + ETH_HLEN + sizeof(*hdr) + n);
+		switch (ntohs(tag->tag_type)) {
+			case TAG_END_OF_LIST:
+				break;
+			case TAG_SERVICE_NAME:
+				if (service_names && tag->tag_len) {
+					for (i = 0; i < MAX_SERVICE_NAMES && service_names[i]; i++) {
+						if (ntohs(tag->tag_len) != strlen(service_names[i]))
+							continue;
+						if (memcmp(tag->tag_data, service_names[i], ntohs(tag->tag_len)))
 							continue;
 						if (conf_reply_exact_service)
 							service_name_tag = tag;
@@ -855,40 +1628,12 @@ static void pppoe_recv_PADI(struct pppoe_serv_t *serv, uint8_t *pack, int size)
 	}
 
 	if (pado_delay) {
-		list_for_each_entry(pado, &serv->pado_list, entry) {
-			if (memcmp(pado->addr, ethhdr->h_source, ETH_ALEN))
-				continue;
+		if (pado_queued(serv, ethhdr->h_source, host_uniq_tag)) {
 			if (conf_verbose)
 				log_warn("pppoe: discarding PADI packet (already queued)\n");
 			return;
 		}
-		pado = mempool_alloc(pado_pool);
-		memset(pado, 0, sizeof(*pado));
-		pado->serv = serv;
-		memcpy(pado->addr, ethhdr->h_source, ETH_ALEN);
-
-		if (host_uniq_tag) {
-			pado->host_uniq = _malloc(sizeof(*host_uniq_tag) + ntohs(host_uniq_tag->tag_len));
-			memcpy(pado->host_uniq, host_uniq_tag, sizeof(*host_uniq_tag) + ntohs(host_uniq_tag->tag_len));
-		}
-
-		if (relay_sid_tag) {
-			pado->relay_sid = _malloc(sizeof(*relay_sid_tag) + ntohs(relay_sid_tag->tag_len));
-			memcpy(pado->relay_sid, relay_sid_tag, sizeof(*relay_sid_tag) + ntohs(relay_sid_tag->tag_len));
-		}
-
-		if (service_name_tag) {
-			pado->service_name = _malloc(sizeof(*service_name_tag) + ntohs(service_name_tag->tag_len));
-			memcpy(pado->service_name, service_name_tag, sizeof(*service_name_tag) + ntohs(service_name_tag->tag_len));
-		}
-
-		pado->timer.expire = pado_timer;
-		pado->timer.period = pado_delay;
-
-		triton_timer_add(&serv->ctx, &pado->timer, 0);
-
-		list_add_tail(&pado->entry, &serv->pado_list);
-		__sync_add_and_fetch(&stat_delayed_pado, 1);
+		pado_queue(serv, pado_delay, ethhdr->h_source, host_uniq_tag, relay_sid_tag, service_name_tag);
 	} else
 		pppoe_send_PADO(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, service_name_tag);
 }
@@ -908,7 +1653,7 @@ static void pppoe_recv_PADR(struct pppoe_serv_t *serv, uint8_t *pack, int size)
 	int vendor_id;
 	char **service_names = NULL;
 
-	__sync_add_and_fetch(&stat_PADR_recv, 1);
+	stat_inc(serv, STAT_PADR_RECV);
 
 	if (ppp_shutdown)
 		return;
@@ -977,153 +1722,836 @@ static void pppoe_recv_PADR(struct pppoe_serv_t *serv, uint8_t *pack, int size)
 		}
 	}
 
-	if (!ac_cookie_tag) {
-		if (conf_verbose)
-			log_warn("pppoe: discard PADR packet (no AC-Cookie tag present)\n");
-		return;
+	if (!ac_cookie_tag) {
+		if (conf_verbose)
+			log_warn("pppoe: discard PADR packet (no AC-Cookie tag present)\n");
+		return;
+	}
+
+	if (ntohs(ac_cookie_tag->tag_len) != COOKIE_LENGTH) {
+		if (conf_verbose)
+			log_warn("pppoe: discard PADR packet (incorrect AC-Cookie tag length)\n");
+		return;
+	}
+
+	if (check_cookie(serv, ethhdr->h_source, (uint8_t *)ac_cookie_tag->tag_data)) {
+		if (conf_verbose)
+			log_warn("pppoe: discard PADR packet (incorrect AC-Cookie)\n");
+		return;
+	}
+
+	if (!service_match) {
+		if (conf_verbose)
+			log_warn("pppoe: Service-Name mismatch\n");
+		pppoe_send_err(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, CODE_PADS, TAG_SERVICE_NAME_ERROR);
+		return;
+	}
+
+	pthread_mutex_lock(&serv->lock);
+	conn = find_channel(serv, (uint8_t *)ac_cookie_tag->tag_data);
+	if (!conn && host_uniq_tag) {
+		// same request answered with another cookie, unless the session is already up
+		conn = find_channel_uniq(serv, ethhdr->h_source, host_uniq_tag);
+		if (conn && conn->ppp.username)
+			conn = NULL;
+	}
+	if (conn && !conn->ppp.username) {
+		stat_inc(serv, STAT_PADR_DUP_RECV);
+		pppoe_send_PADS(conn);
+	}
+	pthread_mutex_unlock(&serv->lock);
+
+	if (conn)
+		return;
+
+	conn = allocate_channel(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, service_name_tag, tr101_tag, (uint8_t *)ac_cookie_tag->tag_data, 0);
+	if (!conn)
+		pppoe_send_err(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, CODE_PADS, TAG_AC_SYSTEM_ERROR);
+	else {
+		pppoe_send_PADS(conn);
+		triton_context_call(&conn->ctx, (triton_event_func)connect_channel, conn);
+	}
+}
+
+static void pppoe_recv_PADT(struct pppoe_serv_t *serv, uint8_t *pack)
+{
+	struct ethhdr *ethhdr = (struct ethhdr *)pack;
+	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
+	struct pppoe_conn_t *conn;
+	
+	if (!memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN)) {
+		if (conf_verbose)
+			log_warn("pppoe: discard PADT (destination address is broadcast)\n");
+		return;
+	}
+	
+	if (conf_verbose) {
+		log_info2("recv ");
+		print_packet(pack);
+	}
+
+	pthread_mutex_lock(&serv->lock);
+	conn = sid_lookup(serv, ntohs(hdr->sid));
+	if (conn && !memcmp(conn->addr, ethhdr->h_source, ETH_ALEN))
+		triton_context_call(&conn->ctx, (void (*)(void *))disconnect, conn);
+	pthread_mutex_unlock(&serv->lock);
+}
+
+static void pppoe_serv_recv(struct pppoe_serv_t *serv, uint8_t *pack, int n)
+{
+	struct ethhdr *ethhdr = (struct ethhdr *)pack;
+	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
+
+	if (n < ETH_HLEN + sizeof(*hdr)) {
+		if (conf_verbose)
+			log_warn("pppoe: short packet received (%i)\n", n);
+		return;
+	}
+
+	if (mac_filter_check(ethhdr->h_source))
+		return;
+
+	if (memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN) && memcmp(ethhdr->h_dest, serv->hwaddr, ETH_ALEN))
+		return;
+
+	if (!memcmp(ethhdr->h_source, bc_addr, ETH_ALEN)) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (host address is broadcast)\n");
+		return;
+	}
+
+	if ((ethhdr->h_source[0] & 1) != 0) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (host address is not unicast)\n");
+		return;
+	}
+
+	if (n < ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length)) {
+		if (conf_verbose)
+			log_warn("pppoe: short packet received\n");
+		return;
+	}
+
+	if (hdr->ver != 1) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (unsupported version %i)\n", hdr->ver);
+		return;
+	}
+	
+	if (hdr->type != 1) {
+		if (conf_verbose)
+			log_warn("pppoe: discarding packet (unsupported type %i)\n", hdr->type);
+	}
+
+	switch (hdr->code) {
+		case CODE_PADI:
+			pppoe_recv_PADI(serv, pack, n);
+			break;
+		case CODE_PADR:
+			pppoe_recv_PADR(serv, pack, n);
+			break;
+		case CODE_PADT:
+			pppoe_recv_PADT(serv, pack);
+			break;
+	}
+}
+
+static void rx_ring_update_drops(struct pppoe_serv_t *serv)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len = sizeof(st);
+
+	// the kernel resets its counters on every read
+	if (getsockopt(serv->hnd.fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+		__sync_add_and_fetch(&serv->stat_ring_drops, st.tp_drops);
+}
+
+static void pppoe_serv_read_ring(struct pppoe_serv_t *serv)
+{
+	struct tpacket_block_desc *pbd;
+	struct tpacket3_hdr *ppd;
+	unsigned int i, n;
+
+	while (1) {
+		pbd = (struct tpacket_block_desc *)(serv->rx_ring + serv->rx_ring_block * RX_RING_BLOCK_SIZE);
+		if (!(pbd->hdr.bh1.block_status & TP_STATUS_USER))
+			break;
+
+		__sync_synchronize();
+
+		if (pbd->hdr.bh1.block_status & TP_STATUS_LOSING)
+			rx_ring_update_drops(serv);
+
+		n = pbd->hdr.bh1.num_pkts;
+		ppd = (struct tpacket3_hdr *)((uint8_t *)pbd + pbd->hdr.bh1.offset_to_first_pkt);
+		for (i = 0; i < n; i++) {
+			pppoe_serv_recv(serv, (uint8_t *)ppd + ppd->tp_mac, ppd->tp_snaplen);
+			ppd = (struct tpacket3_hdr *)((uint8_t *)ppd + ppd->tp_next_offset);
+		}
+
+		__sync_add_and_fetch(&serv->stat_ring_blocks, 1);
+		__sync_add_and_fetch(&serv->stat_ring_frames, n);
+
+		// frames of the block must not be referenced past this point
+		__sync_synchronize();
+		pbd->hdr.bh1.block_status = TP_STATUS_KERNEL;
+
+		if (++serv->rx_ring_block == serv->rx_ring_blocks)
+			serv->rx_ring_block = 0;
+
+		pppoe_serv_flush(serv);
+	}
+}
+
+static int pppoe_serv_read(struct triton_md_handler_t *h)
+{
+	struct pppoe_serv_t *serv = container_of(h, typeof(*serv), hnd);
+	uint8_t pack[ETHER_MAX_LEN];
+	int n;
+
+	if (serv->rx_ring) {
+		pppoe_serv_read_ring(serv);
+		return 0;
+	}
+
+	while (1) {
+		n = read(h->fd, pack, sizeof(pack));
+		if (n < 0) {
+			if (errno == EAGAIN)
+				break;
+			log_error("pppoe: read: %s\n", strerror(errno));
+			return 0;
+		}
+
+		pppoe_serv_recv(serv, pack, n);
+	}
+	return 0;
+}
+
+static void vlan_serv_recv(struct pppoe_serv_t *serv)
+{
+	struct vlan_frame_t *frame;
+
+	while (1) {
+		pthread_mutex_lock(&serv->lock);
+		if (list_empty(&serv->rx_queue)) {
+			pthread_mutex_unlock(&serv->lock);
+			break;
+		}
+		frame = list_entry(serv->rx_queue.next, typeof(*frame), entry);
+		list_del(&frame->entry);
+		serv->rx_queue_len--;
+		pthread_mutex_unlock(&serv->lock);
+
+		if (!serv->stopping) {
+			serv->vlan_active = 1;
+			pppoe_serv_recv(serv, frame->pack, frame->len);
+		}
+
+		mempool_free(frame);
+	}
+}
+
+static int vlan_serv_queue(struct pppoe_serv_t *serv, struct vlan_frame_t *frame)
+{
+	int r = 0;
+
+	pthread_mutex_lock(&serv->lock);
+	if (serv->rx_queue_len == VLAN_QUEUE_MAX)
+		r = -1;
+	else {
+		list_add_tail(&frame->entry, &serv->rx_queue);
+		if (serv->rx_queue_len++ == 0)
+			triton_context_call(&serv->ctx, (triton_event_func)vlan_serv_recv, serv);
+	}
+	pthread_mutex_unlock(&serv->lock);
+
+	return r;
+}
+
+static int vlan_mon_create(struct pppoe_parent_t *parent, const char *ifname, int vid)
+{
+	struct rtnl_handle rth;
+	struct {
+		struct nlmsghdr n;
+		struct ifinfomsg i;
+		char buf[1024];
+	} req;
+	struct rtattr *linkinfo, *data;
+	uint16_t id = vid;
+	int r;
+
+	if (rtnl_open(&rth, 0)) {
+		log_emerg("pppoe: cannot open rtnetlink\n");
+		return -1;
+	}
+
+	memset(&req, 0, sizeof(req) - 1024);
+
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.n.nlmsg_flags = NLM_F_REQUEST | NLM_F_CREATE | NLM_F_EXCL;
+	req.n.nlmsg_type = RTM_NEWLINK;
+	req.i.ifi_family = AF_UNSPEC;
+	req.i.ifi_flags = IFF_UP;
+	req.i.ifi_change = IFF_UP;
+
+	addattr32(&req.n, sizeof(req), IFLA_LINK, parent->ifindex);
+	addattr_l(&req.n, sizeof(req), IFLA_IFNAME, ifname, strlen(ifname) + 1);
+	linkinfo = addattr_nest(&req.n, sizeof(req), IFLA_LINKINFO);
+	addattr_l(&req.n, sizeof(req), IFLA_INFO_KIND, "vlan", 4);
+	data = addattr_nest(&req.n, sizeof(req), IFLA_INFO_DATA);
+	addattr_l(&req.n, sizeof(req), IFLA_VLAN_ID, &id, sizeof(id));
+	addattr_nest_end(&req.n, data);
+	addattr_nest_end(&req.n, linkinfo);
+
+	r = rtnl_talk(&rth, &req.n, 0, 0, NULL, NULL, NULL, 0);
+
+	rtnl_close(&rth);
+
+	if (r < 0) {
+		log_error("pppoe: failed to create %s\n", ifname);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void vlan_mon_del(const char *ifname)
+{
+	struct rtnl_handle rth;
+	struct {
+		struct nlmsghdr n;
+		struct ifinfomsg i;
+		char buf[256];
+	} req;
+
+	if (rtnl_open(&rth, 0)) {
+		log_emerg("pppoe: cannot open rtnetlink\n");
+		return;
+	}
+
+	memset(&req, 0, sizeof(req) - 256);
+
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.n.nlmsg_type = RTM_DELLINK;
+	req.i.ifi_family = AF_UNSPEC;
+
+	addattr_l(&req.n, sizeof(req), IFLA_IFNAME, ifname, strlen(ifname) + 1);
+
+	if (rtnl_talk(&rth, &req.n, 0, 0, NULL, NULL, NULL, 0) < 0)
+		log_error("pppoe: failed to delete %s\n", ifname);
+
+	rtnl_close(&rth);
+}
+
+static void vlan_mon_ctx_close(struct triton_context_t *ctx)
+{
+	triton_context_unregister(ctx);
+}
+
+// devices are created here, rtnetlink round-trips would stall discovery
+static struct triton_context_t vlan_mon_ctx = {
+	.close = vlan_mon_ctx_close,
+};
+
+/* Starts the server (and the device), runs in vlan_mon_ctx */
+static void vlan_mon_start(struct vlan_mon_req_t *req)
+{
+	struct pppoe_parent_t *parent = req->parent;
+	struct vlan_mon_t *mon = parent->mon;
+	int vid = req->vid;
+	struct ifreq ifr;
+	struct timespec ts;
+	char opt[IFNAMSIZ + 32];
+	int flags = SERV_VLAN_MON;
+
+	_free(req);
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	memset(&ifr, 0, sizeof(ifr));
+	snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s.%i", parent->ifname, vid);
+
+	if (ioctl(parent->hnd.fd, SIOCGIFINDEX, &ifr)) {
+		if (!conf_vlan_create || vlan_mon_create(parent, ifr.ifr_name, vid))
+			goto out_fail;
+		flags |= SERV_VLAN_CREATED;
+	}
+
+	if (conf_verbose)
+		log_info2("pppoe: %s: starting on demand\n", ifr.ifr_name);
+
+	sprintf(opt, "%s,vlan-shared-socket=1", ifr.ifr_name);
+	if (__pppoe_server_start(opt, NULL, flags))
+		goto out;
+
+	if (flags & SERV_VLAN_CREATED)
+		vlan_mon_del(ifr.ifr_name);
+
+out_fail:
+	mon->last_fail[vid] = ts.tv_sec;
+out:
+	__sync_fetch_and_and(&mon->starting[vid / 8], ~(1 << (vid % 8)));
+	vlan_parent_put(parent);
+}
+
+/* First PADI on a monitored VLAN, the client retries once the server is up */
+static void vlan_mon_queue(struct pppoe_parent_t *parent, int vid)
+{
+	struct vlan_mon_t *mon = parent->mon;
+	struct vlan_mon_req_t *req;
+	struct timespec ts;
+	uint8_t bit = 1 << (vid % 8);
+
+	if (!(mon->vid[vid / 8] & bit))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	if (mon->last_fail[vid] && ts.tv_sec - mon->last_fail[vid] < VLAN_MON_RETRY)
+		return;
+
+	if (__sync_fetch_and_or(&mon->starting[vid / 8], bit) & bit)
+		return;
+
+	req = _malloc(sizeof(*req));
+	if (!req) {
+		__sync_fetch_and_and(&mon->starting[vid / 8], ~bit);
+		return;
+	}
+
+	req->parent = parent;
+	req->vid = vid;
+
+	// the parent and its mon stay while the request is queued
+	pthread_mutex_lock(&parent_list_lock);
+	parent->refs++;
+	pthread_mutex_unlock(&parent_list_lock);
+
+	if (triton_context_call(&vlan_mon_ctx, (triton_event_func)vlan_mon_start, req)) {
+		__sync_fetch_and_and(&mon->starting[vid / 8], ~bit);
+		_free(req);
+		vlan_parent_put(parent);
+	}
+}
+
+static void vlan_mon_timer(struct triton_timer_t *t)
+{
+	struct pppoe_serv_t *serv = container_of(t, typeof(*serv), vlan_timer);
+
+	if (serv->conn_cnt || serv->vlan_active) {
+		serv->vlan_active = 0;
+		return;
+	}
+
+	if (conf_verbose)
+		log_info2("pppoe: %s: idle, stopping\n", serv->ifname);
+
+	_server_stop(serv);
+}
+
+static int vlan_parent_read(struct triton_md_handler_t *h)
+{
+	struct pppoe_parent_t *parent = container_of(h, typeof(*parent), hnd);
+	struct pppoe_serv_t *serv;
+	struct vlan_frame_t *frame = NULL;
+	struct tpacket_auxdata *aux;
+	struct cmsghdr *cmsg;
+	struct sockaddr_ll sa;
+	struct msghdr msg;
+	struct iovec iov;
+	union {
+		struct cmsghdr cmsg;
+		char buf[CMSG_SPACE(sizeof(struct tpacket_auxdata))];
+	} cbuf;
+	int n, vid;
+
+	while (1) {
+		if (!frame) {
+			frame = mempool_alloc(frame_pool);
+			if (!frame) {
+				log_emerg("pppoe: out of memory\n");
+				break;
+			}
+		}
+
+		iov.iov_base = frame->pack;
+		iov.iov_len = sizeof(frame->pack);
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &sa;
+		msg.msg_namelen = sizeof(sa);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		n = recvmsg(h->fd, &msg, 0);
+		if (n < 0) {
+			if (errno == EAGAIN)
+				break;
+			log_error("pppoe: %s: recvmsg: %s\n", parent->ifname, strerror(errno));
+			break;
+		}
+
+		// frames are demuxed by (ifindex, vlan), nested VLANs aren't ours
+		if (sa.sll_ifindex != parent->ifindex)
+			continue;
+
+		vid = 0;
+		for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_PACKET || cmsg->cmsg_type != PACKET_AUXDATA)
+				continue;
+			aux = (struct tpacket_auxdata *)CMSG_DATA(cmsg);
+			if (aux->tp_vlan_tci || (aux->tp_status & TP_STATUS_VLAN_VALID))
+				vid = aux->tp_vlan_tci & (VLAN_CNT - 1);
+		}
+
+		if (!vid)
+			continue;
+
+		frame->len = n;
+
+		if (parent->mon && !parent->mon_stop && !parent->serv[vid] && n > ETH_HLEN + 1 && frame->pack[ETH_HLEN + 1] == CODE_PADI)
+			vlan_mon_queue(parent, vid);
+
+		pthread_rwlock_rdlock(&parent->lock);
+		serv = parent->serv[vid];
+		if (serv && !vlan_serv_queue(serv, frame))
+			frame = NULL;
+		pthread_rwlock_unlock(&parent->lock);
+	}
+
+	if (frame)
+		mempool_free(frame);
+
+	return 0;
+}
+
+static int vlan_parent_attach_filter(struct pppoe_parent_t *parent)
+{
+	struct sock_filter f[] = {
+		// tagged frames only, they are the ones VLAN devices receive
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0, 2, 0),
+		// multicast source
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, ETH_ALEN),
+		BPF_JUMP(BPF_JMP | BPF_JSET | BPF_K, 1, 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+	};
+	struct sock_fprog prog = {
+		.len = sizeof(f) / sizeof(f[0]),
+		.filter = f,
+	};
+
+	return setsockopt(parent->hnd.fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog));
+}
+
+static void vlan_parent_close(struct triton_context_t *ctx)
+{
+	struct pppoe_parent_t *parent = container_of(ctx, typeof(*parent), ctx);
+
+	// mon is freed with the parent, queued starts may still use it
+	if (parent->mon && !parent->mon_stop) {
+		parent->mon_stop = 1;
+		vlan_parent_put(parent);
+	}
+}
+
+static struct pppoe_parent_t *vlan_parent_create(const char *ifname)
+{
+	struct pppoe_parent_t *parent;
+	struct sockaddr_ll sa;
+	struct ifreq ifr;
+	int f = 1;
+
+	parent = _malloc(sizeof(*parent));
+	if (!parent)
+		return NULL;
+	memset(parent, 0, sizeof(*parent));
+
+	/*
+	 * Protocol handlers bound to the parent get frames of its VLAN devices
+	 * too, after the tag is moved to metadata. Only discovery frames are
+	 * cloned, session traffic doesn't pass through here.
+	 */
+	parent->hnd.fd = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_PPP_DISC));
+	if (parent->hnd.fd < 0) {
+		log_emerg("pppoe: socket: %s\n", strerror(errno));
+		goto out_free;
 	}
 
-	if (ntohs(ac_cookie_tag->tag_len) != COOKIE_LENGTH) {
-		if (conf_verbose)
-			log_warn("pppoe: discard PADR packet (incorrect AC-Cookie tag length)\n");
-		return;
+	fcntl(parent->hnd.fd, F_SETFD, fcntl(parent->hnd.fd, F_GETFD) | FD_CLOEXEC);
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ifname, sizeof(ifr.ifr_name) - 1);
+	if (ioctl(parent->hnd.fd, SIOCGIFINDEX, &ifr)) {
+		log_emerg("pppoe: %s: ioctl(SIOCGIFINDEX): %s\n", ifname, strerror(errno));
+		goto out_close;
 	}
+	parent->ifindex = ifr.ifr_ifindex;
 
-	if (check_cookie(serv, ethhdr->h_source, (uint8_t *)ac_cookie_tag->tag_data)) {
-		if (conf_verbose)
-			log_warn("pppoe: discard PADR packet (incorrect AC-Cookie)\n");
-		return;
+	if (vlan_parent_attach_filter(parent)) {
+		log_emerg("pppoe: %s: setsockopt(SO_ATTACH_FILTER): %s\n", ifname, strerror(errno));
+		goto out_close;
 	}
 
-	if (!service_match) {
-		if (conf_verbose)
-			log_warn("pppoe: Service-Name mismatch\n");
-		pppoe_send_err(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, CODE_PADS, TAG_SERVICE_NAME_ERROR);
-		return;
+	if (setsockopt(parent->hnd.fd, SOL_PACKET, PACKET_AUXDATA, &f, sizeof(f))) {
+		log_emerg("pppoe: %s: setsockopt(PACKET_AUXDATA): %s\n", ifname, strerror(errno));
+		goto out_close;
 	}
 
-	pthread_mutex_lock(&serv->lock);
-	conn = find_channel(serv, (uint8_t *)ac_cookie_tag->tag_data);
-	if (conn && !conn->ppp.username) {
-		__sync_add_and_fetch(&stat_PADR_dup_recv, 1);
-		pppoe_send_PADS(conn);
+	// report the parent rather than the VLAN device the frame went to
+	if (setsockopt(parent->hnd.fd, SOL_PACKET, PACKET_ORIGDEV, &f, sizeof(f))) {
+		log_emerg("pppoe: %s: setsockopt(PACKET_ORIGDEV): %s\n", ifname, strerror(errno));
+		goto out_close;
 	}
-	pthread_mutex_unlock(&serv->lock);
 
-	if (conn)
-		return;
+	memset(&sa, 0, sizeof(sa));
+	sa.sll_family = AF_PACKET;
+	sa.sll_protocol = htons(ETH_P_PPP_DISC);
+	sa.sll_ifindex = parent->ifindex;
 
-	conn = allocate_channel(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, service_name_tag, tr101_tag, (uint8_t *)ac_cookie_tag->tag_data);
-	if (!conn)
-		pppoe_send_err(serv, ethhdr->h_source, host_uniq_tag, relay_sid_tag, CODE_PADS, TAG_AC_SYSTEM_ERROR);
-	else {
-		pppoe_send_PADS(conn);
-		triton_context_call(&conn->ctx, (triton_event_func)connect_channel, conn);
+	if (bind(parent->hnd.fd, (struct sockaddr *)&sa, sizeof(sa))) {
+		log_emerg("pppoe: %s: bind: %s\n", ifname, strerror(errno));
+		goto out_close;
+	}
+
+	if (fcntl(parent->hnd.fd, F_SETFL, O_NONBLOCK)) {
+		log_emerg("pppoe: failed to set nonblocking mode: %s\n", strerror(errno));
+		goto out_close;
 	}
+
+	parent->ifname = _strdup(ifname);
+	pthread_rwlock_init(&parent->lock, NULL);
+
+	parent->ctx.before_switch = log_switch;
+	parent->ctx.close = vlan_parent_close;
+	parent->hnd.read = vlan_parent_read;
+
+	triton_context_register(&parent->ctx, NULL);
+	triton_md_register_handler(&parent->ctx, &parent->hnd);
+	triton_md_enable_handler(&parent->hnd, MD_MODE_READ);
+	triton_context_wakeup(&parent->ctx);
+
+	list_add_tail(&parent->entry, &parent_list);
+
+	return parent;
+
+out_close:
+	close(parent->hnd.fd);
+out_free:
+	_free(parent);
+	return NULL;
 }
 
-static void pppoe_recv_PADT(struct pppoe_serv_t *serv, uint8_t *pack)
+/* Runs in parent's context, so vlan_parent_read isn't running */
+static void vlan_parent_free(struct pppoe_parent_t *parent)
 {
-	struct ethhdr *ethhdr = (struct ethhdr *)pack;
-	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
-	struct pppoe_conn_t *conn;
-	
-	if (!memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN)) {
-		if (conf_verbose)
-			log_warn("pppoe: discard PADT (destination address is broadcast)\n");
-		return;
+	if (parent->mon)
+		_free(parent->mon);
+	triton_md_unregister_handler(&parent->hnd);
+	close(parent->hnd.fd);
+	triton_context_unregister(&parent->ctx);
+	pthread_rwlock_destroy(&parent->lock);
+	_free(parent->ifname);
+	_free(parent);
+}
+
+/* Last reference is gone, must be called with parent_list_lock held */
+static void vlan_parent_release(struct pppoe_parent_t *parent)
+{
+	list_del(&parent->entry);
+
+	if (triton_context_call(&parent->ctx, (triton_event_func)vlan_parent_free, parent))
+		log_emerg("pppoe: %s: failed to free shared socket\n", parent->ifname);
+}
+
+/* If ifname is a VLAN device take the discovery socket of its parent
+ * instead of opening own one, sock is used for ioctls only */
+static int vlan_parent_get(struct pppoe_serv_t *serv, int sock)
+{
+	struct vlan_ioctl_args args;
+	struct pppoe_parent_t *parent;
+	int vid;
+
+	memset(&args, 0, sizeof(args));
+	args.cmd = GET_VLAN_VID_CMD;
+	strncpy(args.device1, serv->ifname, sizeof(args.device1) - 1);
+	if (ioctl(sock, SIOCGIFVLAN, &args))
+		return -1;
+	vid = args.u.VID;
+
+	memset(&args, 0, sizeof(args));
+	args.cmd = GET_VLAN_REALDEV_NAME_CMD;
+	strncpy(args.device1, serv->ifname, sizeof(args.device1) - 1);
+	if (ioctl(sock, SIOCGIFVLAN, &args))
+		return -1;
+
+	pthread_mutex_lock(&parent_list_lock);
+	list_for_each_entry(parent, &parent_list, entry) {
+		if (!strcmp(parent->ifname, args.u.device2))
+			goto found;
 	}
-	
-	if (conf_verbose) {
-		log_info2("recv ");
-		print_packet(pack);
+	parent = vlan_parent_create(args.u.device2);
+	if (!parent) {
+		pthread_mutex_unlock(&parent_list_lock);
+		return -1;
+	}
+found:
+	pthread_rwlock_wrlock(&parent->lock);
+	if (parent->serv[vid]) {
+		pthread_rwlock_unlock(&parent->lock);
+		if (!parent->refs)
+			vlan_parent_release(parent);
+		pthread_mutex_unlock(&parent_list_lock);
+		log_emerg("pppoe: %s: VLAN %i of %s is already served\n", serv->ifname, vid, args.u.device2);
+		return -1;
 	}
+	parent->refs++;
+	pthread_rwlock_unlock(&parent->lock);
+	pthread_mutex_unlock(&parent_list_lock);
 
-	pthread_mutex_lock(&serv->lock);
-	conn = serv->conn[ntohs(hdr->sid)];
-	if (conn && !memcmp(conn->addr, ethhdr->h_source, ETH_ALEN))
-		triton_context_call(&conn->ctx, (void (*)(void *))disconnect, conn);
-	pthread_mutex_unlock(&serv->lock);
+	serv->parent = parent;
+	serv->vid = vid;
+
+	return 0;
 }
 
-static int pppoe_serv_read(struct triton_md_handler_t *h)
+static void vlan_parent_put(struct pppoe_parent_t *parent)
 {
-	struct pppoe_serv_t *serv = container_of(h, typeof(*serv), hnd);
-	uint8_t pack[ETHER_MAX_LEN];
-	struct ethhdr *ethhdr = (struct ethhdr *)pack;
-	struct pppoe_hdr *hdr = (struct pppoe_hdr *)(pack + ETH_HLEN);
-	int n;
+	pthread_mutex_lock(&parent_list_lock);
+	if (--parent->refs == 0)
+		vlan_parent_release(parent);
+	pthread_mutex_unlock(&parent_list_lock);
+}
 
-	while (1) {
-		n = read(h->fd, pack, sizeof(pack));
-		if (n < 0) {
-			if (errno == EAGAIN)
-				break;
-			log_error("pppoe: read: %s\n", strerror(errno));
-			return 0;
-		}
+/* Frames for serv are (not) dispatched from now on */
+static void vlan_parent_link(struct pppoe_serv_t *serv, int link)
+{
+	pthread_rwlock_wrlock(&serv->parent->lock);
+	if (link)
+		serv->parent->serv[serv->vid] = serv;
+	else if (serv->parent->serv[serv->vid] == serv)
+		serv->parent->serv[serv->vid] = NULL;
+	pthread_rwlock_unlock(&serv->parent->lock);
+}
 
-		if (n < ETH_HLEN + sizeof(*hdr)) {
-			if (conf_verbose)
-				log_warn("pppoe: short packet received (%i)\n", n);
-			continue;
+static int vlan_mon_parse(const char *opt)
+{
+	struct pppoe_parent_t *parent;
+	struct vlan_mon_t *mon;
+	char *str = _strdup(opt);
+	char *ptr, *tok, *end;
+	long v1, v2;
+
+	ptr = strchr(str, ',');
+	if (!ptr)
+		goto out_err;
+	*ptr++ = 0;
+
+	mon = _malloc(sizeof(*mon));
+	memset(mon, 0, sizeof(*mon));
+
+	for (tok = strtok(ptr, ","); tok; tok = strtok(NULL, ",")) {
+		v1 = strtol(tok, &end, 10);
+		if (*end == '-')
+			v2 = strtol(end + 1, &end, 10);
+		else
+			v2 = v1;
+		if (*end || v1 < 1 || v2 >= VLAN_CNT - 1 || v1 > v2) {
+			_free(mon);
+			goto out_err;
 		}
+		for (; v1 <= v2; v1++)
+			mon->vid[v1 / 8] |= 1 << (v1 % 8);
+	}
 
-		if (mac_filter_check(ethhdr->h_source))
-			continue;
+	pthread_mutex_lock(&parent_list_lock);
+	list_for_each_entry(parent, &parent_list, entry) {
+		if (!strcmp(parent->ifname, str))
+			goto found;
+	}
+	parent = vlan_parent_create(str);
+	if (!parent) {
+		pthread_mutex_unlock(&parent_list_lock);
+		_free(mon);
+		_free(str);
+		return -1;
+	}
+found:
+	if (parent->mon) {
+		for (v1 = 0; v1 < VLAN_CNT / 8; v1++)
+			parent->mon->vid[v1] |= mon->vid[v1];
+		_free(mon);
+	} else {
+		parent->mon = mon;
+		parent->refs++;
+	}
+	pthread_mutex_unlock(&parent_list_lock);
 
-		if (memcmp(ethhdr->h_dest, bc_addr, ETH_ALEN) && memcmp(ethhdr->h_dest, serv->hwaddr, ETH_ALEN))
-			continue;
+	_free(str);
+	return 0;
 
-		if (!memcmp(ethhdr->h_source, bc_addr, ETH_ALEN)) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (host address is broadcast)\n");
-			continue;
-		}
+out_err:
+	log_emerg("pppoe: vlan-mon: invalid format '%s'\n", opt);
+	_free(str);
+	return -1;
+}
 
-		if ((ethhdr->h_source[0] & 1) != 0) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (host address is not unicast)\n");
-			continue;
-		}
+static void rx_ring_setup(struct pppoe_serv_t *serv)
+{
+	struct tpacket_req3 req;
+	int ver = TPACKET_V3;
+	size_t size = (size_t)serv->rx_ring_blocks * RX_RING_BLOCK_SIZE;
+	void *ring;
 
-		if (n < ETH_HLEN + sizeof(*hdr) + ntohs(hdr->length)) {
-			if (conf_verbose)
-				log_warn("pppoe: short packet received\n");
-			continue;
-		}
+	if (setsockopt(serv->hnd.fd, SOL_PACKET, PACKET_VERSION, &ver, sizeof(ver))) {
+		log_warn("pppoe: %s: setsockopt(PACKET_VERSION): %s, falling back to read()\n", serv->ifname, strerror(errno));
+		return;
+	}
 
-		if (hdr->ver != 1) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (unsupported version %i)\n", hdr->ver);
-			continue;
-		}
-		
-		if (hdr->type != 1) {
-			if (conf_verbose)
-				log_warn("pppoe: discarding packet (unsupported type %i)\n", hdr->type);
-		}
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = RX_RING_BLOCK_SIZE;
+	req.tp_block_nr = serv->rx_ring_blocks;
+	req.tp_frame_size = RX_RING_FRAME_SIZE;
+	req.tp_frame_nr = RX_RING_BLOCK_SIZE / RX_RING_FRAME_SIZE * serv->rx_ring_blocks;
+	req.tp_retire_blk_tov = RX_RING_TIMEOUT;
 
-		switch (hdr->code) {
-			case CODE_PADI:
-				pppoe_recv_PADI(serv, pack, n);
-				break;
-			case CODE_PADR:
-				pppoe_recv_PADR(serv, pack, n);
-				break;
-			case CODE_PADT:
-				pppoe_recv_PADT(serv, pack);
-				break;
-		}
+	if (setsockopt(serv->hnd.fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req))) {
+		log_warn("pppoe: %s: setsockopt(PACKET_RX_RING): %s, falling back to read()\n", serv->ifname, strerror(errno));
+		return;
 	}
-	return 0;
+
+	ring = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, serv->hnd.fd, 0);
+	if (ring == MAP_FAILED) {
+		log_warn("pppoe: %s: mmap: %s, falling back to read()\n", serv->ifname, strerror(errno));
+		// frames are delivered to the ring while it exists, tear it down
+		memset(&req, 0, sizeof(req));
+		setsockopt(serv->hnd.fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req));
+		return;
+	}
+
+	serv->tx_buf = _malloc(TX_BATCH * ETHER_MAX_LEN);
+	serv->rx_ring = ring;
+}
+
+static void rx_ring_free(struct pppoe_serv_t *serv)
+{
+	if (serv->rx_ring)
+		munmap(serv->rx_ring, (size_t)serv->rx_ring_blocks * RX_RING_BLOCK_SIZE);
+	if (serv->tx_buf)
+		_free(serv->tx_buf);
 }
 
 static void pppoe_serv_close(struct triton_context_t *ctx)
 {
 	struct pppoe_serv_t *serv = container_of(ctx, typeof(*serv), ctx);
 
-	triton_md_disable_handler(&serv->hnd, MD_MODE_READ | MD_MODE_WRITE);
+	if (serv->parent)
+		vlan_parent_link(serv, 0);
+	else
+		triton_md_disable_handler(&serv->hnd, MD_MODE_READ | MD_MODE_WRITE);
 
 	serv->stopping = 1;
 
@@ -1136,6 +2564,88 @@ static void pppoe_serv_close(struct triton_context_t *ctx)
 	pthread_mutex_unlock(&serv->lock);
 }
 
+#define MAC_HI(a) (((uint32_t)(a)[0] << 24) | ((a)[1] << 16) | ((a)[2] << 8) | (a)[3])
+#define MAC_LO(a) (((a)[4] << 8) | (a)[5])
+
+/* Kernel side copy of the checks done by pppoe_serv_recv(), so that
+ * garbage on busy segments doesn't wake up md thread. pppoe_serv_recv()
+ * still does all the checks, the filter may lag behind mac-filter changes */
+static int pppoe_serv_attach_filter(struct pppoe_serv_t *serv)
+{
+	struct sock_filter f[21 + MAC_FILTER_BPF_MAX * 4];
+	struct sock_fprog prog;
+	uint8_t macs[MAC_FILTER_BPF_MAX][ETH_ALEN];
+	int i, n = 0, mac_cnt, type, accept, drop;
+
+	type = mac_filter_get(macs, MAC_FILTER_BPF_MAX, &mac_cnt);
+	if (type == -1 || mac_cnt < 0)
+		mac_cnt = 0;
+
+	// jump targets below are absolute instruction numbers, 0 - next one
+	accept = 18 + mac_cnt * 4 + 1;
+	drop = accept + 1;
+
+#define J(c, k, jt, jf) f[n] = (struct sock_filter)BPF_JUMP(BPF_JMP | c | BPF_K, k, (jt) ? (jt) - n - 1 : 0, (jf) ? (jf) - n - 1 : 0), n++
+#define S(c, k) f[n] = (struct sock_filter)BPF_STMT(c, k), n++
+	S(BPF_LD | BPF_H | BPF_ABS, 12);
+	J(BPF_JEQ, ETH_P_PPP_DISC, 0, drop);
+	// multicast (and broadcast) source
+	S(BPF_LD | BPF_B | BPF_ABS, ETH_ALEN);
+	J(BPF_JSET, 1, drop, 0);
+	// destination is broadcast or our address
+	S(BPF_LD | BPF_W | BPF_ABS, 0);
+	J(BPF_JEQ, 0xffffffff, 0, 8);
+	S(BPF_LD | BPF_H | BPF_ABS, 4);
+	J(BPF_JEQ, 0xffff, 11, drop);
+	J(BPF_JEQ, MAC_HI(serv->hwaddr), 0, drop);
+	S(BPF_LD | BPF_H | BPF_ABS, 4);
+	J(BPF_JEQ, MAC_LO(serv->hwaddr), 0, drop);
+	// version
+	S(BPF_LD | BPF_B | BPF_ABS, ETH_HLEN);
+	S(BPF_ALU | BPF_AND | BPF_K, 0xf0);
+	J(BPF_JEQ, 0x10, 0, drop);
+	// code
+	S(BPF_LD | BPF_B | BPF_ABS, ETH_HLEN + 1);
+	J(BPF_JEQ, CODE_PADI, 18, 0);
+	J(BPF_JEQ, CODE_PADR, 18, 0);
+	J(BPF_JEQ, CODE_PADT, 0, drop);
+	// mac-filter
+	for (i = 0; i < mac_cnt; i++) {
+		S(BPF_LD | BPF_W | BPF_ABS, ETH_ALEN);
+		J(BPF_JEQ, MAC_HI(macs[i]), 0, n + 3);
+		S(BPF_LD | BPF_H | BPF_ABS, ETH_ALEN + 4);
+		J(BPF_JEQ, MAC_LO(macs[i]), type ? accept : drop, 0);
+	}
+	// not in the list
+	S(BPF_RET | BPF_K, mac_cnt && type == 1 ? 0 : 0xffffffff);
+	S(BPF_RET | BPF_K, 0xffffffff);
+	S(BPF_RET | BPF_K, 0);
+#undef J
+#undef S
+
+	prog.len = n;
+	prog.filter = f;
+
+	if (setsockopt(serv->hnd.fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog))) {
+		log_warn("pppoe: %s: setsockopt(SO_ATTACH_FILTER): %s\n", serv->ifname, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+void pppoe_update_filters(void)
+{
+	struct pppoe_serv_t *serv;
+
+	pthread_rwlock_rdlock(&serv_lock);
+	list_for_each_entry(serv, &serv_list, entry) {
+		if (!serv->parent)
+			pppoe_serv_attach_filter(serv);
+	}
+	pthread_rwlock_unlock(&serv_lock);
+}
+
 static int parse_interface(const char *opt, char **ifname, char **ifopt)
 {
 	char *comma;
@@ -1200,6 +2710,26 @@ static int parse_interface_set_option(struct pppoe_serv_t *serv, char *property,
 			sprintf(errbuf, "Invalid padi-limit value %d", serv->padi_limit);
 			return 0;
 		}
+	} else if (!strcmp(property, "padi-burst")) {
+		serv->padi_burst = atol(value);
+		if (serv->padi_burst < 0) {
+			sprintf(errbuf, "Invalid padi-burst value %d", serv->padi_burst);
+			return 0;
+		}
+	} else if (!strcmp(property, "sid-reuse-delay")) {
+		serv->sid_reuse_delay = atol(value);
+		if (serv->sid_reuse_delay < 0) {
+			sprintf(errbuf, "Invalid sid-reuse-delay value %d", serv->sid_reuse_delay);
+			return 0;
+		}
+	} else if (!strcmp(property, "vlan-shared-socket")) {
+		serv->vlan_shared = !!atoi(value);
+	} else if (!strcmp(property, "rx-ring")) {
+		if (atoi(value) < 0) {
+			sprintf(errbuf, "Invalid rx-ring value %s", value);
+			return 0;
+		}
+		serv->rx_ring_blocks = atoi(value);
 	} else if (!strcmp(property, "require-service-name") || !strcmp(property, "require-sn")) {
 		serv->require_service_name = !!atoi(value);
 	} else if (!strcmp(property, "service-name")) {
@@ -1314,7 +2844,7 @@ static int parse_interface_options(const char *ifopt, struct pppoe_serv_t *serv,
 	return 0;
 }
 
-void pppoe_server_start(const char *opt, void *cli)
+static struct pppoe_serv_t *__pppoe_server_start(const char *opt, void *cli, int vlan_mon)
 {
 	struct pppoe_serv_t *serv;
 	int sock;
@@ -1336,19 +2866,20 @@ void pppoe_server_start(const char *opt, void *cli)
 			if (cli)
 				cli_send(cli, "error: already exists\r\n");
 			pthread_rwlock_unlock(&serv_lock);
-			return;
+			return NULL;
 		}
 	}
 	pthread_rwlock_unlock(&serv_lock);
 
 	serv = _malloc(sizeof(*serv));
 	memset(serv, 0, sizeof(*serv));
+	serv->stat_counters = -1;
 
 	if (init_secret(serv)) {
 		if (cli)
 			cli_sendv(cli, "init secret failed\r\n");
 		_free(serv);
-		return;
+		return NULL;
 	}
 
 	sock = socket(PF_PACKET, SOCK_RAW, htons(ETH_P_PPP_DISC));
@@ -1357,7 +2888,7 @@ void pppoe_server_start(const char *opt, void *cli)
 			cli_sendv(cli, "socket: %s\r\n", strerror(errno));
 		log_emerg("pppoe: socket: %s\n", strerror(errno));
 		_free(serv);
-		return;
+		return NULL;
 	}
 	
 	fcntl(sock, F_SETFD, fcntl(sock, F_GETFD) | FD_CLOEXEC);
@@ -1413,26 +2944,14 @@ void pppoe_server_start(const char *opt, void *cli)
 		goto out_err;
 	}
 
-	memset(&sa, 0, sizeof(sa));
-	sa.sll_family = AF_PACKET;
-	sa.sll_protocol = htons(ETH_P_PPP_DISC);
-	sa.sll_ifindex = ifr.ifr_ifindex;
-
-	if (bind(sock, (struct sockaddr *)&sa, sizeof(sa))) {
-		if (cli)
-			cli_sendv(cli, "bind: %s\n", strerror(errno));
-		log_emerg("pppoe: bind: %s\n", strerror(errno));
-		goto out_err;
-	}
-
-	if (fcntl(sock, F_SETFL, O_NONBLOCK)) {
-		if (cli)
-			cli_sendv(cli, "failed to set nonblocking mode: %s\n", strerror(errno));
-    log_emerg("pppoe: failed to set nonblocking mode: %s\n", strerror(errno));
-		goto out_err;
-	}
-
+	serv->ifindex = ifr.ifr_ifindex;
+	serv->ifname = _strdup(ifname);
+	serv->stat_counters = triton_counter_alloc(STAT_CNT);
 	serv->padi_limit = conf_padi_limit;
+	serv->padi_burst = conf_padi_burst;
+	serv->sid_reuse_delay = conf_sid_reuse_delay;
+	serv->rx_ring_blocks = conf_rx_ring;
+	serv->vlan_shared = conf_vlan_shared_socket;
 
 	if (ifopt && parse_interface_options(ifopt, serv, &errmsg)) {
 		if (cli)
@@ -1443,31 +2962,85 @@ void pppoe_server_start(const char *opt, void *cli)
 		goto out_err;
 	}
 
+	if (serv->vlan_shared && !vlan_parent_get(serv, sock)) {
+		close(sock);
+		sock = serv->parent->hnd.fd;
+	} else {
+		memset(&sa, 0, sizeof(sa));
+		sa.sll_family = AF_PACKET;
+		sa.sll_protocol = htons(ETH_P_PPP_DISC);
+		sa.sll_ifindex = ifr.ifr_ifindex;
+
+		if (bind(sock, (struct sockaddr *)&sa, sizeof(sa))) {
+			if (cli)
+				cli_sendv(cli, "bind: %s\n", strerror(errno));
+			log_emerg("pppoe: bind: %s\n", strerror(errno));
+			goto out_err;
+		}
+
+		if (fcntl(sock, F_SETFL, O_NONBLOCK)) {
+			if (cli)
+				cli_sendv(cli, "failed to set nonblocking mode: %s\n", strerror(errno));
+			log_emerg("pppoe: failed to set nonblocking mode: %s\n", strerror(errno));
+			goto out_err;
+		}
+	}
+
 	serv->ctx.close = pppoe_serv_close;
 	serv->ctx.before_switch = log_switch;
 	serv->hnd.fd = sock;
 	serv->hnd.read = pppoe_serv_read;
-	serv->ifname = _strdup(ifname);
+
+	if (!serv->parent) {
+		pppoe_serv_attach_filter(serv);
+
+		if (serv->rx_ring_blocks)
+			rx_ring_setup(serv);
+	}
+
 	pthread_mutex_init(&serv->lock, NULL);
 
 	INIT_LIST_HEAD(&serv->conn_list);
-	INIT_LIST_HEAD(&serv->pado_list);
-	INIT_LIST_HEAD(&serv->padi_list);
+	INIT_LIST_HEAD(&serv->pado_buckets);
+	INIT_LIST_HEAD(&serv->sid_quarantine);
+	INIT_LIST_HEAD(&serv->rx_queue);
 
 	triton_context_register(&serv->ctx, NULL);
-	triton_md_register_handler(&serv->ctx, &serv->hnd);
-	triton_md_enable_handler(&serv->hnd, MD_MODE_READ);
+
+	serv->vlan_mon = vlan_mon;
+	if (vlan_mon && conf_vlan_timeout) {
+		serv->vlan_timer.expire = vlan_mon_timer;
+		serv->vlan_timer.period = conf_vlan_timeout * 1000;
+		triton_timer_add(&serv->ctx, &serv->vlan_timer, 0);
+	}
+
+	if (serv->parent)
+		vlan_parent_link(serv, 1);
+	else {
+		triton_md_register_handler(&serv->ctx, &serv->hnd);
+		triton_md_enable_handler(&serv->hnd, MD_MODE_READ);
+	}
 	triton_context_wakeup(&serv->ctx);
 
 	pthread_rwlock_wrlock(&serv_lock);
 	list_add_tail(&serv->entry, &serv_list);
 	pthread_rwlock_unlock(&serv_lock);
 
-	return;
+	return serv;
 
 out_err:
 	close(sock);
+	if (serv->stat_counters >= 0)
+		triton_counter_free(serv->stat_counters, STAT_CNT);
+	if (serv->ifname)
+		_free(serv->ifname);
 	_free(serv);
+	return NULL;
+}
+
+void pppoe_server_start(const char *opt, void *cli)
+{
+	__pppoe_server_start(opt, cli, 0);
 }
 
 static void _conn_stop(struct pppoe_conn_t *conn)
@@ -1483,7 +3056,10 @@ static void _server_stop(struct pppoe_serv_t *serv)
 		return;
 	
 	serv->stopping = 1;
-	triton_md_disable_handler(&serv->hnd, MD_MODE_READ | MD_MODE_WRITE);
+	if (serv->parent)
+		vlan_parent_link(serv, 0);
+	else
+		triton_md_disable_handler(&serv->hnd, MD_MODE_READ | MD_MODE_WRITE);
 
 	pthread_mutex_lock(&serv->lock);
 	if (!serv->conn_cnt) {
@@ -1491,34 +3067,89 @@ static void _server_stop(struct pppoe_serv_t *serv)
 		pppoe_server_free(serv);
 		return;
 	}
-	list_for_each_entry(conn, &serv->conn_list, entry)
+	// PADTs go out in batches before sessions are terminated in their contexts
+	list_for_each_entry(conn, &serv->conn_list, entry) {
+		if (!conn->padt_sent && __pppoe_queue_PADT(conn))
+			pppoe_send_PADT(conn);
 		triton_context_call(&conn->ctx, (triton_event_func)_conn_stop, conn);
+	}
+	padt_flush(serv);
 	pthread_mutex_unlock(&serv->lock);
 }
 
 void pppoe_server_free(struct pppoe_serv_t *serv)
 {
+	struct pado_bucket_t *b;
 	struct delayed_pado_t *pado;
+	struct vlan_frame_t *frame;
+	struct sid_quarantine_t *q;
 	int i;
 
 	pthread_rwlock_wrlock(&serv_lock);
 	list_del(&serv->entry);
 	pthread_rwlock_unlock(&serv_lock);
 
-	while (!list_empty(&serv->pado_list)) {
-		pado = list_entry(serv->pado_list.next, typeof(*pado), entry);
-		free_delayed_pado(pado);
+	while (!list_empty(&serv->pado_buckets)) {
+		b = list_entry(serv->pado_buckets.next, typeof(*b), entry);
+		while (!list_empty(&b->queue)) {
+			pado = list_entry(b->queue.next, typeof(*pado), entry);
+			free_delayed_pado(serv, pado);
+		}
+		list_del(&b->entry);
+		_free(b);
 	}
+	if (serv->pado_timer.tpd)
+		triton_timer_del(&serv->pado_timer);
+	if (serv->pado_hash)
+		_free(serv->pado_hash);
 
-	triton_md_unregister_handler(&serv->hnd);
-	close(serv->hnd.fd);
+	pthread_mutex_lock(&serv->lock);
+	padt_flush(serv);
+	if (serv->padt_timer.tpd)
+		triton_timer_del(&serv->padt_timer);
+	pthread_mutex_unlock(&serv->lock);
+	if (serv->padt_buf)
+		_free(serv->padt_buf);
+	if (serv->stat_counters >= 0)
+		triton_counter_free(serv->stat_counters, STAT_CNT);
+
+	if (serv->parent) {
+		vlan_parent_link(serv, 0);
+		while (!list_empty(&serv->rx_queue)) {
+			frame = list_entry(serv->rx_queue.next, typeof(*frame), entry);
+			list_del(&frame->entry);
+			mempool_free(frame);
+		}
+		vlan_parent_put(serv->parent);
+	} else {
+		triton_md_unregister_handler(&serv->hnd);
+		rx_ring_free(serv);
+		close(serv->hnd.fd);
+	}
+	if (serv->vlan_timer.tpd)
+		triton_timer_del(&serv->vlan_timer);
 	triton_context_unregister(&serv->ctx);
+	if (serv->vlan_mon & SERV_VLAN_CREATED)
+		vlan_mon_del(serv->ifname);
 	for (i = 0; i < MAX_SERVICE_NAMES; i++) {
 		if (serv->service_names[i]) {
 			_free(serv->service_names[i]);
 			serv->service_names[i] = NULL;
 		}
 	}
+	for (i = 0; i < SID_PAGE_CNT; i++) {
+		if (serv->conn[i])
+			_free(serv->conn[i]);
+	}
+	if (serv->cookie_hash)
+		_free(serv->cookie_hash);
+	if (serv->sid_map)
+		_free(serv->sid_map);
+	while (!list_empty(&serv->sid_quarantine)) {
+		q = list_entry(serv->sid_quarantine.next, typeof(*q), entry);
+		list_del(&q->entry);
+		mempool_free(q);
+	}
 	_free(serv->ifname);
 	_free(serv);
 }
@@ -1546,6 +3177,7 @@ void __export pppoe_get_stat(unsigned int **starting, unsigned int **active)
 static int init_secret(struct pppoe_serv_t *serv)
 {
 	DES_cblock key;
+	struct timespec ts;
 
 	if (read(urandom_fd, serv->secret, SECRET_LENGTH) < 0) {
 		log_emerg("pppoe: faild to read /dev/urandom\n", strerror(errno));
@@ -1556,6 +3188,13 @@ static int init_secret(struct pppoe_serv_t *serv)
 	DES_random_key(&key);
 	DES_set_key(&key, &serv->des_ks);
 
+	if (read(urandom_fd, serv->cookie_key[0], COOKIE_KEY_LENGTH) < 0) {
+		log_emerg("pppoe: failed to read /dev/urandom: %s\n", strerror(errno));
+		return -1;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	serv->cookie_key_ts = ts.tv_sec;
+
 	return 0;
 }
 
@@ -1610,6 +3249,44 @@ static void load_config(void)
 	if (opt)
 		conf_padi_limit = atoi(opt);
 
+	opt = conf_get_opt("pppoe", "padi-burst");
+	if (opt && atoi(opt) >= 0)
+		conf_padi_burst = atoi(opt);
+
+	opt = conf_get_opt("pppoe", "sid-reuse-delay");
+	if (opt && atoi(opt) >= 0)
+		conf_sid_reuse_delay = atoi(opt);
+
+	opt = conf_get_opt("pppoe", "rx-ring");
+	if (opt && atoi(opt) >= 0)
+		conf_rx_ring = atoi(opt);
+
+	opt = conf_get_opt("pppoe", "vlan-shared-socket");
+	if (opt)
+		conf_vlan_shared_socket = !!atoi(opt);
+
+	opt = conf_get_opt("pppoe", "cookie-type");
+	if (opt) {
+		if (!strcmp(opt, "des"))
+			conf_cookie_type = COOKIE_DES;
+		else if (!strcmp(opt, "siphash"))
+			conf_cookie_type = COOKIE_SIPHASH;
+		else
+			log_error("pppoe: unknown cookie-type '%s'\n", opt);
+	}
+
+	opt = conf_get_opt("pppoe", "cookie-timeout");
+	if (opt && atoi(opt) > 0)
+		conf_cookie_timeout = atoi(opt);
+
+	opt = conf_get_opt("pppoe", "vlan-timeout");
+	if (opt && atoi(opt) >= 0)
+		conf_vlan_timeout = atoi(opt);
+
+	opt = conf_get_opt("pppoe", "vlan-create");
+	if (opt)
+		conf_vlan_create = !!atoi(opt);
+
 	conf_mppe = MPPE_UNSET;
 	opt = conf_get_opt("l2tp", "mppe");
 	if (opt) {
@@ -1634,24 +3311,40 @@ static void pppoe_init(void)
 
 	conn_pool = mempool_create(sizeof(struct pppoe_conn_t));
 	pado_pool = mempool_create(sizeof(struct delayed_pado_t));
-	padi_pool = mempool_create(sizeof(struct padi_t));
+
+	padi_mac_hash = _malloc(PADI_MAC_HASH_SIZE * sizeof(*padi_mac_hash));
+	memset(padi_mac_hash, 0, PADI_MAC_HASH_SIZE * sizeof(*padi_mac_hash));
+	if (read(urandom_fd, padi_mac_key, sizeof(padi_mac_key)) < 0)
+		log_emerg("pppoe: failed to read /dev/urandom: %s\n", strerror(errno));
+	frame_pool = mempool_create(sizeof(struct vlan_frame_t));
+	sid_pool = mempool_create(sizeof(struct sid_quarantine_t));
+	stat_counters = triton_counter_alloc(STAT_CNT);
 
 	if (!s) {
 		log_emerg("pppoe: no configuration, disabled...\n");
 		return;
 	}
 
+	// vlan-mon parents get PADIs as soon as they are created
+	triton_context_register(&vlan_mon_ctx, NULL);
+	triton_context_wakeup(&vlan_mon_ctx);
+
+	// interfaces take their defaults from the global options
+	load_config();
+
 	list_for_each_entry(opt, &s->items, entry) {
 		if (opt->val) {
 			if (!strcmp(opt->name, "interface")) {
 				pppoe_server_start(opt->val, NULL);
+			} else if (!strcmp(opt->name, "vlan-mon")) {
+				vlan_mon_parse(opt->val);
 			} else if (!strcmp(opt->name, "service-name") || !strcmp(opt->name, "Service-Name")) {
 				pppoe_add_service_name(conf_service_names, opt->val);
 			}
 		}
 	}
 
-	load_config();
+	ppp_ckpt_register(CTRL_TYPE_PPPOE, pppoe_restore);
 
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
 }
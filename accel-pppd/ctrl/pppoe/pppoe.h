@@ -46,8 +46,62 @@
 #define MAX_SID 65534
 #define SECRET_LENGTH 16
 #define COOKIE_LENGTH 24
+#define COOKIE_KEY_LENGTH 16
 #define MAX_SERVICE_NAMES 8
 
+#define COOKIE_DES     0
+#define COOKIE_SIPHASH 1
+#define CONN_HASH_BITS 10
+#define CONN_HASH_SIZE (1 << CONN_HASH_BITS)
+
+/* SID table is allocated by pages as sessions come */
+#define SID_PAGE_BITS 8
+#define SID_PAGE_SIZE (1 << SID_PAGE_BITS)
+#define SID_PAGE_CNT (1 << (16 - SID_PAGE_BITS))
+/* busy (used or quarantined) SIDs bitmap, with a bitmap of full words on top */
+#define SID_MAP_WORDS (65536 / 64)
+
+#define VLAN_CNT 4096
+#define VLAN_QUEUE_MAX 64
+#define VLAN_MON_RETRY 10 // s, before next attempt to start failed VLAN
+
+#define SERV_VLAN_MON     1 // started by vlan-mon
+#define SERV_VLAN_CREATED 2 // VLAN device is ours
+
+/* TPACKET_V3 discovery ring */
+#define RX_RING_BLOCK_SIZE (1 << 16)
+#define RX_RING_FRAME_SIZE 2048
+#define RX_RING_TIMEOUT 10 // ms, block is handed to us even if not full
+#define TX_BATCH 32
+#define PADT_BATCH_TIMEOUT 10 // ms, PADTs of mass disconnect are held at most
+
+/* delayed PADOs are queued per delay value and sent by a periodic tick */
+#define PADO_TICK 10 // ms
+#define PADO_HASH_BITS 8
+#define PADO_HASH_SIZE (1 << PADO_HASH_BITS)
+
+/* mac-filter lists up to this size are also compiled into socket filter */
+#define MAC_FILTER_BPF_MAX 32
+
+/* per-mac PADI filter, each slot is 48-bit mac and 16-bit timestamp */
+#define PADI_MAC_HASH_BITS 16
+#define PADI_MAC_HASH_SIZE (1 << PADI_MAC_HASH_BITS)
+#define PADI_MAC_TS_SHIFT 4 // timestamp units are 16ms
+#define PADI_MAC_INTERVAL 1000 // ms
+
+/* discovery counters, kept both globally and per interface */
+#define STAT_PADI_RECV           0
+#define STAT_PADI_DROP           1
+#define STAT_PADI_DROP_IF        2
+#define STAT_PADI_DROP_GLOBAL    3
+#define STAT_PADI_DROP_MAC       4
+#define STAT_PADI_DROP_CONNLIMIT 5
+#define STAT_PADO_SENT           6
+#define STAT_PADR_RECV           7
+#define STAT_PADR_DUP_RECV       8
+#define STAT_PADS_SENT           9
+#define STAT_CNT                 10
+
 struct pppoe_tag_t
 {
 	struct list_head entry;
@@ -55,6 +109,12 @@ struct pppoe_tag_t
 	int len;
 };
 
+struct token_bucket_t
+{
+	int64_t tokens; // in 1/1000 of token
+	uint64_t ts;    // ms, CLOCK_MONOTONIC
+};
+
 struct pppoe_packet_t
 {
 	uint8_t src[ETH_ALEN];
@@ -71,26 +131,84 @@ struct pppoe_serv_t
 	struct triton_md_handler_t hnd;
 	uint8_t hwaddr[ETH_ALEN];
 	char *ifname;
+	int ifindex;
 	int require_service_name:1;
 	char *service_names[MAX_SERVICE_NAMES];
 
 	uint8_t secret[SECRET_LENGTH];
 	DES_key_schedule des_ks;
 
+	uint8_t cookie_key[2][COOKIE_KEY_LENGTH]; // indexed by generation
+	uint8_t cookie_gen;
+	time_t cookie_key_ts;
+	uint32_t cookie_seq;
+
 	pthread_mutex_t lock;
-	struct pppoe_conn_t *conn[MAX_SID];
+	struct pppoe_conn_t **conn[SID_PAGE_CNT];
 	uint16_t sid;
+	uint64_t *sid_map; // allocated with the first connection
+	uint64_t sid_map_full[SID_MAP_WORDS / 64];
+	struct list_head sid_quarantine;
+	int sid_reuse_delay;
 	int stopping:1;
 
 	unsigned int conn_cnt;
 	struct list_head conn_list;
+	struct list_head *cookie_hash; // allocated with the first connection
+	struct list_head *uniq_hash;
 
-	struct list_head pado_list;
+	struct list_head pado_buckets; // FIFOs of delayed PADOs, one per delay value
+	struct list_head *pado_hash; // delayed PADOs by MAC + Host-Uniq, allocated on demand
+	unsigned int pado_cnt;
+	struct triton_timer_t pado_timer;
 
-	struct list_head padi_list;
-	int padi_cnt;
+	struct token_bucket_t padi_bucket;
 	int padi_limit;
+	int padi_burst;
 	time_t last_padi_limit_warn;
+	int stat_counters; // first of STAT_CNT triton counters, -1 if none
+
+	uint8_t *rx_ring;  // NULL if frames are read()
+	unsigned int rx_ring_blocks;
+	unsigned int rx_ring_block;
+	uint8_t *tx_buf;
+	int tx_len[TX_BATCH];
+	int tx_cnt;
+
+	uint8_t *padt_buf; // PADTs of mass disconnect, protected by lock
+	int padt_len[TX_BATCH];
+	int padt_cnt;
+	struct triton_timer_t padt_timer;
+
+	unsigned long stat_ring_blocks;
+	unsigned long stat_ring_frames;
+	unsigned long stat_ring_drops;
+
+	int vlan_shared;
+	struct pppoe_parent_t *parent; // discovery goes through parent's socket
+	int vid;
+	struct list_head rx_queue;
+	int rx_queue_len;
+
+	int vlan_mon;
+	int vlan_active;
+	struct triton_timer_t vlan_timer;
+};
+
+/* Discovery socket of a device shared by its VLAN interfaces */
+struct pppoe_parent_t
+{
+	struct list_head entry;
+	struct triton_context_t ctx;
+	struct triton_md_handler_t hnd;
+	char *ifname;
+	int ifindex;
+	int refs;
+	struct vlan_mon_t *mon; // NULL if VLANs aren't started on demand
+	int mon_stop;
+
+	pthread_rwlock_t lock;
+	struct pppoe_serv_t *serv[VLAN_CNT];
 };
 
 extern int conf_verbose;
@@ -100,28 +218,41 @@ extern char *conf_pado_delay;
 
 extern unsigned int stat_active;
 extern unsigned int stat_delayed_pado;
-extern unsigned long stat_PADI_recv;
-extern unsigned long stat_PADO_sent;
-extern unsigned long stat_PADR_recv;
-extern unsigned long stat_PADR_dup_recv;
-extern unsigned long stat_PADS_sent;
-extern unsigned long stat_PADI_drop;
+extern int stat_counters;
 
 extern pthread_rwlock_t serv_lock;
 extern struct list_head serv_list;
 
 int mac_filter_check(const uint8_t *addr);
+int mac_filter_get(uint8_t (*addrs)[ETH_ALEN], int max, int *cnt);
+void pppoe_update_filters(void);
 void pppoe_server_start(const char *intf, void *client);
 void pppoe_server_stop(const char *intf);
 
 int pppoe_add_service_name(char **list, const char *item);
 int pppoe_del_service_name(char **list, const char *item);
 
-extern int pado_delay;
-void dpado_check_next(int conn_cnt);
-void dpado_check_prev(int conn_cnt);
+int dpado_get(void);
 int dpado_parse(const char *str);
 
+/* Tables read without locking are swapped by pointer and freed after a grace period */
+struct retire_t
+{
+	struct list_head entry;
+	uint64_t retired; // ms
+	void *ptr;
+};
+
+void retire_ptr(void *ptr, struct retire_t *r);
+
+#define publish_ptr(slot, t, member) \
+	do { \
+		typeof(t) __old = *(slot); \
+		__atomic_store_n(slot, t, __ATOMIC_RELEASE); \
+		if (__old) \
+			retire_ptr(__old, &__old->member); \
+	} while (0)
+
 struct rad_packet_t;
 int tr101_send_access_request(struct pppoe_tag *tr101, struct rad_packet_t *pack);
 int tr101_send_accounting_request(struct pppoe_tag *tr101, struct rad_packet_t *pack);
@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <net/ethernet.h>
+
+#include "list.h"
+#include "triton.h"
+#include "memdebug.h"
+
+#include "pppoe.h"
+
+/*
+ * Lock-free readers hold a table only for a lookup, so one timer period is
+ * enough. An object is freed by the first expiry at least GRACE_PERIOD ms
+ * after it was retired, i.e. after one to two timer periods.
+ */
+
+#define GRACE_PERIOD 1000 // ms
+
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static LIST_HEAD(retired_list);
+static struct triton_timer_t retire_timer;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void retire_timer_func(struct triton_timer_t *timer)
+{
+	struct retire_t *r;
+	uint64_t now = now_ms();
+
+	pthread_mutex_lock(&retire_lock);
+	while (!list_empty(&retired_list)) {
+		r = list_entry(retired_list.next, typeof(*r), entry);
+		if (now - r->retired < GRACE_PERIOD)
+			break;
+		list_del(&r->entry);
+		_free(r->ptr);
+	}
+
+	if (list_empty(&retired_list))
+		triton_timer_del(timer);
+	pthread_mutex_unlock(&retire_lock);
+}
+
+void retire_ptr(void *ptr, struct retire_t *r)
+{
+	r->ptr = ptr;
+	r->retired = now_ms();
+
+	pthread_mutex_lock(&retire_lock);
+	list_add_tail(&r->entry, &retired_list);
+
+	if (!retire_timer.tpd) {
+		retire_timer.expire = retire_timer_func;
+		retire_timer.period = GRACE_PERIOD;
+		triton_timer_add(NULL, &retire_timer, 0);
+	}
+	pthread_mutex_unlock(&retire_lock);
+}
@@ -65,12 +65,28 @@ static mempool_t conn_pool;
 static unsigned int stat_starting;
 static unsigned int stat_active;
 
+#define STAT_ACCEPT 0 // control connections
+#define STAT_DROP   1 // connections refused before a session is created
+#define STAT_CNT    2
+static int stat_counters = -1;
+
 static int pptp_read(struct triton_md_handler_t *h);
 static int pptp_write(struct triton_md_handler_t *h);
 static void pptp_timeout(struct triton_timer_t *);
 static void ppp_started(struct ppp_t *);
 static void ppp_finished(struct ppp_t *);
 
+static void stat_inc(int stat)
+{
+	if (stat_counters >= 0)
+		triton_counter_inc(stat_counters + stat);
+}
+
+static long stat_read(int stat)
+{
+	return stat_counters >= 0 ? triton_counter_read(stat_counters + stat) : 0;
+}
+
 static void disconnect(struct pptp_conn_t *conn)
 {
 	log_ppp_debug("pptp: disconnect\n");
@@ -628,12 +644,16 @@ static int pptp_connect(struct triton_md_handler_t *h)
 			continue;
 		}
 
+		stat_inc(STAT_ACCEPT);
+
 		if (ppp_shutdown) {
+			stat_inc(STAT_DROP);
 			close(sock);
 			continue;
 		}
 
 		if (triton_module_loaded("connlimit") && connlimit_check(cl_key_from_ipv4(addr.sin_addr.s_addr))) {
+			stat_inc(STAT_DROP);
 			close(sock);
 			return 0;
 		}
@@ -642,6 +662,7 @@ static int pptp_connect(struct triton_md_handler_t *h)
 
 		if (iprange_client_check(addr.sin_addr.s_addr)) {
 			log_warn("pptp: IP is out of client-ip-range, droping connection...\n");
+			stat_inc(STAT_DROP);
 			close(sock);
 			continue;
 		}
@@ -713,6 +734,8 @@ static int show_stat_exec(const char *cmd, char * const *fields, int fields_cnt,
 	cli_send(client, "pptp:\r\n");
 	cli_sendv(client,"  starting: %u\r\n", stat_starting);
 	cli_sendv(client,"  active: %u\r\n", stat_active);
+	cli_sendv(client,"  accepted: %ld\r\n", stat_read(STAT_ACCEPT));
+	cli_sendv(client,"  dropped: %ld\r\n", stat_read(STAT_DROP));
 
 	return CLI_CMD_OK;
 }
@@ -802,6 +825,7 @@ static void pptp_init(void)
 	}
 	
 	conn_pool = mempool_create(sizeof(struct pptp_conn_t));
+	stat_counters = triton_counter_alloc(STAT_CNT);
 
 	load_config();
 
@@ -1,104 +1,108 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <errno.h>
 #include <pthread.h>
 
 #include "ppp.h"
 #include "events.h"
 #include "triton.h"
 #include "log.h"
+#include "spinlock.h"
+#include "utils.h"
 
 #include "memdebug.h"
 
+/*
+ * Keys are kept in a set-associative hash table sized by connlimit.size at
+ * startup, each key is a token bucket of conf_burst tokens refilled with one
+ * token per conf_limit_timeout. When a set is full the least recently used
+ * key is evicted, so lookups never depend on the number of keys. If the
+ * evicted key was still limited the table is under pressure and a returning
+ * key can't be told from a new one, so new keys get a single token.
+ */
+
+#define SET_WAYS 4
+#define DEFAULT_SIZE 65536
+
 struct item
 {
-	struct list_head entry;
 	uint64_t key;
-	struct timespec ts;
-	int count;
+	uint64_t ts; // ms, 0 - free
+	int64_t tokens; // in 1/1000 of token
+};
+
+struct item_set
+{
+	spinlock_t lock;
+	struct item items[SET_WAYS];
 };
 
 static int conf_burst = 3;
 static int conf_burst_timeout = 60 * 1000;
 static int conf_limit_timeout = 5000;
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static LIST_HEAD(items);
+static struct item_set *table;
+static unsigned int table_mask;
+static uint8_t hash_key[16];
 
 int __export connlimit_check(uint64_t key)
 {
-	struct item *it;
+	struct item_set *set = &table[u_siphash(hash_key, &key, sizeof(key)) & table_mask];
+	struct item *it, *victim = NULL;
 	struct timespec ts;
-	unsigned int d;
-	struct list_head *pos, *n;
-	LIST_HEAD(tmp_list);
-	int r = 1;
+	uint64_t now, d;
+	int64_t max = (int64_t)(conf_burst > 0 ? conf_burst : 1) * 1000;
+	int i, r;
 
-	
 	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 
-	pthread_mutex_lock(&lock);
-	log_debug("connlimit: check entry %llu\n", key);
-	list_for_each_safe(pos, n, &items) {
-		it = list_entry(pos, typeof(*it), entry);
-
-		d = (ts.tv_sec - it->ts.tv_sec) * 1000 + (ts.tv_nsec - it->ts.tv_nsec) / 1000000;
-
-		if (it->key == key) {
-			if (d >= conf_burst_timeout) {
-				it->ts = ts;
-				list_move(&it->entry, &items);
-				it->count = 0;
-				r = 0;
-				break;
-			}
-			it->count++;
-			if (it->count >= conf_burst) {
-				if (d >= conf_limit_timeout) {
-					it->ts = ts;
-					list_move(&it->entry, &items);
-					r = 0;
-				} else
-					r = -1;
-			} else
-				r = 0;
+	spin_lock(&set->lock);
+
+	for (i = 0; i < SET_WAYS; i++) {
+		it = &set->items[i];
+		if (it->ts && it->key == key)
 			break;
-		}
+		if (!victim || it->ts < victim->ts)
+			victim = it;
+	}
 
-		if (d > conf_burst_timeout) {
-			log_debug("connlimit: remove %llu\n", it->key);
-			list_move(&it->entry, &tmp_list);
+	if (i == SET_WAYS) {
+		log_debug("connlimit: add entry %llu\n", key);
+		it = victim;
+		if (it->ts && now - it->ts < conf_burst_timeout && it->tokens < max)
+			it->tokens = 1000;
+		else
+			it->tokens = max;
+		it->key = key;
+	} else {
+		d = now - it->ts;
+		if (d >= conf_burst_timeout || !conf_limit_timeout)
+			it->tokens = max;
+		else {
+			it->tokens += d * 1000 / conf_limit_timeout;
+			if (it->tokens > max)
+				it->tokens = max;
 		}
 	}
-	pthread_mutex_unlock(&lock);
 
-	if (r == 1) {
-		it = _malloc(sizeof(*it));
-		memset(it, 0, sizeof(*it));
-		it->ts = ts;
-		it->key = key;
+	it->ts = now;
 
-		log_debug("connlimit: add entry %llu\n", key);
+	if (it->tokens >= 1000) {
+		it->tokens -= 1000;
+		r = 0;
+	} else
+		r = -1;
 
-		pthread_mutex_lock(&lock);
-		list_add(&it->entry, &items);
-		pthread_mutex_unlock(&lock);
+	spin_unlock(&set->lock);
 
-		r = 0;
-	}
-	
 	if (r == 0)
 		log_debug("connlimit: accept %llu\n", key);
 	else
 		log_debug("connlimit: drop %llu\n", key);
 
-	
-	while (!list_empty(&tmp_list)) {
-		it = list_entry(tmp_list.next, typeof(*it), entry);
-		list_del(&it->entry);
-		_free(it);
-	}
-
 	return r;
 }
 
@@ -163,6 +167,26 @@ static void load_config()
 
 static void init()
 {
+	const char *opt;
+	unsigned int i, n = 1, size = DEFAULT_SIZE;
+
+	// not reloadable, keys would move between sets
+	opt = conf_get_opt("connlimit", "size");
+	if (opt && atoi(opt) > 0)
+		size = atoi(opt);
+
+	while (n * SET_WAYS < size && n < (1u << 24))
+		n <<= 1;
+	table_mask = n - 1;
+
+	table = _malloc(n * sizeof(*table));
+	memset(table, 0, n * sizeof(*table));
+	for (i = 0; i < n; i++)
+		spinlock_init(&table[i].lock);
+
+	if (read(urandom_fd, hash_key, sizeof(hash_key)) < 0)
+		log_error("connlimit: failed to read /dev/urandom: %s\n", strerror(errno));
+
 	load_config();
 
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 
 #include "events.h"
@@ -49,6 +50,11 @@ static int cnt;
 static LIST_HEAD(pool_list);
 static struct ippool_t *def_pool;
 
+// items by peer address, built by the first restored session
+static struct ippool_item_t **restore_idx;
+static int restore_idx_cnt;
+static pthread_mutex_t restore_lock = PTHREAD_MUTEX_INITIALIZER;
+
 struct ippool_t *create_pool(const char *name)
 {
 	struct ippool_t *p = malloc(sizeof(*p));
@@ -221,7 +227,7 @@ static struct ipv4db_item_t *get_ip(struct ppp_t *ppp)
 	spin_lock(&p->lock);
 	if (!list_empty(&p->items)) {
 		it = list_entry(p->items.next, typeof(*it), entry);
-		list_del(&it->entry);
+		list_del_init(&it->entry);
 	} else
 		it = NULL;
 	spin_unlock(&p->lock);
@@ -238,9 +244,99 @@ static void put_ip(struct ppp_t *ppp, struct ipv4db_item_t *it)
 	spin_unlock(&pit->pool->lock);
 }
 
+static int item_cmp(const void *a, const void *b)
+{
+	in_addr_t a1 = ntohl((*(struct ippool_item_t **)a)->it.peer_addr);
+	in_addr_t a2 = ntohl((*(struct ippool_item_t **)b)->it.peer_addr);
+
+	return a1 < a2 ? -1 : a1 > a2;
+}
+
+static int add_restore_idx(struct ippool_t *p, int n)
+{
+	struct ippool_item_t *it;
+
+	spin_lock(&p->lock);
+	list_for_each_entry(it, &p->items, entry) {
+		if (n == cnt)
+			break;
+		restore_idx[n++] = it;
+	}
+	spin_unlock(&p->lock);
+
+	return n;
+}
+
+static void build_restore_idx(void)
+{
+	struct ippool_t *p;
+	int n;
+
+	restore_idx = _malloc(cnt * sizeof(*restore_idx));
+
+	// only free items, addresses of running sessions can't be restored anyway
+	n = add_restore_idx(def_pool, 0);
+	list_for_each_entry(p, &pool_list, entry)
+		n = add_restore_idx(p, n);
+
+	qsort(restore_idx, n, sizeof(*restore_idx), item_cmp);
+	restore_idx_cnt = n;
+}
+
+static struct ipv4db_item_t *restore_ip(struct ppp_t *ppp, in_addr_t addr, in_addr_t peer_addr)
+{
+	struct ippool_item_t *it = NULL;
+	int l = 0, r, m;
+
+	if (!def_pool)
+		return NULL;
+
+	pthread_mutex_lock(&restore_lock);
+
+	if (!restore_idx)
+		build_restore_idx();
+
+	r = restore_idx_cnt;
+	while (l < r) {
+		m = (l + r) / 2;
+		if (ntohl(restore_idx[m]->it.peer_addr) < ntohl(peer_addr))
+			l = m + 1;
+		else
+			r = m;
+	}
+
+	for (; l < restore_idx_cnt && restore_idx[l]->it.peer_addr == peer_addr; l++) {
+		it = restore_idx[l];
+		spin_lock(&it->pool->lock);
+		if (!list_empty(&it->entry) && it->it.addr == addr) {
+			list_del_init(&it->entry);
+			spin_unlock(&it->pool->lock);
+			break;
+		}
+		spin_unlock(&it->pool->lock);
+		it = NULL;
+	}
+
+	pthread_mutex_unlock(&restore_lock);
+
+	return it ? &it->it : NULL;
+}
+
+static void restore_end(void)
+{
+	pthread_mutex_lock(&restore_lock);
+	if (restore_idx) {
+		_free(restore_idx);
+		restore_idx = NULL;
+	}
+	pthread_mutex_unlock(&restore_lock);
+}
+
 static struct ipdb_t ipdb = {
 	.get_ipv4 = get_ip,
 	.put_ipv4 = put_ip,
+	.restore_ipv4 = restore_ip,
+	.restore_end = restore_end,
 };
 
 #ifdef RADIUS
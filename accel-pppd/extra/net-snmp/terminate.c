@@ -23,12 +23,14 @@ static void __terminate(struct ppp_t *ppp)
 
 static void terminate_by_sid(const char *val)
 {
+	char str[PPP_SESSIONID_LEN + 1];
 	struct ppp_t *ppp;
 
+	strncpy(str, val, PPP_SESSIONID_LEN);
+	str[PPP_SESSIONID_LEN] = 0;
+
 	pthread_rwlock_rdlock(&ppp_lock);
-	list_for_each_entry(ppp, &ppp_list, entry) {
-		if (strncmp(ppp->sessionid, val, PPP_SESSIONID_LEN))
-			continue;
+	ppp_index_for_each(ppp, PPP_IDX_SESSIONID, str) {
 		triton_context_call(ppp->ctrl->ctx, (triton_event_func)__terminate, ppp);
 		break;
 	}
@@ -37,16 +39,14 @@ static void terminate_by_sid(const char *val)
 
 static void terminate_by_ifname(const char *val, size_t len)
 {
+	char str[len + 1];
 	struct ppp_t *ppp;
-	size_t n;
+
+	strncpy(str, val, len);
+	str[len] = 0;
 
 	pthread_rwlock_rdlock(&ppp_lock);
-	list_for_each_entry(ppp, &ppp_list, entry) {
-		n = strlen(ppp->ifname);
-		if (n != len)
-			continue;
-		if (strncmp(ppp->ifname, val, len))
-			continue;
+	ppp_index_for_each(ppp, PPP_IDX_IFNAME, str) {
 		triton_context_call(ppp->ctrl->ctx, (triton_event_func)__terminate, ppp);
 		break;
 	}
@@ -65,9 +65,7 @@ static void terminate_by_ip(const char *val, size_t len)
 	addr = inet_addr(str);
 	
 	pthread_rwlock_rdlock(&ppp_lock);
-	list_for_each_entry(ppp, &ppp_list, entry) {
-		if (!ppp->ipv4 || ppp->ipv4->peer_addr != addr)
-			continue;
+	ppp_index_for_each(ppp, PPP_IDX_IPV4, &addr) {
 		triton_context_call(ppp->ctrl->ctx, (triton_event_func)__terminate, ppp);
 		break;
 	}
@@ -76,18 +74,14 @@ static void terminate_by_ip(const char *val, size_t len)
 
 static void terminate_by_username(const char *val, size_t len)
 {
+	char str[len + 1];
 	struct ppp_t *ppp;
-	size_t n;
+
+	strncpy(str, val, len);
+	str[len] = 0;
 
 	pthread_rwlock_rdlock(&ppp_lock);
-	list_for_each_entry(ppp, &ppp_list, entry) {
-		if (!ppp->username)
-			continue;
-		n = strlen(ppp->username);
-		if (n != len)
-			continue;
-		if (strncmp(ppp->username, val, len))
-			continue;
+	ppp_index_for_each(ppp, PPP_IDX_USERNAME, str) {
 		triton_context_call(ppp->ctrl->ctx, (triton_event_func)__terminate, ppp);
 	}
 	pthread_rwlock_unlock(&ppp_lock);
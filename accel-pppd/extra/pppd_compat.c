@@ -224,6 +224,15 @@ static void ev_ppp_started(struct ppp_t *ppp)
 	pd->started = 1;
 }
 
+static void ev_ppp_restored(struct ppp_t *ppp)
+{
+	struct pppd_compat_pd_t *pd = find_pd(ppp);
+
+	// ip-up was run by the previous process, ip-down is still due
+	if (pd)
+		pd->started = 1;
+}
+
 static void ev_ppp_finishing(struct ppp_t *ppp)
 {
 	struct ifpppstatsreq ifreq;
@@ -537,6 +546,7 @@ static void init(void)
 	triton_event_register_handler(EV_PPP_STARTING, (triton_event_func)ev_ppp_starting);
 	triton_event_register_handler(EV_PPP_PRE_UP, (triton_event_func)ev_ppp_pre_up);
 	triton_event_register_handler(EV_PPP_STARTED, (triton_event_func)ev_ppp_started);
+	triton_event_register_handler(EV_PPP_RESTORED, (triton_event_func)ev_ppp_restored);
 	triton_event_register_handler(EV_PPP_FINISHING, (triton_event_func)ev_ppp_finishing);
 	triton_event_register_handler(EV_PPP_PRE_FINISHED, (triton_event_func)ev_ppp_finished);
 #ifdef RADIUS
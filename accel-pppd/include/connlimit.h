@@ -12,8 +12,9 @@ static inline uint64_t cl_key_from_mac(uint8_t hw[6])
 		uint8_t hw[6];
 		uint64_t key;
 	} key;
-	
-	memcpy(key.hw, hw, sizeof(hw));
+
+	key.key = 0;
+	memcpy(key.hw, hw, 6);
 
 	return key.key;
 }
@@ -17,6 +17,7 @@
 #define EV_CONFIG_RELOAD		11
 #define EV_PPP_AUTH_FAILED  12
 #define EV_PPP_PRE_FINISHED 13
+#define EV_PPP_RESTORED     14
 #define EV_IP_CHANGED       100
 #define EV_SHAPER           101
 #define EV_MPPE_KEYS        102
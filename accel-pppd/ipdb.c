@@ -1,3 +1,5 @@
+#include <stdlib.h>
+
 #include "triton.h"
 #include "ipdb.h"
 
@@ -71,6 +73,46 @@ void __export ipdb_put_ipv6_prefix(struct ppp_t *ppp, struct ipv6db_prefix_t *it
 		it->owner->put_ipv6_prefix(ppp, it);
 }
 
+static void put_restored_ipv4(struct ppp_t *ppp, struct ipv4db_item_t *it)
+{
+	_free(it);
+}
+
+// holds addresses no module claimed, e.g. taken from chap-secrets
+static struct ipdb_t restored_ipdb = {
+	.put_ipv4 = put_restored_ipv4,
+};
+
+struct ipv4db_item_t __export *ipdb_restore_ipv4(struct ppp_t *ppp, in_addr_t addr, in_addr_t peer_addr)
+{
+	struct ipdb_t *ipdb;
+	struct ipv4db_item_t *it;
+
+	list_for_each_entry(ipdb, &ipdb_handlers, entry) {
+		if (!ipdb->restore_ipv4)
+			continue;
+		it = ipdb->restore_ipv4(ppp, addr, peer_addr);
+		if (it)
+			return it;
+	}
+
+	it = _malloc(sizeof(*it));
+	it->owner = &restored_ipdb;
+	it->addr = addr;
+	it->peer_addr = peer_addr;
+
+	return it;
+}
+
+void __export ipdb_restore_end(void)
+{
+	struct ipdb_t *ipdb;
+
+	list_for_each_entry(ipdb, &ipdb_handlers, entry) {
+		if (ipdb->restore_end)
+			ipdb->restore_end();
+	}
+}
 
 void __export ipdb_register(struct ipdb_t *ipdb)
 {
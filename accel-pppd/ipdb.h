@@ -48,6 +48,10 @@ struct ipdb_t
 
 	struct ipv6db_prefix_t *(*get_ipv6_prefix)(struct ppp_t *ppp);
 	void (*put_ipv6_prefix)(struct ppp_t *ppp, struct ipv6db_prefix_t *);
+
+	// claims the address of a session resumed after hot restart
+	struct ipv4db_item_t *(*restore_ipv4)(struct ppp_t *ppp, in_addr_t addr, in_addr_t peer_addr);
+	void (*restore_end)(void);
 };
 
 struct ipv4db_item_t *ipdb_get_ipv4(struct ppp_t *ppp);
@@ -59,6 +63,9 @@ void ipdb_put_ipv6(struct ppp_t *ppp, struct ipv6db_item_t *);
 struct ipv6db_prefix_t __export *ipdb_get_ipv6_prefix(struct ppp_t *ppp);
 void __export ipdb_put_ipv6_prefix(struct ppp_t *ppp, struct ipv6db_prefix_t *it);
 
+struct ipv4db_item_t *ipdb_restore_ipv4(struct ppp_t *ppp, in_addr_t addr, in_addr_t peer_addr);
+void ipdb_restore_end(void);
+
 void ipdb_register(struct ipdb_t *);
 
 #endif
@@ -139,48 +139,36 @@ static void insert_dp_routes(struct ppp_t *ppp, struct dhcpv6_pd *pd)
 {
 	struct ipv6db_addr_t *a;
 	struct ipv6db_addr_t *p;
-	struct in6_rtmsg rt6;
+	struct in6_addr gw;
 	char str1[INET6_ADDRSTRLEN];
 	char str2[INET6_ADDRSTRLEN];
-	int err;
-
-	memset(&rt6, 0, sizeof(rt6));
-	rt6.rtmsg_ifindex = ppp->ifindex;
-	rt6.rtmsg_flags = RTF_UP;
+	int metric;
 
 	list_for_each_entry(p, &pd->ipv6_dp->prefix_list, entry) {
-		memcpy(&rt6.rtmsg_dst, &p->addr, sizeof(p->addr));
-		rt6.rtmsg_dst_len = p->prefix_len;
-		rt6.rtmsg_metric = 1;
+		metric = 1;
 
 		if (conf_route_via_gw) {
-			rt6.rtmsg_flags |= RTF_GATEWAY;
 			list_for_each_entry(a, &ppp->ipv6->addr_list, entry) {
-				build_addr(a, ppp->ipv6->peer_intf_id, &rt6.rtmsg_gateway);
-				if (ioctl(sock6_fd, SIOCADDRT, &rt6)) {
-					err = errno;
-					inet_ntop(AF_INET6, &p->addr, str1, sizeof(str1));
-					inet_ntop(AF_INET6, &rt6.rtmsg_gateway, str2, sizeof(str2));
-					log_ppp_error("dhcpv6: route add %s/%i via %s: %s\n", str1, p->prefix_len, str2, strerror(err));
-				} else if (conf_verbose) {
+				build_addr(a, ppp->ipv6->peer_intf_id, &gw);
+				ppp_ifcfg_route6(ppp, &p->addr, p->prefix_len, &gw, metric++);
+				if (conf_verbose) {
 					inet_ntop(AF_INET6, &p->addr, str1, sizeof(str1));
-					inet_ntop(AF_INET6, &rt6.rtmsg_gateway, str2, sizeof(str2));
+					inet_ntop(AF_INET6, &gw, str2, sizeof(str2));
 					log_ppp_info2("dhcpv6: route add %s/%i via %s\n", str1, p->prefix_len, str2);
 				}
-				rt6.rtmsg_metric++;
 			}
 		} else {
-			if (ioctl(sock6_fd, SIOCADDRT, &rt6)) {
-				err = errno;
-				inet_ntop(AF_INET6, &p->addr, str1, sizeof(str1));
-				log_ppp_error("dhcpv6: route add %s/%i: %s\n", str1, p->prefix_len);
-			} else if (conf_verbose) {
+			ppp_ifcfg_route6(ppp, &p->addr, p->prefix_len, NULL, metric);
+			if (conf_verbose) {
 				inet_ntop(AF_INET6, &p->addr, str1, sizeof(str1));
 				log_ppp_info2("dhcpv6: route add %s/%i\n", str1, p->prefix_len);
 			}
 		}
 	}
 
+	// failures are logged by the netlink channel
+	ppp_ifcfg_flush(ppp);
+
 	pd->dp_active = 1;
 }
 
@@ -769,16 +757,13 @@ static int dhcpv6_read(struct triton_md_handler_t *h)
 		}
 
 		pthread_rwlock_rdlock(&ppp_lock);
-		list_for_each_entry(ppp, &ppp_list, entry) {
+		ppp_index_for_each(ppp, PPP_IDX_IFINDEX, &addr.sin6_scope_id) {
 			if (ppp->state != PPP_STATE_ACTIVE)
 				continue;
 
 			if (!ppp->ipv6)
 				continue;
 
-			if (ppp->ifindex != addr.sin6_scope_id)
-				continue;
-
 			if (ppp->ipv6->peer_intf_id != *(uint64_t *)(addr.sin6_addr.s6_addr + 8))
 				continue;
 
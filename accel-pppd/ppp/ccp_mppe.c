@@ -45,6 +45,7 @@ struct mppe_option_t
 };
 
 static struct ccp_option_handler_t mppe_opt_hnd = {
+	.id = CI_MPPE,
 	.init = mppe_init,
 	.send_conf_req = mppe_send_conf_req,
 	.send_conf_nak = mppe_send_conf_nak,
@@ -120,21 +121,22 @@ static int setup_mppe_key(int fd, int transmit, uint8_t *key)
 static int decrease_mtu(struct ppp_t *ppp)
 {
 	struct ifreq ifr;
+	int mtu = ppp->mtu;
 
-	strcpy(ifr.ifr_name, ppp->ifname);
+	if (!mtu) {
+		strcpy(ifr.ifr_name, ppp->ifname);
 
-	if (ioctl(sock_fd, SIOCGIFMTU, &ifr)) {
-		log_ppp_error("mppe: failed to get MTU: %s\n", strerror(errno));
-		return -1;
-	}
-
-	ifr.ifr_mtu -= MPPE_PAD;
+		if (ioctl(sock_fd, SIOCGIFMTU, &ifr)) {
+			log_ppp_error("mppe: failed to get MTU: %s\n", strerror(errno));
+			return -1;
+		}
 
-	if (ioctl(sock_fd, SIOCSIFMTU, &ifr)) {
-		log_ppp_error("mppe: failed to set MTU: %s\n", strerror(errno));
-		return -1;
+		mtu = ifr.ifr_mtu;
 	}
 
+	ppp_ifcfg_mtu(ppp, mtu - MPPE_PAD);
+	ppp_ifcfg_commit(ppp);
+
 	return 0;
 }
 
@@ -30,6 +30,7 @@ struct dns_option_t
 
 static struct ipcp_option_handler_t dns1_opt_hnd=
 {
+	.id=CI_DNS1,
 	.init=dns1_init,
 	.send_conf_req=dns_send_conf_req,
 	.send_conf_nak=dns_send_conf_nak,
@@ -40,6 +41,7 @@ static struct ipcp_option_handler_t dns1_opt_hnd=
 
 static struct ipcp_option_handler_t dns2_opt_hnd=
 {
+	.id=CI_DNS2,
 	.init=dns2_init,
 	.send_conf_req=dns_send_conf_req,
 	.send_conf_nak=dns_send_conf_nak,
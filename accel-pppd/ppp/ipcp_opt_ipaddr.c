@@ -35,6 +35,7 @@ struct ipaddr_option_t
 };
 
 static struct ipcp_option_handler_t ipaddr_opt_hnd = {
+	.id            = CI_ADDR,
 	.init          = ipaddr_init,
 	.send_conf_req = ipaddr_send_conf_req,
 	.send_conf_nak = ipaddr_send_conf_nak,
@@ -70,8 +71,8 @@ static int check_exists(struct ppp_t *self_ppp, in_addr_t addr)
 	int r = 0;
 
 	pthread_rwlock_rdlock(&ppp_lock);
-	list_for_each_entry(ppp, &ppp_list, entry) {
-		if (!ppp->terminating && ppp->ipv4 && ppp->ipv4->peer_addr == addr && ppp != self_ppp) {
+	ppp_index_for_each(ppp, PPP_IDX_IPV4, &addr) {
+		if (!ppp->terminating && ppp != self_ppp) {
 			log_ppp_warn("ppp: requested IPv4 address already assigned to %s\n", ppp->ifname);
 			r = 1;
 			break;
@@ -89,6 +90,8 @@ static int alloc_ip(struct ppp_t *ppp)
 		log_ppp_warn("ppp: no free IPv4 address\n");
 		return IPCP_OPT_CLOSE;
 	}
+
+	ppp_index_update(ppp, PPP_IDX_IPV4);
 	
 	if (iprange_tunnel_check(ppp->ipv4->peer_addr)) {
 		log_ppp_warn("ppp:ipcp: to avoid kernel soft lockup requested IP cannot be assigned (%i.%i.%i.%i)\n",
@@ -137,8 +140,6 @@ static int ipaddr_recv_conf_req(struct ppp_ipcp_t *ipcp, struct ipcp_option_t *o
 {
 	struct ipaddr_option_t *ipaddr_opt = container_of(opt, typeof(*ipaddr_opt), opt);
 	struct ipcp_opt32_t *opt32 = (struct ipcp_opt32_t *)ptr;
-	struct ifreq ifr;
-	struct sockaddr_in addr;
 	int r;
 
 	if (!ipcp->ppp->ipv4) {
@@ -158,23 +159,8 @@ static int ipaddr_recv_conf_req(struct ppp_ipcp_t *ipcp, struct ipcp_option_t *o
 	return IPCP_OPT_NAK;
 
 ack:
-	memset(&ifr, 0, sizeof(ifr));
-	memset(&addr, 0, sizeof(addr));
-
-	strcpy(ifr.ifr_name, ipcp->ppp->ifname);
-
-	addr.sin_family = AF_INET;
-  addr.sin_addr.s_addr = ipcp->ppp->ipv4->addr;
-	memcpy(&ifr.ifr_addr,&addr,sizeof(addr));
-
-	if (ioctl(sock_fd, SIOCSIFADDR, &ifr))
-		log_ppp_error("ipcp: failed to set PA address: %s\n", strerror(errno));
-	
-  addr.sin_addr.s_addr = ipcp->ppp->ipv4->peer_addr;
-	memcpy(&ifr.ifr_dstaddr,&addr,sizeof(addr));
-	
-	if (ioctl(sock_fd, SIOCSIFDSTADDR, &ifr))
-		log_ppp_error("ipcp: failed to set remote PA address: %s\n", strerror(errno));
+	ppp_ifcfg_addr4(ipcp->ppp, ipcp->ppp->ipv4->addr, ipcp->ppp->ipv4->peer_addr);
+	ppp_ifcfg_commit(ipcp->ppp);
 
 	return IPCP_OPT_ACK;
 }
@@ -30,13 +30,6 @@ static int conf_peer_intf_id = INTF_ID_FIXED;
 static uint64_t conf_peer_intf_id_val = 2;
 static int conf_accept_peer_intf_id;
 
-// from /usr/include/linux/ipv6.h
-struct in6_ifreq {
-        struct in6_addr ifr6_addr;
-        __u32           ifr6_prefixlen;
-        int             ifr6_ifindex; 
-};
-
 static struct ipv6cp_option_t *ipaddr_init(struct ppp_ipv6cp_t *ipv6cp);
 static void ipaddr_free(struct ppp_ipv6cp_t *ipv6cp, struct ipv6cp_option_t *opt);
 static int ipaddr_send_conf_req(struct ppp_ipv6cp_t *ipv6cp, struct ipv6cp_option_t *opt, uint8_t *ptr);
@@ -88,27 +81,20 @@ static void ipaddr_free(struct ppp_ipv6cp_t *ipv6cp, struct ipv6cp_option_t *opt
 static int check_exists(struct ppp_t *self_ppp)
 {
 	struct ppp_t *ppp;
-	struct ipv6db_addr_t *a1, *a2;
+	struct ipv6db_addr_t *a2;
 	int r = 0;
 
 	pthread_rwlock_rdlock(&ppp_lock);
-	list_for_each_entry(ppp, &ppp_list, entry) {
-		if (ppp->terminating)
-			continue;
-		if (!ppp->ipv6)
-			continue;
-		if (ppp == self_ppp)
-			continue;
-
-		list_for_each_entry(a1, &ppp->ipv6->addr_list, entry) {
-			list_for_each_entry(a2, &self_ppp->ipv6->addr_list, entry) {
-				if (a1->addr.s6_addr32[0] == a2->addr.s6_addr32[0] &&
-						a1->addr.s6_addr32[1] == a2->addr.s6_addr32[1]) {
-					log_ppp_warn("ppp: requested IPv6 address already assigned to %s\n", ppp->ifname);
-					r = 1;
-					goto out;
-				}
-			}
+	list_for_each_entry(a2, &self_ppp->ipv6->addr_list, entry) {
+		ppp_index_for_each(ppp, PPP_IDX_IPV6, &a2->addr) {
+			if (ppp->terminating)
+				continue;
+			if (ppp == self_ppp)
+				continue;
+
+			log_ppp_warn("ppp: requested IPv6 address already assigned to %s\n", ppp->ifname);
+			r = 1;
+			goto out;
 		}
 	}
 out:
@@ -174,6 +160,8 @@ static int alloc_ip(struct ppp_t *ppp)
 		return IPV6CP_OPT_CLOSE;
 	}
 
+	ppp_index_update(ppp, PPP_IDX_IPV6);
+
 	if (!ppp->ipv6->intf_id)
 		ppp->ipv6->intf_id = generate_intf_id(ppp);
 	
@@ -242,7 +230,7 @@ static int ipaddr_recv_conf_req(struct ppp_ipv6cp_t *ipv6cp, struct ipv6cp_optio
 {
 	struct ipaddr_option_t *ipaddr_opt = container_of(opt, typeof(*ipaddr_opt), opt);
 	struct ipv6cp_opt64_t *opt64 = (struct ipv6cp_opt64_t* )ptr;
-	struct in6_ifreq ifr6;
+	struct in6_addr addr;
 	struct ipv6db_addr_t *a;
 	int r;
 
@@ -280,32 +268,23 @@ ack:
 	devconf(ipv6cp->ppp, "autoconf", "0");
 	devconf(ipv6cp->ppp, "forwarding", "1");
 
-	memset(&ifr6, 0, sizeof(ifr6));
-	ifr6.ifr6_addr.s6_addr32[0] = htons(0xfe80);
-	*(uint64_t *)(ifr6.ifr6_addr.s6_addr + 8) = ipv6cp->ppp->ipv6->intf_id;
-	ifr6.ifr6_prefixlen = 64;
-	ifr6.ifr6_ifindex = ipv6cp->ppp->ifindex;
+	memset(&addr, 0, sizeof(addr));
+	addr.s6_addr32[0] = htons(0xfe80);
+	*(uint64_t *)(addr.s6_addr + 8) = ipv6cp->ppp->ipv6->intf_id;
+
+	ppp_ifcfg_addr6(ipv6cp->ppp, &addr, 64);
 
-	if (ioctl(sock6_fd, SIOCSIFADDR, &ifr6)) {
-		log_ppp_error("ppp:ipv6cp: ioctl(SIOCSIFADDR): %s\n", strerror(errno));
-		return IPV6CP_OPT_REJ;
-	}
-	
 	list_for_each_entry(a, &ipv6cp->ppp->ipv6->addr_list, entry) {
 		if (a->prefix_len == 128)
 			continue;
 
-		build_addr(a, ipv6cp->ppp->ipv6->intf_id, &ifr6.ifr6_addr);
-		ifr6.ifr6_prefixlen = a->prefix_len;
-
-		if (ioctl(sock6_fd, SIOCSIFADDR, &ifr6)) {
-			log_ppp_error("ppp:ipv6cp: ioctl(SIOCSIFADDR): %s\n", strerror(errno));
-			return IPV6CP_OPT_REJ;
-		}
-	
-			
+		build_addr(a, ipv6cp->ppp->ipv6->intf_id, &addr);
+		ppp_ifcfg_addr6(ipv6cp->ppp, &addr, a->prefix_len);
 	}
 
+	// failures are logged when the kernel replies, the option is acked anyway
+	ppp_ifcfg_commit(ipv6cp->ppp);
+
 	return IPV6CP_OPT_ACK;
 }
 
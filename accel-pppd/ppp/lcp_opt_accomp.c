@@ -24,6 +24,7 @@ struct accomp_option_t
 
 static struct lcp_option_handler_t accomp_opt_hnd=
 {
+	.id=CI_ACCOMP,
 	.init=accomp_init,
 	.send_conf_req=accomp_send_conf_req,
 	.send_conf_nak=accomp_send_conf_nak,
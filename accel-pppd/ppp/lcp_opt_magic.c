@@ -23,6 +23,7 @@ struct magic_option_t
 
 static struct lcp_option_handler_t magic_opt_hnd=
 {
+	.id = CI_MAGIC,
 	.init = magic_init,
 	.send_conf_req = magic_send_conf_req,
 	.send_conf_nak = magic_send_conf_nak,
@@ -39,6 +39,7 @@ struct mru_option_t
 
 static struct lcp_option_handler_t mru_opt_hnd=
 {
+	.id=CI_MRU,
 	.init=mru_init,
 	.send_conf_req=mru_send_conf_req,
 	.send_conf_nak=mru_send_conf_nak,
@@ -117,18 +118,13 @@ static int mru_recv_conf_req(struct ppp_lcp_t *lcp, struct lcp_option_t *opt, ui
 static int mru_recv_conf_ack(struct ppp_lcp_t *lcp, struct lcp_option_t *opt, uint8_t *ptr)
 {
 	struct mru_option_t *mru_opt = container_of(opt,typeof(*mru_opt), opt);
-	struct ifreq ifr = {
-		.ifr_mtu = mru_opt->mtu,
-	};
-
-	strcpy(ifr.ifr_name, lcp->ppp->ifname);
 
 	if (ioctl(lcp->ppp->unit_fd, PPPIOCSMRU, &mru_opt->mru))
 		log_ppp_error("lcp:mru: failed to set MRU: %s\n", strerror(errno));
 
-	if (ioctl(sock_fd, SIOCSIFMTU, &ifr))
-		log_ppp_error("lcp:mru: failed to set MTU: %s\n", strerror(errno));
-	
+	ppp_ifcfg_mtu(lcp->ppp, mru_opt->mtu);
+	ppp_ifcfg_commit(lcp->ppp);
+
 	return 0;
 }
 
@@ -24,6 +24,7 @@ struct pcomp_option_t
 
 static struct lcp_option_handler_t pcomp_opt_hnd=
 {
+	.id=CI_PCOMP,
 	.init=pcomp_init,
 	.send_conf_req=pcomp_send_conf_req,
 	.send_conf_nak=pcomp_send_conf_nak,
@@ -6,6 +6,7 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/ioctl.h>
+#include <sys/stat.h>
 #include <arpa/inet.h>
 #include <features.h>
 #include <signal.h>
@@ -18,6 +19,7 @@
 #include "events.h"
 #include "ppp.h"
 #include "ppp_fsm.h"
+#include "ipdb.h"
 #include "log.h"
 #include "spinlock.h"
 #include "mempool.h"
@@ -47,6 +49,7 @@ static spinlock_t seq_lock;
 #endif
 
 __export struct ppp_stat_t ppp_stat;
+__export int ppp_counters = -1;
 
 struct layer_node_t
 {
@@ -63,11 +66,16 @@ static void start_first_layer(struct ppp_t *);
 
 void __export ppp_init(struct ppp_t *ppp)
 {
+	int i;
+
 	memset(ppp,0,sizeof(*ppp));
+	INIT_LIST_HEAD(&ppp->entry);
 	INIT_LIST_HEAD(&ppp->layers);
 	INIT_LIST_HEAD(&ppp->chan_handlers);
 	INIT_LIST_HEAD(&ppp->unit_handlers);
 	INIT_LIST_HEAD(&ppp->pd_list);
+	for (i = 0; i < PPP_IDX_CNT; i++)
+		INIT_LIST_HEAD(&ppp->idx_entry[i]);
 }
 
 static void generate_sessionid(struct ppp_t *ppp)
@@ -88,9 +96,37 @@ static void generate_sessionid(struct ppp_t *ppp)
 		sprintf(ppp->sessionid, "%016llx", sid);
 }
 
+static void counter_inc(int c)
+{
+	if (ppp_counters >= 0)
+		triton_counter_inc(ppp_counters + c);
+}
+
+static void lat_add(int c, const struct timespec *start)
+{
+	struct timespec ts;
+	uint64_t us;
+	int i;
+
+	if (ppp_counters < 0)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	us = (ts.tv_sec - start->tv_sec) * 1000000ll + (ts.tv_nsec - start->tv_nsec) / 1000;
+
+	i = us ? 64 - __builtin_clzll(us) : 0;
+	if (i >= PPP_LAT_BUCKETS)
+		i = PPP_LAT_BUCKETS - 1;
+
+	triton_counter_inc(ppp_counters + c + i);
+}
+
 int __export establish_ppp(struct ppp_t *ppp)
 {
 	struct ifreq ifr;
+	int cached;
+
+	clock_gettime(CLOCK_MONOTONIC, &ppp->establish_ts);
 
 	/* Open an instance of /dev/ppp and connect the channel to it */
 	if (ioctl(ppp->fd, PPPIOCGCHAN, &ppp->chan_idx) == -1) {
@@ -111,18 +147,23 @@ int __export establish_ppp(struct ppp_t *ppp)
 		goto exit_close_chan;
 	}
 
-	ppp->unit_fd = open("/dev/ppp", O_RDWR);
-	if (ppp->unit_fd < 0) {
-		log_ppp_error("open(unit) /dev/ppp: %s\n", strerror(errno));
-		goto exit_close_chan;
-	}
-	
-	fcntl(ppp->unit_fd, F_SETFD, fcntl(ppp->unit_fd, F_GETFD) | FD_CLOEXEC);
+	cached = !ppp_unit_get(ppp);
+	counter_inc(cached ? PPP_COUNTER_UNIT_HIT : PPP_COUNTER_UNIT_MISS);
 
-	ppp->unit_idx = -1;
-	if (ioctl(ppp->unit_fd, PPPIOCNEWUNIT, &ppp->unit_idx) < 0) {
-		log_ppp_error("ioctl(PPPIOCNEWUNIT): %s\n", strerror(errno));
-		goto exit_close_unit;
+	if (!cached) {
+		ppp->unit_fd = open("/dev/ppp", O_RDWR);
+		if (ppp->unit_fd < 0) {
+			log_ppp_error("open(unit) /dev/ppp: %s\n", strerror(errno));
+			goto exit_close_chan;
+		}
+
+		fcntl(ppp->unit_fd, F_SETFD, fcntl(ppp->unit_fd, F_GETFD) | FD_CLOEXEC);
+
+		ppp->unit_idx = -1;
+		if (ioctl(ppp->unit_fd, PPPIOCNEWUNIT, &ppp->unit_idx) < 0) {
+			log_ppp_error("ioctl(PPPIOCNEWUNIT): %s\n", strerror(errno));
+			goto exit_close_unit;
+		}
 	}
 
   if (ioctl(ppp->chan_fd, PPPIOCCONNECT, &ppp->unit_idx) < 0) {
@@ -135,7 +176,8 @@ int __export establish_ppp(struct ppp_t *ppp)
 		goto exit_close_unit;
 	}
 	
-	if (fcntl(ppp->unit_fd, F_SETFL, O_NONBLOCK)) {
+	// cached units are opened nonblocking
+	if (!cached && fcntl(ppp->unit_fd, F_SETFL, O_NONBLOCK)) {
 		log_ppp_error("ppp: cann't to set nonblocking mode: %s\n", strerror(errno));
 		goto exit_close_unit;
 	}
@@ -144,14 +186,16 @@ int __export establish_ppp(struct ppp_t *ppp)
 	generate_sessionid(ppp);
 	sprintf(ppp->ifname, "ppp%i", ppp->unit_idx);
 
-	memset(&ifr, 0, sizeof(ifr));
-	strcpy(ifr.ifr_name, ppp->ifname);
+	if (!cached) {
+		memset(&ifr, 0, sizeof(ifr));
+		strcpy(ifr.ifr_name, ppp->ifname);
 
-	if (ioctl(sock_fd, SIOCGIFINDEX, &ifr)) {
-		log_ppp_error("ppp: ioctl(SIOCGIFINDEX): %s\n", strerror(errno));
-		goto exit_close_unit;
+		if (ioctl(sock_fd, SIOCGIFINDEX, &ifr)) {
+			log_ppp_error("ppp: ioctl(SIOCGIFINDEX): %s\n", strerror(errno));
+			goto exit_close_unit;
+		}
+		ppp->ifindex = ifr.ifr_ifindex;
 	}
-	ppp->ifindex = ifr.ifr_ifindex;
 
 	log_ppp_info1("connect: %s <--> %s(%s)\n", ppp->ifname, ppp->ctrl->name, ppp->chan_name);
 
@@ -179,10 +223,13 @@ int __export establish_ppp(struct ppp_t *ppp)
 
 	pthread_rwlock_wrlock(&ppp_lock);
 	list_add_tail(&ppp->entry, &ppp_list);
+	ppp_index_add(ppp);
 	pthread_rwlock_unlock(&ppp_lock);
 
 	log_ppp_debug("ppp established\n");
 
+	lat_add(PPP_COUNTER_ESTABLISH, &ppp->establish_ts);
+
 	triton_event_fire(EV_PPP_STARTING, ppp);
 	
 	start_first_layer(ppp);
@@ -200,12 +247,151 @@ exit_close_chan:
 	return -1;
 }
 
+static int check_fds(struct ppp_t *ppp, struct ppp_ckpt_rec_t *rec)
+{
+	struct stat st1, st2;
+	int idx;
+
+	if (ioctl(ppp->fd, PPPIOCGCHAN, &idx) || idx != rec->chan_idx)
+		return -1;
+
+	if (ioctl(ppp->unit_fd, PPPIOCGUNIT, &idx) || idx != rec->unit_idx)
+		return -1;
+
+	if (fstat(ppp->chan_fd, &st1) || fstat(ppp->unit_fd, &st2))
+		return -1;
+
+	if (!S_ISCHR(st1.st_mode) || st1.st_rdev != st2.st_rdev)
+		return -1;
+
+	return 0;
+}
+
+/*
+ * Resumes a session kept over hot restart. Ctrl sets ppp->fd and ppp->ckpt
+ * and calls it in the session context. Channel and unit are still connected,
+ * layers take their state from the record instead of negotiating.
+ */
+int __export ppp_restore(struct ppp_t *ppp)
+{
+	struct ppp_ckpt_rec_t *rec = ppp->ckpt;
+	struct layer_node_t *n;
+	struct ppp_layer_data_t *d;
+	const char *username;
+	int len;
+
+	clock_gettime(CLOCK_MONOTONIC, &ppp->establish_ts);
+
+	ppp->chan_fd = rec->chan_fd;
+	ppp->unit_fd = rec->unit_fd;
+	ppp->chan_idx = rec->chan_idx;
+	ppp->unit_idx = rec->unit_idx;
+
+	if (check_fds(ppp, rec)) {
+		log_ppp_error("ppp: restore: %s: channel or unit mismatch\n", rec->ifname);
+		goto out_err;
+	}
+
+	fcntl(ppp->fd, F_SETFD, fcntl(ppp->fd, F_GETFD) | FD_CLOEXEC);
+	fcntl(ppp->chan_fd, F_SETFD, fcntl(ppp->chan_fd, F_GETFD) | FD_CLOEXEC);
+	fcntl(ppp->unit_fd, F_SETFD, fcntl(ppp->unit_fd, F_GETFD) | FD_CLOEXEC);
+
+	ppp->ifindex = rec->ifindex;
+	ppp->mtu = rec->mtu;
+	ppp->start_time = rec->start_time;
+	memcpy(ppp->ifname, rec->ifname, PPP_IFNAME_LEN);
+	memcpy(ppp->sessionid, rec->sessionid, PPP_SESSIONID_LEN + 1);
+
+	username = ppp_ckpt_get(rec, PPP_CKPT_USERNAME, &len);
+	if (username && len)
+		ppp->username = _strndup(username, len);
+
+	init_layers(ppp);
+
+	list_for_each_entry(n, &ppp->layers, entry) {
+		list_for_each_entry(d, &n->items, entry) {
+			d->starting = 1;
+			if (!d->layer->restore || d->layer->restore(d, rec)) {
+				log_ppp_error("ppp: restore: layer state lost\n");
+				goto out_free_layers;
+			}
+		}
+	}
+
+	log_ppp_info1("restore: %s <--> %s(%s)\n", ppp->ifname, ppp->ctrl->name, ppp->chan_name);
+
+	ppp->buf = mempool_alloc(buf_pool);
+
+	ppp->chan_hnd.fd = ppp->chan_fd;
+	ppp->chan_hnd.read = ppp_chan_read;
+	ppp->unit_hnd.fd = ppp->unit_fd;
+	ppp->unit_hnd.read = ppp_unit_read;
+	triton_md_register_handler(ppp->ctrl->ctx, &ppp->chan_hnd);
+	triton_md_register_handler(ppp->ctrl->ctx, &ppp->unit_hnd);
+
+	triton_md_enable_handler(&ppp->chan_hnd, MD_MODE_READ);
+	triton_md_enable_handler(&ppp->unit_hnd, MD_MODE_READ);
+
+	ppp->state = PPP_STATE_STARTING;
+	__sync_add_and_fetch(&ppp_stat.starting, 1);
+
+	pthread_rwlock_wrlock(&ppp_lock);
+	list_add_tail(&ppp->entry, &ppp_list);
+	ppp_index_add(ppp);
+	pthread_rwlock_unlock(&ppp_lock);
+
+	triton_event_fire(EV_PPP_STARTING, ppp);
+
+	if (rec->peer_addr) {
+		ppp->ipv4 = ipdb_restore_ipv4(ppp, rec->addr, rec->peer_addr);
+		ppp->ifcfg_addr = rec->addr;
+		ppp->ifcfg_peer = rec->peer_addr;
+		ppp_index_update(ppp, PPP_IDX_IPV4);
+	}
+
+	// addresses, routes and flags are still on the interface
+	ppp->ifcfg_up = 1;
+
+	ppp->state = PPP_STATE_ACTIVE;
+	__sync_sub_and_fetch(&ppp_stat.starting, 1);
+	__sync_add_and_fetch(&ppp_stat.active, 1);
+
+	ppp->ctrl->started(ppp);
+
+	triton_event_fire(EV_PPP_RESTORED, ppp);
+
+	ppp_ckpt_restore_done(1);
+
+	return 0;
+
+out_free_layers:
+	_free_layers(ppp);
+	if (ppp->username) {
+		_free(ppp->username);
+		ppp->username = NULL;
+	}
+out_err:
+	close(ppp->unit_fd);
+	close(ppp->chan_fd);
+	ppp->unit_fd = -1;
+	ppp->chan_fd = -1;
+
+	ppp_ckpt_free(ppp);
+	ppp_ckpt_restore_done(0);
+
+	return -1;
+}
+
 static void destablish_ppp(struct ppp_t *ppp)
 {
+	// before descriptors are closed, see ppp_hot_restart()
+	ppp_ckpt_free(ppp);
+
 	triton_event_fire(EV_PPP_PRE_FINISHED, ppp);
 
 	pthread_rwlock_wrlock(&ppp_lock);
-	list_del(&ppp->entry);
+	list_del_init(&ppp->entry);
+	ppp_index_del(ppp);
 	pthread_rwlock_unlock(&ppp_lock);
 
 	switch (ppp->state) {
@@ -232,6 +418,7 @@ static void destablish_ppp(struct ppp_t *ppp)
 	ppp->fd = -1;
 
 	_free_layers(ppp);
+	ppp_ifcfg_free(ppp);
 	
 	ppp->terminated = 1;
 	
@@ -262,7 +449,7 @@ static void destablish_ppp(struct ppp_t *ppp)
 		ppp->ipv6_pool_name = NULL;
 	}
 	
-	if (ppp_shutdown && !ppp_stat.starting && !ppp_stat.active && !ppp_stat.finishing)
+	if (ppp_shutdown && !ppp_restarting && !ppp_stat.starting && !ppp_stat.active && !ppp_stat.finishing)
 		kill(getpid(), SIGTERM);
 }
 
@@ -300,6 +487,49 @@ int __export ppp_unit_send(struct ppp_t *ppp, void *data, int size)
 	return n;
 }
 
+static inline int proto_hash(int proto)
+{
+	// distinct for LCP, PAP and CHAP, and for IPCP, IPV6CP and CCP
+	return (proto ^ proto >> 7) & (PPP_PROTO_TAB_SIZE - 1);
+}
+
+static void proto_tab_build(struct ppp_proto_tab_t *tab, struct list_head *handlers)
+{
+	struct ppp_handler_t *h;
+	int i, n = 0;
+
+	memset(tab, 0, sizeof(*tab));
+
+	list_for_each_entry(h, handlers, entry) {
+		if (++n == PPP_PROTO_TAB_SIZE) {
+			tab->overflow = 1;
+			break;
+		}
+		for (i = proto_hash(h->proto); tab->h[i]; i = (i + 1) & (PPP_PROTO_TAB_SIZE - 1));
+		tab->h[i] = h;
+	}
+}
+
+static struct ppp_handler_t *proto_lookup(struct ppp_proto_tab_t *tab, struct list_head *handlers, int proto)
+{
+	struct ppp_handler_t *h;
+	int i;
+
+	for (i = proto_hash(proto); tab->h[i]; i = (i + 1) & (PPP_PROTO_TAB_SIZE - 1)) {
+		if (tab->h[i]->proto == proto)
+			return tab->h[i];
+	}
+
+	if (tab->overflow) {
+		list_for_each_entry(h, handlers, entry) {
+			if (h->proto == proto)
+				return h;
+		}
+	}
+
+	return NULL;
+}
+
 static int ppp_chan_read(struct triton_md_handler_t *h)
 {
 	struct ppp_t *ppp = container_of(h, typeof(*ppp), chan_hnd);
@@ -307,7 +537,6 @@ static int ppp_chan_read(struct triton_md_handler_t *h)
 	uint16_t proto;
 
 	while(1) {
-cont:
 		ppp->buf_size = read(h->fd, ppp->buf, PPP_MRU);
 		if (ppp->buf_size < 0) {
 			if (errno == EAGAIN)
@@ -328,18 +557,20 @@ cont:
 			continue;
 		}
 
+		counter_inc(PPP_COUNTER_RECV);
+
 		proto = ntohs(*(uint16_t*)ppp->buf);
-		list_for_each_entry(ppp_h, &ppp->chan_handlers, entry) {
-			if (ppp_h->proto == proto) {
-				ppp_h->recv(ppp_h);
-				if (ppp->chan_fd == -1) {
-					//ppp->ctrl->finished(ppp);
-					return 1;
-				}
-				goto cont;
+		ppp_h = proto_lookup(&ppp->chan_tab, &ppp->chan_handlers, proto);
+		if (ppp_h) {
+			ppp_h->recv(ppp_h);
+			if (ppp->chan_fd == -1) {
+				//ppp->ctrl->finished(ppp);
+				return 1;
 			}
+			continue;
 		}
 
+		counter_inc(PPP_COUNTER_PROTO_REJ);
 		lcp_send_proto_rej(ppp, proto);
 		//log_ppp_warn("ppp_chan_read: discarding unknown packet %x\n", proto);
 	}
@@ -352,7 +583,6 @@ static int ppp_unit_read(struct triton_md_handler_t *h)
 	uint16_t proto;
 
 	while (1) {
-cont:
 		ppp->buf_size = read(h->fd, ppp->buf, PPP_MRU);
 		if (ppp->buf_size < 0) {
 			if (errno == EAGAIN)
@@ -374,17 +604,19 @@ cont:
 			continue;
 		}
 
+		counter_inc(PPP_COUNTER_RECV);
+
 		proto=ntohs(*(uint16_t*)ppp->buf);
-		list_for_each_entry(ppp_h, &ppp->unit_handlers, entry) {
-			if (ppp_h->proto == proto) {
-				ppp_h->recv(ppp_h);
-				if (ppp->unit_fd == -1) {
-					//ppp->ctrl->finished(ppp);
-					return 1;
-				}
-				goto cont;
+		ppp_h = proto_lookup(&ppp->unit_tab, &ppp->unit_handlers, proto);
+		if (ppp_h) {
+			ppp_h->recv(ppp_h);
+			if (ppp->unit_fd == -1) {
+				//ppp->ctrl->finished(ppp);
+				return 1;
 			}
+			continue;
 		}
+		counter_inc(PPP_COUNTER_PROTO_REJ);
 		lcp_send_proto_rej(ppp, proto);
 		//log_ppp_warn("ppp_unit_read: discarding unknown packet %x\n", proto);
 	}
@@ -394,28 +626,21 @@ void ppp_recv_proto_rej(struct ppp_t *ppp, uint16_t proto)
 {
 	struct ppp_handler_t *ppp_h;
 
-	list_for_each_entry(ppp_h, &ppp->chan_handlers, entry) {
-		if (ppp_h->proto == proto) {
-			if (ppp_h->recv_proto_rej)
-				ppp_h->recv_proto_rej(ppp_h);
-			return;
-		}
-	}
-	
-	list_for_each_entry(ppp_h, &ppp->unit_handlers, entry) {
-		if (ppp_h->proto == proto) {
-			if (ppp_h->recv_proto_rej)
-				ppp_h->recv_proto_rej(ppp_h);
-			return;
-		}
-	}
+	ppp_h = proto_lookup(&ppp->chan_tab, &ppp->chan_handlers, proto);
+	if (!ppp_h)
+		ppp_h = proto_lookup(&ppp->unit_tab, &ppp->unit_handlers, proto);
+
+	if (ppp_h && ppp_h->recv_proto_rej)
+		ppp_h->recv_proto_rej(ppp_h);
 }
 
 static void ppp_ifup(struct ppp_t *ppp)
 {
-	struct ifreq ifr;
 	struct npioctl np;
-	
+
+	// pre-up scripts expect addresses to be assigned already
+	ppp_ifcfg_flush(ppp);
+
 	triton_event_fire(EV_PPP_ACCT_START, ppp);
 	if (ppp->stop_time)
 		return;
@@ -424,16 +649,8 @@ static void ppp_ifup(struct ppp_t *ppp)
 	if (ppp->stop_time)
 		return;
 
-	memset(&ifr, 0, sizeof(ifr));
-	strcpy(ifr.ifr_name, ppp->ifname);
-
-	if (ioctl(sock_fd, SIOCGIFFLAGS, &ifr))
-		log_ppp_error("ppp: failed to get interface flags: %s\n", strerror(errno));
-
-	ifr.ifr_flags |= IFF_UP | IFF_POINTOPOINT;
-
-	if (ioctl(sock_fd, SIOCSIFFLAGS, &ifr))
-		log_ppp_error("ppp: failed to set interface flags: %s\n", strerror(errno));
+	ppp_ifcfg_up(ppp);
+	lat_add(PPP_COUNTER_CONNECT, &ppp->establish_ts);
 
 	if (ppp->ipv4) {
 		np.protocol = PPP_IP;
@@ -451,6 +668,8 @@ static void ppp_ifup(struct ppp_t *ppp)
 			log_ppp_error("ppp: failed to set NP (IPv6) mode: %s\n", strerror(errno));
 	}
 	
+	ppp_ckpt_save(ppp);
+
 	ppp->ctrl->started(ppp);
 
 	triton_event_fire(EV_PPP_STARTED, ppp);
@@ -581,14 +800,18 @@ void __export ppp_terminate(struct ppp_t *ppp, int cause, int hard)
 void __export ppp_register_chan_handler(struct ppp_t *ppp,struct ppp_handler_t *h)
 {
 	list_add_tail(&h->entry,&ppp->chan_handlers);
+	proto_tab_build(&ppp->chan_tab, &ppp->chan_handlers);
 }
 void __export ppp_register_unit_handler(struct ppp_t *ppp,struct ppp_handler_t *h)
 {
 	list_add_tail(&h->entry,&ppp->unit_handlers);
+	proto_tab_build(&ppp->unit_tab, &ppp->unit_handlers);
 }
 void __export ppp_unregister_handler(struct ppp_t *ppp,struct ppp_handler_t *h)
 {
 	list_del(&h->entry);
+	proto_tab_build(&ppp->chan_tab, &ppp->chan_handlers);
+	proto_tab_build(&ppp->unit_tab, &ppp->unit_handlers);
 }
 
 static int get_layer_order(const char *name)
@@ -716,7 +939,7 @@ void ppp_shutdown_soft(void)
 		kill(getpid(), SIGTERM);
 }
 
-static void save_seq(void)
+void ppp_save_seq(void)
 {
 	FILE *f;
 	char *opt = conf_get_opt("ppp", "seq-file");
@@ -762,6 +985,7 @@ static void init(void)
 	FILE *f;
 
 	buf_pool = mempool_create(PPP_MRU);
+	ppp_counters = triton_counter_alloc(PPP_COUNTER_CNT);
 
 	sock_fd = socket(AF_INET, SOCK_DGRAM, 0);
 	if (sock_fd < 0) {
@@ -799,7 +1023,7 @@ static void init(void)
 	load_config();
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
 
-	atexit(save_seq);
+	atexit(ppp_save_seq);
 }
 
 DEFINE_INIT(2, init);
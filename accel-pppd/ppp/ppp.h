@@ -60,6 +60,16 @@
 #define CTRL_TYPE_L2TP  2
 #define CTRL_TYPE_PPPOE 3
 
+/* session index keys, see ppp_index_find() for lookup key types */
+#define PPP_IDX_SESSIONID 0 // char *
+#define PPP_IDX_USERNAME  1 // char *
+#define PPP_IDX_IFNAME    2 // char *
+#define PPP_IDX_IFINDEX   3 // int *
+#define PPP_IDX_IPV4      4 // in_addr_t *, peer address
+#define PPP_IDX_IPV6      5 // struct in6_addr *, /64 of any address
+#define PPP_IDX_CSID      6 // char *, calling station id
+#define PPP_IDX_CNT       7
+
 #define MPPE_UNSET   -2
 #define MPPE_ALLOW   -1
 #define MPPE_DENY    0
@@ -70,6 +80,17 @@ struct ppp_t;
 
 struct ipv4db_item_t;
 struct ipv6db_item_t;
+struct ppp_ckpt_rec_t;
+struct ppp_handler_t;
+
+// open addressed by protocol, one slot is always left empty
+#define PPP_PROTO_TAB_SIZE 8
+
+struct ppp_proto_tab_t
+{
+	struct ppp_handler_t *h[PPP_PROTO_TAB_SIZE];
+	int overflow:1; // handlers didn't fit, the rest are only in the list
+};
 
 struct ppp_ctrl_t
 {
@@ -109,6 +130,7 @@ struct ppp_t
 	char sessionid[PPP_SESSIONID_LEN+1];
 	time_t start_time;
 	time_t stop_time;
+	struct timespec establish_ts; // monotonic, for latency histograms
 	char *username;
 	char *chargeable_identity;
 	struct ipv4db_item_t *ipv4;
@@ -128,12 +150,25 @@ struct ppp_t
 
 	struct list_head chan_handlers;
 	struct list_head unit_handlers;
+	struct ppp_proto_tab_t chan_tab;
+	struct ppp_proto_tab_t unit_tab;
 
 	struct list_head layers;
 	
 	struct ppp_lcp_t *lcp;
 
 	struct list_head pd_list;
+
+	struct list_head idx_entry[PPP_IDX_CNT];
+
+	struct ppp_ifcfg_t *ifcfg; // interface changes not sent yet
+	int ifcfg_up:1;
+	int restart_term; // terminated by ppp_hot_restart(), not a bit field as set by another context
+	int mtu; // 0 until set by ppp_ifcfg_mtu()
+	in_addr_t ifcfg_addr; // IPv4 address last set by ppp_ifcfg_addr4()
+	in_addr_t ifcfg_peer;
+
+	struct ppp_ckpt_rec_t *ckpt; // checkpoint record, NULL until first ppp_ckpt_set()
 };
 
 struct ppp_layer_t;
@@ -157,6 +192,8 @@ struct ppp_layer_t
 	int (*start)(struct ppp_layer_data_t*);
 	void (*finish)(struct ppp_layer_data_t*);
 	void (*free)(struct ppp_layer_data_t *);
+	// sets up negotiated state of a resumed session instead of start
+	int (*restore)(struct ppp_layer_data_t *, struct ppp_ckpt_rec_t *);
 };
 
 struct ppp_handler_t
@@ -208,8 +245,88 @@ extern int conf_single_session;
 extern pthread_rwlock_t ppp_lock;
 extern struct list_head ppp_list;
 
+void ppp_index_add(struct ppp_t *ppp);
+void ppp_index_del(struct ppp_t *ppp);
+void __ppp_index_update(struct ppp_t *ppp, int idx);
+void ppp_index_update(struct ppp_t *ppp, int idx);
+struct ppp_t *ppp_index_find(int idx, const void *key, struct ppp_t *prev);
+
+#define ppp_index_for_each(ppp, idx, key) \
+	for (ppp = ppp_index_find(idx, key, NULL); ppp; ppp = ppp_index_find(idx, key, ppp))
+
+struct in6_addr;
+void ppp_ifcfg_mtu(struct ppp_t *ppp, int mtu);
+void ppp_ifcfg_addr4(struct ppp_t *ppp, in_addr_t addr, in_addr_t peer);
+void ppp_ifcfg_addr6(struct ppp_t *ppp, const struct in6_addr *addr, int prefix_len);
+void ppp_ifcfg_route6(struct ppp_t *ppp, const struct in6_addr *dst, int prefix_len, const struct in6_addr *gw, int metric);
+int ppp_ifcfg_route4_del(const char *ifname, in_addr_t dst);
+int ppp_ifcfg_flush(struct ppp_t *ppp);
+int ppp_ifcfg_up(struct ppp_t *ppp);
+void ppp_ifcfg_commit(struct ppp_t *ppp);
+void ppp_ifcfg_free(struct ppp_t *ppp);
+
 extern struct ppp_stat_t ppp_stat;
 
+/*
+ * triton counters at ppp_counters + PPP_COUNTER_*. Latency histograms take
+ * PPP_LAT_BUCKETS counters, bucket i counts times below 2^i us, the last one
+ * counts the rest.
+ */
+#define PPP_LAT_BUCKETS       24
+#define PPP_COUNTER_RECV      0 // control frames read from channel and unit
+#define PPP_COUNTER_PROTO_REJ 1
+#define PPP_COUNTER_UNIT_HIT  2 // units taken from the unit cache
+#define PPP_COUNTER_UNIT_MISS 3
+#define PPP_COUNTER_ESTABLISH 4 // establish_ppp() time
+#define PPP_COUNTER_CONNECT   (PPP_COUNTER_ESTABLISH + PPP_LAT_BUCKETS) // establish_ppp() to interface up
+#define PPP_COUNTER_CNT       (PPP_COUNTER_CONNECT + PPP_LAT_BUCKETS)
+extern int ppp_counters;
+
+int ppp_unit_get(struct ppp_t *ppp);
+
+/*
+ * Session checkpoint, one fixed size slot of the checkpoint file per session.
+ * Core fields are written by ppp_ckpt_save() when the interface goes up,
+ * modules append their state as tagged blobs with ppp_ckpt_set().
+ */
+#define PPP_CKPT_USERNAME 1
+#define PPP_CKPT_LCP      2
+#define PPP_CKPT_PPPOE    3
+#define PPP_CKPT_RADIUS   4
+
+#define PPP_CKPT_ACTIVE   0x1
+
+struct ppp_ckpt_rec_t
+{
+	uint32_t flags;
+	int32_t ctrl_type;
+	int32_t fd;
+	int32_t chan_fd;
+	int32_t unit_fd;
+	int32_t chan_idx;
+	int32_t unit_idx;
+	int32_t ifindex;
+	int32_t mtu;
+	int64_t start_time;
+	in_addr_t addr;
+	in_addr_t peer_addr;
+	char ifname[PPP_IFNAME_LEN];
+	char sessionid[PPP_SESSIONID_LEN + 1];
+	uint16_t data_len;
+	uint8_t data[0] __attribute__((aligned(8)));
+};
+
+int ppp_ckpt_set(struct ppp_t *ppp, int tag, const void *data, int len);
+void *ppp_ckpt_get(struct ppp_ckpt_rec_t *rec, int tag, int *len);
+void ppp_ckpt_save(struct ppp_t *ppp);
+void ppp_ckpt_free(struct ppp_t *ppp);
+void ppp_ckpt_register(int ctrl_type, int (*restore)(struct ppp_ckpt_rec_t *));
+void ppp_ckpt_restore_done(int ok);
+int ppp_hot_restart(void);
+extern int ppp_restarting;
+int ppp_restore(struct ppp_t *ppp);
+void ppp_save_seq(void);
+
 extern int sock_fd; // internet socket for ioctls
 extern int sock6_fd; // internet socket for ioctls
 extern int urandom_fd;
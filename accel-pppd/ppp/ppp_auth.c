@@ -1,8 +1,6 @@
 #include <stdlib.h>
 #include <string.h>
 #include <arpa/inet.h>
-#include <sys/ioctl.h>
-#include <linux/route.h>
 
 #include "ppp.h"
 #include "ipdb.h"
@@ -31,6 +29,7 @@ static struct ppp_layer_data_t *auth_layer_init(struct ppp_t*);
 static int auth_layer_start(struct ppp_layer_data_t *);
 static void auth_layer_finish(struct ppp_layer_data_t *);
 static void auth_layer_free(struct ppp_layer_data_t *);
+static int auth_layer_restore(struct ppp_layer_data_t *, struct ppp_ckpt_rec_t *);
 
 static void __ppp_auth_started(struct ppp_t *ppp);
 
@@ -52,6 +51,7 @@ struct auth_layer_data_t
 
 static struct lcp_option_handler_t auth_opt_hnd = 
 {
+	.id = CI_AUTH,
 	.init = auth_init,
 	.send_conf_req = auth_send_conf_req,
 	.send_conf_nak = auth_send_conf_req,
@@ -69,6 +69,7 @@ static struct ppp_layer_t auth_layer =
 	.start = auth_layer_start,
 	.finish = auth_layer_finish,
 	.free = auth_layer_free,
+	.restore = auth_layer_restore,
 };
 
 static struct lcp_option_t *auth_init(struct ppp_lcp_t *lcp)
@@ -317,6 +318,14 @@ static void auth_layer_free(struct ppp_layer_data_t *ld)
 	_free(ad);
 }
 
+static int auth_layer_restore(struct ppp_layer_data_t *ld, struct ppp_ckpt_rec_t *rec)
+{
+	// authenticated by the previous process, re-authentication isn't resumed
+	ld->started = 1;
+
+	return 0;
+}
+
 static void ppp_terminate_sec(struct ppp_t *ppp)
 {
 	ppp_terminate(ppp, TERM_NAS_REQUEST, 0);
@@ -339,19 +348,8 @@ static void __ppp_auth_started(struct ppp_t *ppp)
 
 static void delete_route(struct ppp_t *ppp)
 {
-	struct rtentry rt;
-	struct sockaddr_in *addr;
-
-	if (ppp->ipv4) {
-		memset(&rt, 0, sizeof(rt));
-		addr = (struct sockaddr_in *)&rt.rt_dst;
-		addr->sin_family = AF_INET;
-		addr->sin_addr.s_addr = ppp->ipv4->peer_addr;
-		rt.rt_flags = RTF_HOST;
-		rt.rt_metric = 1; 
-
-		ioctl(sock_fd, SIOCDELRT, &rt);
-	}
+	if (ppp->ipv4)
+		ppp_ifcfg_route4_del(ppp->ifname, ppp->ipv4->peer_addr);
 }
 
 int __export ppp_auth_successed(struct ppp_t *ppp, char *username)
@@ -360,17 +358,15 @@ int __export ppp_auth_successed(struct ppp_t *ppp, char *username)
 	struct auth_layer_data_t *ad = container_of(ppp_find_layer_data(ppp, &auth_layer), typeof(*ad), ld);
 	
 	pthread_rwlock_rdlock(&ppp_lock);
-	list_for_each_entry(p, &ppp_list, entry) {
-		if (p->username && !strcmp(p->username, username)) {
-			if (conf_single_session == 0) {
-				pthread_rwlock_unlock(&ppp_lock);
-				log_ppp_info1("%s: second session denied\n", username);
-				return -1;
-			} else {
-				if (conf_single_session == 1) {
-					delete_route(p);
-					triton_context_call(p->ctrl->ctx, (triton_event_func)ppp_terminate_sec, p);
-				}
+	ppp_index_for_each(p, PPP_IDX_USERNAME, username) {
+		if (conf_single_session == 0) {
+			pthread_rwlock_unlock(&ppp_lock);
+			log_ppp_info1("%s: second session denied\n", username);
+			return -1;
+		} else {
+			if (conf_single_session == 1) {
+				delete_route(p);
+				triton_context_call(p->ctrl->ctx, (triton_event_func)ppp_terminate_sec, p);
 			}
 		}
 	}
@@ -378,6 +374,7 @@ int __export ppp_auth_successed(struct ppp_t *ppp, char *username)
 
 	pthread_rwlock_wrlock(&ppp_lock);
 	ppp->username = username;
+	__ppp_index_update(ppp, PPP_IDX_USERNAME);
 	pthread_rwlock_unlock(&ppp_lock);
 
 	triton_context_call(ppp->ctrl->ctx, (triton_event_func)__ppp_auth_started, ppp);
@@ -389,8 +386,10 @@ void __export ppp_auth_failed(struct ppp_t *ppp, char *username)
 {
 	if (username) {
 		pthread_rwlock_wrlock(&ppp_lock);
-		if (!ppp->username)
+		if (!ppp->username) {
 			ppp->username = _strdup(username);
+			__ppp_index_update(ppp, PPP_IDX_USERNAME);
+		}
 		pthread_rwlock_unlock(&ppp_lock);
 		log_ppp_info1("%s: authentication failed\n", username);
 		log_info1("%s: authentication failed\n", username);
@@ -31,6 +31,11 @@ static int conf_ccp_max_configure = 3;
 static struct ppp_layer_t ccp_layer;
 static LIST_HEAD(option_handlers);
 
+// option type to 1 + index in opt_tab of session, filled by ccp_option_register() only
+#define OPT_SLOT_ANY 0xff // several handlers or not in opt_tab, look in the list
+static uint8_t opt_slot[256];
+static int handler_cnt;
+
 static void ccp_layer_up(struct ppp_fsm_t*);
 static void ccp_layer_down(struct ppp_fsm_t*);
 static void ccp_layer_finished(struct ppp_fsm_t*);
@@ -47,6 +52,9 @@ static void ccp_options_init(struct ppp_ccp_t *ccp)
 {
 	struct ccp_option_t *lopt;
 	struct ccp_option_handler_t *h;
+	int i = 0;
+
+	memset(ccp->opt_tab, 0, sizeof(ccp->opt_tab));
 
 	ccp->conf_req_len = sizeof(struct ccp_hdr_t);
 
@@ -56,10 +64,31 @@ static void ccp_options_init(struct ppp_ccp_t *ccp)
 			lopt->h = h;
 			list_add_tail(&lopt->entry, &ccp->options);
 			ccp->conf_req_len += lopt->len;
+			if (i < CCP_OPT_TAB_SIZE)
+				ccp->opt_tab[i] = lopt;
 		}
+		i++;
 	}
 }
 
+static struct ccp_option_t *find_option(struct ppp_ccp_t *ccp, int id)
+{
+	struct ccp_option_t *lopt;
+	int slot = opt_slot[id];
+
+	if (slot != OPT_SLOT_ANY) {
+		lopt = slot ? ccp->opt_tab[slot - 1] : NULL;
+		return lopt && lopt->id == id ? lopt : NULL;
+	}
+
+	list_for_each_entry(lopt, &ccp->options, entry) {
+		if (lopt->id == id)
+			return lopt;
+	}
+
+	return NULL;
+}
+
 static void ccp_options_free(struct ppp_ccp_t *ccp)
 {
 	struct ccp_option_t *lopt;
@@ -69,6 +98,8 @@ static void ccp_options_free(struct ppp_ccp_t *ccp)
 		list_del(&lopt->entry);
 		lopt->h->free(ccp, lopt);
 	}
+
+	memset(ccp->opt_tab, 0, sizeof(ccp->opt_tab));
 }
 
 static int ccp_set_flags(int fd, int isopen, int isup)
@@ -161,6 +192,17 @@ int ccp_layer_start(struct ppp_layer_data_t *ld)
 	return 0;
 }
 
+static int ccp_layer_restore(struct ppp_layer_data_t *ld, struct ppp_ckpt_rec_t *rec)
+{
+	struct ppp_ccp_t *ccp = container_of(ld, typeof(*ccp), ld);
+
+	// sessions with compression aren't resumed, unit flags are kept as set
+	ccp->starting = 1;
+	ld->passive = 1;
+
+	return 0;
+}
+
 void ccp_layer_finish(struct ppp_layer_data_t *ld)
 {
 	struct ppp_ccp_t *ccp = container_of(ld, typeof(*ccp), ld);
@@ -406,25 +448,23 @@ static int ccp_recv_conf_req(struct ppp_ccp_t *ccp, uint8_t *data, int size)
 		log_ppp_info2("recv [CCP ConfReq id=%x", ccp->fsm.recv_id);
 
 	list_for_each_entry(ropt, &ccp->ropt_list, entry) {
-		list_for_each_entry(lopt, &ccp->options, entry) {
-			if (lopt->id == ropt->hdr->id) {
-				if (conf_ppp_verbose) {
-					log_ppp_info2(" ");
-					lopt->h->print(log_ppp_info2, lopt, (uint8_t*)ropt->hdr);
-				}
-				r = lopt->h->recv_conf_req(ccp, lopt, (uint8_t*)ropt->hdr);
-				if (ack) {
-					lopt->state = CCP_OPT_REJ;
-					ropt->state = CCP_OPT_REJ;
-				} else	{
-					lopt->state = r;
-					ropt->state = r;
-				}
-				ropt->lopt = lopt;
-				if (r < ret)
-					ret = r;
-				break;
+		lopt = find_option(ccp, ropt->hdr->id);
+		if (lopt) {
+			if (conf_ppp_verbose) {
+				log_ppp_info2(" ");
+				lopt->h->print(log_ppp_info2, lopt, (uint8_t*)ropt->hdr);
 			}
+			r = lopt->h->recv_conf_req(ccp, lopt, (uint8_t*)ropt->hdr);
+			if (ack) {
+				lopt->state = CCP_OPT_REJ;
+				ropt->state = CCP_OPT_REJ;
+			} else	{
+				lopt->state = r;
+				ropt->state = r;
+			}
+			ropt->lopt = lopt;
+			if (r < ret)
+				ret = r;
 		}
 		if (ropt->state == CCP_OPT_ACK || ropt->state == CCP_OPT_NAK)
 			ack = 1;
@@ -485,14 +525,12 @@ static int ccp_recv_conf_rej(struct ppp_ccp_t *ccp, uint8_t *data, int size)
 		if (!hdr->len || hdr->len > size)
 			break;
 
-		list_for_each_entry(lopt, &ccp->options, entry) {
-			if (lopt->id == hdr->id) {
-				if (!lopt->h->recv_conf_rej)
-					res = -1;
-				else if (lopt->h->recv_conf_rej(ccp, lopt, data))
-					res = -1;
-				break;
-			}
+		lopt = find_option(ccp, hdr->id);
+		if (lopt) {
+			if (!lopt->h->recv_conf_rej)
+				res = -1;
+			else if (lopt->h->recv_conf_rej(ccp, lopt, data))
+				res = -1;
 		}
 
 		data += hdr->len;
@@ -526,16 +564,14 @@ static int ccp_recv_conf_nak(struct ppp_ccp_t *ccp, uint8_t *data, int size)
 		if (!hdr->len || hdr->len > size)
 			break;
 
-		list_for_each_entry(lopt, &ccp->options, entry) {
-			if (lopt->id == hdr->id) {
-				if (conf_ppp_verbose) {
-					log_ppp_info2(" ");
-					lopt->h->print(log_ppp_info2, lopt, data);
-				}
-				if (lopt->h->recv_conf_nak && lopt->h->recv_conf_nak(ccp, lopt, data))
-					res = -1;
-				break;
+		lopt = find_option(ccp, hdr->id);
+		if (lopt) {
+			if (conf_ppp_verbose) {
+				log_ppp_info2(" ");
+				lopt->h->print(log_ppp_info2, lopt, data);
 			}
+			if (lopt->h->recv_conf_nak && lopt->h->recv_conf_nak(ccp, lopt, data))
+				res = -1;
 		}
 
 		data += hdr->len;
@@ -569,18 +605,14 @@ static int ccp_recv_conf_ack(struct ppp_ccp_t *ccp, uint8_t *data, int size)
 		if (!hdr->len || hdr->len > size)
 			break;
 
-		list_for_each_entry(lopt, &ccp->options, entry) {
-			if (lopt->id == hdr->id) {
-				if (conf_ppp_verbose) {
-					log_ppp_info2(" ");
-					lopt->h->print(log_ppp_info2,lopt,data);
-				}
-				if (!lopt->h->recv_conf_ack)
-					break;
-				if (lopt->h->recv_conf_ack(ccp, lopt, data))
-					res = -1;
-				break;
+		lopt = find_option(ccp, hdr->id);
+		if (lopt) {
+			if (conf_ppp_verbose) {
+				log_ppp_info2(" ");
+				lopt->h->print(log_ppp_info2,lopt,data);
 			}
+			if (lopt->h->recv_conf_ack && lopt->h->recv_conf_ack(ccp, lopt, data))
+				res = -1;
 		}
 
 		data += hdr->len;
@@ -749,6 +781,16 @@ int ccp_option_register(struct ccp_option_handler_t *h)
 		if (p->id==h->id) 
 			return -1;*/
 	
+	// handlers are registered on init, sessions only read opt_slot
+	if (!h->id)
+		memset(opt_slot, OPT_SLOT_ANY, sizeof(opt_slot));
+	else if (opt_slot[h->id] || handler_cnt >= CCP_OPT_TAB_SIZE)
+		opt_slot[h->id] = OPT_SLOT_ANY;
+	else
+		opt_slot[h->id] = handler_cnt + 1;
+
+	handler_cnt++;
+
 	list_add_tail(&h->entry,&option_handlers);
 
 	return 0;
@@ -784,6 +826,7 @@ static struct ppp_layer_t ccp_layer=
 	.start  = ccp_layer_start,
 	.finish = ccp_layer_finish,
 	.free   = ccp_layer_free,
+	.restore = ccp_layer_restore,
 };
 
 static void load_config(void)
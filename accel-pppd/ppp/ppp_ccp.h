@@ -60,6 +60,7 @@ struct ccp_option_t
 struct ccp_option_handler_t
 {
 	struct list_head entry;
+	int id; // option type, 0 - not known in advance
 	struct ccp_option_t* (*init)(struct ppp_ccp_t*);
 	int (*send_conf_req)(struct ppp_ccp_t*,struct ccp_option_t*,uint8_t*);
 	int (*send_conf_rej)(struct ppp_ccp_t*,struct ccp_option_t*,uint8_t*);
@@ -72,6 +73,8 @@ struct ccp_option_handler_t
 	void (*print)(void (*print)(const char *fmt,...), struct ccp_option_t*,uint8_t*);
 };
 
+#define CCP_OPT_TAB_SIZE 16
+
 struct ppp_ccp_t
 {
 	struct ppp_layer_data_t ld;
@@ -79,6 +82,7 @@ struct ppp_ccp_t
 	struct ppp_fsm_t fsm;
 	struct ppp_t *ppp;
 	struct list_head options;
+	struct ccp_option_t *opt_tab[CCP_OPT_TAB_SIZE]; // by handler, first ones registered
 
 	struct list_head ropt_list; // last received ConfReq
 	int ropt_len;
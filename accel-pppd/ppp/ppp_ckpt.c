@@ -0,0 +1,628 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "triton.h"
+#include "events.h"
+#include "log.h"
+#include "ppp.h"
+#include "ipdb.h"
+#include "spinlock.h"
+
+#include "memdebug.h"
+
+/*
+ * Session checkpoint file. It is a shared mapping of fixed size slots, slot 0
+ * is the header, a session takes a slot with the first ppp_ckpt_set() and
+ * updates it in place, so there is nothing to flush on restart.
+ *
+ * Hot restart keeps channel and unit descriptors of resumable sessions open
+ * across exec, the new process finds them by the records and hands them to
+ * restore hooks of their ctrl. The header token passed through environment
+ * tells records of the previous process from a stale file. Sessions which
+ * can't be resumed are terminated before exec, new ones are refused
+ * meanwhile by ppp_shutdown.
+ */
+
+#define CKPT_MAGIC     0x54504b43
+#define CKPT_VERSION   1
+#define CKPT_SLOT_SIZE 1024
+#define CKPT_DATA_SIZE (CKPT_SLOT_SIZE - sizeof(struct ppp_ckpt_rec_t))
+#define CKPT_ENV       "ACCEL_PPP_HOT_RESTART"
+#define CKPT_CTRL_MAX  4
+#define TERM_WAIT      30 // s, for sessions which can't be resumed to finish
+
+struct ckpt_hdr_t
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_size;
+	uint32_t slot_cnt;
+	uint64_t token;
+};
+
+struct ckpt_tlv_t
+{
+	uint16_t tag;
+	uint16_t len;
+	uint32_t reserved;
+	uint8_t data[0];
+};
+
+static int conf_slots = 65536;
+
+static struct ckpt_hdr_t *hdr;
+static size_t map_size;
+static int slot_cnt;
+
+// records are written under read lock, hot restart takes it for writing
+static pthread_rwlock_t ckpt_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint64_t *slot_map;
+static int slot_next;
+static spinlock_t slot_lock;
+
+static int (*restore_hooks[CKPT_CTRL_MAX])(struct ppp_ckpt_rec_t *);
+static int restore_pending;
+static int restore_cnt;
+
+int __export ppp_restarting;
+static struct triton_context_t *restart_ctx;
+static struct triton_timer_t restart_timer;
+
+static inline struct ppp_ckpt_rec_t *slot_rec(int i)
+{
+	return (struct ppp_ckpt_rec_t *)((uint8_t *)hdr + (size_t)i * CKPT_SLOT_SIZE);
+}
+
+static inline int rec_slot(struct ppp_ckpt_rec_t *rec)
+{
+	return ((uint8_t *)rec - (uint8_t *)hdr) / CKPT_SLOT_SIZE;
+}
+
+static inline int tlv_size(int len)
+{
+	return (sizeof(struct ckpt_tlv_t) + len + 7) & ~7;
+}
+
+static int slot_alloc(void)
+{
+	int i, n;
+
+	spin_lock(&slot_lock);
+	for (n = 0; n < slot_cnt; n++) {
+		i = slot_next;
+		if (++slot_next > slot_cnt)
+			slot_next = 1;
+		if (!(slot_map[i >> 6] & (1ull << (i & 63)))) {
+			slot_map[i >> 6] |= 1ull << (i & 63);
+			spin_unlock(&slot_lock);
+			return i;
+		}
+	}
+	spin_unlock(&slot_lock);
+
+	return 0;
+}
+
+static void slot_free(int i)
+{
+	spin_lock(&slot_lock);
+	slot_map[i >> 6] &= ~(1ull << (i & 63));
+	spin_unlock(&slot_lock);
+}
+
+static struct ckpt_tlv_t *tlv_find(struct ppp_ckpt_rec_t *rec, int tag)
+{
+	struct ckpt_tlv_t *t;
+	int pos = 0;
+
+	while (pos + sizeof(*t) <= rec->data_len) {
+		t = (struct ckpt_tlv_t *)(rec->data + pos);
+		if (t->tag == tag)
+			return t;
+		pos += tlv_size(t->len);
+	}
+
+	return NULL;
+}
+
+/*
+ * Stores a blob of the session, replaces previous one with the same tag.
+ * Returns -1 if checkpointing is disabled or the slot is full.
+ */
+int __export ppp_ckpt_set(struct ppp_t *ppp, int tag, const void *data, int len)
+{
+	struct ppp_ckpt_rec_t *rec;
+	struct ckpt_tlv_t *t;
+	int i, sz, r = -1;
+
+	if (!hdr)
+		return -1;
+
+	pthread_rwlock_rdlock(&ckpt_lock);
+
+	if (!ppp->ckpt) {
+		i = slot_alloc();
+		if (!i) {
+			log_ppp_warn("ppp: checkpoint: no free slots\n");
+			goto out;
+		}
+		rec = slot_rec(i);
+		memset(rec, 0, sizeof(*rec));
+		ppp->ckpt = rec;
+	} else
+		rec = ppp->ckpt;
+
+	t = tlv_find(rec, tag);
+	if (t && t->len == len) {
+		memcpy(t->data, data, len);
+		r = 0;
+		goto out;
+	}
+
+	if (t) {
+		sz = tlv_size(t->len);
+		memmove(t, (uint8_t *)t + sz, rec->data + rec->data_len - ((uint8_t *)t + sz));
+		rec->data_len -= sz;
+	}
+
+	if (rec->data_len + tlv_size(len) > CKPT_DATA_SIZE) {
+		log_ppp_warn("ppp: checkpoint: record is full\n");
+		goto out;
+	}
+
+	t = (struct ckpt_tlv_t *)(rec->data + rec->data_len);
+	t->tag = tag;
+	t->len = len;
+	t->reserved = 0;
+	memcpy(t->data, data, len);
+	rec->data_len += tlv_size(len);
+	r = 0;
+
+out:
+	pthread_rwlock_unlock(&ckpt_lock);
+
+	return r;
+}
+
+void __export *ppp_ckpt_get(struct ppp_ckpt_rec_t *rec, int tag, int *len)
+{
+	struct ckpt_tlv_t *t;
+
+	if (!rec)
+		return NULL;
+
+	t = tlv_find(rec, tag);
+	if (!t)
+		return NULL;
+
+	if (len)
+		*len = t->len;
+
+	return t->data;
+}
+
+/* Called when the interface goes up, the record becomes eligible for resume */
+void ppp_ckpt_save(struct ppp_t *ppp)
+{
+	struct ppp_ckpt_rec_t *rec;
+
+	if (!hdr)
+		return;
+
+	if (ppp_ckpt_set(ppp, PPP_CKPT_USERNAME, ppp->username ? ppp->username : "", ppp->username ? strlen(ppp->username) : 0))
+		return;
+
+	rec = ppp->ckpt;
+
+	pthread_rwlock_rdlock(&ckpt_lock);
+	rec->ctrl_type = ppp->ctrl->type;
+	rec->fd = ppp->fd;
+	rec->chan_fd = ppp->chan_fd;
+	rec->unit_fd = ppp->unit_fd;
+	rec->chan_idx = ppp->chan_idx;
+	rec->unit_idx = ppp->unit_idx;
+	rec->ifindex = ppp->ifindex;
+	rec->mtu = ppp->mtu;
+	rec->start_time = ppp->start_time;
+	rec->addr = ppp->ipv4 ? ppp->ipv4->addr : 0;
+	rec->peer_addr = ppp->ipv4 ? ppp->ipv4->peer_addr : 0;
+	memcpy(rec->ifname, ppp->ifname, PPP_IFNAME_LEN);
+	memcpy(rec->sessionid, ppp->sessionid, PPP_SESSIONID_LEN + 1);
+	rec->flags |= PPP_CKPT_ACTIVE;
+	pthread_rwlock_unlock(&ckpt_lock);
+}
+
+void ppp_ckpt_free(struct ppp_t *ppp)
+{
+	if (!ppp->ckpt)
+		return;
+
+	pthread_rwlock_rdlock(&ckpt_lock);
+	ppp->ckpt->flags = 0;
+	ppp->ckpt->data_len = 0;
+	slot_free(rec_slot(ppp->ckpt));
+	pthread_rwlock_unlock(&ckpt_lock);
+
+	ppp->ckpt = NULL;
+}
+
+void __export ppp_ckpt_register(int ctrl_type, int (*restore)(struct ppp_ckpt_rec_t *))
+{
+	if (ctrl_type < CKPT_CTRL_MAX)
+		restore_hooks[ctrl_type] = restore;
+}
+
+/* Called by ppp_restore() for every record handed to a restore hook */
+void ppp_ckpt_restore_done(int ok)
+{
+	if (ok)
+		__sync_add_and_fetch(&restore_cnt, 1);
+
+	if (__sync_sub_and_fetch(&restore_pending, 1))
+		return;
+
+	log_info1("ppp: hot restart: %i sessions resumed\n", restore_cnt);
+
+	ipdb_restore_end();
+}
+
+static int resumable(struct ppp_t *ppp)
+{
+	if (ppp->state != PPP_STATE_ACTIVE || ppp->terminating)
+		return 0;
+
+	if (!ppp->ckpt || !(ppp->ckpt->flags & PPP_CKPT_ACTIVE))
+		return 0;
+
+	if (ppp->ctrl->type >= CKPT_CTRL_MAX || !restore_hooks[ppp->ctrl->type])
+		return 0;
+
+	// ND/DHCPv6 state and MPPE keys are not checkpointed
+	if (ppp->ipv6 || ppp->comp)
+		return 0;
+
+	return 1;
+}
+
+static void set_cloexec(int fd, int on)
+{
+	int flags = fcntl(fd, F_GETFD);
+
+	fcntl(fd, F_SETFD, on ? flags | FD_CLOEXEC : flags & ~FD_CLOEXEC);
+}
+
+static char **read_cmdline(void)
+{
+	char *buf, **argv;
+	int fd, n, len = 0, i, argc = 0;
+
+	fd = open("/proc/self/cmdline", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	buf = _malloc(PATH_MAX * 4);
+	while (len < PATH_MAX * 4 - 1) {
+		n = read(fd, buf + len, PATH_MAX * 4 - 1 - len);
+		if (n <= 0)
+			break;
+		len += n;
+	}
+	close(fd);
+
+	buf[len] = 0;
+
+	for (i = 0; i < len; i++) {
+		if (!buf[i])
+			argc++;
+	}
+
+	if (!argc) {
+		_free(buf);
+		return NULL;
+	}
+
+	argv = _malloc((argc + 1) * sizeof(*argv));
+	for (i = 0, n = 0; n < argc; n++) {
+		argv[n] = buf + i;
+		i += strlen(buf + i) + 1;
+	}
+	argv[argc] = NULL;
+
+	return argv;
+}
+
+static void restart_terminate(struct ppp_t *ppp)
+{
+	ppp_terminate(ppp, TERM_NAS_REBOOT, 0);
+}
+
+static void restart_timer_func(struct triton_timer_t *t)
+{
+	triton_context_wakeup(restart_ctx);
+}
+
+/* Must be called with ppp_lock held, returns number of sessions left to finish */
+static int terminate_unresumable(int *term)
+{
+	struct ppp_t *ppp;
+	int n = 0;
+
+	list_for_each_entry(ppp, &ppp_list, entry) {
+		if (resumable(ppp))
+			continue;
+
+		n++;
+
+		if (!ppp->restart_term) {
+			ppp->restart_term = 1;
+			triton_context_call(ppp->ctrl->ctx, (triton_event_func)restart_terminate, ppp);
+			(*term)++;
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Re-executes the daemon keeping resumable sessions. Others are terminated
+ * first, the caller's context sleeps until they finish. Returns only on
+ * error or if they didn't finish in TERM_WAIT seconds.
+ */
+int __export ppp_hot_restart(void)
+{
+	struct ppp_t *ppp;
+	char exe[PATH_MAX], env[32], *p;
+	char **argv;
+	uint64_t token;
+	int i, n, cnt = 0, term = 0;
+
+	if (!hdr) {
+		log_error("ppp: hot restart: checkpoint-file is not configured\n");
+		return -1;
+	}
+
+	if (ppp_shutdown || ppp_restarting) {
+		log_error("ppp: hot restart: shutdown or restart is in progress\n");
+		return -1;
+	}
+
+	n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (n < 0) {
+		log_error("ppp: hot restart: readlink: %s\n", strerror(errno));
+		return -1;
+	}
+	exe[n] = 0;
+
+	// binary was upgraded, run the new one
+	p = strstr(exe, " (deleted)");
+	if (p && !p[10])
+		*p = 0;
+
+	argv = read_cmdline();
+	if (!argv) {
+		log_error("ppp: hot restart: failed to read command line\n");
+		return -1;
+	}
+
+	if (read(urandom_fd, &token, sizeof(token)) != sizeof(token)) {
+		log_error("ppp: hot restart: read urandom: %s\n", strerror(errno));
+		goto out_free;
+	}
+
+	ppp_restarting = 1;
+	ppp_shutdown = 1;
+	restart_ctx = triton_context_self();
+	restart_timer.expire = restart_timer_func;
+	restart_timer.period = 1000;
+	triton_timer_add(NULL, &restart_timer, 0);
+
+	for (i = 0; ; i++) {
+		pthread_rwlock_rdlock(&ppp_lock);
+		n = terminate_unresumable(&term);
+		if (!n || i == TERM_WAIT)
+			break;
+		pthread_rwlock_unlock(&ppp_lock);
+
+		if (!i)
+			log_info1("ppp: hot restart: terminating %i sessions which can't be resumed\n", n);
+
+		triton_context_schedule();
+	}
+
+	triton_timer_del(&restart_timer);
+
+	if (n) {
+		pthread_rwlock_unlock(&ppp_lock);
+		log_error("ppp: hot restart: %i sessions which can't be resumed didn't finish, restart refused\n", n);
+		goto out_restart;
+	}
+
+	pthread_rwlock_wrlock(&ckpt_lock);
+
+	// everything left is resumable
+	list_for_each_entry(ppp, &ppp_list, entry) {
+		set_cloexec(ppp->fd, 0);
+		set_cloexec(ppp->chan_fd, 0);
+		set_cloexec(ppp->unit_fd, 0);
+		cnt++;
+	}
+
+	hdr->token = token;
+
+	ppp_save_seq();
+
+	log_info1("ppp: hot restart: %i sessions to resume, %i terminated\n", cnt, term);
+
+	sprintf(env, "%llx", (unsigned long long)token);
+	setenv(CKPT_ENV, env, 1);
+
+	execv(exe, argv);
+
+	log_error("ppp: hot restart: exec %s: %s\n", exe, strerror(errno));
+
+	unsetenv(CKPT_ENV);
+	hdr->token = 0;
+
+	list_for_each_entry(ppp, &ppp_list, entry) {
+		set_cloexec(ppp->fd, 1);
+		set_cloexec(ppp->chan_fd, 1);
+		set_cloexec(ppp->unit_fd, 1);
+	}
+
+	pthread_rwlock_unlock(&ckpt_lock);
+	pthread_rwlock_unlock(&ppp_lock);
+
+out_restart:
+	ppp_shutdown = 0;
+	ppp_restarting = 0;
+
+out_free:
+	_free(argv[0]);
+	_free(argv);
+
+	return -1;
+}
+
+static void rec_drop(struct ppp_ckpt_rec_t *rec)
+{
+	close(rec->fd);
+	close(rec->chan_fd);
+	close(rec->unit_fd);
+
+	rec->flags = 0;
+	rec->data_len = 0;
+	slot_free(rec_slot(rec));
+}
+
+static void restore_sessions(void)
+{
+	struct ppp_ckpt_rec_t *rec;
+	int (*restore)(struct ppp_ckpt_rec_t *);
+	int i, n = 0;
+
+	for (i = 1; i <= slot_cnt; i++) {
+		rec = slot_rec(i);
+		if (rec->flags & PPP_CKPT_ACTIVE)
+			slot_map[i >> 6] |= 1ull << (i & 63);
+	}
+
+	// hold off completion until every record is dispatched
+	restore_pending = 1;
+
+	for (i = 1; i <= slot_cnt; i++) {
+		rec = slot_rec(i);
+		if (!(rec->flags & PPP_CKPT_ACTIVE))
+			continue;
+
+		n++;
+
+		restore = rec->ctrl_type >= 0 && rec->ctrl_type < CKPT_CTRL_MAX ? restore_hooks[rec->ctrl_type] : NULL;
+
+		__sync_add_and_fetch(&restore_pending, 1);
+		if (!restore || restore(rec)) {
+			log_warn("ppp: hot restart: failed to resume %s\n", rec->ifname);
+			rec_drop(rec);
+			__sync_sub_and_fetch(&restore_pending, 1);
+		}
+	}
+
+	log_info1("ppp: hot restart: %i sessions in checkpoint\n", n);
+
+	ppp_ckpt_restore_done(0);
+}
+
+static int open_file(const char *fname, int *hot)
+{
+	struct ckpt_hdr_t h;
+	char *env;
+	int fd, n;
+
+	fd = open(fname, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		log_emerg("ppp: checkpoint: open %s: %s\n", fname, strerror(errno));
+		return -1;
+	}
+
+	env = getenv(CKPT_ENV);
+
+	n = pread(fd, &h, sizeof(h), 0);
+	*hot = env && n == sizeof(h) && h.magic == CKPT_MAGIC && h.version == CKPT_VERSION &&
+		h.slot_size == CKPT_SLOT_SIZE && h.slot_cnt == conf_slots &&
+		strtoull(env, NULL, 16) == h.token;
+
+	if (env)
+		unsetenv(CKPT_ENV);
+
+	if (!*hot && ftruncate(fd, 0)) {
+		log_emerg("ppp: checkpoint: truncate %s: %s\n", fname, strerror(errno));
+		goto out_err;
+	}
+
+	map_size = (size_t)(conf_slots + 1) * CKPT_SLOT_SIZE;
+
+	// sparse, only slots of live sessions take space
+	if (ftruncate(fd, map_size)) {
+		log_emerg("ppp: checkpoint: truncate %s: %s\n", fname, strerror(errno));
+		goto out_err;
+	}
+
+	hdr = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		log_emerg("ppp: checkpoint: mmap %s: %s\n", fname, strerror(errno));
+		hdr = NULL;
+		goto out_err;
+	}
+
+	close(fd);
+
+	hdr->magic = CKPT_MAGIC;
+	hdr->version = CKPT_VERSION;
+	hdr->slot_size = CKPT_SLOT_SIZE;
+	hdr->slot_cnt = conf_slots;
+	hdr->token = 0;
+
+	return 0;
+
+out_err:
+	close(fd);
+	return -1;
+}
+
+static void init(void)
+{
+	const char *fname, *opt;
+	int hot;
+
+	spinlock_init(&slot_lock);
+
+	fname = conf_get_opt("ppp", "checkpoint-file");
+	if (!fname)
+		return;
+
+	opt = conf_get_opt("ppp", "checkpoint-slots");
+	if (opt && atoi(opt) > 0)
+		conf_slots = (atoi(opt) + 63) & ~63;
+
+	if (open_file(fname, &hot))
+		return;
+
+	slot_cnt = conf_slots;
+	slot_next = 1;
+	slot_map = _malloc((slot_cnt / 64 + 1) * sizeof(uint64_t));
+	memset(slot_map, 0, (slot_cnt / 64 + 1) * sizeof(uint64_t));
+
+	if (hot)
+		restore_sessions();
+}
+
+// after all ctrl modules registered their restore hooks
+DEFINE_INIT(1000, init);
@@ -0,0 +1,463 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+
+#include "triton.h"
+#include "log.h"
+#include "ppp.h"
+#include "mempool.h"
+#include "libnetlink.h"
+
+#include "memdebug.h"
+
+/*
+ * Interface configuration of sessions goes through rtnetlink instead of
+ * one ioctl per change. Changes made while a session negotiates are queued
+ * and sent by one sendmsg() when the interface comes up, later changes are
+ * sent as soon as their caller is done.
+ *
+ * Every worker thread has its own netlink socket. Requests don't ask for
+ * acks, the kernel answers only on failures and the answers are read by the
+ * channel's context, so a sender never waits. Sequence numbers of recent
+ * requests are kept to name the interface in error messages, a slot is
+ * invalidated before it is rewritten and the reader checks it on both sides
+ * of the copy.
+ *
+ * Channels live as long as the process: the thread owning one may still
+ * send after its context has been closed on shutdown.
+ */
+
+#define IFCFG_BUF_SIZE 2048
+#define IFCFG_MAX_MSG 32
+#define PENDING_BITS 8
+#define PENDING_SIZE (1 << PENDING_BITS)
+
+struct ppp_ifcfg_t
+{
+	int len;
+	int cnt;
+	int mtu; // 0 - unchanged
+	const char *op[IFCFG_MAX_MSG];
+	uint8_t buf[IFCFG_BUF_SIZE];
+};
+
+struct pending_t
+{
+	uint32_t seq;
+	char ifname[PPP_IFNAME_LEN];
+	const char *op;
+};
+
+struct nl_chan_t
+{
+	struct triton_context_t ctx;
+	struct triton_md_handler_t hnd;
+	uint32_t seq;
+	struct pending_t pending[PENDING_SIZE];
+};
+
+static __thread struct nl_chan_t *chan;
+static mempool_t ifcfg_pool;
+
+static int chan_read(struct triton_md_handler_t *h)
+{
+	struct nl_chan_t *c = container_of(h, typeof(*c), hnd);
+	struct pending_t *p;
+	struct nlmsghdr *nh;
+	struct nlmsgerr *err;
+	char ifname[PPP_IFNAME_LEN];
+	const char *op;
+	char buf[8192];
+	int n;
+
+	while (1) {
+		n = recv(h->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			if (errno == ENOBUFS) {
+				log_warn("ppp: netlink: some replies were lost\n");
+				continue;
+			}
+			log_error("ppp: netlink: recv: %s\n", strerror(errno));
+			return 0;
+		}
+
+		for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, n); nh = NLMSG_NEXT(nh, n)) {
+			if (nh->nlmsg_type != NLMSG_ERROR)
+				continue;
+			err = NLMSG_DATA(nh);
+			if (!err->error)
+				continue;
+
+			p = &c->pending[nh->nlmsg_seq & (PENDING_SIZE - 1)];
+			if (__atomic_load_n(&p->seq, __ATOMIC_ACQUIRE) == nh->nlmsg_seq) {
+				memcpy(ifname, p->ifname, sizeof(ifname));
+				ifname[sizeof(ifname) - 1] = 0;
+				op = p->op;
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if (__atomic_load_n(&p->seq, __ATOMIC_RELAXED) == nh->nlmsg_seq) {
+					log_error("ppp: %s: netlink: %s: %s\n", ifname, op, strerror(-err->error));
+					continue;
+				}
+			}
+			log_error("ppp: netlink: %s\n", strerror(-err->error));
+		}
+	}
+}
+
+/* Runs on any thread, so the owner's chan and the socket are left alone */
+static void chan_close(struct triton_context_t *ctx)
+{
+	struct nl_chan_t *c = container_of(ctx, typeof(*c), ctx);
+
+	triton_md_unregister_handler(&c->hnd);
+	triton_context_unregister(ctx);
+}
+
+static struct nl_chan_t *chan_get(void)
+{
+	struct sockaddr_nl addr;
+	struct nl_chan_t *c;
+	int fd;
+
+	if (chan)
+		return chan;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC | SOCK_NONBLOCK, NETLINK_ROUTE);
+	if (fd < 0) {
+		log_error("ppp: netlink: socket: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		log_error("ppp: netlink: bind: %s\n", strerror(errno));
+		close(fd);
+		return NULL;
+	}
+
+	c = _malloc(sizeof(*c));
+	memset(c, 0, sizeof(*c));
+
+	c->ctx.close = chan_close;
+	c->hnd.fd = fd;
+	c->hnd.read = chan_read;
+
+	triton_context_register(&c->ctx, NULL);
+	triton_md_register_handler(&c->ctx, &c->hnd);
+	triton_md_enable_handler(&c->hnd, MD_MODE_READ);
+	triton_context_wakeup(&c->ctx);
+
+	chan = c;
+
+	return c;
+}
+
+/* Numbers messages of buf and sends them at once */
+static int chan_send(const char *ifname, uint8_t *buf, int len, const char **op)
+{
+	struct nl_chan_t *c = chan_get();
+	struct sockaddr_nl addr;
+	struct nlmsghdr *nh;
+	struct pending_t *p;
+	struct iovec iov = {
+		.iov_base = buf,
+		.iov_len = len,
+	};
+	struct msghdr msg = {
+		.msg_name = &addr,
+		.msg_namelen = sizeof(addr),
+		.msg_iov = &iov,
+		.msg_iovlen = 1,
+	};
+	int i = 0;
+
+	if (!c)
+		return -1;
+
+	for (nh = (struct nlmsghdr *)buf; NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+		if (!++c->seq)
+			++c->seq;
+		nh->nlmsg_seq = c->seq;
+		p = &c->pending[nh->nlmsg_seq & (PENDING_SIZE - 1)];
+		__atomic_store_n(&p->seq, 0, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		strcpy(p->ifname, ifname);
+		p->op = op[i++];
+		__atomic_store_n(&p->seq, nh->nlmsg_seq, __ATOMIC_RELEASE);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (sendmsg(c->hnd.fd, &msg, 0) < 0) {
+		log_error("ppp: %s: netlink: sendmsg: %s\n", ifname, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static struct ppp_ifcfg_t *ifcfg_get(struct ppp_t *ppp)
+{
+	if (!ppp->ifcfg) {
+		ppp->ifcfg = mempool_alloc(ifcfg_pool);
+		if (!ppp->ifcfg)
+			return NULL;
+		ppp->ifcfg->len = 0;
+		ppp->ifcfg->cnt = 0;
+		ppp->ifcfg->mtu = 0;
+	}
+
+	return ppp->ifcfg;
+}
+
+static struct nlmsghdr *msg_add(struct ppp_t *ppp, int type, int flags, const void *data, int len, const char *op)
+{
+	struct ppp_ifcfg_t *cfg = ifcfg_get(ppp);
+	struct nlmsghdr *nh;
+
+	if (!cfg)
+		return NULL;
+
+	// attributes take at most a few hundred bytes, send what we have if out of space
+	if (cfg->cnt == IFCFG_MAX_MSG || cfg->len + NLMSG_SPACE(len) + 256 > IFCFG_BUF_SIZE) {
+		if (ppp_ifcfg_flush(ppp))
+			return NULL;
+		return msg_add(ppp, type, flags, data, len, op);
+	}
+
+	nh = (struct nlmsghdr *)(cfg->buf + cfg->len);
+	memset(nh, 0, NLMSG_SPACE(len));
+	nh->nlmsg_len = NLMSG_LENGTH(len);
+	nh->nlmsg_type = type;
+	nh->nlmsg_flags = NLM_F_REQUEST | flags;
+	memcpy(NLMSG_DATA(nh), data, len);
+
+	cfg->op[cfg->cnt++] = op;
+
+	return nh;
+}
+
+static void msg_end(struct ppp_t *ppp, struct nlmsghdr *nh)
+{
+	ppp->ifcfg->len += NLMSG_ALIGN(nh->nlmsg_len);
+}
+
+static int link_msg(struct nlmsghdr *nh, int maxlen, int ifindex, int mtu, int up)
+{
+	struct ifinfomsg *ifi = NLMSG_DATA(nh);
+
+	memset(nh, 0, NLMSG_SPACE(sizeof(*ifi)));
+	nh->nlmsg_len = NLMSG_LENGTH(sizeof(*ifi));
+	nh->nlmsg_type = RTM_NEWLINK;
+	nh->nlmsg_flags = NLM_F_REQUEST;
+
+	ifi->ifi_family = AF_UNSPEC;
+	ifi->ifi_index = ifindex;
+	if (up) {
+		ifi->ifi_flags = IFF_UP;
+		ifi->ifi_change = IFF_UP;
+	}
+
+	if (mtu)
+		addattr32(nh, maxlen, IFLA_MTU, mtu);
+
+	return NLMSG_ALIGN(nh->nlmsg_len);
+}
+
+void __export ppp_ifcfg_mtu(struct ppp_t *ppp, int mtu)
+{
+	struct ppp_ifcfg_t *cfg = ifcfg_get(ppp);
+
+	ppp->mtu = mtu;
+
+	if (cfg)
+		cfg->mtu = mtu;
+}
+
+void __export ppp_ifcfg_addr4(struct ppp_t *ppp, in_addr_t addr, in_addr_t peer)
+{
+	struct ifaddrmsg ifa = {
+		.ifa_family = AF_INET,
+		.ifa_prefixlen = 32,
+		.ifa_scope = RT_SCOPE_UNIVERSE,
+		.ifa_index = ppp->ifindex,
+	};
+	struct nlmsghdr *nh;
+
+	// NLM_F_REPLACE only matches the same local/peer pair, a new pair would be added aside
+	if (ppp->ifcfg_addr && (ppp->ifcfg_addr != addr || ppp->ifcfg_peer != peer)) {
+		nh = msg_add(ppp, RTM_DELADDR, 0, &ifa, sizeof(ifa), "delete IPv4 address");
+		if (!nh)
+			return;
+
+		addattr_l(nh, IFCFG_BUF_SIZE, IFA_LOCAL, &ppp->ifcfg_addr, sizeof(ppp->ifcfg_addr));
+		addattr_l(nh, IFCFG_BUF_SIZE, IFA_ADDRESS, &ppp->ifcfg_peer, sizeof(ppp->ifcfg_peer));
+		msg_end(ppp, nh);
+	}
+
+	nh = msg_add(ppp, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, &ifa, sizeof(ifa), "set IPv4 address");
+	if (!nh)
+		return;
+
+	addattr_l(nh, IFCFG_BUF_SIZE, IFA_LOCAL, &addr, sizeof(addr));
+	addattr_l(nh, IFCFG_BUF_SIZE, IFA_ADDRESS, &peer, sizeof(peer));
+	msg_end(ppp, nh);
+
+	ppp->ifcfg_addr = addr;
+	ppp->ifcfg_peer = peer;
+}
+
+void __export ppp_ifcfg_addr6(struct ppp_t *ppp, const struct in6_addr *addr, int prefix_len)
+{
+	struct ifaddrmsg ifa = {
+		.ifa_family = AF_INET6,
+		.ifa_prefixlen = prefix_len,
+		.ifa_scope = IN6_IS_ADDR_LINKLOCAL(addr) ? RT_SCOPE_LINK : RT_SCOPE_UNIVERSE,
+		.ifa_index = ppp->ifindex,
+	};
+	struct nlmsghdr *nh;
+
+	nh = msg_add(ppp, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, &ifa, sizeof(ifa), "set IPv6 address");
+	if (!nh)
+		return;
+
+	addattr_l(nh, IFCFG_BUF_SIZE, IFA_LOCAL, addr, sizeof(*addr));
+	msg_end(ppp, nh);
+}
+
+void __export ppp_ifcfg_route6(struct ppp_t *ppp, const struct in6_addr *dst, int prefix_len, const struct in6_addr *gw, int metric)
+{
+	struct rtmsg rtm = {
+		.rtm_family = AF_INET6,
+		.rtm_dst_len = prefix_len,
+		.rtm_table = RT_TABLE_MAIN,
+		.rtm_protocol = RTPROT_BOOT,
+		.rtm_scope = RT_SCOPE_UNIVERSE,
+		.rtm_type = RTN_UNICAST,
+	};
+	struct nlmsghdr *nh;
+
+	nh = msg_add(ppp, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL, &rtm, sizeof(rtm), "add IPv6 route");
+	if (!nh)
+		return;
+
+	addattr_l(nh, IFCFG_BUF_SIZE, RTA_DST, dst, sizeof(*dst));
+	addattr32(nh, IFCFG_BUF_SIZE, RTA_OIF, ppp->ifindex);
+	addattr32(nh, IFCFG_BUF_SIZE, RTA_PRIORITY, metric);
+	if (gw)
+		addattr_l(nh, IFCFG_BUF_SIZE, RTA_GATEWAY, gw, sizeof(*gw));
+	msg_end(ppp, nh);
+}
+
+/* Host route of some other session, so it isn't queued */
+int __export ppp_ifcfg_route4_del(const char *ifname, in_addr_t dst)
+{
+	struct {
+		struct nlmsghdr n;
+		struct rtmsg r;
+		char buf[64];
+	} req;
+	const char *op = "delete IPv4 route";
+
+	memset(&req, 0, sizeof(req));
+	req.n.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtmsg));
+	req.n.nlmsg_type = RTM_DELROUTE;
+	req.n.nlmsg_flags = NLM_F_REQUEST;
+	req.r.rtm_family = AF_INET;
+	req.r.rtm_dst_len = 32;
+	req.r.rtm_table = RT_TABLE_MAIN;
+	req.r.rtm_scope = RT_SCOPE_NOWHERE;
+
+	addattr_l(&req.n, sizeof(req), RTA_DST, &dst, sizeof(dst));
+
+	return chan_send(ifname, (uint8_t *)&req, req.n.nlmsg_len, &op);
+}
+
+/*
+ * Sends everything queued, link-up goes last. MTU is applied first, so that
+ * IPv6 addresses aren't refused for a link created with a small MTU.
+ */
+static int __ppp_ifcfg_flush(struct ppp_t *ppp, int up)
+{
+	struct ppp_ifcfg_t *cfg = ppp->ifcfg;
+	uint8_t buf[IFCFG_BUF_SIZE + 2 * NLMSG_SPACE(sizeof(struct ifinfomsg) + 64)];
+	const char *op[IFCFG_MAX_MSG + 2];
+	int len = 0, cnt = 0, r;
+
+	if (!cfg && !up)
+		return 0;
+
+	if (cfg && cfg->mtu) {
+		len += link_msg((struct nlmsghdr *)buf, sizeof(buf), ppp->ifindex, cfg->mtu, 0);
+		op[cnt++] = "set MTU";
+	}
+
+	if (cfg && cfg->cnt) {
+		memcpy(buf + len, cfg->buf, cfg->len);
+		memcpy(op + cnt, cfg->op, cfg->cnt * sizeof(*op));
+		len += cfg->len;
+		cnt += cfg->cnt;
+	}
+
+	if (up) {
+		len += link_msg((struct nlmsghdr *)(buf + len), sizeof(buf) - len, ppp->ifindex, 0, 1);
+		op[cnt++] = "set link up";
+	}
+
+	if (cfg) {
+		mempool_free(cfg);
+		ppp->ifcfg = NULL;
+	}
+
+	if (!cnt)
+		return 0;
+
+	r = chan_send(ppp->ifname, buf, len, op);
+	if (!r && up)
+		ppp->ifcfg_up = 1;
+
+	return r;
+}
+
+int __export ppp_ifcfg_flush(struct ppp_t *ppp)
+{
+	return __ppp_ifcfg_flush(ppp, 0);
+}
+
+int __export ppp_ifcfg_up(struct ppp_t *ppp)
+{
+	return __ppp_ifcfg_flush(ppp, 1);
+}
+
+/* Sends queued changes if the interface is up already, otherwise they go with ppp_ifcfg_up() */
+void __export ppp_ifcfg_commit(struct ppp_t *ppp)
+{
+	if (ppp->ifcfg_up)
+		__ppp_ifcfg_flush(ppp, 0);
+}
+
+void ppp_ifcfg_free(struct ppp_t *ppp)
+{
+	if (ppp->ifcfg) {
+		mempool_free(ppp->ifcfg);
+		ppp->ifcfg = NULL;
+	}
+}
+
+static void init(void)
+{
+	ifcfg_pool = mempool_create(sizeof(struct ppp_ifcfg_t));
+}
+
+DEFINE_INIT(1, init);
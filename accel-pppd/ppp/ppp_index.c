@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "triton.h"
+#include "log.h"
+#include "ppp.h"
+#include "ipdb.h"
+#include "mempool.h"
+
+#include "memdebug.h"
+
+/*
+ * Sessions of ppp_list hashed by several keys. Chains are protected by
+ * ppp_lock, like the list itself. A session is linked into the chain of a
+ * key only while it has that key, unlinked entries are empty lists.
+ *
+ * A session may have several IPv6 addresses (a pool address and a
+ * Framed-IPv6-Prefix), so it gets a node per distinct /64 and its
+ * idx_entry[PPP_IDX_IPV6] is the list of its nodes.
+ */
+
+#define IDX_HASH_BITS 14
+#define IDX_HASH_SIZE (1 << IDX_HASH_BITS)
+
+struct ipv6_node_t
+{
+	struct list_head entry; // hash chain
+	struct list_head ppp_entry; // ppp->idx_entry[PPP_IDX_IPV6]
+	struct ppp_t *ppp;
+	uint64_t prefix;
+};
+
+static struct list_head *idx_hash[PPP_IDX_CNT];
+static mempool_t ipv6_node_pool;
+
+static uint32_t hash_bytes(uint32_t h, const void *data, size_t len)
+{
+	const uint8_t *ptr = data;
+
+	while (len--)
+		h = (h ^ *ptr++) * 16777619;
+
+	return h;
+}
+
+static inline uint64_t ipv6_prefix(const struct in6_addr *addr)
+{
+	return (uint64_t)addr->s6_addr32[0] << 32 | addr->s6_addr32[1];
+}
+
+/* Fills key of the session, returns its size or -1 if session hasn't it */
+static int ppp_key(const struct ppp_t *ppp, int idx, const void **key)
+{
+	switch (idx) {
+		case PPP_IDX_SESSIONID:
+			*key = ppp->sessionid;
+			return strlen(ppp->sessionid);
+		case PPP_IDX_USERNAME:
+			if (!ppp->username)
+				return -1;
+			*key = ppp->username;
+			return strlen(ppp->username);
+		case PPP_IDX_IFNAME:
+			*key = ppp->ifname;
+			return strlen(ppp->ifname);
+		case PPP_IDX_IFINDEX:
+			*key = &ppp->ifindex;
+			return sizeof(ppp->ifindex);
+		case PPP_IDX_IPV4:
+			if (!ppp->ipv4)
+				return -1;
+			*key = &ppp->ipv4->peer_addr;
+			return sizeof(ppp->ipv4->peer_addr);
+		case PPP_IDX_CSID:
+			if (!ppp->ctrl->calling_station_id)
+				return -1;
+			*key = ppp->ctrl->calling_station_id;
+			return strlen(ppp->ctrl->calling_station_id);
+	}
+
+	return -1;
+}
+
+/* Lookup key as passed by callers, see PPP_IDX_* */
+static int lookup_key(int idx, const void *val, const void **key)
+{
+	switch (idx) {
+		case PPP_IDX_IFINDEX:
+			*key = val;
+			return sizeof(int);
+		case PPP_IDX_IPV4:
+			*key = val;
+			return sizeof(in_addr_t);
+	}
+
+	*key = val;
+	return strlen(val);
+}
+
+static struct list_head *bucket(int idx, const void *key, int len)
+{
+	return &idx_hash[idx][hash_bytes(2166136261u, key, len) & (IDX_HASH_SIZE - 1)];
+}
+
+static void ipv6_index_del(struct ppp_t *ppp)
+{
+	struct ipv6_node_t *n;
+
+	while (!list_empty(&ppp->idx_entry[PPP_IDX_IPV6])) {
+		n = list_entry(ppp->idx_entry[PPP_IDX_IPV6].next, typeof(*n), ppp_entry);
+		list_del(&n->ppp_entry);
+		list_del(&n->entry);
+		mempool_free(n);
+	}
+}
+
+static void ipv6_index_add(struct ppp_t *ppp)
+{
+	struct ipv6db_addr_t *a;
+	struct ipv6_node_t *n;
+	uint64_t prefix;
+
+	if (!ppp->ipv6)
+		return;
+
+	list_for_each_entry(a, &ppp->ipv6->addr_list, entry) {
+		prefix = ipv6_prefix(&a->addr);
+
+		list_for_each_entry(n, &ppp->idx_entry[PPP_IDX_IPV6], ppp_entry) {
+			if (n->prefix == prefix)
+				goto next;
+		}
+
+		n = mempool_alloc(ipv6_node_pool);
+		if (!n) {
+			log_emerg("ppp: out of memory\n");
+			return;
+		}
+
+		n->ppp = ppp;
+		n->prefix = prefix;
+		list_add_tail(&n->ppp_entry, &ppp->idx_entry[PPP_IDX_IPV6]);
+		list_add_tail(&n->entry, bucket(PPP_IDX_IPV6, &prefix, sizeof(prefix)));
+next:;
+	}
+}
+
+static struct ppp_t *ipv6_index_find(const void *val, struct ppp_t *prev)
+{
+	uint64_t prefix = ipv6_prefix(val);
+	struct list_head *head = bucket(PPP_IDX_IPV6, &prefix, sizeof(prefix));
+	struct list_head *pos = head->next;
+	struct ipv6_node_t *n;
+
+	// continue after the node of prev
+	if (prev) {
+		list_for_each_entry(n, &prev->idx_entry[PPP_IDX_IPV6], ppp_entry) {
+			if (n->prefix == prefix)
+				break;
+		}
+		if (&n->ppp_entry == &prev->idx_entry[PPP_IDX_IPV6])
+			return NULL;
+		pos = n->entry.next;
+	}
+
+	for (; pos != head; pos = pos->next) {
+		n = list_entry(pos, typeof(*n), entry);
+		if (n->prefix == prefix)
+			return n->ppp;
+	}
+
+	return NULL;
+}
+
+/* Must be called with ppp_lock held for writing */
+void __export __ppp_index_update(struct ppp_t *ppp, int idx)
+{
+	const void *key;
+	int len;
+
+	if (idx == PPP_IDX_IPV6) {
+		ipv6_index_del(ppp);
+		ipv6_index_add(ppp);
+		return;
+	}
+
+	if (!list_empty(&ppp->idx_entry[idx]))
+		list_del_init(&ppp->idx_entry[idx]);
+
+	len = ppp_key(ppp, idx, &key);
+	if (len >= 0)
+		list_add_tail(&ppp->idx_entry[idx], bucket(idx, key, len));
+}
+
+void __export ppp_index_update(struct ppp_t *ppp, int idx)
+{
+	pthread_rwlock_wrlock(&ppp_lock);
+	if (!list_empty(&ppp->entry))
+		__ppp_index_update(ppp, idx);
+	pthread_rwlock_unlock(&ppp_lock);
+}
+
+void ppp_index_add(struct ppp_t *ppp)
+{
+	int i;
+
+	for (i = 0; i < PPP_IDX_CNT; i++)
+		__ppp_index_update(ppp, i);
+}
+
+void ppp_index_del(struct ppp_t *ppp)
+{
+	int i;
+
+	for (i = 0; i < PPP_IDX_CNT; i++) {
+		if (i == PPP_IDX_IPV6)
+			ipv6_index_del(ppp);
+		else if (!list_empty(&ppp->idx_entry[i]))
+			list_del_init(&ppp->idx_entry[i]);
+	}
+}
+
+/*
+ * Returns next session after prev (first if prev is NULL) which has the key.
+ * Must be called with ppp_lock held.
+ */
+struct ppp_t __export *ppp_index_find(int idx, const void *val, struct ppp_t *prev)
+{
+	struct list_head *head, *pos;
+	struct ppp_t *ppp;
+	const void *key, *k;
+	int len;
+
+	if (idx == PPP_IDX_IPV6)
+		return ipv6_index_find(val, prev);
+
+	len = lookup_key(idx, val, &key);
+	head = bucket(idx, key, len);
+
+	for (pos = prev ? prev->idx_entry[idx].next : head->next; pos != head; pos = pos->next) {
+		ppp = container_of(pos, typeof(*ppp), idx_entry[idx]);
+		if (ppp_key(ppp, idx, &k) != len)
+			continue;
+		if (memcmp(k, key, len))
+			continue;
+		return ppp;
+	}
+
+	return NULL;
+}
+
+static void init(void)
+{
+	int i, j;
+
+	for (i = 0; i < PPP_IDX_CNT; i++) {
+		idx_hash[i] = _malloc(IDX_HASH_SIZE * sizeof(struct list_head));
+		for (j = 0; j < IDX_HASH_SIZE; j++)
+			INIT_LIST_HEAD(&idx_hash[i][j]);
+	}
+
+	ipv6_node_pool = mempool_create(sizeof(struct ipv6_node_t));
+}
+
+DEFINE_INIT(1, init);
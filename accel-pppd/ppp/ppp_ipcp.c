@@ -33,6 +33,11 @@ struct recv_opt_t
 static int conf_ipv4 = IPV4_ALLOW;
 
 static LIST_HEAD(option_handlers);
+
+// option type to 1 + index in opt_tab of session, filled by ipcp_option_register() only
+#define OPT_SLOT_ANY 0xff // several handlers or not in opt_tab, look in the list
+static uint8_t opt_slot[256];
+static int handler_cnt;
 static struct ppp_layer_t ipcp_layer;
 
 static void ipcp_layer_up(struct ppp_fsm_t*);
@@ -51,6 +56,9 @@ static void ipcp_options_init(struct ppp_ipcp_t *ipcp)
 {
 	struct ipcp_option_t *lopt;
 	struct ipcp_option_handler_t *h;
+	int i = 0;
+
+	memset(ipcp->opt_tab, 0, sizeof(ipcp->opt_tab));
 
 	ipcp->conf_req_len = sizeof(struct ipcp_hdr_t);
 	
@@ -60,8 +68,29 @@ static void ipcp_options_init(struct ppp_ipcp_t *ipcp)
 			lopt->h = h;
 			list_add_tail(&lopt->entry, &ipcp->options);
 			ipcp->conf_req_len += lopt->len;
+			if (i < IPCP_OPT_TAB_SIZE)
+				ipcp->opt_tab[i] = lopt;
 		}
+		i++;
+	}
+}
+
+static struct ipcp_option_t *find_option(struct ppp_ipcp_t *ipcp, int id)
+{
+	struct ipcp_option_t *lopt;
+	int slot = opt_slot[id];
+
+	if (slot != OPT_SLOT_ANY) {
+		lopt = slot ? ipcp->opt_tab[slot - 1] : NULL;
+		return lopt && lopt->id == id ? lopt : NULL;
+	}
+
+	list_for_each_entry(lopt, &ipcp->options, entry) {
+		if (lopt->id == id)
+			return lopt;
 	}
+
+	return NULL;
 }
 
 static void ipcp_options_free(struct ppp_ipcp_t *ipcp)
@@ -73,6 +102,8 @@ static void ipcp_options_free(struct ppp_ipcp_t *ipcp)
 		list_del(&lopt->entry);
 		lopt->h->free(ipcp, lopt);
 	}
+
+	memset(ipcp->opt_tab, 0, sizeof(ipcp->opt_tab));
 }
 
 static struct ppp_layer_data_t *ipcp_layer_init(struct ppp_t *ppp)
@@ -147,6 +178,24 @@ int ipcp_layer_start(struct ppp_layer_data_t *ld)
 	return 0;
 }
 
+static int ipcp_layer_restore(struct ppp_layer_data_t *ld, struct ppp_ckpt_rec_t *rec)
+{
+	struct ppp_ipcp_t *ipcp = container_of(ld, typeof(*ipcp), ld);
+
+	ipcp->starting = 1;
+
+	if (!rec->peer_addr) {
+		ld->passive = 1;
+		return 0;
+	}
+
+	ipcp->fsm.fsm_state = FSM_Opened;
+	ipcp->started = 1;
+	ld->started = 1;
+
+	return 0;
+}
+
 void ipcp_layer_finish(struct ppp_layer_data_t *ld)
 {
 	struct ppp_ipcp_t *ipcp = container_of(ld, typeof(*ipcp), ld);
@@ -414,13 +463,11 @@ static int ipcp_recv_conf_req(struct ppp_ipcp_t *ipcp, uint8_t *data, int size)
 		log_ppp_info2("recv [IPCP ConfReq id=%x", ipcp->fsm.recv_id);
 
 		list_for_each_entry(ropt, &ipcp->ropt_list, entry) {
-			list_for_each_entry(lopt, &ipcp->options, entry) {
-				if (lopt->id == ropt->hdr->id) {
-					ropt->lopt = lopt;
-					log_ppp_info2(" ");
-					lopt->h->print(log_ppp_info2, lopt, (uint8_t*)ropt->hdr);
-					break;
-				}
+			lopt = find_option(ipcp, ropt->hdr->id);
+			if (lopt) {
+				ropt->lopt = lopt;
+				log_ppp_info2(" ");
+				lopt->h->print(log_ppp_info2, lopt, (uint8_t*)ropt->hdr);
 			}
 			if (!ropt->lopt) {
 				log_ppp_info2(" ");
@@ -431,29 +478,27 @@ static int ipcp_recv_conf_req(struct ppp_ipcp_t *ipcp, uint8_t *data, int size)
 	}
 
 	list_for_each_entry(ropt, &ipcp->ropt_list, entry) {
-		list_for_each_entry(lopt, &ipcp->options, entry) {
-			if (lopt->id == ropt->hdr->id) {
-				r = lopt->h->recv_conf_req(ipcp, lopt, (uint8_t*)ropt->hdr);
-				if (r == IPCP_OPT_TERMACK) {
-					send_term_ack(&ipcp->fsm);
-					return 0;
-				}
-				if (r == IPCP_OPT_CLOSE) {
-					if (conf_ipv4 == IPV4_REQUIRE)
-						ppp_terminate(ipcp->ppp, TERM_NAS_ERROR, 0);
-					else
-						lcp_send_proto_rej(ipcp->ppp, PPP_IPCP);
-					return 0;
-				}
-				if (ipcp->ppp->stop_time)
-					return -1;
-				lopt->state = r;
-				ropt->state = r;
-				ropt->lopt = lopt;
-				if (r < ret)
-					ret = r;
-				break;
-			}	
+		lopt = find_option(ipcp, ropt->hdr->id);
+		if (lopt) {
+			r = lopt->h->recv_conf_req(ipcp, lopt, (uint8_t*)ropt->hdr);
+			if (r == IPCP_OPT_TERMACK) {
+				send_term_ack(&ipcp->fsm);
+				return 0;
+			}
+			if (r == IPCP_OPT_CLOSE) {
+				if (conf_ipv4 == IPV4_REQUIRE)
+					ppp_terminate(ipcp->ppp, TERM_NAS_ERROR, 0);
+				else
+					lcp_send_proto_rej(ipcp->ppp, PPP_IPCP);
+				return 0;
+			}
+			if (ipcp->ppp->stop_time)
+				return -1;
+			lopt->state = r;
+			ropt->state = r;
+			ropt->lopt = lopt;
+			if (r < ret)
+				ret = r;
 		}
 		if (!ropt->lopt) {
 			ropt->state = IPCP_OPT_REJ;
@@ -507,14 +552,12 @@ static int ipcp_recv_conf_rej(struct ppp_ipcp_t *ipcp, uint8_t *data, int size)
 		if (!hdr->len || hdr->len > size)
 			break;
 
-		list_for_each_entry(lopt, &ipcp->options, entry) {
-			if (lopt->id == hdr->id) {
-				if (!lopt->h->recv_conf_rej)
-					res = -1;
-				else if (lopt->h->recv_conf_rej(ipcp, lopt, data))
-					res = -1;
-				break;
-			}
+		lopt = find_option(ipcp, hdr->id);
+		if (lopt) {
+			if (!lopt->h->recv_conf_rej)
+				res = -1;
+			else if (lopt->h->recv_conf_rej(ipcp, lopt, data))
+				res = -1;
 		}
 
 		data += hdr->len;
@@ -548,16 +591,14 @@ static int ipcp_recv_conf_nak(struct ppp_ipcp_t *ipcp, uint8_t *data, int size)
 		if (!hdr->len || hdr->len > size)
 			break;
 
-		list_for_each_entry(lopt, &ipcp->options, entry) {
-			if (lopt->id == hdr->id) {
-				if (conf_ppp_verbose) {
-					log_ppp_info2(" ");
-					lopt->h->print(log_ppp_info2,lopt,data);
-				}
-				if (lopt->h->recv_conf_nak && lopt->h->recv_conf_nak(ipcp, lopt, data))
-					res =- 1;
-				break;
+		lopt = find_option(ipcp, hdr->id);
+		if (lopt) {
+			if (conf_ppp_verbose) {
+				log_ppp_info2(" ");
+				lopt->h->print(log_ppp_info2,lopt,data);
 			}
+			if (lopt->h->recv_conf_nak && lopt->h->recv_conf_nak(ipcp, lopt, data))
+				res =- 1;
 		}
 
 		data += hdr->len;
@@ -591,18 +632,14 @@ static int ipcp_recv_conf_ack(struct ppp_ipcp_t *ipcp, uint8_t *data, int size)
 		if (!hdr->len || hdr->len > size)
 			break;
 
-		list_for_each_entry(lopt, &ipcp->options, entry) {
-			if (lopt->id == hdr->id) {
-				if (conf_ppp_verbose) {
-					log_ppp_info2(" ");
-					lopt->h->print(log_ppp_info2, lopt, data);
-				}
-				if (!lopt->h->recv_conf_ack)
-					break;
-				if (lopt->h->recv_conf_ack(ipcp, lopt, data))
-					res = -1;
-				break;
+		lopt = find_option(ipcp, hdr->id);
+		if (lopt) {
+			if (conf_ppp_verbose) {
+				log_ppp_info2(" ");
+				lopt->h->print(log_ppp_info2, lopt, data);
 			}
+			if (lopt->h->recv_conf_ack && lopt->h->recv_conf_ack(ipcp, lopt, data))
+				res = -1;
 		}
 
 		data += hdr->len;
@@ -775,6 +812,16 @@ int ipcp_option_register(struct ipcp_option_handler_t *h)
 		if (p->id==h->id) 
 			return -1;*/
 	
+	// handlers are registered on init, sessions only read opt_slot
+	if (!h->id)
+		memset(opt_slot, OPT_SLOT_ANY, sizeof(opt_slot));
+	else if (opt_slot[h->id] || handler_cnt >= IPCP_OPT_TAB_SIZE)
+		opt_slot[h->id] = OPT_SLOT_ANY;
+	else
+		opt_slot[h->id] = handler_cnt + 1;
+
+	handler_cnt++;
+
 	list_add_tail(&h->entry, &option_handlers);
 
 	return 0;
@@ -799,6 +846,7 @@ static struct ppp_layer_t ipcp_layer =
 	.start  = ipcp_layer_start,
 	.finish = ipcp_layer_finish,
 	.free   = ipcp_layer_free,
+	.restore = ipcp_layer_restore,
 };
 
 static void load_config(void)
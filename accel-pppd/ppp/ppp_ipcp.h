@@ -65,6 +65,7 @@ struct ipcp_option_t
 struct ipcp_option_handler_t
 {
 	struct list_head entry;
+	int id; // option type, 0 - not known in advance
 	struct ipcp_option_t* (*init)(struct ppp_ipcp_t*);
 	int (*send_conf_req)(struct ppp_ipcp_t*,struct ipcp_option_t*,uint8_t*);
 	int (*send_conf_rej)(struct ppp_ipcp_t*,struct ipcp_option_t*,uint8_t*);
@@ -77,6 +78,8 @@ struct ipcp_option_handler_t
 	void (*print)(void (*print)(const char *fmt,...), struct ipcp_option_t*,uint8_t*);
 };
 
+#define IPCP_OPT_TAB_SIZE 16
+
 struct ppp_ipcp_t
 {
 	struct ppp_layer_data_t ld;
@@ -84,6 +87,7 @@ struct ppp_ipcp_t
 	struct ppp_fsm_t fsm;
 	struct ppp_t *ppp;
 	struct list_head options;
+	struct ipcp_option_t *opt_tab[IPCP_OPT_TAB_SIZE]; // by handler, first ones registered
 
 	struct triton_timer_t timeout;
 
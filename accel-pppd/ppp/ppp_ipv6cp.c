@@ -147,6 +147,18 @@ int ipv6cp_layer_start(struct ppp_layer_data_t *ld)
 	return 0;
 }
 
+static int ipv6cp_layer_restore(struct ppp_layer_data_t *ld, struct ppp_ckpt_rec_t *rec)
+{
+	struct ppp_ipv6cp_t *ipv6cp = container_of(ld, typeof(*ipv6cp), ld);
+
+	// sessions with IPv6 aren't resumed, so it has never been opened
+	ipv6cp_options_init(ipv6cp);
+	ipv6cp->starting = 1;
+	ld->passive = 1;
+
+	return 0;
+}
+
 void ipv6cp_layer_finish(struct ppp_layer_data_t *ld)
 {
 	struct ppp_ipv6cp_t *ipv6cp = container_of(ld, typeof(*ipv6cp), ld);
@@ -799,6 +811,7 @@ static struct ppp_layer_t ipv6cp_layer =
 	.start  = ipv6cp_layer_start,
 	.finish = ipv6cp_layer_finish,
 	.free   = ipv6cp_layer_free,
+	.restore = ipv6cp_layer_restore,
 };
 
 static void load_config(void)
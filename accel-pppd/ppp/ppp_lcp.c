@@ -31,6 +31,11 @@ static int conf_echo_timeout = 60;
 static LIST_HEAD(option_handlers);
 static struct ppp_layer_t lcp_layer;
 
+// option type to 1 + index in opt_tab of session, filled by lcp_option_register() only
+#define OPT_SLOT_ANY 0xff // several handlers or not in opt_tab, look in the list
+static uint8_t opt_slot[256];
+static int handler_cnt;
+
 static void lcp_layer_up(struct ppp_fsm_t*);
 static void lcp_layer_down(struct ppp_fsm_t*);
 static void lcp_layer_finished(struct ppp_fsm_t*);
@@ -49,8 +54,10 @@ static void lcp_options_init(struct ppp_lcp_t *lcp)
 {
 	struct lcp_option_t *lopt;
 	struct lcp_option_handler_t *h;
+	int i = 0;
 
 	INIT_LIST_HEAD(&lcp->options);
+	memset(lcp->opt_tab, 0, sizeof(lcp->opt_tab));
 
 	lcp->conf_req_len = sizeof(struct lcp_hdr_t);
 
@@ -60,8 +67,29 @@ static void lcp_options_init(struct ppp_lcp_t *lcp)
 			lopt->h = h;
 			list_add_tail(&lopt->entry, &lcp->options);
 			lcp->conf_req_len += lopt->len;
+			if (i < LCP_OPT_TAB_SIZE)
+				lcp->opt_tab[i] = lopt;
 		}
+		i++;
+	}
+}
+
+static struct lcp_option_t *find_option(struct ppp_lcp_t *lcp, int id)
+{
+	struct lcp_option_t *lopt;
+	int slot = opt_slot[id];
+
+	if (slot != OPT_SLOT_ANY) {
+		lopt = slot ? lcp->opt_tab[slot - 1] : NULL;
+		return lopt && lopt->id == id ? lopt : NULL;
+	}
+
+	list_for_each_entry(lopt, &lcp->options, entry) {
+		if (lopt->id == id)
+			return lopt;
 	}
+
+	return NULL;
 }
 
 static void lcp_options_free(struct ppp_lcp_t *lcp)
@@ -73,6 +101,8 @@ static void lcp_options_free(struct ppp_lcp_t *lcp)
 		list_del(&lopt->entry);
 		lopt->h->free(lcp, lopt);
 	}
+
+	memset(lcp->opt_tab, 0, sizeof(lcp->opt_tab));
 }
 
 static struct ppp_layer_data_t *lcp_layer_init(struct ppp_t *ppp)
@@ -162,6 +192,9 @@ static void lcp_layer_up(struct ppp_fsm_t *fsm)
 
 	log_ppp_debug("lcp_layer_started\n");
 
+	// echo requests carry the magic, peer may check it
+	ppp_ckpt_set(lcp->ppp, PPP_CKPT_LCP, &lcp->magic, sizeof(lcp->magic));
+
 	if (!lcp->started) {
 		lcp->started = 1;
 		ppp_layer_started(lcp->ppp, &lcp->ld);
@@ -169,6 +202,27 @@ static void lcp_layer_up(struct ppp_fsm_t *fsm)
 	start_echo(lcp);
 }
 
+static int lcp_layer_restore(struct ppp_layer_data_t *ld, struct ppp_ckpt_rec_t *rec)
+{
+	struct ppp_lcp_t *lcp = container_of(ld, typeof(*lcp), ld);
+	int *magic, len;
+
+	magic = ppp_ckpt_get(rec, PPP_CKPT_LCP, &len);
+	if (!magic || len != sizeof(*magic))
+		return -1;
+
+	lcp_options_init(lcp);
+	lcp->magic = *magic;
+
+	lcp->fsm.fsm_state = FSM_Opened;
+	lcp->started = 1;
+	ld->started = 1;
+
+	start_echo(lcp);
+
+	return 0;
+}
+
 static void lcp_layer_down(struct ppp_fsm_t *fsm)
 {
 	struct ppp_lcp_t *lcp = container_of(fsm, typeof(*lcp), fsm);
@@ -392,20 +446,18 @@ static int lcp_recv_conf_req(struct ppp_lcp_t *lcp, uint8_t *data, int size)
 		log_ppp_info2("recv [LCP ConfReq id=%x", lcp->fsm.recv_id);
 
 	list_for_each_entry(ropt, &lcp->ropt_list, entry) {
-		list_for_each_entry(lopt, &lcp->options, entry) {
-			if (lopt->id == ropt->hdr->id) {
-				if (conf_ppp_verbose) {
-					log_ppp_info2(" ");
-					lopt->h->print(log_ppp_info2, lopt, (uint8_t*)ropt->hdr);
-				}
-				r = lopt->h->recv_conf_req(lcp, lopt, (uint8_t*)ropt->hdr);
-				lopt->state = r;
-				ropt->state = r;
-				ropt->lopt = lopt;
-				if (r<ret)
-					ret = r;
-				break;
+		lopt = find_option(lcp, ropt->hdr->id);
+		if (lopt) {
+			if (conf_ppp_verbose) {
+				log_ppp_info2(" ");
+				lopt->h->print(log_ppp_info2, lopt, (uint8_t*)ropt->hdr);
 			}
+			r = lopt->h->recv_conf_req(lcp, lopt, (uint8_t*)ropt->hdr);
+			lopt->state = r;
+			ropt->state = r;
+			ropt->lopt = lopt;
+			if (r<ret)
+				ret = r;
 		}
 		if (!ropt->lopt) {
 			if (conf_ppp_verbose) {
@@ -465,18 +517,16 @@ static int lcp_recv_conf_rej(struct ppp_lcp_t *lcp, uint8_t *data, int size)
 		if (!hdr->len || hdr->len > size)
 			break;
 		
-		list_for_each_entry(lopt, &lcp->options, entry) {
-			if (lopt->id == hdr->id) {
-				if (conf_ppp_verbose) {
-					log_ppp_info2(" ");
-					lopt->h->print(log_ppp_info2, lopt, (uint8_t*)hdr);
-				}
-				if (!lopt->h->recv_conf_rej)
-					res = -1;
-				else if (lopt->h->recv_conf_rej(lcp, lopt, data))
-					res = -1;
-				break;
+		lopt = find_option(lcp, hdr->id);
+		if (lopt) {
+			if (conf_ppp_verbose) {
+				log_ppp_info2(" ");
+				lopt->h->print(log_ppp_info2, lopt, (uint8_t*)hdr);
 			}
+			if (!lopt->h->recv_conf_rej)
+				res = -1;
+			else if (lopt->h->recv_conf_rej(lcp, lopt, data))
+				res = -1;
 		}
 
 		data += hdr->len;
@@ -510,16 +560,14 @@ static int lcp_recv_conf_nak(struct ppp_lcp_t *lcp, uint8_t *data, int size)
 		if (!hdr->len || hdr->len > size)
 			break;
 		
-		list_for_each_entry(lopt,&lcp->options,entry) {
-			if (lopt->id == hdr->id) {
-				if (conf_ppp_verbose) {
-					log_ppp_info2(" ");
-					lopt->h->print(log_ppp_info2, lopt, data);
-				}
-				if (lopt->h->recv_conf_nak && lopt->h->recv_conf_nak(lcp, lopt, data))
-					res = -1;
-				break;
+		lopt = find_option(lcp, hdr->id);
+		if (lopt) {
+			if (conf_ppp_verbose) {
+				log_ppp_info2(" ");
+				lopt->h->print(log_ppp_info2, lopt, data);
 			}
+			if (lopt->h->recv_conf_nak && lopt->h->recv_conf_nak(lcp, lopt, data))
+				res = -1;
 		}
 
 		data += hdr->len;
@@ -553,18 +601,14 @@ static int lcp_recv_conf_ack(struct ppp_lcp_t *lcp, uint8_t *data, int size)
 		if (!hdr->len || hdr->len > size)
 			break;
 		
-		list_for_each_entry(lopt, &lcp->options, entry) {
-			if (lopt->id == hdr->id) {
-				if (conf_ppp_verbose) {
-					log_ppp_info2(" ");
-					lopt->h->print(log_ppp_info2, lopt, data);
-				}
-				if (!lopt->h->recv_conf_ack)
-					break;
-				if (lopt->h->recv_conf_ack(lcp, lopt, data))
-					res = -1;
-				break;
+		lopt = find_option(lcp, hdr->id);
+		if (lopt) {
+			if (conf_ppp_verbose) {
+				log_ppp_info2(" ");
+				lopt->h->print(log_ppp_info2, lopt, data);
 			}
+			if (lopt->h->recv_conf_ack && lopt->h->recv_conf_ack(lcp, lopt, data))
+				res = -1;
 		}
 
 		data += hdr->len;
@@ -890,6 +934,16 @@ int lcp_option_register(struct lcp_option_handler_t *h)
 		if (p->id==h->id) 
 			return -1;*/
 	
+	// handlers are registered on init, sessions only read opt_slot
+	if (!h->id)
+		memset(opt_slot, OPT_SLOT_ANY, sizeof(opt_slot));
+	else if (opt_slot[h->id] || handler_cnt >= LCP_OPT_TAB_SIZE)
+		opt_slot[h->id] = OPT_SLOT_ANY;
+	else
+		opt_slot[h->id] = handler_cnt + 1;
+
+	handler_cnt++;
+
 	list_add_tail(&h->entry, &option_handlers);
 
 	return 0;
@@ -901,6 +955,7 @@ static struct ppp_layer_t lcp_layer=
 	.start  = lcp_layer_start,
 	.finish = lcp_layer_finish,
 	.free   = lcp_layer_free,
+	.restore = lcp_layer_restore,
 };
 
 static void load_config(void)
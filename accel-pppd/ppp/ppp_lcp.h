@@ -97,6 +97,7 @@ struct lcp_option_t
 struct lcp_option_handler_t
 {
 	struct list_head entry;
+	int id; // option type, 0 - not known in advance
 	struct lcp_option_t* (*init)(struct ppp_lcp_t*);
 	int (*send_conf_req)(struct ppp_lcp_t*,struct lcp_option_t*,uint8_t*);
 	int (*send_conf_rej)(struct ppp_lcp_t*,struct lcp_option_t*,uint8_t*);
@@ -109,6 +110,8 @@ struct lcp_option_handler_t
 	void (*print)(void (*print)(const char *fmt,...), struct lcp_option_t*,uint8_t*);
 };
 
+#define LCP_OPT_TAB_SIZE 16
+
 struct ppp_lcp_t
 {
 	struct ppp_layer_data_t ld;
@@ -116,6 +119,7 @@ struct ppp_lcp_t
 	struct ppp_fsm_t fsm;
 	struct ppp_t *ppp;
 	struct list_head options;
+	struct lcp_option_t *opt_tab[LCP_OPT_TAB_SIZE]; // by handler, first ones registered
 
 	struct triton_timer_t echo_timer;
 	int echo_sent;
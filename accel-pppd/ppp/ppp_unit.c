@@ -0,0 +1,234 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include "linux_ppp.h"
+
+#include "triton.h"
+#include "events.h"
+#include "log.h"
+#include "ppp.h"
+#include "spinlock.h"
+
+#include "memdebug.h"
+
+/*
+ * Warm pool of ppp units. PPPIOCNEWUNIT registers a net_device, which is the
+ * slowest part of establish_ppp(), so when ppp.unit-cache is set units are
+ * created in advance by a dedicated context and sessions only connect their
+ * channel to one of them. Units are never returned to the pool, a used
+ * interface may keep addresses, MTU and flags of its previous session.
+ */
+
+#define REFILL_BATCH 16
+
+struct unit_t
+{
+	struct list_head entry;
+	int fd;
+	int idx;
+	int ifindex;
+};
+
+static int conf_unit_cache;
+
+static LIST_HEAD(unit_list);
+static int unit_cnt;
+static spinlock_t unit_lock;
+static int refill_queued;
+
+static void unit_ctx_close(struct triton_context_t *ctx);
+
+static struct triton_context_t unit_ctx = {
+	.close = unit_ctx_close,
+};
+
+static struct unit_t *unit_create(void)
+{
+	struct unit_t *u;
+	struct ifreq ifr;
+	int fd;
+
+	fd = open("/dev/ppp", O_RDWR | O_CLOEXEC | O_NONBLOCK);
+	if (fd < 0) {
+		log_error("ppp: unit-cache: open /dev/ppp: %s\n", strerror(errno));
+		return NULL;
+	}
+
+	u = _malloc(sizeof(*u));
+	u->fd = fd;
+	u->idx = -1;
+
+	if (ioctl(fd, PPPIOCNEWUNIT, &u->idx) < 0) {
+		log_error("ppp: unit-cache: ioctl(PPPIOCNEWUNIT): %s\n", strerror(errno));
+		goto out_err;
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	sprintf(ifr.ifr_name, "ppp%i", u->idx);
+
+	if (ioctl(sock_fd, SIOCGIFINDEX, &ifr)) {
+		log_error("ppp: unit-cache: ioctl(SIOCGIFINDEX): %s\n", strerror(errno));
+		goto out_err;
+	}
+	u->ifindex = ifr.ifr_ifindex;
+
+	return u;
+
+out_err:
+	close(fd);
+	_free(u);
+	return NULL;
+}
+
+static void refill(void *arg)
+{
+	struct unit_t *u;
+	int i, n;
+
+	spin_lock(&unit_lock);
+	n = conf_unit_cache - unit_cnt;
+	spin_unlock(&unit_lock);
+
+	// don't keep the worker thread for long, the rest goes by next call
+	if (n > REFILL_BATCH)
+		n = REFILL_BATCH;
+
+	for (i = 0; i < n; i++) {
+		u = unit_create();
+		if (!u)
+			break;
+
+		spin_lock(&unit_lock);
+		list_add_tail(&u->entry, &unit_list);
+		unit_cnt++;
+		spin_unlock(&unit_lock);
+	}
+
+	spin_lock(&unit_lock);
+	if (i == n && unit_cnt < conf_unit_cache) {
+		spin_unlock(&unit_lock);
+		triton_context_call(&unit_ctx, refill, NULL);
+		return;
+	}
+	refill_queued = 0;
+	spin_unlock(&unit_lock);
+}
+
+/* Must be called with unit_lock held, the caller posts refill after unlock if 1 is returned */
+static int queue_refill(void)
+{
+	if (refill_queued || unit_cnt >= conf_unit_cache)
+		return 0;
+
+	refill_queued = 1;
+
+	return 1;
+}
+
+/*
+ * Takes a unit from the pool, fills unit_fd, unit_idx and ifindex of ppp.
+ * Returns -1 if the pool is empty or disabled.
+ */
+int ppp_unit_get(struct ppp_t *ppp)
+{
+	struct unit_t *u = NULL;
+	int r;
+
+	if (!conf_unit_cache)
+		return -1;
+
+	spin_lock(&unit_lock);
+	if (!list_empty(&unit_list)) {
+		u = list_entry(unit_list.next, typeof(*u), entry);
+		list_del(&u->entry);
+		unit_cnt--;
+	}
+	r = queue_refill();
+	spin_unlock(&unit_lock);
+
+	if (r)
+		triton_context_call(&unit_ctx, refill, NULL);
+
+	if (!u)
+		return -1;
+
+	ppp->unit_fd = u->fd;
+	ppp->unit_idx = u->idx;
+	ppp->ifindex = u->ifindex;
+
+	_free(u);
+
+	return 0;
+}
+
+static void trim(void *arg)
+{
+	struct unit_t *u;
+
+	while (1) {
+		spin_lock(&unit_lock);
+		if (unit_cnt <= conf_unit_cache) {
+			spin_unlock(&unit_lock);
+			break;
+		}
+		u = list_entry(unit_list.prev, typeof(*u), entry);
+		list_del(&u->entry);
+		unit_cnt--;
+		spin_unlock(&unit_lock);
+
+		close(u->fd);
+		_free(u);
+	}
+}
+
+static void unit_ctx_close(struct triton_context_t *ctx)
+{
+	spin_lock(&unit_lock);
+	conf_unit_cache = 0;
+	spin_unlock(&unit_lock);
+
+	trim(NULL);
+
+	triton_context_unregister(ctx);
+}
+
+static void load_config(void)
+{
+	const char *opt;
+	int n = 0, do_trim, do_refill = 0;
+
+	opt = conf_get_opt("ppp", "unit-cache");
+	if (opt && atoi(opt) > 0)
+		n = atoi(opt);
+
+	spin_lock(&unit_lock);
+	conf_unit_cache = n;
+	do_trim = unit_cnt > n;
+	if (!do_trim)
+		do_refill = queue_refill();
+	spin_unlock(&unit_lock);
+
+	// calls allocate and take the context lock, not under the spinlock
+	if (do_trim)
+		triton_context_call(&unit_ctx, trim, NULL);
+	else if (do_refill)
+		triton_context_call(&unit_ctx, refill, NULL);
+}
+
+static void init(void)
+{
+	spinlock_init(&unit_lock);
+
+	triton_context_register(&unit_ctx, NULL);
+	triton_context_wakeup(&unit_ctx);
+
+	load_config();
+	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
+}
+
+DEFINE_INIT(3, init);
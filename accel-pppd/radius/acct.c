@@ -59,6 +59,9 @@ static void req_set_stat(struct rad_req_t *req, struct ppp_t *ppp)
 		req->rpd->acct_output_gigawords++;
 	req->rpd->acct_output_octets = ifreq.stats.p.ppp_obytes;
 
+	if (!ppp->stop_time)
+		rad_ckpt_save(req->rpd);
+
 	rad_packet_change_int(req->pack, NULL, "Acct-Input-Octets", ifreq.stats.p.ppp_ibytes);
 	rad_packet_change_int(req->pack, NULL, "Acct-Output-Octets", ifreq.stats.p.ppp_obytes);
 	rad_packet_change_int(req->pack, NULL, "Acct-Input-Packets", ifreq.stats.p.ppp_ipackets);
@@ -200,8 +203,8 @@ static void rad_acct_interim_update(struct triton_timer_t *t)
 	if (rpd->acct_req->timeout.tpd)
 		return;
 
-	if (rpd->session_timeout.expire_tv.tv_sec && 
-			rpd->session_timeout.expire_tv.tv_sec - (time(NULL) - rpd->ppp->start_time) < INTERIM_SAFE_TIME)
+	if (rpd->session_timeout_sec &&
+			rpd->session_timeout_sec - (time(NULL) - rpd->ppp->start_time) < INTERIM_SAFE_TIME)
 			return;
 
 	req_set_stat(rpd->acct_req, rpd->ppp);
@@ -224,6 +227,19 @@ static void rad_acct_interim_update(struct triton_timer_t *t)
 	triton_timer_add(rpd->ppp->ctrl->ctx, &rpd->acct_req->timeout, 0);
 }
 
+static int start_interim(struct radius_pd_t *rpd)
+{
+	rpd->acct_req->timeout.expire = rad_acct_timeout;
+	rpd->acct_req->timeout.period = conf_timeout * 1000;
+	
+	rpd->acct_interim_timer.expire = rad_acct_interim_update;
+	rpd->acct_interim_timer.period = rpd->acct_interim_interval ? rpd->acct_interim_interval * 1000 : STAT_UPDATE_INTERVAL;
+	if (rpd->acct_interim_interval && triton_timer_add(rpd->ppp->ctrl->ctx, &rpd->acct_interim_timer, 0))
+		return -1;
+
+	return 0;
+}
+
 int rad_acct_start(struct radius_pd_t *rpd)
 {
 	int i;
@@ -329,12 +345,7 @@ int rad_acct_start(struct radius_pd_t *rpd)
 	if (triton_md_enable_handler(&rpd->acct_req->hnd, MD_MODE_READ))
 		goto out_err;
 	
-	rpd->acct_req->timeout.expire = rad_acct_timeout;
-	rpd->acct_req->timeout.period = conf_timeout * 1000;
-	
-	rpd->acct_interim_timer.expire = rad_acct_interim_update;
-	rpd->acct_interim_timer.period = rpd->acct_interim_interval ? rpd->acct_interim_interval * 1000 : STAT_UPDATE_INTERVAL;
-	if (rpd->acct_interim_interval && triton_timer_add(rpd->ppp->ctrl->ctx, &rpd->acct_interim_timer, 0)) {
+	if (start_interim(rpd)) {
 		triton_md_unregister_handler(&rpd->acct_req->hnd);
 		triton_timer_del(&rpd->acct_req->timeout);
 		goto out_err;
@@ -347,6 +358,40 @@ out_err:
 	return -1;
 }
 
+/*
+ * Continues accounting of a session resumed after hot restart, Start was sent
+ * by the previous process. The socket is created with the first update.
+ */
+int rad_acct_resume(struct radius_pd_t *rpd)
+{
+	if (!conf_accounting)
+		return 0;
+
+	rpd->acct_req = rad_req_alloc(rpd, CODE_ACCOUNTING_REQUEST, rpd->ppp->username);
+	if (!rpd->acct_req)
+		return -1;
+
+	if (rad_req_acct_fill(rpd->acct_req)) {
+		log_ppp_error("radius:acct: failed to fill accounting attributes\n");
+		goto out_err;
+	}
+
+	rad_packet_change_val(rpd->acct_req->pack, NULL, "Acct-Status-Type", "Interim-Update");
+
+	rpd->acct_req->hnd.read = rad_acct_read;
+	time(&rpd->acct_timestamp);
+
+	if (start_interim(rpd))
+		goto out_err;
+
+	return 0;
+
+out_err:
+	rad_req_free(rpd->acct_req);
+	rpd->acct_req = NULL;
+	return -1;
+}
+
 void rad_acct_stop(struct radius_pd_t *rpd)
 {
 	int i;
@@ -360,7 +405,9 @@ void rad_acct_stop(struct radius_pd_t *rpd)
 		triton_timer_del(&rpd->acct_interim_timer);
 
 	if (rpd->acct_req) {
-		triton_md_unregister_handler(&rpd->acct_req->hnd);
+		// not registered yet by resumed sessions
+		if (rpd->acct_req->hnd.tpd)
+			triton_md_unregister_handler(&rpd->acct_req->hnd);
 		if (rpd->acct_req->timeout.tpd)
 			triton_timer_del(&rpd->acct_req->timeout);
 
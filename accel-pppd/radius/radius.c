@@ -54,6 +54,23 @@ static struct ipdb_t ipdb;
 
 static mempool_t rpd_pool;
 
+// session state kept in the checkpoint record for hot restart
+struct rad_ckpt_t
+{
+	in_addr_t framed_ip; // 0 if the address isn't from Framed-IP-Address
+	int32_t acct_interim_interval;
+	int32_t session_timeout;
+	int32_t termination_action;
+	uint32_t acct_input_octets;
+	uint32_t acct_output_octets;
+	uint32_t acct_input_gigawords;
+	uint32_t acct_output_gigawords;
+	uint16_t class_len;
+	uint16_t state_len;
+	uint16_t cui_len;
+	uint8_t data[0]; // Class, State, Chargeable-User-Identity
+};
+
 int rad_proc_attrs(struct rad_req_t *req)
 {
 	struct rad_attr_t *attr;
@@ -95,6 +112,7 @@ int rad_proc_attrs(struct rad_req_t *req)
 				break;
 			case Session_Timeout:
 				req->rpd->session_timeout.expire_tv.tv_sec = attr->val.integer;
+				req->rpd->session_timeout_sec = attr->val.integer;
 				break;
 			case Class:
 				if (!req->rpd->attr_class)
@@ -190,6 +208,33 @@ static struct ipv4db_item_t *get_ipv4(struct ppp_t *ppp)
 	return NULL;
 }
 
+static struct rad_ckpt_t *ckpt_get(struct ppp_t *ppp)
+{
+	struct rad_ckpt_t *ck;
+	int len;
+
+	ck = ppp_ckpt_get(ppp->ckpt, PPP_CKPT_RADIUS, &len);
+	if (!ck || len < sizeof(*ck) || len != sizeof(*ck) + ck->class_len + ck->state_len + ck->cui_len)
+		return NULL;
+
+	return ck;
+}
+
+static struct ipv4db_item_t *restore_ipv4(struct ppp_t *ppp, in_addr_t addr, in_addr_t peer_addr)
+{
+	struct radius_pd_t *rpd = find_pd(ppp);
+	struct rad_ckpt_t *ck = ckpt_get(ppp);
+
+	if (!ck || ck->framed_ip != peer_addr)
+		return NULL;
+
+	rpd->ipv4_addr.owner = &ipdb;
+	rpd->ipv4_addr.addr = addr;
+	rpd->ipv4_addr.peer_addr = peer_addr;
+
+	return &rpd->ipv4_addr;
+}
+
 static struct ipv6db_item_t *get_ipv6(struct ppp_t *ppp)
 {
 	struct radius_pd_t *rpd = find_pd(ppp);
@@ -251,6 +296,41 @@ static void ppp_starting(struct ppp_t *ppp)
 	pthread_rwlock_unlock(&sessions_lock);
 }
 
+void rad_ckpt_save(struct radius_pd_t *rpd)
+{
+	struct rad_ckpt_t *ck;
+	int cui_len = rpd->ppp->chargeable_identity ? strlen(rpd->ppp->chargeable_identity) : 0;
+	int len = sizeof(*ck) + rpd->attr_class_len + rpd->attr_state_len + cui_len;
+
+	if (!rpd->authenticated)
+		return;
+
+	ck = _malloc(len);
+
+	ck->framed_ip = rpd->ppp->ipv4 == &rpd->ipv4_addr ? rpd->ipv4_addr.peer_addr : 0;
+	ck->acct_interim_interval = rpd->acct_interim_interval;
+	ck->session_timeout = rpd->session_timeout_sec;
+	ck->termination_action = rpd->termination_action;
+	ck->acct_input_octets = rpd->acct_input_octets;
+	ck->acct_output_octets = rpd->acct_output_octets;
+	ck->acct_input_gigawords = rpd->acct_input_gigawords;
+	ck->acct_output_gigawords = rpd->acct_output_gigawords;
+	ck->class_len = rpd->attr_class_len;
+	ck->state_len = rpd->attr_state_len;
+	ck->cui_len = cui_len;
+
+	if (rpd->attr_class)
+		memcpy(ck->data, rpd->attr_class, rpd->attr_class_len);
+	if (rpd->attr_state)
+		memcpy(ck->data + ck->class_len, rpd->attr_state, rpd->attr_state_len);
+	if (cui_len)
+		memcpy(ck->data + ck->class_len + ck->state_len, rpd->ppp->chargeable_identity, cui_len);
+
+	ppp_ckpt_set(rpd->ppp, PPP_CKPT_RADIUS, ck, len);
+
+	_free(ck);
+}
+
 static void ppp_acct_start(struct ppp_t *ppp)
 {
 	struct radius_pd_t *rpd = find_pd(ppp);
@@ -267,6 +347,56 @@ static void ppp_acct_start(struct ppp_t *ppp)
 		rpd->session_timeout.expire = session_timeout;
 		triton_timer_add(ppp->ctrl->ctx, &rpd->session_timeout, 0);
 	}
+
+	rad_ckpt_save(rpd);
+}
+
+static void ppp_restored(struct ppp_t *ppp)
+{
+	struct radius_pd_t *rpd = find_pd(ppp);
+	struct rad_ckpt_t *ck = ckpt_get(ppp);
+	time_t t;
+
+	// wasn't authenticated by radius
+	if (!ck)
+		return;
+
+	rpd->authenticated = 1;
+	rpd->acct_interim_interval = ck->acct_interim_interval;
+	rpd->termination_action = ck->termination_action;
+	rpd->acct_input_octets = ck->acct_input_octets;
+	rpd->acct_output_octets = ck->acct_output_octets;
+	rpd->acct_input_gigawords = ck->acct_input_gigawords;
+	rpd->acct_output_gigawords = ck->acct_output_gigawords;
+
+	if (ck->class_len) {
+		rpd->attr_class = _malloc(ck->class_len);
+		memcpy(rpd->attr_class, ck->data, ck->class_len);
+		rpd->attr_class_len = ck->class_len;
+	}
+
+	if (ck->state_len) {
+		rpd->attr_state = _malloc(ck->state_len);
+		memcpy(rpd->attr_state, ck->data + ck->class_len, ck->state_len);
+		rpd->attr_state_len = ck->state_len;
+	}
+
+	if (ck->cui_len)
+		ppp->chargeable_identity = _strndup((char *)ck->data + ck->class_len + ck->state_len, ck->cui_len);
+
+	if (rad_acct_resume(rpd)) {
+		ppp_terminate(ppp, TERM_NAS_ERROR, 0);
+		return;
+	}
+
+	if (ck->session_timeout) {
+		// what is left of the timeout checkpointed relative to session start
+		t = ck->session_timeout - (time(NULL) - ppp->start_time);
+		rpd->session_timeout_sec = ck->session_timeout;
+		rpd->session_timeout.expire = session_timeout;
+		rpd->session_timeout.expire_tv.tv_sec = t > 0 ? t : 1;
+		triton_timer_add(ppp->ctrl->ctx, &rpd->session_timeout, 0);
+	}
 }
 static void ppp_finishing(struct ppp_t *ppp)
 {
@@ -323,17 +453,25 @@ static void ppp_finished(struct ppp_t *ppp)
 	mempool_free(rpd);
 }
 
-struct radius_pd_t *find_pd(struct ppp_t *ppp)
+static struct radius_pd_t *__find_pd(struct ppp_t *ppp)
 {
 	struct ppp_pd_t *pd;
-	struct radius_pd_t *rpd;
 
 	list_for_each_entry(pd, &ppp->pd_list, entry) {
-		if (pd->key == &pd_key) {
-			rpd = container_of(pd, typeof(*rpd), pd);
-			return rpd;
-		}
+		if (pd->key == &pd_key)
+			return container_of(pd, struct radius_pd_t, pd);
 	}
+
+	return NULL;
+}
+
+struct radius_pd_t *find_pd(struct ppp_t *ppp)
+{
+	struct radius_pd_t *rpd = __find_pd(ppp);
+
+	if (rpd)
+		return rpd;
+
 	log_emerg("radius:BUG: rpd not found\n");
 	abort();
 }
@@ -368,6 +506,10 @@ int rad_find_sessions_pack(struct rad_packet_t *pack, int (*callback)(struct rad
 	int port_id = -1;
 	in_addr_t ipaddr = 0;
 	unsigned int count = 0;
+	struct ppp_t *ppp;
+	char ifname[16];
+	const void *key = NULL;
+	int idx = -1;
 	
 	list_for_each_entry(attr, &pack->attrs, entry) {
 		switch(attr->attr->id) {
@@ -401,14 +543,48 @@ int rad_find_sessions_pack(struct rad_packet_t *pack, int (*callback)(struct rad
 
 	if (!sessionid && !username && port_id == -1 && ipaddr == 0 && !csid && !cui)
 		return -1;
-	
+
+	// candidates come from the session index by the most selective key
+	if (sessionid) {
+		idx = PPP_IDX_SESSIONID;
+		key = sessionid;
+	} else if (port_id >= 0) {
+		idx = PPP_IDX_IFNAME;
+		snprintf(ifname, sizeof(ifname), "ppp%i", port_id);
+		key = ifname;
+	} else if (ipaddr) {
+		idx = PPP_IDX_IPV4;
+		key = &ipaddr;
+	} else if (username) {
+		idx = PPP_IDX_USERNAME;
+		key = username;
+	} else if (csid) {
+		idx = PPP_IDX_CSID;
+		key = csid;
+	}
+
 	pthread_rwlock_rdlock(&sessions_lock);
-	list_for_each_entry(rpd, &sessions, entry) {
-		if (!rad_match_session(rpd->ppp, sessionid, username, port_id, ipaddr, csid, cui))
-			continue;
-	    pthread_mutex_lock(&rpd->lock);
-		if (!callback(rpd, cb_data))
-			count++;
+	if (idx < 0) {
+		list_for_each_entry(rpd, &sessions, entry) {
+			if (!rad_match_session(rpd->ppp, sessionid, username, port_id, ipaddr, csid, cui))
+				continue;
+			pthread_mutex_lock(&rpd->lock);
+			if (!callback(rpd, cb_data))
+				count++;
+		}
+	} else {
+		pthread_rwlock_rdlock(&ppp_lock);
+		ppp_index_for_each(ppp, idx, key) {
+			if (!rad_match_session(ppp, sessionid, username, port_id, ipaddr, csid, cui))
+				continue;
+			rpd = __find_pd(ppp);
+			if (!rpd)
+				continue;
+			pthread_mutex_lock(&rpd->lock);
+			if (!callback(rpd, cb_data))
+				count++;
+		}
+		pthread_rwlock_unlock(&ppp_lock);
 	}
 	pthread_rwlock_unlock(&sessions_lock);
 	return count;
@@ -453,6 +629,7 @@ static struct ipdb_t ipdb = {
 	.get_ipv4 = get_ipv4,
 	.get_ipv6 = get_ipv6,
 	.get_ipv6_prefix = get_ipv6_prefix,
+	.restore_ipv4 = restore_ipv4,
 };
 
 static struct pwdb_t pwdb = {
@@ -600,6 +777,7 @@ static void radius_init(void)
 	triton_event_register_handler(EV_PPP_ACCT_START, (triton_event_func)ppp_acct_start);
 	triton_event_register_handler(EV_PPP_FINISHING, (triton_event_func)ppp_finishing);
 	triton_event_register_handler(EV_PPP_FINISHED, (triton_event_func)ppp_finished);
+	triton_event_register_handler(EV_PPP_RESTORED, (triton_event_func)ppp_restored);
 	triton_event_register_handler(EV_CONFIG_RELOAD, (triton_event_func)load_config);
 }
 
@@ -29,6 +29,7 @@ struct radius_pd_t
 	uint32_t acct_output_gigawords;
 
 	struct triton_timer_t session_timeout;
+	int session_timeout_sec; // from session start, the timer may be armed with what is left
 
 	struct rad_dm_coa_req_t *dm_coa_req;
 
@@ -156,8 +157,11 @@ int rad_auth_mschap_v1(struct radius_pd_t *rpd, const char *username, va_list ar
 int rad_auth_mschap_v2(struct radius_pd_t *rpd, const char *username, va_list args);
 
 int rad_acct_start(struct radius_pd_t *rpd);
+int rad_acct_resume(struct radius_pd_t *rpd);
 void rad_acct_stop(struct radius_pd_t *rpd);
 
+void rad_ckpt_save(struct radius_pd_t *rpd);
+
 struct rad_packet_t *rad_packet_alloc(int code);
 int rad_packet_build(struct rad_packet_t *pack, uint8_t *RA);
 int rad_packet_recv(int fd, struct rad_packet_t **, struct sockaddr_in *addr);
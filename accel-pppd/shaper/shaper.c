@@ -25,6 +25,7 @@
 
 #define ATTR_UP 1
 #define ATTR_DOWN 2
+#define TR_CALL_BATCH 64
 
 static int conf_verbose = 0;
 #ifdef RADIUS
@@ -656,33 +657,45 @@ static void update_shaper_tr(struct shaper_pd_t *pd)
 			log_ppp_info2("shaper: removed shaper\n");	
 }
 
+static void update_shaper_tr_all(void)
+{
+	struct shaper_pd_t *pd;
+	struct triton_context_t *ctx[TR_CALL_BATCH];
+	void *arg[TR_CALL_BATCH];
+	int n = 0;
+
+	pthread_rwlock_rdlock(&shaper_lock);
+	list_for_each_entry(pd, &shaper_list, entry) {
+		ctx[n] = pd->ppp->ctrl->ctx;
+		arg[n++] = pd;
+		if (n == TR_CALL_BATCH) {
+			triton_context_call_many(ctx, (triton_event_func)update_shaper_tr, arg, n);
+			n = 0;
+		}
+	}
+	if (n)
+		triton_context_call_many(ctx, (triton_event_func)update_shaper_tr, arg, n);
+	pthread_rwlock_unlock(&shaper_lock);
+}
+
 static void time_range_begin_timer(struct triton_timer_t *t)
 {
 	struct time_range_t *tr = container_of(t, typeof(*tr), begin);
-	struct shaper_pd_t *pd;
 
 	time_range_id = tr->id;
 
 	log_debug("shaper: time_range_begin_timer: id=%i\n", time_range_id);
 
-	pthread_rwlock_rdlock(&shaper_lock);
-	list_for_each_entry(pd, &shaper_list, entry)
-		triton_context_call(pd->ppp->ctrl->ctx, (triton_event_func)update_shaper_tr, pd);
-	pthread_rwlock_unlock(&shaper_lock);
+	update_shaper_tr_all();
 }
 
 static void time_range_end_timer(struct triton_timer_t *t)
 {
-	struct shaper_pd_t *pd;
-
 	time_range_id = 0;
 	
 	log_debug("shaper: time_range_end_timer\n");
 
-	pthread_rwlock_rdlock(&shaper_lock);
-	list_for_each_entry(pd, &shaper_list, entry)
-		triton_context_call(pd->ppp->ctrl->ctx, (triton_event_func)update_shaper_tr, pd);
-	pthread_rwlock_unlock(&shaper_lock);
+	update_shaper_tr_all();
 }
 
 static struct time_range_t *parse_range(const char *val)
@@ -0,0 +1,218 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "triton_p.h"
+
+#include "memdebug.h"
+
+/*
+ * Every thread owns a block of counter pages and increments its own copy
+ * of a counter with plain adds. Readers sum the copies of all blocks.
+ * Blocks of exited threads are handed over to new threads, their values
+ * stay in the sums.
+ *
+ * Freed counters are zeroed and reused only after a grace period, so that
+ * an increment still in flight on another thread can't leak into the next
+ * user of the counter.
+ */
+
+#define COUNTER_GRACE 2000 // ms
+
+struct counter_block_t
+{
+	struct list_head entry;
+	struct list_head free_entry;
+	long *pages[TRITON_COUNTER_MAX >> TRITON_COUNTER_PAGE_BITS];
+};
+
+__export __thread long **triton_counter_pages;
+
+static LIST_HEAD(block_list);
+static LIST_HEAD(free_blocks);
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t block_key;
+static pthread_once_t block_key_once = PTHREAD_ONCE_INIT;
+static uint64_t used[TRITON_COUNTER_MAX / 64];
+
+struct counter_range_t
+{
+	struct list_head entry;
+	int id;
+	int n;
+	uint64_t freed; // ms
+};
+
+static LIST_HEAD(retired_list);
+
+static void block_release(void *arg)
+{
+	struct counter_block_t *b = arg;
+
+	pthread_mutex_lock(&lock);
+	list_add_tail(&b->free_entry, &free_blocks);
+	pthread_mutex_unlock(&lock);
+}
+
+static void block_key_init(void)
+{
+	pthread_key_create(&block_key, block_release);
+}
+
+static struct counter_block_t *block_get(void)
+{
+	struct counter_block_t *b;
+
+	pthread_once(&block_key_once, block_key_init);
+
+	pthread_mutex_lock(&lock);
+	if (!list_empty(&free_blocks)) {
+		b = list_entry(free_blocks.next, typeof(*b), free_entry);
+		list_del(&b->free_entry);
+	} else {
+		b = _malloc(sizeof(*b));
+		if (b) {
+			memset(b, 0, sizeof(*b));
+			list_add_tail(&b->entry, &block_list);
+		}
+	}
+	pthread_mutex_unlock(&lock);
+
+	if (b)
+		pthread_setspecific(block_key, b);
+
+	return b;
+}
+
+/* Slow path of triton_counter_add(), first use of a page by this thread */
+long __export *__triton_counter_slot(int id)
+{
+	static long dummy;
+	struct counter_block_t *b;
+	long *page;
+
+	if (!triton_counter_pages) {
+		b = block_get();
+		if (!b)
+			return &dummy;
+		triton_counter_pages = b->pages;
+	}
+
+	page = triton_counter_pages[id >> TRITON_COUNTER_PAGE_BITS];
+	if (!page) {
+		page = _malloc(TRITON_COUNTER_PAGE_SIZE * sizeof(long));
+		if (!page)
+			return &dummy;
+		memset(page, 0, TRITON_COUNTER_PAGE_SIZE * sizeof(long));
+		__atomic_store_n(&triton_counter_pages[id >> TRITON_COUNTER_PAGE_BITS], page, __ATOMIC_RELEASE);
+	}
+
+	return &page[id & (TRITON_COUNTER_PAGE_SIZE - 1)];
+}
+
+long __export triton_counter_read(int id)
+{
+	struct counter_block_t *b;
+	long *page;
+	long v = 0;
+
+	pthread_mutex_lock(&lock);
+	list_for_each_entry(b, &block_list, entry) {
+		page = __atomic_load_n(&b->pages[id >> TRITON_COUNTER_PAGE_BITS], __ATOMIC_ACQUIRE);
+		if (page)
+			v += page[id & (TRITON_COUNTER_PAGE_SIZE - 1)];
+	}
+	pthread_mutex_unlock(&lock);
+
+	return v;
+}
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Must be called with lock held */
+static void counter_release(int id, int n)
+{
+	struct counter_block_t *b;
+	long *page;
+	int i;
+
+	for (i = id; i < id + n; i++) {
+		list_for_each_entry(b, &block_list, entry) {
+			page = b->pages[i >> TRITON_COUNTER_PAGE_BITS];
+			if (page)
+				page[i & (TRITON_COUNTER_PAGE_SIZE - 1)] = 0;
+		}
+		used[i / 64] &= ~(1ull << (i % 64));
+	}
+}
+
+/* Must be called with lock held */
+static void release_retired(void)
+{
+	struct counter_range_t *r;
+	uint64_t now = now_ms();
+
+	while (!list_empty(&retired_list)) {
+		r = list_entry(retired_list.next, typeof(*r), entry);
+		if (now - r->freed < COUNTER_GRACE)
+			break;
+		list_del(&r->entry);
+		counter_release(r->id, r->n);
+		_free(r);
+	}
+}
+
+/* Allocates n consecutive counters, returns id of the first one or -1 */
+int __export triton_counter_alloc(int n)
+{
+	int id, i, cnt = 0;
+
+	pthread_mutex_lock(&lock);
+	release_retired();
+
+	for (id = TRITON_COUNTER_RESERVED; id < TRITON_COUNTER_MAX; id++) {
+		if (used[id / 64] & (1ull << (id % 64))) {
+			cnt = 0;
+			continue;
+		}
+		if (++cnt == n)
+			break;
+	}
+
+	if (id == TRITON_COUNTER_MAX) {
+		pthread_mutex_unlock(&lock);
+		return -1;
+	}
+
+	id -= n - 1;
+
+	// released counters are zero already
+	for (i = id; i < id + n; i++)
+		used[i / 64] |= 1ull << (i % 64);
+	pthread_mutex_unlock(&lock);
+
+	return id;
+}
+
+void __export triton_counter_free(int id, int n)
+{
+	struct counter_range_t *r = _malloc(sizeof(*r));
+
+	pthread_mutex_lock(&lock);
+	if (r) {
+		r->id = id;
+		r->n = n;
+		r->freed = now_ms();
+		list_add_tail(&r->entry, &retired_list);
+	} else
+		counter_release(id, n);
+	pthread_mutex_unlock(&lock);
+}
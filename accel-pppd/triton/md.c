@@ -12,54 +12,92 @@
 
 extern int max_events;
 
-static int epoll_fd;
-static struct epoll_event *epoll_events;
+struct _triton_md_thread_t
+{
+	int epoll_fd;
+	struct epoll_event *epoll_events;
+	pthread_t thread;
+
+	pthread_mutex_t freed_list_lock;
+	struct list_head freed_list;
+	struct list_head freed_list2;
+};
+
+static int md_thread_count = 1;
+static struct _triton_md_thread_t *md_threads;
 
-static pthread_t md_thr;
 static void *md_thread(void *arg);
 
 static mempool_t *md_pool;
 
-static pthread_mutex_t freed_list_lock = PTHREAD_MUTEX_INITIALIZER;
-static LIST_HEAD(freed_list);
-static LIST_HEAD(freed_list2);
-
 int md_init(void)
 {
-	epoll_fd = epoll_create(1);
-	if (epoll_fd < 0) {
-		perror("md:epoll_create");
-		return -1;
-	}
+	struct _triton_md_thread_t *md;
+	char *opt;
+	int i;
 
-	epoll_events = _malloc(max_events * sizeof(struct epoll_event));
-	if (!epoll_events) {
+	opt = conf_get_opt("core", "md-threads");
+	if (opt && atoi(opt) > 0)
+		md_thread_count = atoi(opt);
+
+	md_threads = _malloc(md_thread_count * sizeof(*md_threads));
+	if (!md_threads) {
 		fprintf(stderr,"md:cann't allocate memory\n");
 		return -1;
 	}
 
+	for (i = 0; i < md_thread_count; i++) {
+		md = &md_threads[i];
+
+		md->epoll_fd = epoll_create(1);
+		if (md->epoll_fd < 0) {
+			perror("md:epoll_create");
+			return -1;
+		}
+
+		md->epoll_events = _malloc(max_events * sizeof(struct epoll_event));
+		if (!md->epoll_events) {
+			fprintf(stderr,"md:cann't allocate memory\n");
+			return -1;
+		}
+
+		pthread_mutex_init(&md->freed_list_lock, NULL);
+		INIT_LIST_HEAD(&md->freed_list);
+		INIT_LIST_HEAD(&md->freed_list2);
+	}
+
 	md_pool = mempool_create(sizeof(struct _triton_md_handler_t));
 
 	return 0;
 }
 void md_run(void)
 {
-	if (pthread_create(&md_thr, NULL, md_thread, NULL)) {
-		triton_log_error("md:pthread_create: %s", strerror(errno));
-		_exit(-1);
+	int i;
+
+	for (i = 0; i < md_thread_count; i++) {
+		if (pthread_create(&md_threads[i].thread, NULL, md_thread, &md_threads[i])) {
+			triton_log_error("md:pthread_create: %s", strerror(errno));
+			_exit(-1);
+		}
 	}
 }
 
 void md_terminate(void)
 {
-	pthread_cancel(md_thr);	
-	pthread_join(md_thr, NULL);	
+	int i;
+
+	for (i = 0; i < md_thread_count; i++) {
+		pthread_cancel(md_threads[i].thread);
+		pthread_join(md_threads[i].thread, NULL);
+	}
 }
 
 static void *md_thread(void *arg)
 {
-	int i,n,r;
+	struct _triton_md_thread_t *md = arg;
+	int i,n;
 	struct _triton_md_handler_t *h;
+	struct _triton_thread_t *t;
 	sigset_t set;
 
 	sigfillset(&set);
@@ -68,53 +106,64 @@ static void *md_thread(void *arg)
 	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
 	while(1) {
-		n = epoll_wait(epoll_fd, epoll_events, max_events, -1);
+		n = epoll_wait(md->epoll_fd, md->epoll_events, max_events, -1);
 		if (n < 0) {
 			if (errno == EINTR)
 				continue;
 			triton_log_error("md:epoll_wait: %s", strerror(errno));
 			_exit(-1);
 		}
-		
+
+		triton_counter_inc(TRITON_COUNTER_MD_WAKEUPS);
+		triton_counter_add(TRITON_COUNTER_MD_EVENTS, n);
+
 		for(i = 0; i < n; i++) {
-			h = (struct _triton_md_handler_t *)epoll_events[i].data.ptr;
+			h = (struct _triton_md_handler_t *)md->epoll_events[i].data.ptr;
 			if (!h->ud)
 				continue;
 			spin_lock(&h->ctx->lock);
 			if (h->ud) {
-				h->trig_epoll_events |= epoll_events[i].events;
+				h->trig_epoll_events |= md->epoll_events[i].events;
 				if (!h->pending) {
 					list_add_tail(&h->entry2, &h->ctx->pending_handlers);
 					h->pending = 1;
 					__sync_add_and_fetch(&triton_stat.md_handler_pending, 1);
-					r = triton_queue_ctx(h->ctx);
+					t = triton_queue_ctx(h->ctx);
 				} else
-					r = 0;
+					t = NULL;
 			} else
-				r = 0;
+				t = NULL;
 			spin_unlock(&h->ctx->lock);
-			if (r)
-				triton_thread_wakeup(h->ctx->thread);
+			if (t)
+				triton_thread_wakeup(t);
 		}
 
-		while (!list_empty(&freed_list2)) {
-			h = list_entry(freed_list2.next, typeof(*h), entry);
+		while (!list_empty(&md->freed_list2)) {
+			h = list_entry(md->freed_list2.next, typeof(*h), entry);
 			list_del(&h->entry);
 			mempool_free(h);
 		}
-		
-		pthread_mutex_lock(&freed_list_lock);
-		while (!list_empty(&freed_list)) {
-			h = list_entry(freed_list.next, typeof(*h), entry);
+
+		pthread_mutex_lock(&md->freed_list_lock);
+		while (!list_empty(&md->freed_list)) {
+			h = list_entry(md->freed_list.next, typeof(*h), entry);
 			list_del(&h->entry);
-			list_add(&h->entry, &freed_list2);
+			list_add(&h->entry, &md->freed_list2);
 		}
-		pthread_mutex_unlock(&freed_list_lock);
+		pthread_mutex_unlock(&md->freed_list_lock);
 	}
 
 	return NULL;
 }
 
+static struct _triton_md_thread_t *md_select(struct _triton_context_t *ctx)
+{
+	unsigned long hash = (unsigned long)ctx / sizeof(*ctx);
+
+	// all handlers of a context are served by the same md thread
+	return &md_threads[(hash * 2654435761u) % md_thread_count];
+}
+
 void __export triton_md_register_handler(struct triton_context_t *ctx, struct triton_md_handler_t *ud)
 {
 	struct _triton_md_handler_t *h = mempool_alloc(md_pool);
@@ -125,18 +174,19 @@ void __export triton_md_register_handler(struct triton_context_t *ctx, struct tr
 		h->ctx = (struct _triton_context_t *)ctx->tpd;
 	else
 		h->ctx = (struct _triton_context_t *)default_ctx.tpd;
+	h->md = md_select(h->ctx);
 	ud->tpd = h;
 	spin_lock(&h->ctx->lock);
 	list_add_tail(&h->entry, &h->ctx->handlers);
 	spin_unlock(&h->ctx->lock);
 
-	triton_stat.md_handler_count++;
+	__sync_add_and_fetch(&triton_stat.md_handler_count, 1);
 }
 void __export triton_md_unregister_handler(struct triton_md_handler_t *ud)
 {
 	struct _triton_md_handler_t *h = (struct _triton_md_handler_t *)ud->tpd;
 	triton_md_disable_handler(ud, MD_MODE_READ | MD_MODE_WRITE);
-	
+
 	spin_lock(&h->ctx->lock);
 	h->ud = NULL;
 	list_del(&h->entry);
@@ -148,13 +198,13 @@ void __export triton_md_unregister_handler(struct triton_md_handler_t *ud)
 
 	sched_yield();
 
-	pthread_mutex_lock(&freed_list_lock);
-	list_add_tail(&h->entry, &freed_list);
-	pthread_mutex_unlock(&freed_list_lock);
+	pthread_mutex_lock(&h->md->freed_list_lock);
+	list_add_tail(&h->entry, &h->md->freed_list);
+	pthread_mutex_unlock(&h->md->freed_list_lock);
 
 	ud->tpd = NULL;
 
-	triton_stat.md_handler_count--;
+	__sync_sub_and_fetch(&triton_stat.md_handler_count, 1);
 }
 int __export triton_md_enable_handler(struct triton_md_handler_t *ud, int mode)
 {
@@ -166,14 +216,14 @@ int __export triton_md_enable_handler(struct triton_md_handler_t *ud, int mode)
 		h->epoll_event.events |= EPOLLIN;
 	if (mode & MD_MODE_WRITE)
 		h->epoll_event.events |= EPOLLOUT;
-	
+
 	if (!h->trig_level)
 		h->epoll_event.events |= EPOLLET;
-	
+
 	if (events)
-		r = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
+		r = epoll_ctl(h->md->epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
 	else
-		r = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, h->ud->fd, &h->epoll_event);
+		r = epoll_ctl(h->md->epoll_fd, EPOLL_CTL_ADD, h->ud->fd, &h->epoll_event);
 
 	if (r) {
 		triton_log_error("md:epoll_ctl: %s",strerror(errno));
@@ -189,17 +239,17 @@ int __export triton_md_disable_handler(struct triton_md_handler_t *ud,int mode)
 
 	if (!h->epoll_event.events)
 		return -1;
-	
+
 	if (mode & MD_MODE_READ)
 		h->epoll_event.events &= ~EPOLLIN;
 	if (mode & MD_MODE_WRITE)
 		h->epoll_event.events &= ~EPOLLOUT;
 
 	if (h->epoll_event.events & (EPOLLIN | EPOLLOUT))
-		r = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
+		r = epoll_ctl(h->md->epoll_fd, EPOLL_CTL_MOD, h->ud->fd, &h->epoll_event);
 	else {
 		h->epoll_event.events = 0;
-		r = epoll_ctl(epoll_fd, EPOLL_CTL_DEL, h->ud->fd, NULL);
+		r = epoll_ctl(h->md->epoll_fd, EPOLL_CTL_DEL, h->ud->fd, NULL);
 	}
 
 	if (r) {
@@ -15,66 +15,160 @@
 #define DELAY 5
 #endif
 
-//#define MEMPOOL_DISABLE
-
 #define MAGIC1 0x2233445566778899llu
 #define PAGE_ORDER 5
+#define MAG_SIZE 32
+#define SLAB_MIN_OBJECTS 8
+#define RECLAIM_INTERVAL 10000
 
 static int conf_mempool_min = 128;
 
 struct _mempool_t
 {
 	struct list_head entry;
+	int id;
 	int size;
-	struct list_head items;
 #ifdef MEMDEBUG
+	struct list_head items;
 	struct list_head ditems;
-#endif
-	spinlock_t lock;
 	uint64_t magic;
 	int mmap:1;
+#else
+	int obj_size;
+	int slab_size;
+	int slab_objects;
+	struct list_head partial;
+	struct list_head full;
+	struct list_head empty;
+	struct list_head reclaimed;
+#endif
+	struct list_head mags;
+	spinlock_t lock;
 	int objects;
+	unsigned long allocated;
 };
 
+#ifndef MEMDEBUG
+/*
+ * Objects are carved from page-multiple slabs which are mmap'ed per pool.
+ * Free objects of a slab are chained through their first word. Slabs which
+ * became completely free are returned to the OS by the reclaimer (the
+ * mapping and the descriptor are kept for reuse), as long as the pool
+ * still has mempool-min free objects.
+ */
+struct _mempool_slab_t
+{
+	struct list_head entry;
+	struct _mempool_t *pool;
+	void *mem;
+	void *free;
+	int inuse;
+};
+#endif
+
 struct _item_t
 {
+#ifdef MEMDEBUG
 	struct list_head entry;
 #ifdef VALGRIND
 	time_t timestamp;
 #endif
 	struct _mempool_t *owner;
-#ifdef MEMDEBUG
 	const char *fname;
 	int line;
-#endif
 	uint64_t magic2;
 	uint64_t magic1;
+#else
+	struct _mempool_slab_t *slab;
+#endif
 	char ptr[0];
 };
 
+/*
+ * Per-thread cache of free objects of one pool, so that alloc/free pairs
+ * on the same thread don't touch the pool lock. It is refilled from and
+ * flushed to the pool by halves.
+ */
+struct _mempool_mag_t
+{
+	struct list_head entry;
+	struct _mempool_t *pool;
+	int cnt;
+	struct _item_t *items[MAG_SIZE];
+};
+
+struct _mempool_mags_t
+{
+	int size;
+	struct _mempool_mag_t *mags[0];
+};
+
 static LIST_HEAD(pools);
+static int pools_cnt;
 static spinlock_t pools_lock = SPINLOCK_INITIALIZER;
+
+#ifdef MEMDEBUG
 static spinlock_t mmap_lock = SPINLOCK_INITIALIZER;
 static void *mmap_ptr;
 static void *mmap_endptr;
+static unsigned long mmap_total;
 
 static int mmap_grow(void);
+#else
+static long page_size;
+
+static pthread_key_t mags_key;
+static __thread struct _mempool_mags_t *this_mags;
+
+static struct triton_timer_t reclaim_timer;
+#endif
+
 static void mempool_clean(void);
 
 mempool_t __export *mempool_create(int size)
 {
-	struct _mempool_t *p = _malloc(sizeof(*p));
+	struct _mempool_t *p;
+#ifndef MEMDEBUG
+	int obj_size;
+
+	// size classes of 16 bytes, pools of the same class share slabs
+	if (size < sizeof(void *))
+		size = sizeof(void *);
+	size = (size + 15) & ~15;
+	obj_size = sizeof(struct _item_t) + size;
+
+	spin_lock(&pools_lock);
+	list_for_each_entry(p, &pools, entry) {
+		if (p->obj_size == obj_size) {
+			spin_unlock(&pools_lock);
+			return (mempool_t *)p;
+		}
+	}
+	spin_unlock(&pools_lock);
+#endif
+
+	p = _malloc(sizeof(*p));
 
 	memset(p, 0, sizeof(*p));
-	INIT_LIST_HEAD(&p->items);
 #ifdef MEMDEBUG
+	INIT_LIST_HEAD(&p->items);
 	INIT_LIST_HEAD(&p->ditems);
+	p->magic = (uint64_t)random() * (uint64_t)random();
+#else
+	INIT_LIST_HEAD(&p->partial);
+	INIT_LIST_HEAD(&p->full);
+	INIT_LIST_HEAD(&p->empty);
+	INIT_LIST_HEAD(&p->reclaimed);
+	p->obj_size = obj_size;
+	p->slab_size = (SLAB_MIN_OBJECTS * obj_size + page_size - 1) & ~(page_size - 1);
+	p->slab_objects = p->slab_size / obj_size;
 #endif
+	INIT_LIST_HEAD(&p->mags);
 	spinlock_init(&p->lock);
 	p->size = size;
-	p->magic = (uint64_t)random() * (uint64_t)random();
 
 	spin_lock(&pools_lock);
+	p->id = pools_cnt++;
 	list_add_tail(&p->entry, &pools);
 	spin_unlock(&pools_lock);
 
@@ -84,62 +178,274 @@ mempool_t __export *mempool_create(int size)
 mempool_t __export *mempool_create2(int size)
 {
 	struct _mempool_t *p = (struct _mempool_t *)mempool_create(size);
-	
+
+#ifdef MEMDEBUG
 	p->mmap = 1;
+#endif
 
 	return (mempool_t *)p;
 }
 
 #ifndef MEMDEBUG
-void __export *mempool_alloc(mempool_t *pool)
+static void slab_init(struct _mempool_slab_t *slab)
 {
-	struct _mempool_t *p = (struct _mempool_t *)pool;
+	struct _mempool_t *p = slab->pool;
 	struct _item_t *it;
-	uint32_t size = sizeof(*it) + p->size + 8;
+	void *next = NULL;
+	int i;
+
+	for (i = p->slab_objects - 1; i >= 0; i--) {
+		it = slab->mem + i * p->obj_size;
+		it->slab = slab;
+		*(void **)it->ptr = next;
+		next = it;
+	}
 
-	spin_lock(&p->lock);
-	if (!list_empty(&p->items)) {
-		it = list_entry(p->items.next, typeof(*it), entry);
-		list_del(&it->entry);
-		spin_unlock(&p->lock);
+	slab->free = next;
+	slab->inuse = 0;
+}
 
-		--p->objects;
-		__sync_sub_and_fetch(&triton_stat.mempool_available, size);
-		
-		it->magic1 = MAGIC1;
+static struct _mempool_slab_t *slab_create(struct _mempool_t *p)
+{
+	struct _mempool_slab_t *slab;
 
-		return it->ptr;
-#ifdef VALGRIND
+	slab = _malloc(sizeof(*slab));
+	if (!slab)
+		return NULL;
+
+	slab->mem = mmap(NULL, p->slab_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (slab->mem == MAP_FAILED) {
+		_free(slab);
+		return NULL;
+	}
+
+	slab->pool = p;
+
+	return slab;
+}
+
+// takes up to n objects, returns the number taken
+static int pool_get(struct _mempool_t *p, struct _item_t **items, int n)
+{
+	struct _mempool_slab_t *slab;
+	struct _item_t *it;
+	int cnt = 0;
+
+	spin_lock(&p->lock);
+	while (cnt < n) {
+		if (list_empty(&p->partial)) {
+			if (!list_empty(&p->empty))
+				list_move(p->empty.next, &p->partial);
+			else {
+				if (!list_empty(&p->reclaimed)) {
+					slab = list_entry(p->reclaimed.next, typeof(*slab), entry);
+					list_del(&slab->entry);
+					spin_unlock(&p->lock);
+				} else {
+					spin_unlock(&p->lock);
+					slab = slab_create(p);
+					if (!slab)
+						return cnt;
+				}
+
+				slab_init(slab);
+
+				spin_lock(&p->lock);
+				list_add(&slab->entry, &p->partial);
+				p->objects += p->slab_objects;
+				p->allocated += p->slab_size;
+			}
 		}
-#endif
+
+		slab = list_entry(p->partial.next, typeof(*slab), entry);
+		while (cnt < n && slab->free) {
+			it = slab->free;
+			slab->free = *(void **)it->ptr;
+			slab->inuse++;
+			p->objects--;
+			items[cnt++] = it;
+		}
+
+		if (!slab->free)
+			list_move(&slab->entry, &p->full);
 	}
 	spin_unlock(&p->lock);
 
-	if (p->mmap) {
-		spin_lock(&mmap_lock);
-		if (mmap_ptr + size >= mmap_endptr) {
-			if (mmap_grow())
-				return NULL;
-		}
-		it = (struct _item_t *)mmap_ptr;
-		mmap_ptr += size;
-		spin_unlock(&mmap_lock);
-		__sync_sub_and_fetch(&triton_stat.mempool_available, size);
-	}	else {
-		it = _malloc(size);
-		__sync_add_and_fetch(&triton_stat.mempool_allocated, size);
+	return cnt;
+}
+
+static void pool_put(struct _mempool_t *p, struct _item_t **items, int n)
+{
+	struct _mempool_slab_t *slab;
+	struct _item_t *it;
+
+	spin_lock(&p->lock);
+	while (n--) {
+		it = items[n];
+		slab = it->slab;
+		*(void **)it->ptr = slab->free;
+		slab->free = it;
+		p->objects++;
+		if (--slab->inuse == 0)
+			list_move(&slab->entry, &p->empty);
+		else if (slab->inuse == p->slab_objects - 1)
+			list_move(&slab->entry, &p->partial);
 	}
+	spin_unlock(&p->lock);
+}
 
-	if (!it) {
-		triton_log_error("mempool: out of memory");
+// returns empty slabs to the OS while the pool keeps at least min free objects
+static void pool_reclaim(struct _mempool_t *p, int min)
+{
+	struct _mempool_slab_t *slab;
+	LIST_HEAD(list);
+
+	spin_lock(&p->lock);
+	while (!list_empty(&p->empty) && p->objects - p->slab_objects >= min) {
+		slab = list_entry(p->empty.next, typeof(*slab), entry);
+		list_move(&slab->entry, &list);
+		p->objects -= p->slab_objects;
+		p->allocated -= p->slab_size;
+	}
+	spin_unlock(&p->lock);
+
+	if (list_empty(&list))
+		return;
+
+	list_for_each_entry(slab, &list, entry)
+		madvise(slab->mem, p->slab_size, MADV_DONTNEED);
+
+	spin_lock(&p->lock);
+	list_splice(&list, &p->reclaimed);
+	spin_unlock(&p->lock);
+}
+
+static struct _mempool_mag_t *mag_create(struct _mempool_t *p)
+{
+	struct _mempool_mags_t *mags = this_mags;
+	struct _mempool_mag_t *mag;
+	int old_size = mags ? mags->size : 0;
+	int size;
+
+	if (p->id >= old_size) {
+		size = pools_cnt + 16;
+		mags = _realloc(mags, sizeof(*mags) + size * sizeof(mag));
+		if (!mags)
+			return NULL;
+		memset(mags->mags + old_size, 0, (size - old_size) * sizeof(mag));
+		mags->size = size;
+		this_mags = mags;
+		pthread_setspecific(mags_key, mags);
+	}
+
+	mag = _malloc(sizeof(*mag));
+	if (!mag)
 		return NULL;
+
+	mag->pool = p;
+	mag->cnt = 0;
+
+	spin_lock(&p->lock);
+	list_add_tail(&mag->entry, &p->mags);
+	spin_unlock(&p->lock);
+
+	mags->mags[p->id] = mag;
+
+	return mag;
+}
+
+static inline struct _mempool_mag_t *mag_get(struct _mempool_t *p)
+{
+	struct _mempool_mags_t *mags = this_mags;
+
+	if (mags && p->id < mags->size && mags->mags[p->id])
+		return mags->mags[p->id];
+
+	return mag_create(p);
+}
+
+static void mags_destroy(void *arg)
+{
+	struct _mempool_mags_t *mags = arg;
+	struct _mempool_mag_t *mag;
+	int i;
+
+	for (i = 0; i < mags->size; i++) {
+		mag = mags->mags[i];
+		if (!mag)
+			continue;
+		pool_put(mag->pool, mag->items, mag->cnt);
+		spin_lock(&mag->pool->lock);
+		list_del(&mag->entry);
+		spin_unlock(&mag->pool->lock);
+		_free(mag);
 	}
-	it->owner = p;
-	it->magic2 = p->magic;
-	it->magic1 = MAGIC1;
-	*(uint64_t*)(it->ptr + p->size) = it->magic2;
 
-	return it->ptr;
+	_free(mags);
+}
+
+void __export *mempool_alloc(mempool_t *pool)
+{
+	struct _mempool_t *p = (struct _mempool_t *)pool;
+	struct _mempool_mag_t *mag = mag_get(p);
+	struct _item_t *it;
+
+	if (mag) {
+		if (!mag->cnt)
+			mag->cnt = pool_get(p, mag->items, MAG_SIZE / 2);
+		if (mag->cnt)
+			return mag->items[--mag->cnt]->ptr;
+	} else if (pool_get(p, &it, 1))
+		return it->ptr;
+
+	triton_log_error("mempool: out of memory");
+	return NULL;
+}
+
+void __export mempool_free(void *ptr)
+{
+	struct _item_t *it = container_of(ptr, typeof(*it), ptr);
+	struct _mempool_t *p = it->slab->pool;
+	struct _mempool_mag_t *mag = mag_get(p);
+
+	if (!mag) {
+		pool_put(p, &it, 1);
+		return;
+	}
+
+	if (mag->cnt == MAG_SIZE) {
+		mag->cnt -= MAG_SIZE / 2;
+		pool_put(p, mag->items + mag->cnt, MAG_SIZE / 2);
+	}
+
+	mag->items[mag->cnt++] = it;
+}
+
+static void mempool_clean(void)
+{
+	struct _mempool_t *p;
+
+	triton_log_error("mempool: clean");
+
+	spin_lock(&pools_lock);
+	list_for_each_entry(p, &pools, entry)
+		pool_reclaim(p, 0);
+	spin_unlock(&pools_lock);
+}
+
+static void reclaim_timer_func(struct triton_timer_t *t)
+{
+	struct _mempool_t *p;
+
+	spin_lock(&pools_lock);
+	list_for_each_entry(p, &pools, entry)
+		pool_reclaim(p, conf_mempool_min);
+	spin_unlock(&pools_lock);
+}
+
+static int item_size(struct _mempool_t *p)
+{
+	return p->obj_size;
 }
 #else
 
@@ -159,14 +465,12 @@ void __export *mempool_alloc_md(mempool_t *pool, const char *fname, int line)
 #endif
 		list_del(&it->entry);
 		list_add(&it->entry, &p->ditems);
+		--p->objects;
 		spin_unlock(&p->lock);
 
 		it->fname = fname;
 		it->line = line;
-		
-		--p->objects;
-		__sync_sub_and_fetch(&triton_stat.mempool_available, size);
-		
+
 		it->magic1 = MAGIC1;
 
 		return it->ptr;
@@ -178,15 +482,19 @@ void __export *mempool_alloc_md(mempool_t *pool, const char *fname, int line)
 
 	if (p->mmap) {
 		spin_lock(&mmap_lock);
-		if (mmap_ptr + size >= mmap_endptr)
-			mmap_grow();
+		if (mmap_ptr + size >= mmap_endptr) {
+			if (mmap_grow()) {
+				spin_unlock(&mmap_lock);
+				return NULL;
+			}
+		}
 		it = (struct _item_t *)mmap_ptr;
 		mmap_ptr += size;
 		spin_unlock(&mmap_lock);
-		__sync_sub_and_fetch(&triton_stat.mempool_available, size);
 	}	else {
 		it = md_malloc(size, fname, line);
-		__sync_add_and_fetch(&triton_stat.mempool_allocated, size);
+		if (it)
+			__sync_add_and_fetch(&p->allocated, size);
 	}
 
 	if (!it) {
@@ -206,7 +514,6 @@ void __export *mempool_alloc_md(mempool_t *pool, const char *fname, int line)
 
 	return it->ptr;
 }
-#endif
 
 void __export mempool_free(void *ptr)
 {
@@ -215,7 +522,6 @@ void __export mempool_free(void *ptr)
 	uint32_t size = sizeof(*it) + it->owner->size + 8;
 	int need_free = 0;
 
-#ifdef MEMDEBUG
 	if (it->magic1 != MAGIC1) {
 		triton_log_error("mempool: memory corruption detected");
 		abort();
@@ -232,38 +538,26 @@ void __export mempool_free(void *ptr)
 	}
 
 	it->magic1 = 0;
-#endif
 
 	spin_lock(&p->lock);
-#ifdef MEMDEBUG
 	list_del(&it->entry);
-#endif
-#ifndef MEMPOOL_DISABLE
-	if (p->objects < conf_mempool_min) {
+	if (p->objects < conf_mempool_min || p->mmap) {
 		++p->objects;
 		list_add_tail(&it->entry,&it->owner->items);
 	} else
 		need_free = 1;
-#endif
 #ifdef VALGRIND
 	time(&it->timestamp);
 	VALGRIND_MAKE_MEM_NOACCESS(&it->owner, size - sizeof(it->entry) - sizeof(it->timestamp));
 #endif
 	spin_unlock(&p->lock);
 
-#ifdef MEMPOOL_DISABLE
-	_free(it);
-#else
 	if (need_free) {
 		_free(it);
-		__sync_sub_and_fetch(&triton_stat.mempool_allocated, size);
-	} else
-		__sync_add_and_fetch(&triton_stat.mempool_available, size);
-#endif
-
+		__sync_sub_and_fetch(&p->allocated, size);
+	}
 }
 
-#ifdef MEMDEBUG
 void __export mempool_show(mempool_t *pool)
 {
 	struct _mempool_t *p = (struct _mempool_t *)pool;
@@ -274,7 +568,6 @@ void __export mempool_show(mempool_t *pool)
 		triton_log_error("%s:%i %p\n", it->fname, it->line, it->ptr);
 	spin_unlock(&p->lock);
 }
-#endif
 
 static void mempool_clean(void)
 {
@@ -297,9 +590,9 @@ static void mempool_clean(void)
 			VALGRIND_MAKE_MEM_DEFINED(&it->owner, size - sizeof(it->entry) - sizeof(it->timestamp));
 #endif
 			list_del(&it->entry);
+			--p->objects;
 			_free(it);
-			__sync_sub_and_fetch(&triton_stat.mempool_allocated, size);
-			__sync_sub_and_fetch(&triton_stat.mempool_available, size);
+			__sync_sub_and_fetch(&p->allocated, size);
 #ifdef VALGRIND
 			} else
 				break;
@@ -310,9 +603,9 @@ static void mempool_clean(void)
 	spin_unlock(&pools_lock);
 }
 
-static void sigclean(int num)
+static int item_size(struct _mempool_t *p)
 {
-	mempool_clean();
+	return sizeof(struct _item_t) + p->size + 8;
 }
 
 static int mmap_grow(void)
@@ -334,21 +627,74 @@ static int mmap_grow(void)
 	}
 
 	mmap_endptr = ptr + size;
-		
-	__sync_add_and_fetch(&triton_stat.mempool_allocated, size);
-	__sync_add_and_fetch(&triton_stat.mempool_available, size);
+	mmap_total += size;
 
 	return 0;
 oom:
 	triton_log_error("mempool: out of memory");
 	return -1;
 }
+#endif
+
+struct mempool_stat_t __export mempool_get_stat(void)
+{
+	struct mempool_stat_t stat;
+	struct _mempool_t *p;
+	struct _mempool_mag_t *mag;
+	unsigned long allocated = 0, available = 0;
+	int objects;
+
+	spin_lock(&pools_lock);
+	list_for_each_entry(p, &pools, entry) {
+		spin_lock(&p->lock);
+		objects = p->objects;
+		list_for_each_entry(mag, &p->mags, entry)
+			objects += mag->cnt;
+		allocated += p->allocated;
+		spin_unlock(&p->lock);
+
+		available += objects * item_size(p);
+	}
+	spin_unlock(&pools_lock);
+
+#ifdef MEMDEBUG
+	spin_lock(&mmap_lock);
+	allocated += mmap_total;
+	available += mmap_endptr - mmap_ptr;
+	spin_unlock(&mmap_lock);
+#endif
+
+	stat.allocated = allocated;
+	stat.available = available;
+
+	return stat;
+}
+
+static void sigclean(int num)
+{
+	mempool_clean();
+}
+
+void mempool_run(void)
+{
+	char *opt;
+
+	opt = conf_get_opt("core", "mempool-min");
+	if (opt && atoi(opt) >= 0)
+		conf_mempool_min = atoi(opt);
+
+#ifndef MEMDEBUG
+	reclaim_timer.expire = reclaim_timer_func;
+	reclaim_timer.period = RECLAIM_INTERVAL;
+	triton_timer_add(NULL, &reclaim_timer, 0);
+#endif
+}
 
 static void __init init(void)
 {
 	sigset_t set;
 	sigfillset(&set);
-	
+
 	struct sigaction sa = {
 		.sa_handler = sigclean,
 		.sa_mask = set,
@@ -356,6 +702,10 @@ static void __init init(void)
 
 	sigaction(35, &sa, NULL);
 
+#ifdef MEMDEBUG
 	mmap_grow();
+#else
+	page_size = sysconf(_SC_PAGE_SIZE);
+	pthread_key_create(&mags_key, mags_destroy);
+#endif
 }
-
@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <time.h>
 
 #ifdef HAVE_TIMERFD
 #include <sys/timerfd.h>
@@ -18,10 +19,46 @@
 
 #include "memdebug.h"
 
+/*
+ * Relative timers are kept in a hierarchical timer wheel (the classic
+ * five level cascading scheme) with 1ms ticks. The whole wheel is driven
+ * by a single one-shot timerfd which is armed to the nearest non-empty slot,
+ * so an idle wheel doesn't wake the timer thread at all.
+ * Absolute (CLOCK_REALTIME) timers are rare and must follow wall clock
+ * changes, so they still use their own timerfd.
+ */
+
+#define TVN_BITS 6
+#define TVR_BITS 8
+#define TVN_SIZE (1 << TVN_BITS)
+#define TVR_SIZE (1 << TVR_BITS)
+#define TVN_MASK (TVN_SIZE - 1)
+#define TVR_MASK (TVR_SIZE - 1)
+#define MAX_TVAL ((1llu << (TVR_BITS + 4 * TVN_BITS)) - 1)
+
+#define INDEX(n) ((wheel.timer_jiffies >> (TVR_BITS + (n) * TVN_BITS)) & TVN_MASK)
+
+struct timer_wheel_t
+{
+	spinlock_t lock;
+	int fd;
+	struct epoll_event epoll_event;
+	uint64_t timer_jiffies;
+	uint64_t armed;
+	int count;
+	struct list_head tv1[TVR_SIZE];
+	struct list_head tv2[TVN_SIZE];
+	struct list_head tv3[TVN_SIZE];
+	struct list_head tv4[TVN_SIZE];
+	struct list_head tv5[TVN_SIZE];
+};
+
 extern int max_events;
 static int epoll_fd;
 static struct epoll_event *epoll_events;
 
+static struct timer_wheel_t wheel;
+
 static pthread_t timer_thr;
 static void *timer_thread(void *arg);
 
@@ -31,8 +68,163 @@ static pthread_mutex_t freed_list_lock = PTHREAD_MUTEX_INITIALIZER;
 static LIST_HEAD(freed_list);
 static LIST_HEAD(freed_list2);
 
+static uint64_t get_jiffies(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void wheel_add(struct _triton_timer_t *t)
+{
+	uint64_t expires = t->expires;
+	uint64_t idx = expires - wheel.timer_jiffies;
+	struct list_head *vec;
+
+	if ((int64_t)idx < 0) {
+		vec = wheel.tv1 + (wheel.timer_jiffies & TVR_MASK);
+	} else if (idx < TVR_SIZE) {
+		vec = wheel.tv1 + (expires & TVR_MASK);
+	} else if (idx < 1 << (TVR_BITS + TVN_BITS)) {
+		vec = wheel.tv2 + ((expires >> TVR_BITS) & TVN_MASK);
+	} else if (idx < 1 << (TVR_BITS + 2 * TVN_BITS)) {
+		vec = wheel.tv3 + ((expires >> (TVR_BITS + TVN_BITS)) & TVN_MASK);
+	} else if (idx < 1 << (TVR_BITS + 3 * TVN_BITS)) {
+		vec = wheel.tv4 + ((expires >> (TVR_BITS + 2 * TVN_BITS)) & TVN_MASK);
+	} else {
+		if (idx > MAX_TVAL) {
+			idx = MAX_TVAL;
+			expires = idx + wheel.timer_jiffies;
+		}
+		vec = wheel.tv5 + ((expires >> (TVR_BITS + 3 * TVN_BITS)) & TVN_MASK);
+	}
+
+	list_add_tail(&t->wheel_entry, vec);
+}
+
+static int wheel_cascade(struct list_head *tv, int index)
+{
+	struct _triton_timer_t *t;
+	LIST_HEAD(list);
+
+	list_splice_init(tv + index, &list);
+
+	while (!list_empty(&list)) {
+		t = list_entry(list.next, typeof(*t), wheel_entry);
+		list_del(&t->wheel_entry);
+		wheel_add(t);
+	}
+
+	return index;
+}
+
+static uint64_t wheel_next(void)
+{
+	uint64_t j = wheel.timer_jiffies;
+
+	if (!wheel.count)
+		return 0;
+
+	do {
+		if (!list_empty(&wheel.tv1[j & TVR_MASK]))
+			return j;
+		j++;
+	} while (j & TVR_MASK);
+
+	/* wake up at the next cascade point */
+	return j;
+}
+
+static void wheel_arm(uint64_t expires)
+{
+	struct itimerspec ts;
+
+	memset(&ts, 0, sizeof(ts));
+
+	if (expires) {
+		ts.it_value.tv_sec = expires / 1000;
+		ts.it_value.tv_nsec = (expires % 1000) * 1000000;
+	}
+
+	if (timerfd_settime(wheel.fd, TFD_TIMER_ABSTIME, &ts, NULL))
+		triton_log_error("timer:timerfd_settime: %s", strerror(errno));
+
+	wheel.armed = expires;
+}
+
+static void timer_queue(struct _triton_timer_t *t)
+{
+	struct _triton_thread_t *thread = NULL;
+
+	spin_lock(&t->ctx->lock);
+	if (t->ud && !t->pending) {
+		list_add_tail(&t->entry2, &t->ctx->pending_timers);
+		t->pending = 1;
+		__sync_add_and_fetch(&triton_stat.timer_pending, 1);
+		thread = triton_queue_ctx(t->ctx);
+	}
+	spin_unlock(&t->ctx->lock);
+
+	if (thread)
+		triton_thread_wakeup(thread);
+}
+
+static void wheel_run(void)
+{
+	uint64_t now = get_jiffies();
+	uint64_t period;
+	struct _triton_timer_t *t;
+	LIST_HEAD(list);
+	int index;
+
+	spin_lock(&wheel.lock);
+
+	while (wheel.count && wheel.timer_jiffies <= now) {
+		index = wheel.timer_jiffies & TVR_MASK;
+
+		if (!index &&
+			!wheel_cascade(wheel.tv2, INDEX(0)) &&
+			!wheel_cascade(wheel.tv3, INDEX(1)) &&
+			!wheel_cascade(wheel.tv4, INDEX(2)))
+			wheel_cascade(wheel.tv5, INDEX(3));
+
+		wheel.timer_jiffies++;
+
+		list_splice_init(wheel.tv1 + index, &list);
+
+		while (!list_empty(&list)) {
+			t = list_entry(list.next, typeof(*t), wheel_entry);
+			list_del(&t->wheel_entry);
+
+			timer_queue(t);
+
+			period = t->ud->period;
+			if (period) {
+				t->expires += period;
+				if (t->expires <= now)
+					t->expires = now + period;
+				wheel_add(t);
+			} else {
+				t->queued = 0;
+				wheel.count--;
+			}
+		}
+	}
+
+	if (!wheel.count)
+		wheel.timer_jiffies = now;
+
+	wheel_arm(wheel_next());
+
+	spin_unlock(&wheel.lock);
+}
+
 int timer_init(void)
 {
+	int i;
+
 	epoll_fd = epoll_create(1);
 	if (epoll_fd < 0) {
 		perror("timer:epoll_create");
@@ -45,6 +237,35 @@ int timer_init(void)
 		return -1;
 	}
 
+	spinlock_init(&wheel.lock);
+
+	for (i = 0; i < TVR_SIZE; i++)
+		INIT_LIST_HEAD(&wheel.tv1[i]);
+
+	for (i = 0; i < TVN_SIZE; i++) {
+		INIT_LIST_HEAD(&wheel.tv2[i]);
+		INIT_LIST_HEAD(&wheel.tv3[i]);
+		INIT_LIST_HEAD(&wheel.tv4[i]);
+		INIT_LIST_HEAD(&wheel.tv5[i]);
+	}
+
+	wheel.timer_jiffies = get_jiffies();
+
+	wheel.fd = timerfd_create(CLOCK_MONOTONIC, 0);
+	if (wheel.fd < 0) {
+		perror("timer:timerfd_create");
+		return -1;
+	}
+
+	fcntl(wheel.fd, F_SETFL, O_NONBLOCK);
+
+	wheel.epoll_event.data.ptr = NULL;
+	wheel.epoll_event.events = EPOLLIN | EPOLLET;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wheel.fd, &wheel.epoll_event)) {
+		perror("timer:epoll_ctl");
+		return -1;
+	}
+
 	timer_pool = mempool_create(sizeof(struct _triton_timer_t));
 
 	return 0;
@@ -66,9 +287,10 @@ void timer_terminate(void)
 
 void *timer_thread(void *arg)
 {
-	int i,n,r;
+	int i,n;
 	struct _triton_timer_t *t;
 	sigset_t set;
+	uint64_t tt;
 
 	sigfillset(&set);
 	sigdelset(&set, SIGKILL);
@@ -83,25 +305,17 @@ void *timer_thread(void *arg)
 			triton_log_error("timer:epoll_wait: %s", strerror(errno));
 			_exit(-1);
 		}
-		
+
 		for(i = 0; i < n; i++) {
 			t = (struct _triton_timer_t *)epoll_events[i].data.ptr;
+			if (!t) {
+				read(wheel.fd, &tt, sizeof(tt));
+				wheel_run();
+				continue;
+			}
 			if (!t->ud)
 				continue;
-			spin_lock(&t->ctx->lock);
-			if (t->ud) {
-				if (!t->pending) {
-					list_add_tail(&t->entry2, &t->ctx->pending_timers);
-					t->pending = 1;
-					__sync_add_and_fetch(&triton_stat.timer_pending, 1);
-					r = triton_queue_ctx(t->ctx);
-				} else
-					r = 0;
-			} else
-				r = 0;
-			spin_unlock(&t->ctx->lock);
-			if (r)
-				triton_thread_wakeup(t->ctx->thread);
+			timer_queue(t);
 		}
 
 		while (!list_empty(&freed_list2)) {
@@ -129,34 +343,38 @@ int __export triton_timer_add(struct triton_context_t *ctx, struct triton_timer_
 
 	memset(t, 0, sizeof(*t));
 	t->ud = ud;
+	t->fd = -1;
 	t->epoll_event.data.ptr = t;
 	t->epoll_event.events = EPOLLIN | EPOLLET;
 	if (ctx)
 		t->ctx = (struct _triton_context_t *)ctx->tpd;
 	else
 		t->ctx = (struct _triton_context_t *)default_ctx.tpd;
-	t->fd = timerfd_create(abs_time ? CLOCK_REALTIME : CLOCK_MONOTONIC, 0);
-	if (t->fd < 0) {
-		triton_log_error("timer:timerfd_create: %s", strerror(errno));
-		mempool_free(t);
-		return -1;
-	}
 
-	if (fcntl(t->fd, F_SETFL, O_NONBLOCK)) { 
-    triton_log_error("timer: failed to set nonblocking mode: %s", strerror(errno));
-    goto out_err;
+	if (abs_time) {
+		t->fd = timerfd_create(CLOCK_REALTIME, 0);
+		if (t->fd < 0) {
+			triton_log_error("timer:timerfd_create: %s", strerror(errno));
+			mempool_free(t);
+			return -1;
+		}
+
+		if (fcntl(t->fd, F_SETFL, O_NONBLOCK)) {
+			triton_log_error("timer: failed to set nonblocking mode: %s", strerror(errno));
+			goto out_err;
+		}
 	}
-	
+
 	ud->tpd = t;
 
 	if (triton_timer_mod(ud, abs_time))
 		goto out_err;
-	
+
 	spin_lock(&t->ctx->lock);
 	list_add_tail(&t->entry, &t->ctx->timers);
 	spin_unlock(&t->ctx->lock);
-	
-	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, t->fd, &t->epoll_event)) {
+
+	if (t->fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, t->fd, &t->epoll_event)) {
 		triton_log_error("timer:epoll_ctl: %s", strerror(errno));
 		spin_lock(&t->ctx->lock);
 		t->ud = NULL;
@@ -165,16 +383,52 @@ int __export triton_timer_add(struct triton_context_t *ctx, struct triton_timer_
 		goto out_err;
 	}
 
-	triton_stat.timer_count++;
-	
+	__sync_add_and_fetch(&triton_stat.timer_count, 1);
+
 	return 0;
 
 out_err:
 	ud->tpd = NULL;
-	close(t->fd);
+	if (t->fd >= 0)
+		close(t->fd);
 	mempool_free(t);
 	return -1;
 }
+
+static void wheel_mod(struct _triton_timer_t *t)
+{
+	struct triton_timer_t *ud = t->ud;
+	uint64_t delay;
+
+	if (ud->expire_tv.tv_sec || ud->expire_tv.tv_usec)
+		delay = (uint64_t)ud->expire_tv.tv_sec * 1000 + (ud->expire_tv.tv_usec + 999) / 1000;
+	else
+		delay = ud->period;
+
+	spin_lock(&wheel.lock);
+
+	if (t->queued) {
+		list_del(&t->wheel_entry);
+		t->queued = 0;
+		wheel.count--;
+	}
+
+	if (delay) {
+		if (!wheel.count)
+			wheel.timer_jiffies = get_jiffies();
+
+		t->expires = get_jiffies() + delay;
+		wheel_add(t);
+		t->queued = 1;
+		wheel.count++;
+
+		if (!wheel.armed || t->expires < wheel.armed)
+			wheel_arm(t->expires);
+	}
+
+	spin_unlock(&wheel.lock);
+}
+
 int __export triton_timer_mod(struct triton_timer_t *ud,int abs_time)
 {
 	struct _triton_timer_t *t = (struct _triton_timer_t *)ud->tpd;
@@ -185,6 +439,15 @@ int __export triton_timer_mod(struct triton_timer_t *ud,int abs_time)
 		.it_interval.tv_nsec = (ud->period % 1000) * 1000,
 	};
 
+	if (t->fd < 0) {
+		if (abs_time) {
+			triton_log_error("timer:triton_timer_mod: can't switch timer to absolute time");
+			return -1;
+		}
+		wheel_mod(t);
+		return 0;
+	}
+
 	if (ud->expire_tv.tv_sec == 0 && ud->expire_tv.tv_usec == 0)
 		ts.it_value = ts.it_interval;
 
@@ -198,8 +461,20 @@ int __export triton_timer_mod(struct triton_timer_t *ud,int abs_time)
 void __export triton_timer_del(struct triton_timer_t *ud)
 {
 	struct _triton_timer_t *t = (struct _triton_timer_t *)ud->tpd;
-	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, t->fd, &t->epoll_event);
-	close(t->fd);
+
+	if (t->fd >= 0) {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, t->fd, &t->epoll_event);
+		close(t->fd);
+	}
+
+	spin_lock(&wheel.lock);
+	if (t->queued) {
+		list_del(&t->wheel_entry);
+		t->queued = 0;
+		wheel.count--;
+	}
+	spin_unlock(&wheel.lock);
+
 	spin_lock(&t->ctx->lock);
 	t->ud = NULL;
 	list_del(&t->entry);
@@ -214,9 +489,9 @@ void __export triton_timer_del(struct triton_timer_t *ud)
 	pthread_mutex_lock(&freed_list_lock);
 	list_add_tail(&t->entry, &freed_list);
 	pthread_mutex_unlock(&freed_list_lock);
-	
+
 	ud->tpd = NULL;
-	
-	triton_stat.timer_count--;
+
+	__sync_sub_and_fetch(&triton_stat.timer_count, 1);
 }
 
@@ -6,21 +6,39 @@
 #include <unistd.h>
 #include <limits.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
 
 #include "triton_p.h"
 #include "memdebug.h"
 
+#ifdef VALGRIND
+#include <valgrind/valgrind.h>
+#endif
+
 #define WORKER_STACK_SIZE 1024*1024
+#define CTX_STACK_SIZE 256*1024
+#define CTX_STACK_POOL_MAX 64
 
 int thread_count = 2;
-int thread_count_max = 200;
 int max_events = 64;
+static int ctx_stack_size = CTX_STACK_SIZE;
 
 static spinlock_t threads_lock = SPINLOCK_INITIALIZER;
 static LIST_HEAD(threads);
 static LIST_HEAD(sleep_threads);
+static int sleep_count;
+
+static struct _triton_runq_t *runq;
+static int runq_count;
+static int runq_next_ctx;
+static int runq_next_thread;
+static int prio_pending;
 
-static LIST_HEAD(ctx_queue);
+static spinlock_t stack_lock = SPINLOCK_INITIALIZER;
+static void *stack_pool;
+static int stack_pool_cnt;
 
 static spinlock_t ctx_list_lock = SPINLOCK_INITIALIZER;
 static LIST_HEAD(ctx_list);
@@ -50,13 +68,305 @@ static struct triton_timer_t ru_timer = {
 struct triton_context_t default_ctx;
 
 static struct triton_context_t __thread *this_ctx;
+static struct _triton_thread_t __thread *this_thread;
 
 #define log_debug2(fmt, ...)
 
+static void futex_wait(int *addr, int val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static void futex_wake(int *addr)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
 void triton_thread_wakeup(struct _triton_thread_t *thread)
 {
 	log_debug2("wake up thread %p\n", thread);
-	pthread_kill(thread->thread, SIGUSR1);
+	if (__sync_bool_compare_and_swap(&thread->wakeup, 0, 1))
+		futex_wake(&thread->wakeup);
+}
+
+static void thread_sleep_on(int *wakeup)
+{
+	while (!*wakeup)
+		futex_wait(wakeup, 0);
+	__sync_lock_test_and_set(wakeup, 0);
+}
+
+static void thread_sleep(struct _triton_thread_t *thread)
+{
+	thread_sleep_on(&thread->wakeup);
+}
+
+static struct _triton_thread_t *get_sleep_thread(void)
+{
+	struct _triton_thread_t *t = NULL;
+
+	if (!sleep_count)
+		return NULL;
+
+	spin_lock(&threads_lock);
+	if (!list_empty(&sleep_threads)) {
+		t = list_entry(sleep_threads.next, typeof(*t), entry2);
+		list_del(&t->entry2);
+		t->sleeping = 0;
+		__sync_sub_and_fetch(&sleep_count, 1);
+	}
+	spin_unlock(&threads_lock);
+
+	return t;
+}
+
+static struct _triton_context_t *runq_pop(struct _triton_runq_t *rq, int prio)
+{
+	struct list_head *queue = prio ? &rq->prio_queue : &rq->queue;
+	struct _triton_context_t *ctx = NULL;
+
+	if (list_empty(queue))
+		return NULL;
+
+	spin_lock(&rq->lock);
+	if (!list_empty(queue)) {
+		ctx = list_entry(queue->next, typeof(*ctx), entry2);
+		list_del(&ctx->entry2);
+		if (prio)
+			__sync_sub_and_fetch(&prio_pending, 1);
+	}
+	spin_unlock(&rq->lock);
+
+	return ctx;
+}
+
+static struct _triton_context_t *dequeue_ctx(struct _triton_thread_t *thread)
+{
+	struct _triton_context_t *ctx;
+	int i, n = thread->rq - runq;
+
+	if (!triton_stat.context_pending)
+		return NULL;
+
+	if (prio_pending) {
+		for (i = 0; i < runq_count; i++) {
+			ctx = runq_pop(&runq[(n + i) % runq_count], 1);
+			if (ctx)
+				return ctx;
+		}
+	}
+
+	// own queue first, then try to steal from the others
+	for (i = 0; i < runq_count; i++) {
+		ctx = runq_pop(&runq[(n + i) % runq_count], 0);
+		if (ctx)
+			return ctx;
+	}
+
+	return NULL;
+}
+
+/*
+ * Contexts run on their own stacks, so triton_context_schedule() only
+ * switches back to the worker loop instead of blocking the thread.
+ * A stack belongs to a context only while it is parked in
+ * triton_context_schedule(), otherwise it stays with the worker and is
+ * reused for the next context, so the number of stacks is bounded by
+ * the number of workers plus the number of parked contexts.
+ */
+static void *stack_alloc(void)
+{
+	long page_size = sysconf(_SC_PAGE_SIZE);
+	void *stack;
+
+	spin_lock(&stack_lock);
+	if (stack_pool) {
+		stack = stack_pool;
+		stack_pool = *(void **)(stack + page_size);
+		stack_pool_cnt--;
+		spin_unlock(&stack_lock);
+		return stack;
+	}
+	spin_unlock(&stack_lock);
+
+	stack = mmap(NULL, ctx_stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+	if (stack == MAP_FAILED) {
+		triton_log_error("failed to allocate context stack: %s", strerror(errno));
+		return NULL;
+	}
+
+	// guard page
+	mprotect(stack, page_size, PROT_NONE);
+
+	return stack;
+}
+
+static void stack_free(void *stack)
+{
+	long page_size = sysconf(_SC_PAGE_SIZE);
+
+	spin_lock(&stack_lock);
+	if (stack_pool_cnt < CTX_STACK_POOL_MAX) {
+		*(void **)(stack + page_size) = stack_pool;
+		stack_pool = stack;
+		stack_pool_cnt++;
+		spin_unlock(&stack_lock);
+		return;
+	}
+	spin_unlock(&stack_lock);
+
+	munmap(stack, ctx_stack_size);
+}
+
+#ifdef TRITON_CTX_SWAP
+/*
+ * Switches stacks saving only callee-saved registers. Unlike swapcontext()
+ * it leaves the signal mask alone, which would cost syscalls per dispatch.
+ */
+void ctx_swap(triton_uctx_t *save, triton_uctx_t *to);
+
+#if defined(__x86_64__)
+__asm__(
+	".text\n"
+	".type ctx_swap, @function\n"
+	"ctx_swap:\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq (%rsi), %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+	".size ctx_swap, .-ctx_swap\n"
+);
+
+// 6 registers, then return address aligned as if entry was called
+#define CTX_FRAME_SIZE 8
+#define CTX_FRAME_RET  6
+#elif defined(__aarch64__)
+__asm__(
+	".text\n"
+	".type ctx_swap, %function\n"
+	"ctx_swap:\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	ldr x9, [x1]\n"
+	"	mov sp, x9\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+	".size ctx_swap, .-ctx_swap\n"
+);
+
+// x19-x28, x29, x30 (return address), d8-d15
+#define CTX_FRAME_SIZE 20
+#define CTX_FRAME_RET  11
+#endif
+
+static void ctx_make(triton_uctx_t *uctx, void *stack, void (*entry)(void))
+{
+	void **frame = stack + ctx_stack_size - CTX_FRAME_SIZE * sizeof(void *);
+
+	memset(frame, 0, CTX_FRAME_SIZE * sizeof(void *));
+	frame[CTX_FRAME_RET] = entry;
+
+	*uctx = frame;
+}
+#else
+static void ctx_make(triton_uctx_t *uctx, void *stack, void (*entry)(void))
+{
+	getcontext(uctx);
+	uctx->uc_stack.ss_sp = stack;
+	uctx->uc_stack.ss_size = ctx_stack_size;
+	uctx->uc_link = NULL;
+	makecontext(uctx, entry, 0);
+}
+
+static void ctx_swap(triton_uctx_t *save, triton_uctx_t *to)
+{
+	swapcontext(save, to);
+}
+#endif
+
+static void ctx_thread(struct _triton_context_t *ctx);
+static struct _triton_thread_t *__queue_ctx(struct _triton_context_t *ctx);
+static void calls_free(struct _triton_context_t *ctx);
+
+static void ctx_entry(void)
+{
+	struct _triton_context_t *ctx = this_thread->ctx;
+	triton_uctx_t dummy;
+
+	ctx_thread(ctx);
+
+	// may be resumed by another thread, so don't rely on this_thread here
+	ctx_swap(&dummy, &ctx->thread->uctx);
+}
+
+static void ctx_run(struct _triton_thread_t *thread, struct _triton_context_t *ctx)
+{
+	if (!ctx->stack) {
+		if (!thread->stack)
+			thread->stack = stack_alloc();
+
+		if (!thread->stack) {
+			// degrade to running on the worker stack, see triton_context_schedule
+			ctx->blocked = 1;
+			ctx_thread(ctx);
+			ctx->blocked = 0;
+			return;
+		}
+
+		ctx->stack = thread->stack;
+		thread->stack = NULL;
+
+#ifdef VALGRIND
+		ctx->valgrind_stack_id = VALGRIND_STACK_REGISTER(ctx->stack, ctx->stack + ctx_stack_size);
+#endif
+		ctx_make(&ctx->uctx, ctx->stack, ctx_entry);
+	}
+
+	ctx_swap(&thread->uctx, &ctx->uctx);
+
+	if (ctx->asleep)
+		return;
+
+#ifdef VALGRIND
+	VALGRIND_STACK_DEREGISTER(ctx->valgrind_stack_id);
+#endif
+	if (!thread->stack)
+		thread->stack = ctx->stack;
+	else
+		stack_free(ctx->stack);
+	ctx->stack = NULL;
 }
 
 static void __config_reload(void (*notify)(int))
@@ -76,11 +386,10 @@ static void __config_reload(void (*notify)(int))
 	log_debug2("config_reload: exit\n");
 }
 
-static void ctx_thread(struct _triton_context_t *ctx);
 static void* triton_thread(struct _triton_thread_t *thread)
 {
+	struct _triton_thread_t *t;
 	sigset_t set;
-	int sig;
 
 	sigfillset(&set);
 	sigdelset(&set, SIGKILL);
@@ -88,39 +397,30 @@ static void* triton_thread(struct _triton_thread_t *thread)
 	sigdelset(&set, SIGSEGV);
 	pthread_sigmask(SIG_BLOCK, &set, NULL);
 
-	sigemptyset(&set);
-	sigaddset(&set, SIGUSR1);
-	sigaddset(&set, SIGQUIT);
+	this_thread = thread;
 
 	pthread_mutex_lock(&thread->sleep_lock);
 	pthread_mutex_unlock(&thread->sleep_lock);
 
 	while (1) {
-		spin_lock(&threads_lock);
-		if (!list_empty(&ctx_queue) && !need_config_reload && triton_stat.thread_active <= thread_count) {
-			thread->ctx = list_entry(ctx_queue.next, typeof(*thread->ctx), entry2);
+		if (!need_config_reload && triton_stat.thread_active <= thread_count)
+			thread->ctx = dequeue_ctx(thread);
+
+		if (thread->ctx) {
 			log_debug2("thread: %p: dequeued ctx %p\n", thread, thread->ctx);
-			list_del(&thread->ctx->entry2);
-			spin_unlock(&threads_lock);
 			spin_lock(&thread->ctx->lock);
 			thread->ctx->thread = thread;
 			thread->ctx->queued = 0;
 			spin_unlock(&thread->ctx->lock);
 			__sync_sub_and_fetch(&triton_stat.context_pending, 1);
 		} else {
-			if (triton_stat.thread_count > thread_count + triton_stat.context_sleeping) {
-				__sync_sub_and_fetch(&triton_stat.thread_active, 1);
-				__sync_sub_and_fetch(&triton_stat.thread_count, 1);
-				list_del(&thread->entry);
-				spin_unlock(&threads_lock);
-				pthread_detach(pthread_self());
-				log_debug2("thread: %p: exit\n", thread);
-				_free(thread);
-				return NULL;
-			}
+			spin_lock(&threads_lock);
 			log_debug2("thread: %p: sleeping\n", thread);
-			if (!terminate)
+			if (!terminate) {
 				list_add(&thread->entry2, &sleep_threads);
+				thread->sleeping = 1;
+				__sync_add_and_fetch(&sleep_count, 1);
+			}
 			
 			if (__sync_sub_and_fetch(&triton_stat.thread_active, 1) == 0 && need_config_reload) {
 				spin_unlock(&threads_lock);
@@ -135,41 +435,68 @@ static void* triton_thread(struct _triton_thread_t *thread)
 				return NULL;
 			}
 
-			//printf("thread %p: enter sigwait\n", thread);
-			sigwait(&set, &sig);
-			//printf("thread %p: exit sigwait\n", thread);
+			// recheck the queues to not miss a context queued
+			// while we were going to sleep
+			if (!triton_stat.context_pending || need_config_reload || triton_stat.thread_active >= thread_count)
+				thread_sleep(thread);
 
 			spin_lock(&threads_lock);
 			__sync_add_and_fetch(&triton_stat.thread_active, 1);
-			if (!thread->ctx) {
+			if (thread->sleeping) {
 				list_del(&thread->entry2);
-				spin_unlock(&threads_lock);
-				continue;
+				thread->sleeping = 0;
+				__sync_sub_and_fetch(&sleep_count, 1);
 			}
 			spin_unlock(&threads_lock);
+			continue;
 		}
 
 cont:
 		log_debug2("thread %p: ctx=%p %p\n", thread, thread->ctx, thread->ctx ? thread->ctx->thread : NULL);
+		if (thread->ctx->need_free) {
+			// unregistered by another context, ud may be freed already
+			spin_lock(&thread->ctx->lock);
+			thread->ctx->pending = 0;
+			goto out_free;
+		}
+
 		this_ctx = thread->ctx->ud;
 		if (thread->ctx->ud->before_switch)
 			thread->ctx->ud->before_switch(thread->ctx->ud, thread->ctx->bf_arg);
 
 		log_debug2("thread %p: switch to %p\n", thread, thread->ctx);
-		ctx_thread(thread->ctx);
+		ctx_run(thread, thread->ctx);
 		log_debug2("thread %p: switch from %p %p\n", thread, thread->ctx, thread->ctx->thread);
 
 		spin_lock(&thread->ctx->lock);
+		if (thread->ctx->asleep) {
+			// parked in triton_context_schedule
+			thread->ctx->thread = NULL;
+			if (thread->ctx->wakeup) {
+				thread->ctx->wakeup = 0;
+				thread->ctx->asleep = 0;
+				t = __queue_ctx(thread->ctx);
+			} else
+				t = NULL;
+			spin_unlock(&thread->ctx->lock);
+			if (t)
+				triton_thread_wakeup(t);
+			thread->ctx = NULL;
+			continue;
+		}
 		if (thread->ctx->pending) {
 			spin_unlock(&thread->ctx->lock);
 			goto cont;
 		}
+out_free:
 		thread->ctx->thread = NULL;
 
 		spin_unlock(&thread->ctx->lock);
 
 		if (thread->ctx->need_free) {
 			log_debug2("- context %p removed\n", thread->ctx);
+			// calls made after triton_context_unregister()
+			calls_free(thread->ctx);
 			mempool_free(thread->ctx);
 		}
 
@@ -177,6 +504,61 @@ cont:
 	}
 }
 
+static int call_push(struct _triton_context_t *ctx, struct _triton_ctx_call_t *call)
+{
+	struct _triton_ctx_call_t *head;
+
+	do {
+		head = ctx->calls;
+		call->next = head;
+	} while (!__sync_bool_compare_and_swap(&ctx->calls, head, call));
+
+	// the one who made the mailbox non-empty has to queue the context
+	return head == NULL;
+}
+
+static void calls_drain(struct _triton_context_t *ctx)
+{
+	struct _triton_ctx_call_t *call, *next;
+	LIST_HEAD(list);
+
+	if (!ctx->calls)
+		return;
+
+	call = __sync_lock_test_and_set(&ctx->calls, NULL);
+
+	for (; call; call = next) {
+		next = call->next;
+		list_add(&call->entry, &list);
+	}
+
+	list_splice(&list, ctx->pending_calls.prev);
+}
+
+static void calls_free(struct _triton_context_t *ctx)
+{
+	struct _triton_ctx_call_t *call;
+
+	calls_drain(ctx);
+	while (!list_empty(&ctx->pending_calls)) {
+		call = list_entry(ctx->pending_calls.next, typeof(*call), entry);
+		list_del(&call->entry);
+		mempool_free(call);
+	}
+}
+
+/*
+ * pending_calls is not locked, only the thread running the context may touch
+ * it. Nothing runs a context which was never woken up, so it may be handled
+ * by anyone.
+ */
+static int is_owner(struct triton_context_t *ud)
+{
+	struct _triton_context_t *ctx = (struct _triton_context_t *)ud->tpd;
+
+	return this_ctx == ud || ctx->init;
+}
+
 static void ctx_thread(struct _triton_context_t *ctx)
 {
 	struct _triton_md_handler_t *h;
@@ -199,7 +581,8 @@ static void ctx_thread(struct _triton_context_t *ctx)
 			t->pending = 0;
 			spin_unlock(&ctx->lock);
 			__sync_sub_and_fetch(&triton_stat.timer_pending, 1);
-			read(t->fd, &tt, sizeof(tt));
+			if (t->fd >= 0)
+				read(t->fd, &tt, sizeof(tt));
 			if (t->ud)
 				if (t->ud->expire)
 					t->ud->expire(t->ud);
@@ -224,12 +607,16 @@ static void ctx_thread(struct _triton_context_t *ctx)
 			h->trig_epoll_events = 0;
 			continue;
 		}
-		if (!list_empty(&ctx->pending_calls)) {
-			call = list_entry(ctx->pending_calls.next, typeof(*call), entry);
-			list_del(&call->entry);
+		if (ctx->calls || !list_empty(&ctx->pending_calls)) {
 			spin_unlock(&ctx->lock);
-			call->func(call->arg);
-			mempool_free(call);
+			calls_drain(ctx);
+			while (!list_empty(&ctx->pending_calls)) {
+				call = list_entry(ctx->pending_calls.next, typeof(*call), entry);
+				list_del(&call->entry);
+				if (!ctx->need_free)
+					call->func(call->arg);
+				mempool_free(call);
+			}
 			continue;
 		}
 		ctx->pending = 0;
@@ -253,8 +640,8 @@ struct _triton_thread_t *create_thread()
 	pthread_attr_setstacksize(&attr, WORKER_STACK_SIZE);
 
 	memset(thread, 0, sizeof(*thread));
+	thread->rq = &runq[__sync_fetch_and_add(&runq_next_thread, 1) % runq_count];
 	pthread_mutex_init(&thread->sleep_lock, NULL);
-	pthread_cond_init(&thread->sleep_cond, NULL);
 	pthread_mutex_lock(&thread->sleep_lock);
 	while (pthread_create(&thread->thread, &attr, (void*(*)(void*))triton_thread, thread))
 		sleep(1);
@@ -265,33 +652,35 @@ struct _triton_thread_t *create_thread()
 	return thread;
 }
 
-int triton_queue_ctx(struct _triton_context_t *ctx)
+static struct _triton_thread_t *__queue_ctx(struct _triton_context_t *ctx)
 {
-	ctx->pending = 1;
-	if (ctx->thread || ctx->queued || ctx->init)
-		return 0;
+	struct _triton_runq_t *rq = this_thread ? this_thread->rq : ctx->rq;
 
-	spin_lock(&threads_lock);
-	if (list_empty(&sleep_threads) || need_config_reload || triton_stat.thread_active > thread_count || 
-		(ctx->priority == 0 && triton_stat.thread_count > thread_count_max)) {
-		if (ctx->priority)
-			list_add(&ctx->entry2, &ctx_queue);
-		else
-			list_add_tail(&ctx->entry2, &ctx_queue);
-		spin_unlock(&threads_lock);
-		ctx->queued = 1;
-		log_debug2("ctx %p: queued\n", ctx);
-		__sync_add_and_fetch(&triton_stat.context_pending, 1);
-		return 0;
-	}
+	spin_lock(&rq->lock);
+	if (ctx->priority) {
+		list_add_tail(&ctx->entry2, &rq->prio_queue);
+		__sync_add_and_fetch(&prio_pending, 1);
+	} else
+		list_add_tail(&ctx->entry2, &rq->queue);
+	spin_unlock(&rq->lock);
 
-	ctx->thread = list_entry(sleep_threads.next, typeof(*ctx->thread), entry2);
-	ctx->thread->ctx = ctx;
-	log_debug2("ctx %p: assigned to thread %p\n", ctx, ctx->thread);
-	list_del(&ctx->thread->entry2);
-	spin_unlock(&threads_lock);
+	ctx->queued = 1;
+	log_debug2("ctx %p: queued\n", ctx);
+	__sync_add_and_fetch(&triton_stat.context_pending, 1);
+
+	if (need_config_reload || triton_stat.thread_active > thread_count)
+		return NULL;
+
+	return get_sleep_thread();
+}
+
+struct _triton_thread_t *triton_queue_ctx(struct _triton_context_t *ctx)
+{
+	ctx->pending = 1;
+	if (ctx->thread || ctx->queued || ctx->init || ctx->asleep)
+		return NULL;
 
-	return 1;
+	return __queue_ctx(ctx);
 }
 
 int __export triton_context_register(struct triton_context_t *ud, void *bf_arg)
@@ -306,6 +695,7 @@ int __export triton_context_register(struct triton_context_t *ud, void *bf_arg)
 	ctx->ud = ud;
 	ctx->bf_arg = bf_arg;
 	ctx->init = 1;
+	ctx->rq = &runq[__sync_fetch_and_add(&runq_next_ctx, 1) % runq_count];
 	spinlock_init(&ctx->lock);
 	INIT_LIST_HEAD(&ctx->handlers);
 	INIT_LIST_HEAD(&ctx->timers);
@@ -328,16 +718,12 @@ int __export triton_context_register(struct triton_context_t *ud, void *bf_arg)
 void __export triton_context_unregister(struct triton_context_t *ud)
 {
 	struct _triton_context_t *ctx = (struct _triton_context_t *)ud->tpd;
-	struct _triton_ctx_call_t *call;
 	struct _triton_thread_t *t;
 
 	log_debug2("ctx %p: unregister\n", ctx);
 
-	while (!list_empty(&ctx->pending_calls)) {
-		call = list_entry(ctx->pending_calls.next, typeof(*call), entry);
-		list_del(&call->entry);
-		mempool_free(call);
-	}
+	if (is_owner(ud))
+		calls_free(ctx);
 
 	if (!list_empty(&ctx->handlers)) {
 		triton_log_error("BUG:ctx:triton_unregister_ctx: handlers is not empty");
@@ -365,7 +751,14 @@ void __export triton_context_unregister(struct triton_context_t *ud)
 		abort();
 	}
 
+	spin_lock(&ctx->lock);
 	ctx->need_free = 1;
+	// unregistered from another context, the worker discards calls and frees it
+	t = this_ctx == ud ? NULL : triton_queue_ctx(ctx);
+	spin_unlock(&ctx->lock);
+	if (t)
+		triton_thread_wakeup(t);
+
 	ud->tpd = NULL;
 
 	spin_lock(&ctx_list_lock);
@@ -394,30 +787,34 @@ void __export triton_context_set_priority(struct triton_context_t *ud, int prio)
 void __export triton_context_schedule()
 {
 	struct _triton_context_t *ctx = (struct _triton_context_t *)this_ctx->tpd;
-	struct _triton_thread_t *t = NULL;
-	
+
 	log_debug2("ctx %p: enter schedule\n", ctx);
-	__sync_add_and_fetch(&triton_stat.context_sleeping, 1);
-	__sync_sub_and_fetch(&triton_stat.thread_active, 1);
-	pthread_mutex_lock(&ctx->thread->sleep_lock);
-	while (1) {
-		if (ctx->wakeup) {
-			ctx->wakeup = 0;
-			break;
-		} else {
-			if (!t && triton_stat.thread_count <= thread_count + triton_stat.context_sleeping) {
-				t = create_thread();
-				spin_lock(&threads_lock);
-				list_add_tail(&t->entry, &threads);
-				spin_unlock(&threads_lock);
-				pthread_mutex_unlock(&t->sleep_lock);
-			}
-			pthread_cond_wait(&ctx->thread->sleep_cond, &ctx->thread->sleep_lock);
-		}
+
+	spin_lock(&ctx->lock);
+	if (ctx->wakeup) {
+		ctx->wakeup = 0;
+		spin_unlock(&ctx->lock);
+		return;
+	}
+
+	if (ctx->blocked) {
+		// running on the worker stack, nowhere to switch to
+		spin_unlock(&ctx->lock);
+		__sync_add_and_fetch(&triton_stat.context_sleeping, 1);
+		thread_sleep_on(&ctx->wakeup);
+		__sync_sub_and_fetch(&triton_stat.context_sleeping, 1);
+		return;
 	}
-	pthread_mutex_unlock(&ctx->thread->sleep_lock);
+
+	ctx->asleep = 1;
+	spin_unlock(&ctx->lock);
+
+	__sync_add_and_fetch(&triton_stat.context_sleeping, 1);
+
+	// the worker completes parking after the switch, see triton_thread
+	ctx_swap(&ctx->uctx, &ctx->thread->uctx);
+
 	__sync_sub_and_fetch(&triton_stat.context_sleeping, 1);
-	__sync_add_and_fetch(&triton_stat.thread_active, 1);
 	log_debug2("ctx %p: exit schedule\n", ctx);
 }
 
@@ -437,7 +834,7 @@ void triton_context_print(void)
 void __export triton_context_wakeup(struct triton_context_t *ud)
 {
 	struct _triton_context_t *ctx = (struct _triton_context_t *)ud->tpd;
-	int r = 0;
+	struct _triton_thread_t *t = NULL;
 
 	log_debug2("ctx %p: wakeup\n", ctx);
 
@@ -446,24 +843,32 @@ void __export triton_context_wakeup(struct triton_context_t *ud)
 		spin_lock(&ctx->lock);
 		ctx->init = 0;
 		if (ctx->pending)
-			r = triton_queue_ctx(ctx);
+			t = triton_queue_ctx(ctx);
 		spin_unlock(&ctx->lock);
-		if (r)
-			triton_thread_wakeup(ctx->thread);
+		if (t)
+			triton_thread_wakeup(t);
 		return;
 	}
 
-	pthread_mutex_lock(&ctx->thread->sleep_lock);
-	ctx->wakeup = 1;
-	pthread_cond_signal(&ctx->thread->sleep_cond);
-	pthread_mutex_unlock(&ctx->thread->sleep_lock);
+	spin_lock(&ctx->lock);
+	if (ctx->asleep && !ctx->thread) {
+		ctx->asleep = 0;
+		t = __queue_ctx(ctx);
+	} else
+		ctx->wakeup = 1;
+	spin_unlock(&ctx->lock);
+
+	if (t)
+		triton_thread_wakeup(t);
+	else if (ctx->blocked)
+		futex_wake(&ctx->wakeup);
 }
 
 int __export triton_context_call(struct triton_context_t *ud, void (*func)(void *), void *arg)
 {
 	struct _triton_context_t *ctx = (struct _triton_context_t *)ud->tpd;
 	struct _triton_ctx_call_t *call = mempool_alloc(call_pool);
-	int r;
+	struct _triton_thread_t *t;
 
 	if (!call)
 		return -1;
@@ -471,23 +876,103 @@ int __export triton_context_call(struct triton_context_t *ud, void (*func)(void
 	call->func = func;
 	call->arg = arg;
 
+	if (!call_push(ctx, call))
+		return 0;
+
 	spin_lock(&ctx->lock);
-	list_add_tail(&call->entry, &ctx->pending_calls);
-	r = triton_queue_ctx(ctx);
+	t = triton_queue_ctx(ctx);
 	spin_unlock(&ctx->lock);
 
-	if (r)
-		triton_thread_wakeup(ctx->thread);
+	if (t)
+		triton_thread_wakeup(t);
 
 	return 0;
 }
 
+/*
+ * Calls func(arg[i]) in context ud[i] for each i. Contexts which become
+ * runnable are put on the run queue at once, and no more threads are woken
+ * up than there are such contexts.
+ */
+int __export triton_context_call_many(struct triton_context_t **ud, void (*func)(void *), void **arg, int n)
+{
+	struct _triton_context_t *ctx;
+	struct _triton_ctx_call_t *call;
+	struct _triton_runq_t *rq;
+	struct _triton_thread_t *t;
+	LIST_HEAD(queue);
+	LIST_HEAD(prio_queue);
+	int i, cnt = 0, prio_cnt = 0, r = 0;
+
+	if (n <= 0)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		ctx = (struct _triton_context_t *)ud[i]->tpd;
+		call = mempool_alloc(call_pool);
+		if (!call) {
+			r = -1;
+			break;
+		}
+
+		call->func = func;
+		call->arg = arg[i];
+
+		if (!call_push(ctx, call))
+			continue;
+
+		spin_lock(&ctx->lock);
+		ctx->pending = 1;
+		if (!ctx->thread && !ctx->queued && !ctx->init && !ctx->asleep) {
+			ctx->queued = 1;
+			if (ctx->priority) {
+				list_add_tail(&ctx->entry2, &prio_queue);
+				prio_cnt++;
+			} else
+				list_add_tail(&ctx->entry2, &queue);
+			cnt++;
+		}
+		spin_unlock(&ctx->lock);
+	}
+
+	if (!cnt)
+		return r;
+
+	rq = this_thread ? this_thread->rq : ((struct _triton_context_t *)ud[0]->tpd)->rq;
+
+	spin_lock(&rq->lock);
+	list_splice(&prio_queue, rq->prio_queue.prev);
+	list_splice(&queue, rq->queue.prev);
+	spin_unlock(&rq->lock);
+
+	if (prio_cnt)
+		__sync_add_and_fetch(&prio_pending, prio_cnt);
+	__sync_add_and_fetch(&triton_stat.context_pending, cnt);
+
+	while (cnt--) {
+		if (need_config_reload || triton_stat.thread_active > thread_count)
+			break;
+		t = get_sleep_thread();
+		if (!t)
+			break;
+		triton_thread_wakeup(t);
+	}
+
+	return r;
+}
+
 void __export triton_cancel_call(struct triton_context_t *ud, void (*func)(void *))
 {
 	struct _triton_context_t *ctx = (struct _triton_context_t *)ud->tpd;
 	struct list_head *pos, *n;
 	struct _triton_ctx_call_t *call;
 
+	if (!is_owner(ud)) {
+		triton_log_error("BUG:triton_cancel_call: called outside of the context");
+		abort();
+	}
+
+	calls_drain(ctx);
 	list_for_each_safe(pos, n, &ctx->pending_calls) {
 		call = list_entry(pos, typeof(*call), entry);
 		if (call->func != func)
@@ -556,14 +1041,51 @@ void __export triton_register_init(int order, void (*func)(void))
 	list_add_tail(&i->entry, p);
 }
 
+static int runq_init(void)
+{
+	int i;
+
+	runq_count = thread_count;
+	runq = _malloc(runq_count * sizeof(*runq));
+	if (!runq) {
+		fprintf(stderr, "triton: cann't allocate memory\n");
+		return -1;
+	}
+
+	for (i = 0; i < runq_count; i++) {
+		spinlock_init(&runq[i].lock);
+		INIT_LIST_HEAD(&runq[i].queue);
+		INIT_LIST_HEAD(&runq[i].prio_queue);
+	}
+
+	return 0;
+}
+
 int __export triton_init(const char *conf_file)
 {
+	char *opt;
+
 	ctx_pool = mempool_create(sizeof(struct _triton_context_t));
 	call_pool = mempool_create(sizeof(struct _triton_ctx_call_t));
 
 	if (conf_load(conf_file))
 		return -1;
 
+	opt = conf_get_opt("core", "thread-count");
+	if (opt && atoi(opt) > 0)
+		thread_count = atoi(opt);
+
+	opt = conf_get_opt("core", "max-events");
+	if (opt && atoi(opt) > 0)
+		max_events = atoi(opt);
+
+	opt = conf_get_opt("core", "ctx-stack-size");
+	if (opt && atoi(opt) > 0)
+		ctx_stack_size = (atoi(opt) + 4095) & ~4095;
+
+	if (runq_init())
+		return -1;
+
 	if (log_init())
 		return -1;
 
@@ -614,17 +1136,8 @@ void __export triton_run()
 {
 	struct _triton_thread_t *t;
 	int i;
-	char *opt;
 	struct timespec ts;
 
-	opt = conf_get_opt("core", "thread-count");
-	if (opt && atoi(opt) > 0)
-		thread_count = atoi(opt);
-
-	opt = conf_get_opt("core", "thread-count-max");
-	if (opt && atoi(opt) > 0)
-		thread_count_max = atoi(opt);
-
 	for(i = 0; i < thread_count; i++) {
 		t = create_thread();
 		if (!t)
@@ -639,6 +1152,7 @@ void __export triton_run()
 
 	md_run();
 	timer_run();
+	mempool_run();
 
 	triton_context_wakeup(&default_ctx);
 }
@@ -646,7 +1160,7 @@ void __export triton_run()
 void __export triton_terminate()
 {
 	struct _triton_context_t *ctx;
-	int r;
+	struct _triton_thread_t *t;
 
 	need_terminate = 1;
 
@@ -654,9 +1168,9 @@ void __export triton_terminate()
 	list_for_each_entry(ctx, &ctx_list, entry) {
 		spin_lock(&ctx->lock);
 		ctx->need_close = 1;
-		r = triton_queue_ctx(ctx);
-		if (r)
-			triton_thread_wakeup(ctx->thread);
+		t = triton_queue_ctx(ctx);
+		if (t)
+			triton_thread_wakeup(t);
 		spin_unlock(&ctx->lock);
 	}
 	spin_unlock(&ctx_list_lock);
@@ -52,8 +52,6 @@ struct conf_sect_t
 
 struct triton_stat_t
 {
-	unsigned int mempool_allocated;
-	unsigned int mempool_available;
 	unsigned int thread_count;
 	unsigned int thread_active;
 	unsigned int context_count;
@@ -69,11 +67,14 @@ struct triton_stat_t
 
 extern struct triton_stat_t triton_stat;
 int triton_context_register(struct triton_context_t *, void *arg);
+// calls not run yet are dropped, when called from another context they are dropped by the worker
 void triton_context_unregister(struct triton_context_t *);
 void triton_context_set_priority(struct triton_context_t *, int);
 void triton_context_schedule(void);
 void triton_context_wakeup(struct triton_context_t *);
 int triton_context_call(struct triton_context_t *, void (*func)(void *), void *arg);
+int triton_context_call_many(struct triton_context_t **, void (*func)(void *), void **arg, int n);
+// must be called from the context itself
 void triton_cancel_call(struct triton_context_t *, void (*func)(void *));
 struct triton_context_t *triton_context_self(void);
 
@@ -106,6 +107,36 @@ void triton_stop_collect_cpu_usage(void);
 
 int triton_module_loaded(const char *name);
 
+/* Per-thread counters, see counter.c */
+#define TRITON_COUNTER_MAX (1 << 16)
+#define TRITON_COUNTER_PAGE_BITS 9
+#define TRITON_COUNTER_PAGE_SIZE (1 << TRITON_COUNTER_PAGE_BITS)
+
+#define TRITON_COUNTER_MD_WAKEUPS 0
+#define TRITON_COUNTER_MD_EVENTS  1
+#define TRITON_COUNTER_RESERVED   2
+
+extern __thread long **triton_counter_pages;
+long *__triton_counter_slot(int id);
+int triton_counter_alloc(int n);
+void triton_counter_free(int id, int n);
+long triton_counter_read(int id);
+
+static inline void triton_counter_add(int id, long v)
+{
+	long *page;
+
+	if (triton_counter_pages && (page = triton_counter_pages[id >> TRITON_COUNTER_PAGE_BITS]))
+		page[id & (TRITON_COUNTER_PAGE_SIZE - 1)] += v;
+	else
+		*__triton_counter_slot(id) += v;
+}
+
+static inline void triton_counter_inc(int id)
+{
+	triton_counter_add(id, 1);
+}
+
 void triton_register_init(int order, void (*func)(void));
 
 
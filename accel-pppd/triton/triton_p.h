@@ -2,6 +2,7 @@
 #define TRITON_P_H
 
 #include <pthread.h>
+#include <ucontext.h>
 #include <sys/epoll.h>
 
 #include "triton.h"
@@ -9,15 +10,33 @@
 #include "spinlock.h"
 #include "mempool.h"
 
+#if defined(__x86_64__) || defined(__aarch64__)
+#define TRITON_CTX_SWAP
+typedef void *triton_uctx_t; // saved stack pointer, see ctx_swap()
+#else
+typedef ucontext_t triton_uctx_t;
+#endif
+
+struct _triton_runq_t
+{
+	spinlock_t lock;
+	struct list_head queue;
+	struct list_head prio_queue;
+} __attribute__((aligned(64)));
+
 struct _triton_thread_t
 {
 	struct list_head entry;
 	struct list_head entry2;
 	pthread_t thread;
 	int terminate;
+	int sleeping;
+	int wakeup;
+	struct _triton_runq_t *rq;
 	struct _triton_context_t *ctx;
 	pthread_mutex_t sleep_lock;
-	pthread_cond_t sleep_cond;
+	triton_uctx_t uctx;
+	void *stack;
 };
 
 struct _triton_context_t
@@ -27,12 +46,15 @@ struct _triton_context_t
 	
 	spinlock_t lock;
 	struct _triton_thread_t *thread;
+	struct _triton_runq_t *rq;
 	
 	struct list_head handlers;
 	struct list_head timers;
 	struct list_head pending_handlers;
 	struct list_head pending_timers;
 	struct list_head pending_calls;
+	// lock-free LIFO of calls from other contexts, drained into pending_calls
+	struct _triton_ctx_call_t *calls;
 
 	int init;
 	int queued;
@@ -41,16 +63,27 @@ struct _triton_context_t
 	int need_free;
 	int pending;
 	int priority;
+	int asleep;
+	int blocked; // no stack, triton_context_schedule() blocks the thread
+
+	triton_uctx_t uctx;
+	void *stack;
+#ifdef VALGRIND
+	unsigned int valgrind_stack_id;
+#endif
 
 	struct triton_context_t *ud;
 	void *bf_arg;
 };
 
+struct _triton_md_thread_t;
+
 struct _triton_md_handler_t
 {
 	struct list_head entry;
 	struct list_head entry2;
 	struct _triton_context_t *ctx;
+	struct _triton_md_thread_t *md;
 	struct epoll_event epoll_event;
 	uint32_t trig_epoll_events;
 	int pending:1;
@@ -62,8 +95,11 @@ struct _triton_timer_t
 {
 	struct list_head entry;
 	struct list_head entry2;
+	struct list_head wheel_entry;
 	struct epoll_event epoll_event;
 	struct _triton_context_t *ctx;
+	uint64_t expires;
+	int queued;
 	int fd;
 	int pending:1;
 	struct triton_timer_t *ud;
@@ -77,6 +113,7 @@ struct _triton_event_t
 struct _triton_ctx_call_t
 {
 	struct list_head entry;
+	struct _triton_ctx_call_t *next;
 
 	void *arg;
 	void (*func)(void *);
@@ -99,8 +136,9 @@ void md_run();
 void md_terminate();
 void timer_run();
 void timer_terminate();
+void mempool_run(void);
 extern struct triton_context_t default_ctx;
-int triton_queue_ctx(struct _triton_context_t*);
+struct _triton_thread_t *triton_queue_ctx(struct _triton_context_t*);
 void triton_thread_wakeup(struct _triton_thread_t*);
 int conf_load(const char *fname);
 int conf_reload(const char *fname);
@@ -1,8 +1,11 @@
 #ifndef __UTILS_H
 #define __UTILS_H
 
+#include <stdint.h>
 #include <netinet/in.h>
 
 void u_inet_ntoa(in_addr_t, char *str);
 
+uint64_t u_siphash(const uint8_t *key, const void *data, int len);
+
 #endif